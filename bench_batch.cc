@@ -0,0 +1,112 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com> 2009
+//
+// Compares search against search_batch on an archive. Every key of the
+// source is looked up, together with a truncated copy of it which is
+// mostly missing.
+
+#include <sys/time.h>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdlib>
+#include "trie_impl.h"
+
+using namespace dutil;
+
+static double elapsed(const struct timeval &start, const struct timeval &end)
+{
+    return (end.tv_sec - start.tv_sec) * 1000.0
+           + (end.tv_usec - start.tv_usec) / 1000.0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3) {
+        std::cout << argv[0] << ": ARCHIVE FILE [BATCH]" << std::endl;
+        return 0;
+    }
+
+    trie *archive = trie::create_trie(argv[1]);
+    std::ifstream source(argv[2]);
+    size_t batch = (argc > 3)?atoi(argv[3]):256;
+    std::vector<std::string> lines;
+    std::string line;
+    while (getline(source, line)) {
+        size_t pos = line.find(' ');
+        if (pos == std::string::npos)
+            continue;
+        lines.push_back(line.substr(pos + 1));
+        lines.push_back(lines.back().substr(0, lines.back().length() / 2));
+    }
+    // shuffle so that neighbouring keys do not share cache lines
+    srand(0);
+    for (size_t i = lines.size(); i > 1; i--)
+        std::swap(lines[i - 1], lines[rand() % i]);
+
+    size_t n = lines.size();
+    std::vector<const char *> inputs(n);
+    std::vector<size_t> lengths(n);
+    std::vector<trie::key_type> keys(n);
+    for (size_t i = 0; i < n; i++) {
+        inputs[i] = lines[i].c_str();
+        lengths[i] = lines[i].length();
+        keys[i].assign(inputs[i], lengths[i]);
+    }
+
+    struct timeval tv[2];
+    std::vector<trie::value_type> values[3];
+    std::vector<char> found[3];
+    size_t count[3] = {0, 0, 0};
+    for (size_t k = 0; k < 3; k++) {
+        values[k].resize(n);
+        found[k].resize(n);
+    }
+
+    gettimeofday(&tv[0], NULL);
+    for (size_t i = 0; i < n; i++) {
+        found[0][i] = archive->search(keys[i], &values[0][i]);
+        count[0] += found[0][i];
+    }
+    gettimeofday(&tv[1], NULL);
+    std::cerr << n << " searches (" << count[0] << " found) = "
+              << elapsed(tv[0], tv[1]) << "ms" << std::endl;
+
+    bool *flags = new bool[n];
+    gettimeofday(&tv[0], NULL);
+    for (size_t i = 0; i < n; i += batch)
+        count[1] += archive->search_batch(&keys[i], std::min(batch, n - i),
+                                          &values[1][i], flags + i);
+    gettimeofday(&tv[1], NULL);
+    found[1].assign(flags, flags + n);
+    std::cerr << n << " batched searches (" << count[1] << " found) = "
+              << elapsed(tv[0], tv[1]) << "ms" << std::endl;
+
+    gettimeofday(&tv[0], NULL);
+    for (size_t i = 0; i < n; i += batch)
+        count[2] += archive->search_batch(&inputs[i], &lengths[i],
+                                          std::min(batch, n - i),
+                                          &values[2][i], flags + i);
+    gettimeofday(&tv[1], NULL);
+    found[2].assign(flags, flags + n);
+    std::cerr << n << " batched raw searches (" << count[2] << " found) = "
+              << elapsed(tv[0], tv[1]) << "ms" << std::endl;
+    delete [] flags;
+
+    size_t lost = 0;
+    for (size_t i = 0; i < n; i++) {
+        for (size_t k = 1; k < 3; k++) {
+            if (found[k][i] != found[0][i]
+                || (found[0][i] && values[k][i] != values[0][i])) {
+                std::cerr << "mismatch '" << lines[i] << "'" << std::endl;
+                ++lost;
+            }
+        }
+    }
+    delete archive;
+
+    return lost?1:0;
+}
+
+// vim: ts=4 sw=4 ai et
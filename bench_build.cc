@@ -0,0 +1,90 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com> 2009
+//
+// Compares building a trie key by key against insert_bulk.
+
+#include <sys/time.h>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdlib>
+#include "trie_impl.h"
+
+using namespace dutil;
+
+static double elapsed(const struct timeval &start, const struct timeval &end)
+{
+    return (end.tv_sec - start.tv_sec) * 1000.0
+           + (end.tv_usec - start.tv_usec) / 1000.0;
+}
+
+static trie *create(int type)
+{
+    if (type == 0)
+        return new basic_trie();
+    return trie::create_trie(type == 1?trie::SINGLE_TRIE:trie::DOUBLE_TRIE);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3) {
+        std::cout << argv[0] << ": FILE [0|1|2]" << std::endl;
+        return 0;
+    }
+
+    std::ifstream source(argv[1]);
+    std::vector<std::string> lines;
+    std::string line;
+    while (getline(source, line))
+        if (!line.empty())
+            lines.push_back(line);
+
+    int type = atoi(argv[2]);
+    std::vector<trie::entry_type> entries;
+    for (size_t i = 0; i < lines.size(); i++) {
+        trie::entry_type entry = {lines[i].c_str(), lines[i].length(),
+                                  static_cast<trie::value_type>(i + 1)};
+        entries.push_back(entry);
+    }
+
+    struct timeval tv[2];
+    trie *incremental = create(type);
+    gettimeofday(&tv[0], NULL);
+    for (size_t i = 0; i < entries.size(); i++)
+        incremental->insert(entries[i].data, entries[i].length,
+                            entries[i].value);
+    gettimeofday(&tv[1], NULL);
+    std::cerr << lines.size() << " items, incremental build = "
+              << elapsed(tv[0], tv[1]) << "ms" << std::endl;
+
+    trie *bulk = create(type);
+    gettimeofday(&tv[0], NULL);
+    bulk->insert_bulk(&entries);
+    gettimeofday(&tv[1], NULL);
+    std::cerr << lines.size() << " items, bulk build = "
+              << elapsed(tv[0], tv[1]) << "ms" << std::endl;
+
+    size_t lost = 0;
+    for (size_t i = 0; i < lines.size(); i++) {
+        trie::value_type lhs = 0, rhs = 0;
+        bool found[2];
+        found[0] = incremental->search(lines[i].c_str(), lines[i].length(),
+                                       &lhs);
+        found[1] = bulk->search(lines[i].c_str(), lines[i].length(), &rhs);
+        if (!found[0] || !found[1] || lhs != rhs) {
+            std::cerr << "mismatch '" << lines[i] << "' " << lhs
+                      << " != " << rhs << std::endl;
+            ++lost;
+        }
+    }
+    std::cerr << lines.size() - lost << " items agree, "
+              << lost << " items differ" << std::endl;
+
+    delete incremental;
+    delete bulk;
+
+    return lost?1:0;
+}
+
+// vim: ts=4 sw=4 ai et
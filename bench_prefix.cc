@@ -0,0 +1,112 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com> 2009
+//
+// Measures prefix_search and dump on an archive with every instruction
+// set supported by basic_trie::scan_exist_target, and prefix_cursor
+// stopping at the first 10 keys as typeahead does. top_k is timed
+// against sorting prefix_search, build the archive with -k to see the
+// best-first search.
+
+#include <sys/time.h>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdlib>
+#include "trie_impl.h"
+
+using namespace dutil;
+
+static double elapsed(const struct timeval &start, const struct timeval &end)
+{
+    return (end.tv_sec - start.tv_sec) * 1000.0
+           + (end.tv_usec - start.tv_usec) / 1000.0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3) {
+        std::cout << argv[0] << ": ARCHIVE FILE" << std::endl;
+        return 0;
+    }
+
+    trie *archive = trie::create_trie(argv[1]);
+    std::ifstream source(argv[2]);
+    std::vector<std::string> prefixes;
+    std::string line;
+    while (getline(source, line)) {
+        size_t pos = line.find(' ');
+        if (pos != std::string::npos && line.length() > pos + 3)
+            prefixes.push_back(line.substr(pos + 1, 2));
+    }
+
+    const char *names[] = {"none", "sse2", "avx2"};
+    for (int i = basic_trie::SIMD_NONE; i <= basic_trie::SIMD_AVX2; i++) {
+        basic_trie::simd_type simd =
+            basic_trie::set_simd(static_cast<basic_trie::simd_type>(i));
+        if (simd != i)
+            continue;
+
+        struct timeval tv[2];
+        trie::result_type result;
+        trie::key_type key("", 0);
+        size_t found = 0;
+
+        gettimeofday(&tv[0], NULL);
+        archive->prefix_search(key, &result);
+        gettimeofday(&tv[1], NULL);
+        std::cerr << names[i] << ": dump " << result.size() << " items = "
+                  << elapsed(tv[0], tv[1]) << "ms";
+
+        gettimeofday(&tv[0], NULL);
+        for (size_t j = 0; j < prefixes.size(); j++) {
+            result.clear();
+            key.assign(prefixes[j].c_str(), prefixes[j].length());
+            found += archive->prefix_search(key, &result);
+        }
+        gettimeofday(&tv[1], NULL);
+        std::cerr << ", " << prefixes.size() << " prefix searches ("
+                  << found << " items) = " << elapsed(tv[0], tv[1]) << "ms";
+
+        found = 0;
+        gettimeofday(&tv[0], NULL);
+        for (size_t j = 0; j < prefixes.size(); j++) {
+            trie::cursor *cursor = archive->prefix_cursor(
+                prefixes[j].c_str(), prefixes[j].length(), 10);
+            while (cursor->next())
+                ++found;
+            delete cursor;
+        }
+        gettimeofday(&tv[1], NULL);
+        std::cerr << ", " << prefixes.size() << " cursors ("
+                  << found << " items) = " << elapsed(tv[0], tv[1]) << "ms";
+
+        for (int sorted = 0; sorted < 2; sorted++) {
+            found = 0;
+            gettimeofday(&tv[0], NULL);
+            for (size_t j = 0; j < prefixes.size(); j++) {
+                result.clear();
+                if (sorted)
+                    found += archive->trie::top_k(prefixes[j].c_str(),
+                                                  prefixes[j].length(), 10,
+                                                  &result);
+                else
+                    found += archive->top_k(prefixes[j].c_str(),
+                                            prefixes[j].length(), 10,
+                                            &result);
+            }
+            gettimeofday(&tv[1], NULL);
+            std::cerr << ", " << prefixes.size()
+                      << (sorted?" sorted top 10 (":" top 10 (")
+                      << found << " items) = " << elapsed(tv[0], tv[1])
+                      << "ms";
+        }
+        std::cerr << std::endl;
+    }
+
+    delete archive;
+
+    return 0;
+}
+
+// vim: ts=4 sw=4 ai et
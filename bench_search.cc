@@ -0,0 +1,79 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com> 2009
+//
+// Compares searching c-style keys through key_type against searching
+// their bytes directly.
+
+#include <sys/time.h>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdlib>
+#include "trie_impl.h"
+
+using namespace dutil;
+
+static double elapsed(const struct timeval &start, const struct timeval &end)
+{
+    return (end.tv_sec - start.tv_sec) * 1000.0
+           + (end.tv_usec - start.tv_usec) / 1000.0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3) {
+        std::cout << argv[0] << ": ARCHIVE FILE" << std::endl;
+        return 0;
+    }
+
+    trie *archive = trie::create_trie(argv[1]);
+    std::ifstream source(argv[2]);
+    std::vector<std::string> lines;
+    std::string line;
+    while (getline(source, line)) {
+        size_t pos = line.find(' ');
+        if (pos == std::string::npos)
+            continue;
+        lines.push_back(line.substr(pos + 1));
+        lines.push_back(lines.back().substr(0, lines.back().length() / 2));
+    }
+
+    struct timeval tv[2];
+    size_t n = lines.size(), lost = 0;
+    std::vector<trie::value_type> values(n);
+    std::vector<char> found(n);
+    size_t count[2] = {0, 0};
+
+    gettimeofday(&tv[0], NULL);
+    for (size_t i = 0; i < n; i++) {
+        trie::key_type key(lines[i].c_str(), lines[i].length());
+        found[i] = archive->search(key, &values[i]);
+        count[0] += found[i];
+    }
+    gettimeofday(&tv[1], NULL);
+    std::cerr << n << " key_type searches (" << count[0] << " found) = "
+              << elapsed(tv[0], tv[1]) << "ms" << std::endl;
+
+    gettimeofday(&tv[0], NULL);
+    for (size_t i = 0; i < n; i++) {
+        trie::value_type value = 0;
+        bool hit = archive->search(lines[i].c_str(), lines[i].length(),
+                                   &value);
+        count[1] += hit;
+        if (hit != static_cast<bool>(found[i])
+            || (hit && value != values[i]))
+            ++lost;
+    }
+    gettimeofday(&tv[1], NULL);
+    std::cerr << n << " byte searches (" << count[1] << " found) = "
+              << elapsed(tv[0], tv[1]) << "ms" << std::endl;
+
+    if (lost)
+        std::cerr << lost << " items differ" << std::endl;
+    delete archive;
+
+    return lost?1:0;
+}
+
+// vim: ts=4 sw=4 ai et
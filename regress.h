@@ -0,0 +1,51 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com>
+//
+// Helpers shared by the regress programs: the order tries walk keys in,
+// and the random keys the programs check tries against. Keys are drawn
+// from a linear congruential generator, so a seed always gives the same
+// keys.
+
+#ifndef REGRESS_H_
+#define REGRESS_H_
+
+#include <string>
+#include "trie.h"
+
+/// Bytes most keys are made of, with '\0' and a high byte.
+static const char kKeyBytes[] = {'a', 'b', '\0', '\xff'};
+
+/// Orders keys as tries walk them, a key after the keys it prefixes.
+static inline bool walk_less(const std::string &lhs, const std::string &rhs)
+{
+    return dutil::trie::walk_less(lhs.data(), lhs.size(), rhs.data(),
+                                  rhs.size());
+}
+
+/// Advances seed and returns its high bits.
+static inline unsigned int next_random(unsigned int *seed)
+{
+    *seed = *seed * 1103515245 + 12345;
+    return *seed >> 16;
+}
+
+/// Returns length random bytes of the first size bytes of alphabet.
+static inline std::string random_bytes(const char *alphabet, size_t size,
+                                       size_t length, unsigned int *seed)
+{
+    std::string bytes;
+    for (size_t i = 0; i < length; i++)
+        bytes.push_back(alphabet[next_random(seed) % size]);
+    return bytes;
+}
+
+/// Returns a random key of 1 to max_length bytes of alphabet.
+static inline std::string random_key(const char *alphabet, size_t size,
+                                     size_t max_length, unsigned int *seed)
+{
+    size_t length = 1 + next_random(seed) % max_length;
+    return random_bytes(alphabet, size, length, seed);
+}
+
+#endif  // REGRESS_H_
+
+// vim: ts=4 sw=4 ai et
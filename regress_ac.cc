@@ -0,0 +1,169 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com>
+//
+// ac_trie::scan against a brute-force scan of the text for every key,
+// over the whole text, empty or not, byte by byte and in chunks of any
+// size, built in one and several threads, in memory and reloaded. Keys
+// nest in each other and overlap as in he, she, his and hers, runs of
+// one byte match every key of that byte at once, a long key spans many
+// chunks, and archives cut short are refused.
+
+#include <unistd.h>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "trie.h"
+#include "trie_impl.h"
+#include "regress.h"
+
+using namespace dutil;
+
+typedef std::map<std::string, trie::value_type> key_map;
+
+/// Represents an occurrence as offset, length and value.
+typedef std::vector<size_t> match_list;
+
+static void collect(const ac_trie::match_type &match, void *context)
+{
+    match_list *found = static_cast<match_list *>(context);
+    found->push_back(match.offset);
+    found->push_back(match.length);
+    found->push_back(match.value);
+}
+
+/// Every key at every offset, by end byte then longest first.
+static match_list brute_force(const key_map &keys, const std::string &text)
+{
+    match_list found;
+    size_t longest = 0;
+    key_map::const_iterator it;
+    for (it = keys.begin(); it != keys.end(); it++)
+        longest = std::max(longest, it->first.size());
+    for (size_t end = 1; end <= text.size(); end++) {
+        for (size_t length = std::min(end, longest); length > 0; length--) {
+            it = keys.find(text.substr(end - length, length));
+            if (it == keys.end())
+                continue;
+            found.push_back(end - length);
+            found.push_back(length);
+            found.push_back(it->second);
+        }
+    }
+    return found;
+}
+
+static bool check(const char *name, const ac_trie *mtrie,
+                  const key_map &keys, const std::string &text)
+{
+    bool ok = true;
+    match_list expected = brute_force(keys, text), found;
+    key_map::const_iterator it;
+    trie::value_type value;
+    for (it = keys.begin(); it != keys.end(); it++)
+        if (!mtrie->search(it->first.data(), it->first.size(), &value)
+            || value != it->second)
+            ok = false;
+
+    size_t count = mtrie->scan(text.data(), text.size(), collect, &found);
+    if (found != expected || count * 3 != expected.size())
+        ok = false;
+    // an empty text finds nothing and counts no byte
+    ac_trie::scan_state_type state = {0, 0};
+    if (mtrie->scan("", 0, collect, &found, &state) || state.offset)
+        ok = false;
+
+    // bytes one by one, then chunks of 0 to 16 bytes, occurrences
+    // spanning their bounds
+    unsigned int seed = 12347;
+    for (size_t round = 0; round < 4; round++) {
+        state.state = 0;
+        state.offset = 0;
+        found.clear();
+        for (size_t i = 0; i < text.size(); ) {
+            size_t n = std::min<size_t>(round?next_random(&seed) % 17:1,
+                                        text.size() - i);
+            mtrie->scan(text.data() + i, n, collect, &found, &state);
+            i += n;
+        }
+        if (found != expected)
+            ok = false;
+    }
+    printf("%s: %s\n", name, ok?"ok":"TEST FAILED");
+    return ok;
+}
+
+int main()
+{
+    const char *filename = "regress_ac.trie";
+    unsigned int seed = 977;
+    std::string texts[4];
+    texts[0] = texts[1] = random_bytes(kKeyBytes, 4, 6000, &seed);
+    texts[2] = "ushers hishe hhers shis hehershe";
+    texts[3] = std::string(40, 'a') + "b" + std::string(7, 'a');
+    bool ok = true;
+
+    // only the empty key, which never occurs, then keys of 1 to 6 bytes
+    // and one of 64 bytes, keys nested and overlapped, and runs
+    key_map sets[4];
+    sets[0][""] = 1;
+    sets[1][""] = 1;
+    for (size_t i = 0; i < 300; i++) {
+        sets[1][random_key(kKeyBytes, 4, 6, &seed)] = 2 + i;
+    }
+    sets[1][texts[1].substr(3000, 64)] = -1;
+    const char *words[] = {"he", "she", "his", "hers", "h", "s", "hh"};
+    for (size_t i = 0; i < sizeof(words) / sizeof(words[0]); i++)
+        sets[2][words[i]] = -static_cast<trie::value_type>(i);
+    for (size_t i = 1; i <= 9; i++)
+        sets[3][std::string(i, 'a')] = i;
+    sets[3]["ab"] = 0;
+    for (size_t i = 0; i < 4; i++) {
+        const std::string &text = texts[i];
+        std::vector<trie::entry_type> entries;
+        key_map::const_iterator it;
+        for (it = sets[i].begin(); it != sets[i].end(); it++) {
+            trie::entry_type entry = {it->first.data(), it->first.size(),
+                                      it->second};
+            entries.push_back(entry);
+        }
+        for (size_t threads = 1; threads <= 3; threads += 2) {
+            char name[64];
+            std::vector<trie::entry_type> copy(entries);
+            ac_trie *mtrie = new ac_trie();
+            mtrie->set_build_threads(threads);
+            mtrie->insert_bulk(&copy);
+            snprintf(name, sizeof(name), "%lu keys, -j %lu",
+                     sets[i].size(), threads);
+            ok = check(name, mtrie, sets[i], text) && ok;
+            mtrie->build(filename);
+            delete mtrie;
+            mtrie = new ac_trie(filename);
+            snprintf(name, sizeof(name), "%lu keys, -j %lu, reloaded",
+                     sets[i].size(), threads);
+            ok = check(name, mtrie, sets[i], text) && ok;
+            delete mtrie;
+        }
+    }
+
+    // every array is checked against the size of the file
+    FILE *file = fopen(filename, "r+");
+    fseek(file, 0, SEEK_END);
+    if (ftruncate(fileno(file), ftell(file) - 1) < 0)
+        ok = false;
+    fclose(file);
+    bool thrown = false;
+    try {
+        delete trie::create_trie(filename);
+    } catch (const std::exception &) {
+        thrown = true;
+    }
+    printf("cut short: %s\n", thrown?"ok":"TEST FAILED");
+    ok = thrown && ok;
+    unlink(filename);
+    return ok?0:1;
+}
+
+// vim: ts=4 sw=4 ai et
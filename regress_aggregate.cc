@@ -0,0 +1,236 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com>
+//
+// aggregate_prefix and count_prefix against a brute-force scan of the
+// same keys, recorded or walked, for every archive type, empty or not,
+// built in one and several threads, in memory and reloaded, next to
+// max values and key ids, from archives cut short and under a delta,
+// empty or holding changes. Prefixes of long keys stop at every byte,
+// inside tails and rear tries too.
+
+#include <unistd.h>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include "trie.h"
+#include "trie_impl.h"
+#include "regress.h"
+
+using namespace dutil;
+
+typedef std::map<std::string, trie::value_type> key_map;
+
+/**
+ * Keys of a few bytes with '\0', a high byte and the empty key, values
+ * near both ends of value_type so that sums overflow 32 bits, and long
+ * keys apart only near their ends.
+ */
+static key_map make_keys(size_t count)
+{
+    unsigned int seed = 10007;
+    key_map keys;
+    keys[""] = -1;
+    for (size_t i = 0; i < count; i++) {
+        std::string key = random_key(kKeyBytes, 4, 8, &seed);
+        keys[key] = i % 3?INT32_MAX - static_cast<trie::value_type>(i)
+                         :static_cast<trie::value_type>(seed);
+    }
+    std::string rest(24, 'a');
+    for (size_t i = 0; i < 4; i++) {
+        keys["b\xff" + rest + std::string(1, 'a' + i)] = INT32_MIN + i;
+        keys["b\xff" + rest.substr(i) + "\0"] = INT32_MAX - i;
+    }
+    return keys;
+}
+
+static bool check(const char *name, const trie *mtrie, const key_map &keys)
+{
+    bool ok = true;
+    // every prefix of up to 3 bytes of the alphabet, and a missing one
+    std::vector<std::string> prefixes(1, "");
+    for (size_t i = 0; i < prefixes.size() && prefixes[i].size() < 3; i++) {
+        for (size_t j = 0; j < sizeof(kKeyBytes); j++)
+            prefixes.push_back(prefixes[i] + kKeyBytes[j]);
+    }
+    prefixes.push_back("q");
+    // every prefix of the long keys
+    key_map::const_iterator it;
+    for (it = keys.lower_bound("b\xff"); it != keys.end(); it++)
+        for (size_t n = 4; it->first.size() > 20 && n <= it->first.size();
+             n++)
+            prefixes.push_back(it->first.substr(0, n));
+    for (size_t i = 0; i < prefixes.size(); i++) {
+        const std::string &prefix = prefixes[i];
+        trie::aggregate_type expected = {0, 0, INT32_MAX, INT32_MIN, 0};
+        for (it = keys.lower_bound(prefix);
+             it != keys.end() && !it->first.compare(0, prefix.size(), prefix);
+             it++) {
+            expected.sum += it->second;
+            expected.count++;
+            expected.min = std::min(expected.min, it->second);
+            expected.max = std::max(expected.max, it->second);
+        }
+        trie::aggregate_type found;
+        bool any = mtrie->aggregate_prefix(prefix.data(), prefix.size(),
+                                           &found);
+        if (any != (expected.count > 0)
+            || (any && (found.sum != expected.sum
+                        || found.count != expected.count
+                        || found.min != expected.min
+                        || found.max != expected.max))
+            || mtrie->count_prefix(prefix.data(), prefix.size())
+               != static_cast<size_t>(expected.count)) {
+            printf("TEST FAILED on %s, prefix of %lu bytes\n", name,
+                   prefix.size());
+            ok = false;
+        }
+    }
+    printf("%s: %s\n", name, ok?"ok":"TEST FAILED");
+    return ok;
+}
+
+int main()
+{
+    const char *filename = "regress_aggregate.trie";
+    const char *names[] = {"", "single", "double", "compact", "dawg", "ac"};
+    bool ok = true;
+
+    // no key at all, then many
+    key_map sets[2];
+    sets[1] = make_keys(2500);
+    for (size_t i = 0; i < 2; i++) {
+        const key_map &keys = sets[i];
+        std::vector<trie::entry_type> entries;
+        key_map::const_iterator it;
+        for (it = keys.begin(); it != keys.end(); it++) {
+            trie::entry_type entry = {it->first.data(), it->first.size(),
+                                      it->second};
+            entries.push_back(entry);
+        }
+        for (int type = trie::SINGLE_TRIE; type <= trie::AC_TRIE; type++) {
+            for (size_t mode = 0; mode < 4; mode++) {
+                // recorded or walked, by 1 or 3 threads
+                bool record = mode & 1;
+                size_t threads = (mode & 2)?3:1;
+                char name[64];
+                std::vector<trie::entry_type> copy(entries);
+                trie *mtrie = trie::create_trie(
+                    static_cast<trie::trie_type>(type));
+                mtrie->record_aggregates(record);
+                mtrie->set_build_threads(threads);
+                mtrie->insert_bulk(&copy);
+                if (type <= trie::DOUBLE_TRIE && !record) {
+                    snprintf(name, sizeof(name), "%s, %lu keys, -j %lu, "
+                             "in memory", names[type], keys.size(), threads);
+                    ok = check(name, mtrie, keys) && ok;
+                }
+                mtrie->build(filename);
+                delete mtrie;
+                mtrie = trie::create_trie(filename);
+                snprintf(name, sizeof(name), "%s, %lu keys, -j %lu, %s",
+                         names[type], keys.size(), threads,
+                         record?"recorded":"walked");
+                ok = check(name, mtrie, keys) && ok;
+                delete mtrie;
+            }
+        }
+    }
+    // aggregates next to max values and key ids, and cut short
+    const key_map &keys = sets[1];
+    for (int type = trie::SINGLE_TRIE; type <= trie::DOUBLE_TRIE; type++) {
+        for (int extras = 0; extras < 8; extras++) {
+            char name[64];
+            trie *mtrie = trie::create_trie(
+                static_cast<trie::trie_type>(type));
+            key_map::const_iterator it;
+            for (it = keys.begin(); it != keys.end(); it++)
+                mtrie->insert(it->first.data(), it->first.size(),
+                              it->second);
+            mtrie->record_max_values(extras & 1);
+            mtrie->record_key_ids(extras & 2);
+            mtrie->record_aggregates(extras & 4);
+            mtrie->build(filename);
+            delete mtrie;
+            mtrie = trie::create_trie(filename);
+            snprintf(name, sizeof(name), "%s, %s%s%s", names[type],
+                     (extras & 1)?"max values ":"",
+                     (extras & 2)?"key ids ":"",
+                     (extras & 4)?"aggregates":"no aggregates");
+            ok = check(name, mtrie, keys) && ok;
+            trie::result_type top;
+            trie::aggregate_type all;
+            std::string first;
+            mtrie->aggregate_prefix("", 0, &all);
+            mtrie->top_k("", 0, 1, &top);
+            if (top.size() != 1 || top[0].second != all.max
+                || mtrie->key_id_size() != ((extras & 2)?keys.size():0)
+                || ((extras & 2) && (!mtrie->key_of(0, &first)
+                                     || first != keys.begin()->first))) {
+                printf("%s: TEST FAILED, other arrays\n", name);
+                ok = false;
+            }
+            delete mtrie;
+            if (!extras)
+                continue;
+            // every array is checked against the size of the file
+            FILE *file = fopen(filename, "r+");
+            fseek(file, 0, SEEK_END);
+            if (ftruncate(fileno(file), ftell(file) - 1) < 0)
+                ok = false;
+            fclose(file);
+            bool thrown = false;
+            try {
+                delete trie::create_trie(filename);
+            } catch (const std::exception &) {
+                thrown = true;
+            }
+            printf("%s, cut short: %s\n", name, thrown?"ok":"TEST FAILED");
+            ok = thrown && ok;
+        }
+
+        // a delta reads recorded aggregates until it holds a change
+        trie *mtrie = trie::create_trie(static_cast<trie::trie_type>(type));
+        std::vector<trie::entry_type> entries;
+        key_map::const_iterator it;
+        for (it = keys.begin(); it != keys.end(); it++) {
+            trie::entry_type entry = {it->first.data(), it->first.size(),
+                                      it->second};
+            entries.push_back(entry);
+        }
+        mtrie->record_aggregates(true);
+        mtrie->insert_bulk(&entries);
+        mtrie->build(filename);
+        delete mtrie;
+        std::string delta_filename = std::string(filename) + ".delta";
+        unlink(delta_filename.c_str());
+        delta_trie *delta = new delta_trie(filename);
+        char name[64];
+        snprintf(name, sizeof(name), "%s, empty delta", names[type]);
+        ok = check(name, delta, keys) && ok;
+        key_map changed(keys);
+        size_t n = 0;
+        for (it = keys.begin(); it != keys.end(); it++, n++) {
+            trie::key_type key(it->first.data(), it->first.size());
+            if (n % 9 == 2) {
+                delta->remove(key);
+                changed.erase(it->first);
+            } else if (n % 9 == 5) {
+                delta->insert(key, INT32_MIN);
+                changed[it->first] = INT32_MIN;
+            }
+        }
+        delta->insert(trie::key_type("ab\xff\xff", 4), INT32_MAX);
+        changed["ab\xff\xff"] = INT32_MAX;
+        snprintf(name, sizeof(name), "%s, delta", names[type]);
+        ok = check(name, delta, changed) && ok;
+        delete delta;
+        unlink(delta_filename.c_str());
+    }
+    unlink(filename);
+    return ok?0:1;
+}
+
+// vim: ts=4 sw=4 ai et
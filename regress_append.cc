@@ -0,0 +1,76 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com>
+//
+// prefix_search appends to result and keeps the pairs already in it,
+// which is what merging results of several tries relies on.
+
+#include <unistd.h>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "trie.h"
+#include "trie_impl.h"
+
+using namespace dutil;
+
+static const char *dict[] = {"bachelor", "back", "badge", "badger",
+                             "badness", "bcs", "backbone", NULL};
+static const char *prefixes[] = {"", "ba", "back", "bad", "badger",
+                                 "bx", "x", NULL};
+
+static bool check(const char *name, const trie *mtrie)
+{
+    for (size_t i = 0; prefixes[i]; i++) {
+        trie::result_type result;
+        trie::key_type sentinel("sentinel", 8);
+        result.push_back(std::make_pair(sentinel, -7));
+        mtrie->prefix_search(trie::key_type(prefixes[i],
+                                            strlen(prefixes[i])), &result);
+        std::vector<std::string> found, expected;
+        for (size_t j = 1; j < result.size(); j++)
+            found.push_back(result[j].first.c_str());
+        for (size_t j = 0; dict[j]; j++)
+            if (!strncmp(dict[j], prefixes[i], strlen(prefixes[i])))
+                expected.push_back(dict[j]);
+        std::sort(found.begin(), found.end());
+        std::sort(expected.begin(), expected.end());
+        if (strcmp(result[0].first.c_str(), "sentinel")
+            || result[0].second != -7 || found != expected) {
+            printf("TEST FAILED on %s, prefix '%s'\n", name, prefixes[i]);
+            return false;
+        }
+    }
+    printf("%s: ok\n", name);
+    return true;
+}
+
+int main()
+{
+    const char *filename = "regress_append.trie";
+    bool ok = true;
+    for (int type = trie::SINGLE_TRIE; type <= trie::DOUBLE_TRIE; type++) {
+        trie *mtrie = trie::create_trie(static_cast<trie::trie_type>(type));
+        for (size_t j = 0; dict[j]; j++)
+            mtrie->insert(dict[j], strlen(dict[j]), j + 1);
+        ok = check(type == trie::SINGLE_TRIE?"single":"double", mtrie) && ok;
+        mtrie->build(filename);
+        delete mtrie;
+        mtrie = trie::create_trie(filename);
+        ok = check(type == trie::SINGLE_TRIE?"single archive":"double archive",
+                   mtrie) && ok;
+        delete mtrie;
+    }
+    // delta_trie drops archive keys changed in delta, but not ours
+    unlink((std::string(filename) + ".delta").c_str());
+    {
+        delta_trie mtrie(filename);
+        mtrie.insert(trie::key_type(dict[1], strlen(dict[1])), 9);
+        ok = check("delta", &mtrie) && ok;
+    }
+    unlink((std::string(filename) + ".delta").c_str());
+    unlink(filename);
+    return ok?0:1;
+}
+
+// vim: ts=4 sw=4 ai et
@@ -0,0 +1,200 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com>
+//
+// trie_tool -e answers queries in their order whatever the number of
+// threads, in every mode and across the chunks it reads at a time, keeps
+// stderr quiet without -v and reports every thread with it.
+
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+#include "trie.h"
+#include "trie_impl.h"
+#include "regress.h"
+
+using namespace dutil;
+
+typedef std::map<std::string, trie::value_type> key_map;
+
+/// Keys of a few letters, so that prefixes and near misses are common.
+static key_map make_keys(size_t count)
+{
+    unsigned int seed = 31337;
+    key_map keys;
+    for (size_t i = 0; i < count; i++) {
+        std::string key = random_key("abcd", 4, 6, &seed);
+        keys[key] = static_cast<trie::value_type>(i * 53 % 700) - 200;
+    }
+    return keys;
+}
+
+/// Queries spanning several chunks of trie_tool, hits and misses mixed.
+static std::vector<std::string> make_queries(size_t count)
+{
+    unsigned int seed = 4242;
+    std::vector<std::string> queries;
+    for (size_t i = 0; i < count; i++) {
+        std::string query = random_bytes("abcde", 5, next_random(&seed) % 5,
+                                         &seed);
+        queries.push_back(query);
+    }
+    return queries;
+}
+
+static void append_answer(std::string *out, const std::string &query,
+                          const char *answer)
+{
+    out->append(query);
+    out->push_back('\t');
+    out->append(answer);
+    out->push_back('\n');
+}
+
+static void collect_fuzzy(const trie::fuzzy_match_type &match,
+                          void *context)
+{
+    std::vector<std::string> *found
+        = static_cast<std::vector<std::string> *>(context);
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%d %d ", static_cast<int>(match.distance),
+             match.value);
+    found->push_back(buf + std::string(match.key, match.length));
+}
+
+/**
+ * The output expected from one mode. Exact and count answers come from
+ * keys, the others follow the order of the trie.
+ */
+static std::string expect(const char *mode, const trie &mtrie,
+                          const key_map &keys,
+                          const std::vector<std::string> &queries)
+{
+    std::string out;
+    char buf[128];
+    for (size_t i = 0; i < queries.size(); i++) {
+        const std::string &query = queries[i];
+        if (!strcmp(mode, "")) {
+            key_map::const_iterator it = keys.find(query);
+            if (it != keys.end()) {
+                snprintf(buf, sizeof(buf), "%d", it->second);
+                append_answer(&out, query, buf);
+            }
+        } else if (!strcmp(mode, "-o")) {
+            int count = 0, min = 0, max = 0;
+            long long sum = 0;
+            key_map::const_iterator it;
+            for (it = keys.begin(); it != keys.end(); it++) {
+                if (it->first.compare(0, query.size(), query))
+                    continue;
+                min = count?std::min(min, it->second):it->second;
+                max = count?std::max(max, it->second):it->second;
+                sum += it->second;
+                ++count;
+            }
+            if (count) {
+                snprintf(buf, sizeof(buf), "%d %lld %d %d", count, sum,
+                         min, max);
+                append_answer(&out, query, buf);
+            }
+        } else if (!strcmp(mode, "-f 1")) {
+            std::vector<std::string> found;
+            mtrie.fuzzy_search(query.data(), query.size(), 1,
+                               collect_fuzzy, &found);
+            for (size_t j = 0; j < found.size(); j++)
+                append_answer(&out, query, found[j].c_str());
+        } else {
+            trie::result_type result;
+            if (!strcmp(mode, "-n 3"))
+                mtrie.top_k(query.data(), query.size(), 3, &result);
+            else
+                mtrie.prefix_search(trie::key_type(query.data(),
+                                                   query.size()), &result);
+            for (size_t j = 0; j < result.size(); j++) {
+                snprintf(buf, sizeof(buf), "%d ", result[j].second);
+                append_answer(&out, query, (std::string(buf)
+                                            + result[j].first.c_str())
+                                           .c_str());
+            }
+        }
+    }
+    return out;
+}
+
+static std::string read_file(const char *filename)
+{
+    std::string text;
+    FILE *fp = fopen(filename, "r");
+    if (!fp)
+        return text;
+    char buf[4096];
+    size_t length;
+    while ((length = fread(buf, 1, sizeof(buf), fp)) > 0)
+        text.append(buf, length);
+    fclose(fp);
+    return text;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        printf("usage: %s path/to/trie_tool\n", argv[0]);
+        return 1;
+    }
+    const char *filename = "regress_batch.trie";
+    const char *input = "regress_batch.queries";
+    const char *output = "regress_batch.out";
+    const char *errors = "regress_batch.err";
+    const char *modes[] = {"", "-p", "-n 3", "-f 1", "-o"};
+    key_map keys = make_keys(3000);
+    std::vector<std::string> queries = make_queries(70000);
+    bool ok = true;
+
+    trie *mtrie = trie::create_trie(trie::DOUBLE_TRIE);
+    key_map::const_iterator it;
+    for (it = keys.begin(); it != keys.end(); it++)
+        mtrie->insert(it->first.data(), it->first.size(), it->second);
+    mtrie->record_max_values(true);
+    mtrie->record_aggregates(true);
+    mtrie->build(filename);
+    delete mtrie;
+    unlink((std::string(filename) + ".delta").c_str());
+    mtrie = trie::create_trie(filename);
+
+    FILE *fp = fopen(input, "w");
+    for (size_t i = 0; i < queries.size(); i++)
+        fprintf(fp, "%s\n", queries[i].c_str());
+    fclose(fp);
+
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        std::string expected = expect(modes[m], *mtrie, keys, queries);
+        for (int threads = 1; threads <= 4; threads += 3) {
+            for (int verbose = 0; verbose < 2; verbose++) {
+                char command[1024], last[32];
+                snprintf(command, sizeof(command),
+                         "%s %s -j %d %s -e %s %s > %s 2> %s", argv[1],
+                         modes[m], threads, verbose?"-v":"", input,
+                         filename, output, errors);
+                snprintf(last, sizeof(last), "thread %d: ", threads - 1);
+                bool passed = system(command) == 0;
+                std::string report = read_file(errors);
+                passed = passed && read_file(output) == expected
+                         && report.empty() == !verbose
+                         && (!verbose
+                             || report.find(last) != std::string::npos);
+                printf("%s: %s\n", command, passed?"ok":"TEST FAILED");
+                ok = passed && ok;
+            }
+        }
+    }
+    delete mtrie;
+    unlink(filename);
+    unlink(input);
+    unlink(output);
+    unlink(errors);
+    return ok?0:1;
+}
+
+// vim: ts=4 sw=4 ai et
@@ -0,0 +1,254 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com>
+//
+// insert_bulk and read_from_text against a brute-force scan of the same
+// keys, in one and several threads, in memory and reloaded, with keys
+// given more than once. basic_trie builds an empty trie without moving
+// a single state, and falls back to insert once it holds a key. Key sets
+// at the edges of the depth-first walk: none, only the empty key, a
+// chain of keys each prefixing the next, a state with all 256 bytes as
+// children, and more threads than first bytes.
+
+#include <unistd.h>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include "trie.h"
+#include "trie_impl.h"
+#include "regress.h"
+
+using namespace dutil;
+
+typedef std::map<std::string, trie::value_type> key_map;
+
+/// Random keys over alphabet, the empty key first.
+static std::vector<std::string> make_keys(const char *alphabet, size_t size,
+                                          size_t count)
+{
+    unsigned int seed = 65537;
+    std::vector<std::string> keys(1, "");
+    for (size_t i = 0; i < count; i++) {
+        keys.push_back(random_key(alphabet, size, 12, &seed));
+    }
+    return keys;
+}
+
+static bool check(const char *name, const trie *mtrie, const key_map &keys)
+{
+    bool ok = true;
+    key_map::const_iterator it;
+    trie::value_type value;
+    for (it = keys.begin(); it != keys.end(); it++) {
+        std::string missed = it->first + "q";
+        if (!mtrie->search(it->first.data(), it->first.size(), &value)
+            || value != it->second
+            || (!keys.count(missed)
+                && mtrie->search(missed.data(), missed.size(), &value)))
+            ok = false;
+    }
+
+    std::vector<std::string> expected, walked;
+    for (it = keys.begin(); it != keys.end(); it++)
+        expected.push_back(it->first);
+    std::sort(expected.begin(), expected.end(), walk_less);
+    trie::cursor *cursor = mtrie->prefix_cursor("", 0);
+    while (cursor->next()) {
+        walked.push_back(std::string(cursor->key(), cursor->length()));
+        it = keys.find(walked.back());
+        if (it == keys.end() || it->second != cursor->value())
+            ok = false;
+    }
+    delete cursor;
+    if (walked != expected)
+        ok = false;
+    printf("%s: %s\n", name, ok?"ok":"TEST FAILED");
+    return ok;
+}
+
+/// Counts states moved by relocate.
+class counting_relocator: public trie_relocator_interface<trie::size_type> {
+  public:
+    counting_relocator(): count(0) {}
+
+    void relocate(trie::size_type s, trie::size_type t)
+    {
+        ++count;
+    }
+
+    size_t count;
+};
+
+/// basic_trie::insert_bulk of an empty trie moves no state.
+static bool check_basic(const std::vector<std::string> &keys)
+{
+    std::vector<trie::entry_type> entries;
+    key_map expected;
+    for (size_t i = 0; i < keys.size(); i++) {
+        trie::entry_type entry = {keys[i].data(), keys[i].size(),
+                                  static_cast<trie::value_type>(1 + i)};
+        entries.push_back(entry);
+        expected[keys[i]] = entry.value;
+    }
+    bool ok = true;
+    for (size_t threads = 1; threads <= 3; threads += 2) {
+        std::vector<trie::entry_type> copy(entries);
+        counting_relocator bulk;
+        basic_trie mtrie;
+        mtrie.set_relocator(&bulk);
+        mtrie.set_build_threads(threads);
+        mtrie.insert_bulk(&copy);
+        char name[64];
+        snprintf(name, sizeof(name), "basic -j %lu, %lu states moved",
+                 threads, bulk.count);
+        ok = check(name, &mtrie, expected) && bulk.count == 0 && ok;
+    }
+
+    // key by key moves states, once a key is in only the rest is bulk
+    counting_relocator single;
+    basic_trie other;
+    other.set_relocator(&single);
+    key_map::const_iterator it;
+    for (it = expected.begin(); it != expected.end(); it++)
+        other.insert(trie::key_type(it->first.data(), it->first.size()),
+                     it->second);
+    basic_trie mixed;
+    std::vector<trie::entry_type> rest(entries.begin() + 1, entries.end());
+    mixed.insert(trie::key_type(entries[0].data, entries[0].length),
+                 entries[0].value);
+    mixed.insert_bulk(&rest);
+    ok = single.count > 0 && ok;
+    ok = check("basic by insert", &other, expected) && ok;
+    ok = check("basic, bulk after insert", &mixed, expected) && ok;
+    return ok;
+}
+
+/// Fills mtrie by insert_bulk, every third key given twice.
+static key_map fill(trie *mtrie, const std::vector<std::string> &keys)
+{
+    std::vector<trie::entry_type> entries;
+    key_map expected;
+    for (size_t i = 0; i < keys.size(); i++) {
+        trie::value_type value = 1 + i % 1000;
+        trie::entry_type entry = {keys[i].data(), keys[i].size(), value};
+        entries.push_back(entry);
+        expected[keys[i]] = value;
+    }
+    for (size_t i = 0; i < keys.size(); i += 3) {
+        // the last one wins
+        trie::entry_type entry = {keys[i].data(), keys[i].size(),
+                                  static_cast<trie::value_type>(5000 + i)};
+        entries.push_back(entry);
+        expected[keys[i]] = entry.value;
+    }
+    mtrie->insert_bulk(&entries);
+    return expected;
+}
+
+int main()
+{
+    const char *filename = "regress_bulk.trie";
+    const char *names[] = {"", "single", "double", "compact", "dawg", "ac"};
+    const char alphabet[] = {'a', 'b', 'c', '\0', '\xff'};
+    std::vector<std::string> keys = make_keys(alphabet, sizeof(alphabet),
+                                              4000);
+    bool ok = check_basic(keys);
+
+    // no key, the empty key, a chain of prefixes, a state of 256
+    // children below a long prefix, and more threads than first bytes
+    std::vector<std::string> edges[5];
+    edges[1].push_back("");
+    for (size_t i = 0; i < 300; i++)
+        edges[2].push_back(std::string(i, 'a'));
+    for (int i = 0; i < 256; i++) {
+        edges[3].push_back(std::string(40, 'x') + static_cast<char>(i));
+        edges[3].push_back(std::string(40, 'x') + static_cast<char>(i)
+                           + "yz");
+    }
+    for (size_t i = 0; i < 500; i++)
+        edges[4].push_back("k" + keys[i]);
+    const char *edge_names[] = {"no key", "empty key", "chain",
+                                "256 children", "one first byte"};
+    for (size_t e = 0; e < 5; e++) {
+        for (int type = trie::SINGLE_TRIE; type <= trie::AC_TRIE; type++) {
+            char name[64];
+            trie *mtrie = trie::create_trie(
+                static_cast<trie::trie_type>(type));
+            mtrie->set_build_threads(8);
+            key_map expected = fill(mtrie, edges[e]);
+            mtrie->build(filename);
+            delete mtrie;
+            mtrie = trie::create_trie(filename);
+            snprintf(name, sizeof(name), "%s -j 8, %s", names[type],
+                     edge_names[e]);
+            ok = check(name, mtrie, expected) && ok;
+            delete mtrie;
+        }
+    }
+
+    for (int type = trie::SINGLE_TRIE; type <= trie::AC_TRIE; type++) {
+        for (size_t threads = 1; threads <= 3; threads += 2) {
+            char name[64];
+            trie *mtrie = trie::create_trie(
+                static_cast<trie::trie_type>(type));
+            mtrie->set_build_threads(threads);
+            key_map expected = fill(mtrie, keys);
+            if (type <= trie::DOUBLE_TRIE) {
+                snprintf(name, sizeof(name), "%s -j %lu in memory",
+                         names[type], threads);
+                ok = check(name, mtrie, expected) && ok;
+                // keys inserted one by one end up the same
+                trie *other = trie::create_trie(
+                    static_cast<trie::trie_type>(type));
+                key_map::const_iterator it;
+                for (it = expected.begin(); it != expected.end(); it++)
+                    other->insert(it->first.data(), it->first.size(),
+                                  it->second);
+                snprintf(name, sizeof(name), "%s by insert", names[type]);
+                ok = check(name, other, expected) && ok;
+                delete other;
+            }
+            mtrie->build(filename);
+            delete mtrie;
+            mtrie = trie::create_trie(filename);
+            snprintf(name, sizeof(name), "%s -j %lu archive", names[type],
+                     threads);
+            ok = check(name, mtrie, expected) && ok;
+            delete mtrie;
+        }
+    }
+
+    // read_from_text takes lines of a value and a key
+    const char *source = "regress_bulk.txt";
+    const char letters[] = {'a', 'b', 'c', 'd', ' '};
+    std::vector<std::string> lines = make_keys(letters, sizeof(letters),
+                                               3000);
+    FILE *file = fopen(source, "w");
+    key_map expected;
+    for (size_t i = 1; i < lines.size(); i++) {
+        // keys start with a letter, spaces around them are skipped
+        std::string key = "x" + lines[i];
+        key.erase(key.find_last_not_of(' ') + 1);
+        fprintf(file, "%lu %s\n", 1 + i, key.c_str());
+        expected[key] = 1 + i;
+    }
+    fclose(file);
+    for (size_t threads = 1; threads <= 3; threads += 2) {
+        char name[64];
+        trie *mtrie = trie::create_trie(trie::DOUBLE_TRIE);
+        mtrie->set_build_threads(threads);
+        mtrie->read_from_text(source);
+        mtrie->build(filename);
+        delete mtrie;
+        mtrie = trie::create_trie(filename);
+        snprintf(name, sizeof(name), "read_from_text -j %lu", threads);
+        ok = check(name, mtrie, expected) && ok;
+        delete mtrie;
+    }
+    unlink(source);
+    unlink(filename);
+    return ok?0:1;
+}
+
+// vim: ts=4 sw=4 ai et
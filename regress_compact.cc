@@ -0,0 +1,237 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com>
+//
+// compact_trie against a brute-force scan of the same keys, built in
+// one and several threads, empty or not, reloaded from its archive.
+// Archives hold 4 bytes per unit and per value. Enough keys need
+// offsets past 20 bits, which are then shifted. A node has all 256
+// children and a leaf, and values reach both ends of value_type. Keys
+// can not be added once built, and archives cut short are refused.
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "trie.h"
+#include "trie_impl.h"
+#include "regress.h"
+
+using namespace dutil;
+
+typedef std::map<std::string, trie::value_type> key_map;
+
+/// Keys of a few bytes with '\0', a high byte and the empty key, values
+/// of any sign and size.
+static key_map make_keys(size_t count)
+{
+    const char alphabet[] = {'a', 'b', 'c', '\0', '\xff'};
+    unsigned int seed = 1009;
+    key_map keys;
+    keys[""] = -7;
+    for (size_t i = 0; i < count; i++) {
+        std::string key = random_key(alphabet, 5, 10, &seed);
+        keys[key] = static_cast<trie::value_type>(seed);
+    }
+    // a node with every byte as a child, and a key ending there
+    for (int i = 0; i < 256; i++)
+        keys[std::string("cc") + static_cast<char>(i)] = i;
+    keys["cc"] = 0;
+    keys["\xff\xff"] = INT32_MIN;
+    keys[std::string("\0\0", 2)] = INT32_MAX;
+    return keys;
+}
+
+/// Keys of 12 letters, so many that units need shifted offsets.
+static key_map make_long_keys(size_t count)
+{
+    unsigned int seed = 5;
+    key_map keys;
+    for (size_t i = 0; i < count; i++) {
+        keys[random_bytes("abcdefghijklmnopqrstuvwxyz", 26, 12, &seed)]
+            = static_cast<trie::value_type>(i);
+    }
+    return keys;
+}
+
+/**
+ * The archive is a header, 4 bytes per unit and 4 per value, one value
+ * per key. Returns the number of nodes whose offset is shifted.
+ */
+static size_t check_units(const char *name, const compact_trie *mtrie,
+                          const char *filename, size_t keys, bool *ok)
+{
+    const compact_trie::header_type *header = mtrie->header();
+    struct stat sb;
+    size_t shifted = 0;
+    for (trie::size_type s = 0; s < header->unit_size; s++) {
+        compact_trie::unit_type u = mtrie->unit(s);
+        if (!compact_trie::is_leaf(u) && ((u >> 10) & 1))
+            ++shifted;
+    }
+    if (stat(filename, &sb) < 0
+        || static_cast<size_t>(sb.st_size)
+           != sizeof(*header) + 4 * (header->unit_size + header->value_size)
+        || static_cast<size_t>(header->value_size) != keys) {
+        printf("%s: TEST FAILED, %lu bytes for %d units\n", name,
+               static_cast<size_t>(sb.st_size), header->unit_size);
+        *ok = false;
+    }
+    return shifted;
+}
+
+static bool check(const char *name, const trie *mtrie, const key_map &keys)
+{
+    bool ok = true;
+    key_map::const_iterator it;
+    trie::value_type value;
+    for (it = keys.begin(); it != keys.end(); it++) {
+        std::string missed = it->first + "q";
+        if (!mtrie->search(it->first.data(), it->first.size(), &value)
+            || value != it->second
+            || (!keys.count(missed)
+                && mtrie->search(missed.data(), missed.size(), &value)))
+            ok = false;
+    }
+
+    // prefixes of every key, in one scan
+    const char *texts[] = {"abcab\xff\0a", "", "q", "\0\0\0\0"};
+    const size_t lengths[] = {8, 0, 1, 4};
+    for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+        trie::prefix_result_type found, expected;
+        for (size_t n = 0; n <= lengths[i]; n++) {
+            it = keys.find(std::string(texts[i], n));
+            if (it != keys.end())
+                expected.push_back(std::make_pair(n, it->second));
+        }
+        mtrie->common_prefix_search(texts[i], lengths[i], &found);
+        size_t matched = 0;
+        bool longest = mtrie->longest_prefix(texts[i], lengths[i], &matched,
+                                             &value);
+        if (found != expected || longest != !expected.empty()
+            || (longest && (matched != expected.back().first
+                            || value != expected.back().second)))
+            ok = false;
+    }
+
+    const char *prefixes[] = {"", "a", "c\0", "\xff", "q"};
+    const size_t prefix_lengths[] = {0, 1, 2, 1, 1};
+    for (size_t i = 0; i < sizeof(prefix_lengths) / sizeof(size_t); i++) {
+        std::string prefix(prefixes[i], prefix_lengths[i]);
+        std::vector<std::string> expected, walked;
+        for (it = keys.begin(); it != keys.end(); it++)
+            if (!it->first.compare(0, prefix.size(), prefix))
+                expected.push_back(it->first);
+        std::sort(expected.begin(), expected.end(), walk_less);
+
+        trie::result_type result;
+        mtrie->prefix_search(trie::key_type(prefix.data(), prefix.size()),
+                             &result);
+        if (result.size() != expected.size())
+            ok = false;
+
+        // pages of 11 keys, each page continuing after the last key
+        std::string last;
+        bool more = true;
+        while (more) {
+            trie::cursor *cursor = mtrie->prefix_cursor(
+                prefix.data(), prefix.size(), 11,
+                walked.empty()?NULL:last.data(), last.size());
+            size_t n = 0;
+            while (cursor->next()) {
+                last.assign(cursor->key(), cursor->length());
+                walked.push_back(last);
+                if (cursor->value() != keys.find(last)->second)
+                    ok = false;
+                ++n;
+            }
+            delete cursor;
+            more = (n == 11);
+        }
+        if (walked != expected)
+            ok = false;
+    }
+    printf("%s: %s\n", name, ok?"ok":"TEST FAILED");
+    return ok;
+}
+
+int main()
+{
+    const char *filename = "regress_compact.trie";
+    bool ok = true;
+    // no key at all, then many, then enough for shifted offsets
+    key_map sets[3];
+    sets[1] = make_keys(20000);
+    sets[2] = make_long_keys(120000);
+    for (size_t i = 0; i < 3; i++) {
+        const key_map &keys = sets[i];
+        std::vector<trie::entry_type> entries;
+        key_map::const_iterator it;
+        for (it = keys.begin(); it != keys.end(); it++) {
+            trie::entry_type entry = {it->first.data(), it->first.size(),
+                                      it->second};
+            entries.push_back(entry);
+        }
+        for (size_t threads = 1; threads <= 3; threads += 2) {
+            char name[64];
+            std::vector<trie::entry_type> copy(entries);
+            trie *mtrie = trie::create_trie(trie::COMPACT_TRIE);
+            mtrie->set_build_threads(threads);
+            mtrie->insert_bulk(&copy);
+            snprintf(name, sizeof(name), "%lu keys, -j %lu", keys.size(),
+                     threads);
+            ok = check(name, mtrie, keys) && ok;
+            mtrie->build(filename);
+
+            // built, it takes no more keys
+            int refused = 0;
+            trie::entry_type more = {"zz", 2, 1};
+            copy.assign(1, more);
+            try {
+                mtrie->insert_bulk(&copy);
+            } catch (const std::exception &) {
+                ++refused;
+            }
+            try {
+                mtrie->insert("zz", 2, 1);
+            } catch (const std::exception &) {
+                ++refused;
+            }
+            delete mtrie;
+            compact_trie *archive = new compact_trie(filename);
+            snprintf(name, sizeof(name), "%lu keys, -j %lu, reloaded",
+                     keys.size(), threads);
+            size_t shifted = check_units(name, archive, filename,
+                                         keys.size(), &ok);
+            ok = check(name, archive, keys) && ok;
+            if ((i == 2) != (shifted > 0) || refused != 2) {
+                printf("%s: TEST FAILED, %lu shifted, %d refused\n", name,
+                       shifted, refused);
+                ok = false;
+            }
+            delete archive;
+        }
+    }
+
+    // every array is checked against the size of the file
+    FILE *file = fopen(filename, "r+");
+    fseek(file, 0, SEEK_END);
+    if (ftruncate(fileno(file), ftell(file) - 1) < 0)
+        ok = false;
+    fclose(file);
+    bool thrown = false;
+    try {
+        delete trie::create_trie(filename);
+    } catch (const std::exception &) {
+        thrown = true;
+    }
+    printf("cut short: %s\n", thrown?"ok":"TEST FAILED");
+    ok = thrown && ok;
+    unlink(filename);
+    return ok?0:1;
+}
+
+// vim: ts=4 sw=4 ai et
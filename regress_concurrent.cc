@@ -0,0 +1,221 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com>
+//
+// concurrent_trie against a brute-force scan of the same keys, while
+// readers search it from threads, after compact and reopened from its
+// files, and a reader past kReaderSlots.
+
+#include <pthread.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "trie.h"
+#include "trie_impl.h"
+#include "regress.h"
+
+using namespace dutil;
+
+typedef std::map<std::string, trie::value_type> key_map;
+
+/// Keys of a few bytes, with '\0' and a high byte.
+static key_map make_keys(size_t count)
+{
+    unsigned int seed = 4099;
+    key_map keys;
+    for (size_t i = 0; i < count; i++) {
+        std::string key = random_key(kKeyBytes, 4, 7, &seed);
+        keys[key] = 1 + i % 500;
+    }
+    return keys;
+}
+
+static bool check(const char *name, const trie *mtrie, const key_map &keys)
+{
+    const char *prefixes[] = {"", "a", "b\0", "\xff\xff", "q"};
+    const size_t lengths[] = {0, 1, 2, 2, 1};
+    bool ok = true;
+
+    key_map::const_iterator it;
+    trie::value_type value;
+    for (it = keys.begin(); it != keys.end(); it++)
+        if (!mtrie->search(it->first.data(), it->first.size(), &value)
+            || value != it->second
+            || !mtrie->search(trie::key_type(it->first.data(),
+                                             it->first.size()), &value)
+            || value != it->second)
+            ok = false;
+    if (mtrie->search("abq", 3, &value))
+        ok = false;
+
+    for (size_t i = 0; ok && i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+        std::string prefix(prefixes[i], lengths[i]);
+        std::vector<std::string> expected;
+        for (it = keys.begin(); it != keys.end(); it++)
+            if (!it->first.compare(0, prefix.size(), prefix))
+                expected.push_back(it->first);
+        std::sort(expected.begin(), expected.end(), walk_less);
+
+        trie::result_type result;
+        mtrie->prefix_search(trie::key_type(prefix.data(), prefix.size()),
+                             &result);
+        if (result.size() != expected.size())
+            ok = false;
+
+        // pages of 9 keys, each page continuing after the last key; keys
+        // of delta come after those of archive, so only the set is checked
+        std::vector<std::string> walked;
+        std::string last;
+        bool more = true;
+        while (more) {
+            trie::cursor *cursor = mtrie->prefix_cursor(
+                prefix.data(), prefix.size(), 9,
+                walked.empty()?NULL:last.data(), last.size());
+            size_t n = 0;
+            while (cursor->next()) {
+                last.assign(cursor->key(), cursor->length());
+                walked.push_back(last);
+                ++n;
+            }
+            delete cursor;
+            more = (n == 9);
+        }
+        std::sort(walked.begin(), walked.end(), walk_less);
+        if (walked != expected)
+            ok = false;
+
+        result.clear();
+        mtrie->top_k(prefix.data(), prefix.size(), 4, &result);
+        std::vector<trie::value_type> top, best;
+        for (size_t j = 0; j < result.size(); j++)
+            top.push_back(result[j].second);
+        for (size_t j = 0; j < expected.size(); j++)
+            best.push_back(keys.find(expected[j])->second);
+        std::sort(best.rbegin(), best.rend());
+        best.resize(std::min<size_t>(best.size(), 4));
+        if (top != best)
+            ok = false;
+        if (!ok)
+            printf("TEST FAILED on %s, prefix of %lu bytes\n", name,
+                   prefix.size());
+    }
+    printf("%s: %s\n", name, ok?"ok":"TEST FAILED");
+    return ok;
+}
+
+typedef struct {
+    const concurrent_trie *mtrie;
+    const key_map *keys;
+    std::atomic<bool> *done;
+    size_t wrong;
+} search_job_type;
+
+/// Searches keys of the archive, which no change touches, until done.
+static void *search_keys(void *arg)
+{
+    search_job_type *job = static_cast<search_job_type *>(arg);
+    do {
+        key_map::const_iterator it;
+        for (it = job->keys->begin(); it != job->keys->end(); it++) {
+            trie::value_type value;
+            if (!job->mtrie->search(it->first.data(), it->first.size(),
+                                    &value)
+                || value != it->second)
+                job->wrong++;
+        }
+    } while (!*job->done);
+    return NULL;
+}
+
+int main()
+{
+    const char *filename = "regress_concurrent.trie";
+    key_map keys = make_keys(1200), kept, changed;
+    key_map::iterator it;
+    size_t i = 0;
+    for (it = keys.begin(); it != keys.end(); it++, i++)
+        (i % 3?changed:kept).insert(*it);
+    bool ok = true;
+
+    trie *archive = trie::create_trie(trie::DOUBLE_TRIE);
+    for (it = keys.begin(); it != keys.end(); it++)
+        archive->insert(it->first.data(), it->first.size(), it->second);
+    archive->build(filename);
+    delete archive;
+    unlink((std::string(filename) + ".delta").c_str());
+
+    concurrent_trie *mtrie = new concurrent_trie(filename);
+    ok = check("archive only", mtrie, keys) && ok;
+
+    // change keys not in kept while readers search kept ones
+    std::atomic<bool> done(false);
+    pthread_t threads[3];
+    search_job_type jobs[3];
+    for (i = 0; i < 3; i++) {
+        search_job_type job = {mtrie, &kept, &done, 0};
+        jobs[i] = job;
+        pthread_create(&threads[i], NULL, search_keys, &jobs[i]);
+    }
+    i = 0;
+    for (it = changed.begin(); it != changed.end(); it++, i++) {
+        trie::key_type key(it->first.data(), it->first.size());
+        if (i % 2) {
+            mtrie->remove(key);
+            keys.erase(it->first);
+        } else {
+            mtrie->insert(key, it->second + 1000);
+            keys[it->first] = it->second + 1000;
+        }
+    }
+    mtrie->insert(trie::key_type("", 0), 7);
+    keys[""] = 7;
+    done = true;
+    for (i = 0; i < 3; i++) {
+        pthread_join(threads[i], NULL);
+        if (jobs[i].wrong)
+            ok = false;
+    }
+    printf("readers while writing: %s\n", ok?"ok":"TEST FAILED");
+    ok = check("changed", mtrie, keys) && ok;
+    delete mtrie;
+
+    mtrie = new concurrent_trie(filename);
+    ok = check("reopened with delta", mtrie, keys) && ok;
+    mtrie->compact();
+    ok = check("compacted", mtrie, keys) && ok;
+    delete mtrie;
+    mtrie = new concurrent_trie(filename);
+    ok = check("reopened compacted", mtrie, keys) && ok;
+
+    // every cursor holds a slot, one more reader throws
+    std::vector<trie::cursor *> cursors;
+    for (i = 0; i < concurrent_trie::kReaderSlots; i++)
+        cursors.push_back(mtrie->prefix_cursor("", 0));
+    bool thrown = false;
+    trie::value_type value;
+    try {
+        mtrie->search("a", 1, &value);
+    } catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    delete cursors.back();
+    cursors.pop_back();
+    bool found = mtrie->search(keys.begin()->first.data(),
+                               keys.begin()->first.size(), &value);
+    for (i = 0; i < cursors.size(); i++)
+        delete cursors[i];
+    printf("readers past kReaderSlots: %s\n",
+           thrown && found?"ok":"TEST FAILED");
+    ok = thrown && found && ok;
+    delete mtrie;
+
+    unlink(filename);
+    unlink((std::string(filename) + ".delta").c_str());
+    return ok?0:1;
+}
+
+// vim: ts=4 sw=4 ai et
@@ -0,0 +1,246 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com>
+//
+// dawg_trie against a brute-force scan of the same keys, which share
+// most of their suffixes, built in one and several threads, empty or
+// not, reloaded from its archive and smaller than a double_trie. All
+// strings of 1 to 14 letters over {a, b} fold into 15 states in one
+// block, each key keeping its own value by rank. Keys can not be added
+// once built, and archives cut short are refused.
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "trie.h"
+#include "trie_impl.h"
+#include "regress.h"
+
+using namespace dutil;
+
+typedef std::map<std::string, trie::value_type> key_map;
+
+/// Stems with every suffix, with '\0', a high byte and the empty key,
+/// values of any sign and size.
+static key_map make_keys(size_t count)
+{
+    const char *suffixes[] = {"", "s", "ing", "ed", "\0\xff", "/index"};
+    const size_t lengths[] = {0, 1, 3, 2, 2, 6};
+    const char alphabet[] = {'a', 'b', 'c', '\0', '\xff'};
+    unsigned int seed = 2003;
+    key_map keys;
+    keys[""] = -7;
+    for (size_t i = 0; i < count; i++) {
+        std::string stem = random_key(alphabet, 5, 8, &seed);
+        for (size_t j = 0; j < sizeof(lengths) / sizeof(lengths[0]); j++) {
+            next_random(&seed);
+            keys[stem + std::string(suffixes[j], lengths[j])]
+                = static_cast<trie::value_type>(seed);
+        }
+    }
+    return keys;
+}
+
+/// Every string of 1 to length letters over {a, b}, valued by order.
+static key_map make_binary_keys(size_t length)
+{
+    key_map keys;
+    for (size_t n = 1; n <= length; n++) {
+        for (size_t bits = 0; bits < (1U << n); bits++) {
+            std::string key;
+            for (size_t j = n; j-- > 0; /* empty */)
+                key.push_back((bits >> j) & 1?'b':'a');
+            keys[key] = static_cast<trie::value_type>(keys.size()) * 3 - 7;
+        }
+    }
+    return keys;
+}
+
+/// Returns the size of a file.
+static off_t file_size(const char *filename)
+{
+    struct stat st;
+    return stat(filename, &st)?0:st.st_size;
+}
+
+static bool check(const char *name, const trie *mtrie, const key_map &keys)
+{
+    bool ok = true;
+    key_map::const_iterator it;
+    trie::value_type value;
+    for (it = keys.begin(); it != keys.end(); it++) {
+        std::string missed = it->first + "q";
+        if (!mtrie->search(it->first.data(), it->first.size(), &value)
+            || value != it->second
+            || mtrie->search(missed.data(), missed.size(), &value))
+            ok = false;
+    }
+
+    // prefixes of every key, in one scan
+    const char *texts[] = {"abcab\xff\0a", "", "q", "\0\0\0\0"};
+    const size_t lengths[] = {8, 0, 1, 4};
+    for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+        trie::prefix_result_type found, expected;
+        for (size_t n = 0; n <= lengths[i]; n++) {
+            it = keys.find(std::string(texts[i], n));
+            if (it != keys.end())
+                expected.push_back(std::make_pair(n, it->second));
+        }
+        mtrie->common_prefix_search(texts[i], lengths[i], &found);
+        size_t matched = 0;
+        bool longest = mtrie->longest_prefix(texts[i], lengths[i], &matched,
+                                             &value);
+        if (found != expected || longest != !expected.empty()
+            || (longest && (matched != expected.back().first
+                            || value != expected.back().second)))
+            ok = false;
+    }
+
+    const char *prefixes[] = {"", "a", "c\0", "\xff", "q"};
+    const size_t prefix_lengths[] = {0, 1, 2, 1, 1};
+    for (size_t i = 0; i < sizeof(prefix_lengths) / sizeof(size_t); i++) {
+        std::string prefix(prefixes[i], prefix_lengths[i]);
+        std::vector<std::string> expected, walked;
+        for (it = keys.begin(); it != keys.end(); it++)
+            if (!it->first.compare(0, prefix.size(), prefix))
+                expected.push_back(it->first);
+        std::sort(expected.begin(), expected.end(), walk_less);
+
+        trie::result_type result;
+        mtrie->prefix_search(trie::key_type(prefix.data(), prefix.size()),
+                             &result);
+        if (result.size() != expected.size())
+            ok = false;
+
+        // pages of 11 keys, each page continuing after the last key
+        std::string last;
+        bool more = true;
+        while (more) {
+            trie::cursor *cursor = mtrie->prefix_cursor(
+                prefix.data(), prefix.size(), 11,
+                walked.empty()?NULL:last.data(), last.size());
+            size_t n = 0;
+            while (cursor->next()) {
+                last.assign(cursor->key(), cursor->length());
+                walked.push_back(last);
+                if (cursor->value() != keys.find(last)->second)
+                    ok = false;
+                ++n;
+            }
+            delete cursor;
+            more = (n == 11);
+        }
+        if (walked != expected)
+            ok = false;
+    }
+    printf("%s: %s\n", name, ok?"ok":"TEST FAILED");
+    return ok;
+}
+
+int main()
+{
+    const char *filename = "regress_dawg.trie";
+    bool ok = true;
+    // no key at all, then many
+    key_map sets[2];
+    sets[1] = make_keys(3000);
+    for (size_t i = 0; i < 2; i++) {
+        const key_map &keys = sets[i];
+        std::vector<trie::entry_type> entries;
+        key_map::const_iterator it;
+        for (it = keys.begin(); it != keys.end(); it++) {
+            trie::entry_type entry = {it->first.data(), it->first.size(),
+                                      it->second};
+            entries.push_back(entry);
+        }
+        for (size_t threads = 1; threads <= 3; threads += 2) {
+            char name[64];
+            std::vector<trie::entry_type> copy(entries);
+            trie *mtrie = trie::create_trie(trie::DAWG_TRIE);
+            mtrie->set_build_threads(threads);
+            mtrie->insert_bulk(&copy);
+            snprintf(name, sizeof(name), "%lu keys, -j %lu", keys.size(),
+                     threads);
+            ok = check(name, mtrie, keys) && ok;
+            mtrie->build(filename);
+            delete mtrie;
+            mtrie = trie::create_trie(filename);
+            snprintf(name, sizeof(name), "%lu keys, -j %lu, reloaded",
+                     keys.size(), threads);
+            ok = check(name, mtrie, keys) && ok;
+            delete mtrie;
+        }
+        if (i == 0)
+            continue;
+        // suffixes are shared, unlike in a double_trie
+        off_t size = file_size(filename);
+        trie *other = trie::create_trie(trie::DOUBLE_TRIE);
+        other->insert_bulk(&entries);
+        other->build(filename);
+        delete other;
+        bool smaller = size < file_size(filename);
+        printf("smaller than double: %s\n", smaller?"ok":"TEST FAILED");
+        ok = smaller && ok;
+    }
+
+    // a minimal automaton, one state per length in a single block
+    key_map keys = make_binary_keys(14);
+    std::vector<trie::entry_type> entries;
+    key_map::const_iterator it;
+    for (it = keys.begin(); it != keys.end(); it++) {
+        trie::entry_type entry = {it->first.data(), it->first.size(),
+                                  it->second};
+        entries.push_back(entry);
+    }
+    trie *mtrie = trie::create_trie(trie::DAWG_TRIE);
+    mtrie->insert_bulk(&entries);
+    mtrie->build(filename);
+    int refused = 0;
+    trie::entry_type more = {"c", 1, 1};
+    entries.assign(1, more);
+    try {
+        mtrie->insert_bulk(&entries);
+    } catch (const std::exception &) {
+        ++refused;
+    }
+    try {
+        mtrie->insert("c", 1, 1);
+    } catch (const std::exception &) {
+        ++refused;
+    }
+    delete mtrie;
+    dawg_trie *dawg = new dawg_trie(filename);
+    const dawg_trie::header_type *header = dawg->header();
+    bool minimal = header->state_size == 15
+                   && header->unit_size == compact_trie::kBlockSize
+                   && static_cast<size_t>(header->value_size) == keys.size()
+                   && refused == 2;
+    printf("%lu binary keys, %d states, %d units: %s\n", keys.size(),
+           header->state_size, header->unit_size,
+           minimal?"ok":"TEST FAILED");
+    ok = check("binary keys, reloaded", dawg, keys) && minimal && ok;
+    delete dawg;
+
+    // every array is checked against the size of the file
+    FILE *file = fopen(filename, "r+");
+    fseek(file, 0, SEEK_END);
+    if (ftruncate(fileno(file), ftell(file) - 1) < 0)
+        ok = false;
+    fclose(file);
+    bool thrown = false;
+    try {
+        delete trie::create_trie(filename);
+    } catch (const std::exception &) {
+        thrown = true;
+    }
+    printf("cut short: %s\n", thrown?"ok":"TEST FAILED");
+    ok = thrown && ok;
+    unlink(filename);
+    return ok?0:1;
+}
+
+// vim: ts=4 sw=4 ai et
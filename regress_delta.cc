@@ -0,0 +1,346 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com>
+//
+// delta_trie against a brute-force scan of the same keys, over every
+// archive type, empty or not: after changes, reopened from the delta
+// file, with a record cut by a crash in its header, in its key or with
+// a torn length, after compact -j 3 and with the old delta a crash in
+// compact leaves. Keys removed and inserted again, removed twice or
+// never there, compacting every key away, and a delta whose header is
+// not one are checked on their own.
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "trie.h"
+#include "trie_impl.h"
+#include "regress.h"
+
+using namespace dutil;
+
+typedef std::map<std::string, trie::value_type> key_map;
+
+/// Keys of a few bytes, with '\0' and a high byte.
+static std::vector<std::string> make_keys(size_t count, unsigned int seed)
+{
+    std::vector<std::string> keys;
+    for (size_t i = 0; i < count; i++) {
+        std::string key = random_key(kKeyBytes, 4, 8, &seed);
+        keys.push_back(key);
+    }
+    return keys;
+}
+
+static std::string read_file(const char *filename)
+{
+    std::string text;
+    FILE *file = fopen(filename, "rb");
+    char buf[4096];
+    size_t length;
+    while (file && (length = fread(buf, 1, sizeof(buf), file)) > 0)
+        text.append(buf, length);
+    if (file)
+        fclose(file);
+    return text;
+}
+
+static void write_file(const char *filename, const std::string &text)
+{
+    FILE *file = fopen(filename, "wb");
+    fwrite(text.data(), 1, text.size(), file);
+    fclose(file);
+}
+
+static bool check(const char *name, const trie *mtrie, const key_map &keys)
+{
+    bool ok = true;
+    key_map::const_iterator it;
+    trie::value_type value;
+    std::vector<trie::key_type> batch;
+    for (it = keys.begin(); it != keys.end(); it++) {
+        std::string missed = it->first + "q";
+        if (!mtrie->search(it->first.data(), it->first.size(), &value)
+            || value != it->second
+            || mtrie->search(missed.data(), missed.size(), &value))
+            ok = false;
+        batch.push_back(trie::key_type(it->first.data(), it->first.size()));
+    }
+    // every key at once, in lockstep while delta is empty
+    std::vector<trie::value_type> values(batch.size() + 1);
+    bool *found = new bool[batch.size() + 1];
+    if (mtrie->search_batch(&batch[0], batch.size(), &values[0], found)
+        != batch.size())
+        ok = false;
+    size_t i = 0;
+    for (it = keys.begin(); it != keys.end(); it++, i++)
+        if (!found[i] || values[i] != it->second)
+            ok = false;
+    delete [] found;
+
+    const char *prefixes[] = {"", "a", "b\0", "\xff", "q"};
+    const size_t lengths[] = {0, 1, 2, 1, 1};
+    for (i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+        std::string prefix(prefixes[i], lengths[i]);
+        std::vector<std::string> expected, walked;
+        for (it = keys.begin(); it != keys.end(); it++)
+            if (!it->first.compare(0, prefix.size(), prefix))
+                expected.push_back(it->first);
+        std::sort(expected.begin(), expected.end(), walk_less);
+
+        trie::result_type result;
+        mtrie->prefix_search(trie::key_type(prefix.data(), prefix.size()),
+                             &result);
+        std::vector<std::string> searched;
+        for (size_t j = 0; j < result.size(); j++) {
+            std::string key;
+            for (const trie::char_type *p = result[j].first.data();
+                 *p != trie::key_type::kTerminator; p++)
+                key.push_back(trie::key_type::char_out(*p));
+            searched.push_back(key);
+        }
+        if (searched != expected)
+            ok = false;
+
+        // pages of 13 keys, each page continuing after the last key,
+        // which may be a key of archive or of delta
+        std::string last;
+        bool more = true;
+        while (more) {
+            trie::cursor *cursor = mtrie->prefix_cursor(
+                prefix.data(), prefix.size(), 13,
+                walked.empty()?NULL:last.data(), last.size());
+            size_t n = 0;
+            while (cursor->next()) {
+                last.assign(cursor->key(), cursor->length());
+                walked.push_back(last);
+                if (!keys.count(last)
+                    || cursor->value() != keys.find(last)->second)
+                    ok = false;
+                ++n;
+            }
+            delete cursor;
+            more = (n == 13);
+        }
+        if (walked != expected)
+            ok = false;
+
+        result.clear();
+        mtrie->top_k(prefix.data(), prefix.size(), 6, &result);
+        std::vector<trie::value_type> top, best;
+        for (size_t j = 0; j < result.size(); j++)
+            top.push_back(result[j].second);
+        for (size_t j = 0; j < expected.size(); j++)
+            best.push_back(keys.find(expected[j])->second);
+        std::sort(best.rbegin(), best.rend());
+        best.resize(std::min<size_t>(best.size(), 6));
+        if (top != best)
+            ok = false;
+    }
+    printf("%s: %s\n", name, ok?"ok":"TEST FAILED");
+    return ok;
+}
+
+/**
+ * Removes keys of archive and of delta, again and never there, inserts
+ * removed keys back, then compacts every key away.
+ */
+static bool check_tombstones(const char *name, trie::trie_type type,
+                             const char *filename)
+{
+    std::string delta_filename = std::string(filename) + ".delta";
+    const char *words[] = {"a", "ab", "abc", "b", ""};
+    std::vector<trie::entry_type> entries;
+    key_map keys;
+    for (size_t i = 0; i < sizeof(words) / sizeof(words[0]); i++) {
+        trie::entry_type entry = {words[i], strlen(words[i]),
+                                  static_cast<trie::value_type>(i + 1)};
+        entries.push_back(entry);
+        keys[words[i]] = entry.value;
+    }
+    trie *archive = trie::create_trie(type);
+    archive->insert_bulk(&entries);
+    archive->build(filename);
+    delete archive;
+    unlink(delta_filename.c_str());
+
+    delta_trie *mtrie = new delta_trie(filename);
+    int results = 0;
+    // of archive, twice, then back with a new value
+    results += mtrie->remove(trie::key_type("ab", 2));
+    results += !mtrie->remove(trie::key_type("ab", 2));
+    mtrie->insert(trie::key_type("ab", 2), -2);
+    keys["ab"] = -2;
+    // of delta, twice, then never there
+    mtrie->insert(trie::key_type("abcd", 4), 9);
+    results += mtrie->remove(trie::key_type("abcd", 4));
+    results += !mtrie->remove(trie::key_type("abcd", 4));
+    results += !mtrie->remove(trie::key_type("q", 1));
+    // a prefix of other keys, and the empty key
+    results += mtrie->remove(trie::key_type("a", 1));
+    results += mtrie->remove(trie::key_type("", 0));
+    keys.erase("a");
+    keys.erase("");
+    delete mtrie;
+    mtrie = new delta_trie(filename);
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%s, removed and back", name);
+    bool ok = check(buf, mtrie, keys) && results == 7;
+
+    for (key_map::const_iterator it = keys.begin(); it != keys.end(); it++)
+        mtrie->remove(trie::key_type(it->first.data(), it->first.size()));
+    keys.clear();
+    mtrie->compact();
+    delete mtrie;
+    mtrie = new delta_trie(filename);
+    snprintf(buf, sizeof(buf), "%s, all compacted away", name);
+    ok = check(buf, mtrie, keys) && ok;
+    delete mtrie;
+    return ok;
+}
+
+int main()
+{
+    const char *filename = "regress_delta.trie";
+    std::string delta_filename = std::string(filename) + ".delta";
+    const char *names[] = {"", "single", "double", "compact", "dawg", "ac"};
+    std::vector<std::string> base = make_keys(1500, 17);
+    std::vector<std::string> changes = make_keys(900, 29);
+    bool ok = true;
+
+    for (int type = trie::SINGLE_TRIE; type <= trie::AC_TRIE; type++) {
+        ok = check_tombstones(names[type], static_cast<trie::trie_type>(type),
+                              filename) && ok;
+        for (int empty = 0; empty < 2; empty++) {
+            char name[64];
+            key_map keys;
+            std::vector<trie::entry_type> entries;
+            for (size_t i = 0; !empty && i < base.size(); i++) {
+                trie::entry_type entry = {base[i].data(), base[i].size(),
+                                          static_cast<trie::value_type>(
+                                              1 + i % 300)};
+                entries.push_back(entry);
+                keys[base[i]] = entry.value;
+            }
+            trie *archive = trie::create_trie(
+                static_cast<trie::trie_type>(type));
+            archive->insert_bulk(&entries);
+            archive->build(filename);
+            delete archive;
+            unlink(delta_filename.c_str());
+
+            // inserts, removes of keys of archive, of delta and missing
+            delta_trie *mtrie = new delta_trie(filename);
+            for (size_t i = 0; i < changes.size(); i++) {
+                trie::key_type key(changes[i].data(), changes[i].size());
+                if (i % 3 == 2) {
+                    bool removed = mtrie->remove(key);
+                    if (removed != (keys.erase(changes[i]) > 0))
+                        ok = false;
+                } else {
+                    mtrie->insert(key, 1000 + i);
+                    keys[changes[i]] = 1000 + i;
+                }
+            }
+            for (size_t i = 0; i < base.size(); i += 7) {
+                mtrie->remove(trie::key_type(base[i].data(), base[i].size()));
+                keys.erase(base[i]);
+            }
+            mtrie->insert(trie::key_type("", 0), 5);
+            keys[""] = 5;
+            snprintf(name, sizeof(name), "%s%s, changed", names[type],
+                     empty?" empty":"");
+            ok = check(name, mtrie, keys) && ok;
+            delete mtrie;
+
+            // a record cut by a crash is dropped: in its header, in its
+            // key, and with a length torn past the end of file
+            const char *cuts[] = {"\x05\0\0",
+                                  "\x05\0\0\0\0\0\0\0\x01\0\0\0ab",
+                                  "\xff\xff\xff\x0f\0\0\0\0\x01\0\0\0"};
+            const size_t cut_lengths[] = {3, 14, 12};
+            for (size_t cut = 0; cut < 3; cut++) {
+                FILE *file = fopen(delta_filename.c_str(), "ab");
+                fwrite(cuts[cut], 1, cut_lengths[cut], file);
+                fclose(file);
+                struct stat sb[2];
+                stat(delta_filename.c_str(), &sb[0]);
+                mtrie = new delta_trie(filename);
+                snprintf(name, sizeof(name), "%s%s, reopened, cut %lu",
+                         names[type], empty?" empty":"", cut);
+                ok = check(name, mtrie, keys) && ok;
+                // readers leave the cut record alone, the first append
+                // drops it
+                stat(delta_filename.c_str(), &sb[1]);
+                if (sb[1].st_size != sb[0].st_size) {
+                    printf("%s: TEST FAILED, delta written by a reader\n",
+                           name);
+                    ok = false;
+                }
+                std::string after = "after crash";
+                after.push_back('0' + cut);
+                mtrie->insert(trie::key_type(after.data(), after.size()), 6);
+                keys[after] = 6;
+                delete mtrie;
+            }
+            mtrie = new delta_trie(filename);
+            snprintf(name, sizeof(name), "%s%s, appended after a crash",
+                     names[type], empty?" empty":"");
+            ok = check(name, mtrie, keys) && ok;
+
+            std::string stale = read_file(delta_filename.c_str());
+            mtrie->set_build_threads(3);
+            mtrie->compact();
+            snprintf(name, sizeof(name), "%s%s, compacted", names[type],
+                     empty?" empty":"");
+            ok = check(name, mtrie, keys) && ok;
+            delete mtrie;
+            mtrie = new delta_trie(filename);
+            snprintf(name, sizeof(name), "%s%s, reopened compacted",
+                     names[type], empty?" empty":"");
+            ok = check(name, mtrie, keys) && ok;
+            delete mtrie;
+
+            // a crash between the renames of compact leaves the old delta
+            // next to the new archive, which already holds its changes
+            write_file(delta_filename.c_str(), stale);
+            mtrie = new delta_trie(filename);
+            snprintf(name, sizeof(name), "%s%s, old delta after compact",
+                     names[type], empty?" empty":"");
+            ok = check(name, mtrie, keys) && ok;
+            mtrie->insert(trie::key_type("after stale", 11), 7);
+            keys["after stale"] = 7;
+            delete mtrie;
+            mtrie = new delta_trie(filename);
+            snprintf(name, sizeof(name), "%s%s, appended after old delta",
+                     names[type], empty?" empty":"");
+            ok = check(name, mtrie, keys) && ok;
+            delete mtrie;
+        }
+    }
+
+    // a delta whose header is cut or not one is refused
+    const char *headers[] = {"DELTA", "NOT_A_DELTA_TRIE"};
+    for (size_t i = 0; i < 2; i++) {
+        std::string text(headers[i]);
+        text.resize(i?sizeof(delta_trie::header_type):text.size());
+        write_file(delta_filename.c_str(), text);
+        bool thrown = false;
+        try {
+            delta_trie mtrie(filename);
+        } catch (const bad_trie_archive &) {
+            thrown = true;
+        }
+        printf("bad delta header %lu: %s\n", i, thrown?"ok":"TEST FAILED");
+        ok = thrown && ok;
+    }
+    unlink(filename);
+    unlink(delta_filename.c_str());
+    return ok?0:1;
+}
+
+// vim: ts=4 sw=4 ai et
@@ -0,0 +1,163 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com>
+//
+// trie_tool -d prints the keys of prefix_search in the same order, for
+// every archive type and a sharded one, empty or not, with no delta,
+// with changes, removals and new keys in delta, and with -v counting
+// them on stderr only.
+
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+#include "trie.h"
+#include "trie_impl.h"
+#include "regress.h"
+
+using namespace dutil;
+
+typedef std::map<std::string, trie::value_type> key_map;
+
+/// Keys of a few bytes with '\0', a high byte, a space and the empty
+/// key, but no newline which ends a line of the dump.
+static key_map make_keys(size_t count)
+{
+    const char alphabet[] = {'a', 'b', '\0', ' ', '\xff'};
+    unsigned int seed = 60013;
+    key_map keys;
+    keys[""] = 3;
+    for (size_t i = 0; i < count; i++) {
+        std::string key = random_key(alphabet, 5, 9, &seed);
+        keys[key] = static_cast<trie::value_type>(i * 71 % 900) - 450;
+    }
+    return keys;
+}
+
+/// The dump expected of an archive and its delta, from prefix_search.
+static std::string expect(const char *filename)
+{
+    delta_trie mtrie(filename);
+    trie::result_type result;
+    mtrie.prefix_search(trie::key_type("", 0), &result);
+    std::string out;
+    for (size_t i = 0; i < result.size(); i++) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%d ", result[i].second);
+        out.append(buf);
+        for (const trie::char_type *p = result[i].first.data();
+             *p != trie::key_type::kTerminator; p++)
+            out.push_back(trie::key_type::char_out(*p));
+        out.push_back('\n');
+    }
+    return out;
+}
+
+static std::string read_file(const char *filename)
+{
+    std::string text;
+    FILE *fp = fopen(filename, "r");
+    if (!fp)
+        return text;
+    char buf[4096];
+    size_t length;
+    while ((length = fread(buf, 1, sizeof(buf), fp)) > 0)
+        text.append(buf, length);
+    fclose(fp);
+    return text;
+}
+
+static bool check(const char *name, const char *tool, const char *filename,
+                  size_t count)
+{
+    const char *output = "regress_dump.out";
+    const char *errors = "regress_dump.err";
+    std::string expected = expect(filename);
+    bool ok = true;
+    for (int verbose = 0; verbose < 2; verbose++) {
+        char command[1024], counted[64];
+        snprintf(command, sizeof(command), "%s %s -d %s > %s 2> %s", tool,
+                 verbose?"-v":"", filename, output, errors);
+        snprintf(counted, sizeof(counted), "%lu keys dumped\n", count);
+        if (system(command) != 0 || read_file(output) != expected
+            || read_file(errors) != (verbose?counted:""))
+            ok = false;
+    }
+    unlink(output);
+    unlink(errors);
+    printf("%s, %lu keys: %s\n", name, count, ok?"ok":"TEST FAILED");
+    return ok;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        printf("usage: %s path/to/trie_tool\n", argv[0]);
+        return 1;
+    }
+    const char *filename = "regress_dump.trie";
+    std::string delta_filename = std::string(filename) + ".delta";
+    const char *names[] = {"", "single", "double", "compact", "dawg", "ac",
+                           "sharded"};
+    bool ok = true;
+
+    // no key at all, then many
+    key_map sets[2];
+    sets[1] = make_keys(2000);
+    for (size_t i = 0; i < 2; i++) {
+        key_map keys = sets[i];
+        for (int type = trie::SINGLE_TRIE; type <= trie::SHARDED_TRIE;
+             type++) {
+            char name[64];
+            std::vector<trie::entry_type> entries;
+            key_map::const_iterator it;
+            for (it = keys.begin(); it != keys.end(); it++) {
+                trie::entry_type entry = {it->first.data(),
+                                          it->first.size(), it->second};
+                entries.push_back(entry);
+            }
+            trie *mtrie;
+            if (type == trie::SHARDED_TRIE)
+                mtrie = new sharded_trie(trie::DOUBLE_TRIE, 5,
+                                         sharded_trie::BYTE_ROUTING);
+            else
+                mtrie = trie::create_trie(
+                    static_cast<trie::trie_type>(type));
+            mtrie->insert_bulk(&entries);
+            mtrie->build(filename);
+            delete mtrie;
+            unlink(delta_filename.c_str());
+            snprintf(name, sizeof(name), "%s, no delta", names[type]);
+            ok = check(name, argv[1], filename, keys.size()) && ok;
+
+            // change every 7th key, remove every 11th, add a few
+            delta_trie *delta = new delta_trie(filename);
+            key_map changed;
+            size_t n = 0;
+            for (it = keys.begin(); it != keys.end(); it++, n++) {
+                trie::key_type key(it->first.data(), it->first.size());
+                if (n % 11 == 5)
+                    delta->remove(key);
+                else if (n % 7 == 3)
+                    delta->insert(key, changed[it->first] = n);
+                else
+                    changed[it->first] = it->second;
+            }
+            for (n = 0; n < 40; n++) {
+                char key[16];
+                snprintf(key, sizeof(key), "%s %lu", n % 2?"b":"\xff", n);
+                delta->insert(trie::key_type(key, strlen(key)),
+                              changed[key] = -static_cast<int>(n));
+            }
+            delete delta;
+            snprintf(name, sizeof(name), "%s, delta", names[type]);
+            ok = check(name, argv[1], filename, changed.size()) && ok;
+            unlink(delta_filename.c_str());
+        }
+    }
+    unlink(filename);
+    return ok?0:1;
+}
+
+// vim: ts=4 sw=4 ai et
@@ -0,0 +1,54 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com>
+//
+// An empty trie, in memory and saved to a file, has no keys at all.
+
+#include <unistd.h>
+#include <cstdio>
+#include <vector>
+#include "trie.h"
+#include "trie_impl.h"
+
+using namespace dutil;
+
+static bool check(const char *name, const char *where, const trie *mtrie)
+{
+    trie::value_type value;
+    trie::result_type result;
+    bool ok = true;
+    if (mtrie->search("", 0, &value) || mtrie->search("a", 1, &value))
+        ok = false;
+    if (mtrie->prefix_search(trie::key_type("", 0), &result))
+        ok = false;
+    if (mtrie->top_k("", 0, 10, &result))
+        ok = false;
+    trie::cursor *cursor = mtrie->prefix_cursor("", 0);
+    if (cursor->next())
+        ok = false;
+    delete cursor;
+    printf("%s %s: %s\n", name, where, ok?"ok":"TEST FAILED");
+    return ok;
+}
+
+int main()
+{
+    const char *filename = "regress_empty.trie";
+    const char *names[] = {"", "single", "double", "compact", "dawg", "ac"};
+    bool ok = true;
+    for (int type = trie::SINGLE_TRIE; type <= trie::AC_TRIE; type++) {
+        trie *mtrie = trie::create_trie(static_cast<trie::trie_type>(type));
+        mtrie->record_max_values(true);
+        std::vector<trie::entry_type> entries;
+        mtrie->insert_bulk(&entries);
+        if (type <= trie::DOUBLE_TRIE)
+            ok = check(names[type], "in memory", mtrie) && ok;
+        mtrie->build(filename);
+        delete mtrie;
+        mtrie = trie::create_trie(filename);
+        ok = check(names[type], "archive", mtrie) && ok;
+        delete mtrie;
+    }
+    unlink(filename);
+    return ok?0:1;
+}
+
+// vim: ts=4 sw=4 ai et
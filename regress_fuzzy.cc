@@ -0,0 +1,185 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com>
+//
+// fuzzy_search against the edit distance to every key, for every
+// archive type, empty or not, in memory, reloaded and under a delta
+// holding changes. Long keys differ only deep in their tails or rear
+// tries, inputs run past the keys, and a distance larger than any key
+// finds every key exactly once.
+
+#include <unistd.h>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include "trie.h"
+#include "trie_impl.h"
+#include "regress.h"
+
+using namespace dutil;
+
+typedef std::map<std::string, trie::value_type> key_map;
+
+/// Represents a key found, its value and distance.
+typedef std::pair<std::string, std::pair<trie::value_type, size_t> >
+    fuzzy_found_type;
+
+/// Random bytes of a small alphabet, with '\0' and a high byte.
+static std::string make_key(size_t length, unsigned int *seed)
+{
+    return random_bytes("abc\0\xff", 5, length, seed);
+}
+
+/// Edit distance of lhs and rhs, by bytes.
+static size_t distance_of(const std::string &lhs, const std::string &rhs)
+{
+    std::vector<size_t> row(rhs.size() + 1);
+    for (size_t j = 0; j <= rhs.size(); j++)
+        row[j] = j;
+    for (size_t i = 1; i <= lhs.size(); i++) {
+        size_t diagonal = row[0];
+        row[0] = i;
+        for (size_t j = 1; j <= rhs.size(); j++) {
+            size_t up = row[j];
+            row[j] = std::min(std::min(row[j] + 1, row[j - 1] + 1),
+                              diagonal + (lhs[i - 1] != rhs[j - 1]));
+            diagonal = up;
+        }
+    }
+    return row[rhs.size()];
+}
+
+static void collect(const trie::fuzzy_match_type &match, void *context)
+{
+    std::vector<fuzzy_found_type> *found
+        = static_cast<std::vector<fuzzy_found_type> *>(context);
+    found->push_back(std::make_pair(std::string(match.key, match.length),
+                                    std::make_pair(match.value,
+                                                   match.distance)));
+}
+
+static bool check(const char *name, const trie *mtrie, const key_map &keys,
+                  const std::vector<std::string> &inputs)
+{
+    bool ok = true;
+    for (size_t i = 0; i < inputs.size(); i++) {
+        const size_t distances[] = {0, 1, 2, 3, 40};
+        for (size_t d = 0; d < sizeof(distances) / sizeof(size_t); d++) {
+            size_t distance = distances[d];
+            std::vector<fuzzy_found_type> expected, found;
+            key_map::const_iterator it;
+            for (it = keys.begin(); it != keys.end(); it++) {
+                size_t d = distance_of(inputs[i], it->first);
+                if (d <= distance)
+                    expected.push_back(std::make_pair(
+                        it->first, std::make_pair(it->second, d)));
+            }
+            size_t count = mtrie->fuzzy_search(inputs[i].data(),
+                                               inputs[i].size(), distance,
+                                               collect, &found);
+            std::sort(found.begin(), found.end());
+            if (found != expected || count != expected.size()) {
+                printf("TEST FAILED on %s, input %lu, distance %lu\n",
+                       name, i, distance);
+                ok = false;
+            }
+        }
+    }
+    printf("%s: %s\n", name, ok?"ok":"TEST FAILED");
+    return ok;
+}
+
+int main()
+{
+    const char *filename = "regress_fuzzy.trie";
+    const char *names[] = {"", "single", "double", "compact", "dawg", "ac"};
+    unsigned int seed = 3571;
+    bool ok = true;
+
+    // no key at all, then keys of 0 to 11 bytes, long ones kept in tails
+    key_map sets[3];
+    for (size_t i = 0; i < 800; i++) {
+        sets[1][make_key(next_random(&seed) % 12, &seed)] = 1 + i;
+    }
+    // long keys apart by a byte or two near their ends, in tails
+    std::string stem = "cabcabcabcabcabcabcab";
+    const char *ends[] = {"", "a", "b", "ab", "ba", "\xff\xff", "abc"};
+    for (size_t i = 0; i < sizeof(ends) / sizeof(ends[0]); i++) {
+        sets[2][stem + ends[i]] = 900 + i;
+        sets[2]["c" + stem.substr(2) + ends[i]] = 950 + i;
+    }
+    sets[2]["c"] = 999;
+    // keys, keys one or two edits away, and random bytes
+    std::vector<std::string> inputs(1, "");
+    key_map::const_iterator it = sets[1].begin();
+    for (size_t i = 0; i < 40; i++, it++) {
+        std::string input = it->first;
+        size_t at = next_random(&seed);
+        if (i % 4 == 1 && !input.empty())
+            input.erase(at % input.size(), 1);
+        else if (i % 4 == 2)
+            input.insert(at % (input.size() + 1), "b");
+        else if (i % 4 == 3 && input.size() > 1)
+            input.replace(at % input.size(), 2, "\xff");
+        inputs.push_back(input);
+        inputs.push_back(make_key(i % 9, &seed));
+    }
+    inputs.push_back(stem + "aa");
+    inputs.push_back(stem.substr(0, 18) + "b");
+    inputs.push_back(stem + "abcabc");
+    inputs.push_back("c" + stem + "\xff");
+
+    for (size_t i = 0; i < 3; i++) {
+        std::vector<trie::entry_type> entries;
+        for (it = sets[i].begin(); it != sets[i].end(); it++) {
+            trie::entry_type entry = {it->first.data(), it->first.size(),
+                                      it->second};
+            entries.push_back(entry);
+        }
+        for (int type = trie::SINGLE_TRIE; type <= trie::AC_TRIE; type++) {
+            char name[64];
+            std::vector<trie::entry_type> copy(entries);
+            trie *mtrie = trie::create_trie(
+                static_cast<trie::trie_type>(type));
+            mtrie->insert_bulk(&copy);
+            if (type <= trie::DOUBLE_TRIE) {
+                snprintf(name, sizeof(name), "%s, %lu keys, in memory",
+                         names[type], sets[i].size());
+                ok = check(name, mtrie, sets[i], inputs) && ok;
+            }
+            mtrie->build(filename);
+            delete mtrie;
+            mtrie = trie::create_trie(filename);
+            snprintf(name, sizeof(name), "%s, %lu keys, archive",
+                     names[type], sets[i].size());
+            ok = check(name, mtrie, sets[i], inputs) && ok;
+            delete mtrie;
+
+            // a delta changing, removing and adding keys near the inputs
+            std::string delta_filename = std::string(filename) + ".delta";
+            unlink(delta_filename.c_str());
+            delta_trie *delta = new delta_trie(filename);
+            key_map keys(sets[i]);
+            for (size_t j = 0; j < inputs.size(); j += 3) {
+                trie::key_type key(inputs[j].data(), inputs[j].size());
+                if (keys.count(inputs[j]) && j % 2) {
+                    delta->remove(key);
+                    keys.erase(inputs[j]);
+                } else {
+                    delta->insert(key, -static_cast<int>(j));
+                    keys[inputs[j]] = -static_cast<int>(j);
+                }
+            }
+            snprintf(name, sizeof(name), "%s, %lu keys, delta",
+                     names[type], sets[i].size());
+            ok = check(name, delta, keys, inputs) && ok;
+            delete delta;
+            unlink(delta_filename.c_str());
+        }
+    }
+    unlink(filename);
+    return ok?0:1;
+}
+
+// vim: ts=4 sw=4 ai et
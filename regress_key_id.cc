@@ -0,0 +1,157 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com>
+//
+// key_of and id_of against the keys sorted by bytes, for archives built
+// with record_key_ids, empty or not, by insert and by insert_bulk -j N,
+// and through a delta_trie. Keys are restored from tails and rear tries
+// they share, a key comes before the keys it prefixes unlike in walk
+// order, and prefixes of keys, ids past the end and -1 are not found.
+
+#include <unistd.h>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+#include "trie.h"
+#include "trie_impl.h"
+#include "regress.h"
+
+using namespace dutil;
+
+typedef std::map<std::string, trie::value_type> key_map;
+
+/**
+ * Keys of a few bytes, with '\0', a high byte and the empty key, and
+ * long ones whose rest is held by tails, or by rear tries sharing it.
+ */
+static key_map make_keys(size_t count)
+{
+    unsigned int seed = 6007;
+    key_map keys;
+    keys[""] = 3;
+    for (size_t i = 0; i < count; i++) {
+        std::string key = random_key(kKeyBytes, 4, 9, &seed);
+        keys[key] = 1 + i % 999;
+    }
+    std::string rest(40, 'b');
+    rest.append("\0\xff", 2);
+    for (size_t i = 0; i < 6; i++) {
+        keys[std::string(1, 'a' + i) + rest] = -static_cast<int>(i);
+        keys[std::string(3, '\xff') + rest.substr(i)] = 1000 + i;
+    }
+    return keys;
+}
+
+/// Ids are ranks of keys in byte order, which is the order of key_map.
+static bool check(const char *name, const trie *mtrie, const key_map &keys)
+{
+    bool ok = mtrie->key_id_size() == keys.size();
+    key_map::const_iterator it;
+    trie::size_type id = 0;
+    std::string key;
+    trie::value_type value;
+    for (it = keys.begin(); ok && it != keys.end(); it++, id++) {
+        trie::size_type found = -1;
+        std::string missed = it->first + "q";
+        std::string prefix = it->first.substr(0, it->first.size() / 2);
+        if (!keys.count(prefix)
+            && mtrie->id_of(prefix.data(), prefix.size(), &found))
+            ok = false;
+        if (!mtrie->key_of(id, &key, &value) || key != it->first
+            || value != it->second || !mtrie->key_of(id, &key)
+            || !mtrie->id_of(it->first.data(), it->first.size(), &found)
+            || found != id
+            || mtrie->id_of(missed.data(), missed.size(), &found))
+            ok = false;
+    }
+    if (mtrie->key_of(-1, &key) || mtrie->key_of(id, &key)
+        || mtrie->key_of(INT32_MAX, &key))
+        ok = false;
+    printf("%s: %s\n", name, ok?"ok":"TEST FAILED");
+    return ok;
+}
+
+int main()
+{
+    const char *filename = "regress_key_id.trie";
+    std::string delta_filename = std::string(filename) + ".delta";
+    const char *names[] = {"", "single", "double"};
+    bool ok = true;
+
+    // no key at all, then many
+    key_map sets[2];
+    sets[1] = make_keys(3000);
+    for (size_t i = 0; i < 2; i++) {
+        const key_map &keys = sets[i];
+        std::vector<trie::entry_type> entries;
+        key_map::const_iterator it;
+        for (it = keys.begin(); it != keys.end(); it++) {
+            trie::entry_type entry = {it->first.data(), it->first.size(),
+                                      it->second};
+            entries.push_back(entry);
+        }
+        for (int type = trie::SINGLE_TRIE; type <= trie::DOUBLE_TRIE;
+             type++) {
+            // by insert, then by insert_bulk -j 1 and -j 3
+            const size_t jobs[] = {0, 1, 3};
+            for (size_t j = 0; j < sizeof(jobs) / sizeof(jobs[0]); j++) {
+                size_t threads = jobs[j];
+                char name[64];
+                trie *mtrie = trie::create_trie(
+                    static_cast<trie::trie_type>(type));
+                mtrie->record_key_ids(true);
+                if (threads) {
+                    std::vector<trie::entry_type> copy(entries);
+                    mtrie->set_build_threads(threads);
+                    mtrie->insert_bulk(&copy);
+                } else {
+                    for (it = keys.begin(); it != keys.end(); it++)
+                        mtrie->insert(it->first.data(), it->first.size(),
+                                      it->second);
+                }
+                mtrie->build(filename);
+                delete mtrie;
+                mtrie = trie::create_trie(filename);
+                if (threads)
+                    snprintf(name, sizeof(name), "%s, %lu keys, insert_bulk "
+                             "-j %lu", names[type], keys.size(), threads);
+                else
+                    snprintf(name, sizeof(name), "%s, %lu keys, insert",
+                             names[type], keys.size());
+                ok = check(name, mtrie, keys) && ok;
+                delete mtrie;
+            }
+
+            // ids of the archive while delta is empty, none after a change
+            unlink(delta_filename.c_str());
+            delta_trie *delta = new delta_trie(filename);
+            ok = check("  through delta", delta, keys) && ok;
+            delta->insert(trie::key_type("new", 3), 1);
+            trie::size_type id;
+            if (delta->key_id_size() || delta->id_of("new", 3, &id)) {
+                printf("  changed delta: TEST FAILED\n");
+                ok = false;
+            }
+            delete delta;
+            unlink(delta_filename.c_str());
+        }
+    }
+
+    // no ids unless asked for
+    trie *mtrie = trie::create_trie(trie::DOUBLE_TRIE);
+    mtrie->insert("a", 1, 1);
+    mtrie->build(filename);
+    delete mtrie;
+    mtrie = trie::create_trie(filename);
+    std::string key;
+    trie::size_type id;
+    bool none = !mtrie->key_id_size() && !mtrie->key_of(0, &key)
+                && !mtrie->id_of("a", 1, &id);
+    printf("not recorded: %s\n", none?"ok":"TEST FAILED");
+    ok = none && ok;
+    delete mtrie;
+    unlink(filename);
+    return ok?0:1;
+}
+
+// vim: ts=4 sw=4 ai et
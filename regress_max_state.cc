@@ -0,0 +1,91 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com>
+//
+// Keys inserted one by one, each longer key before its prefix, leave
+// leaves after the last state having a BASE. build must save them.
+
+#include <unistd.h>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "trie.h"
+#include "trie_impl.h"
+
+using namespace dutil;
+
+/// Orders keys by bytes, but puts a key after the keys it prefixes.
+static bool terminator_last(const std::string &lhs, const std::string &rhs)
+{
+    size_t n = std::min(lhs.size(), rhs.size());
+    int retval = memcmp(lhs.data(), rhs.data(), n);
+    return retval < 0 || (retval == 0 && lhs.size() > rhs.size());
+}
+
+/// Inserts keys in order, saves and reloads them, then finds them all.
+static bool check(trie::trie_type type, const std::vector<std::string> &keys,
+                  const char *filename)
+{
+    trie *mtrie = trie::create_trie(type);
+    for (size_t i = 0; i < keys.size(); i++)
+        mtrie->insert(keys[i].data(), keys[i].size(), i);
+    mtrie->build(filename);
+    delete mtrie;
+    mtrie = trie::create_trie(filename);
+    size_t missed = 0, walked = 0;
+    trie::value_type value;
+    for (size_t i = 0; i < keys.size(); i++)
+        if (!mtrie->search(keys[i].data(), keys[i].size(), &value)
+            || value != static_cast<trie::value_type>(i))
+            missed++;
+    trie::cursor *cursor = mtrie->prefix_cursor("", 0);
+    while (cursor->next())
+        walked++;
+    delete cursor;
+    delete mtrie;
+    return !missed && walked == keys.size();
+}
+
+int main(int argc, char *argv[])
+{
+    const char *filename = "regress_max_state.trie";
+    std::ifstream source(argc > 1?argv[1]:"dictionary.txt");
+    std::vector<std::string> keys;
+    std::string line;
+    while (std::getline(source, line))
+        if (!line.empty())
+            keys.push_back(line);
+    if (keys.empty()) {
+        printf("usage: %s [dictionary.txt]\n", argv[0]);
+        return 1;
+    }
+    std::sort(keys.begin(), keys.end(), terminator_last);
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+    // every stride(th) key, the bug shows up only for some of them
+    bool ok = true;
+    for (size_t stride = 1; stride <= 7; stride++) {
+        for (size_t offset = 0; offset < stride; offset++) {
+            std::vector<std::string> subset;
+            for (size_t i = offset; i < keys.size(); i += stride)
+                subset.push_back(keys[i]);
+            for (int type = trie::SINGLE_TRIE; type <= trie::DOUBLE_TRIE;
+                 type++) {
+                if (!check(static_cast<trie::trie_type>(type), subset,
+                           filename)) {
+                    printf("TEST FAILED on %s trie, every %lu(th) key "
+                           "from %lu\n",
+                           type == trie::SINGLE_TRIE?"single":"double",
+                           stride, offset);
+                    ok = false;
+                }
+            }
+        }
+    }
+    printf("%s\n", ok?"ok":"failed");
+    unlink(filename);
+    return ok?0:1;
+}
+
+// vim: ts=4 sw=4 ai et
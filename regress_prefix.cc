@@ -4,8 +4,11 @@
 #include <fstream>
 #include <string>
 #include <cstring>
+#include <vector>
+#include <algorithm>
 #include <math.h>
 #include "trie_impl.h"
+#include "regress.h"
 
 #define length(x) (strlen(x))
 #define unsigned_value(x, y) (unsigned int)(j + 1)
@@ -13,6 +16,105 @@
 
 using namespace dutil;
 
+/* Returns the bytes of a key found by prefix_search */
+static std::string key_bytes(const trie::key_type &key)
+{
+	std::string bytes;
+	for (const trie::char_type *p = key.data(); *p != trie::key_type::kTerminator; p++)
+		bytes.push_back(trie::key_type::char_out(*p));
+	return bytes;
+}
+
+/*
+ * prefix_search and prefix_cursor must find the same keys, which are
+ * exactly the keys starting with the prefix. A few long keys of a few
+ * bytes, including '\0', leave long suffixes in the rear trie of a
+ * two-trie, which the rest of a prefix has to match.
+ */
+static bool check_cursor(trie *trie)
+{
+	const char alphabet[] = {'a', 'b', '\0', 'd'};
+	std::vector<std::string> keys;
+	unsigned int seed = 12345;
+	size_t i, j;
+
+	for (i = 0; i < 60; i++) {
+		std::string key = random_bytes(alphabet, 4,
+					       next_random(&seed) % 10, &seed);
+		keys.push_back(key);
+		trie->insert(key.data(), key.size(), i + 1);
+	}
+	std::sort(keys.begin(), keys.end());
+	keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+	/* every prefix of up to 4 bytes of the alphabet */
+	for (i = 0; i < 1 + 4 + 16 + 64 + 256; i++) {
+		std::string prefix;
+		for (j = i; j > 0; j = (j - 1) / 4)
+			prefix.insert(prefix.begin(), alphabet[(j - 1) % 4]);
+		std::vector<std::string> expected, searched, walked;
+		for (j = 0; j < keys.size(); j++)
+			if (!keys[j].compare(0, prefix.size(), prefix))
+				expected.push_back(keys[j]);
+		trie::result_type result;
+		trie->prefix_search(trie::key_type(prefix.data(), prefix.size()), &result);
+		for (j = 0; j < result.size(); j++)
+			searched.push_back(key_bytes(result[j].first));
+		std::sort(searched.begin(), searched.end());
+		trie::cursor *cursor = trie->prefix_cursor(prefix.data(), prefix.size());
+		/* parenthesized so the length macro is not expanded */
+		while (cursor->next())
+			walked.push_back(std::string(cursor->key(), (cursor->length)()));
+		delete cursor;
+		/* a cursor visits a key after the longer keys it prefixes */
+		std::sort(walked.begin(), walked.end());
+		if (searched != expected || walked != expected) {
+			std::cout << "TEST FAILED on prefix of " << prefix.size()
+				  << " bytes: " << expected.size() << " keys, "
+				  << searched.size() << " searched, "
+				  << walked.size() << " walked" << std::endl;
+			return false;
+		}
+	}
+	std::cout << "== prefix_search and prefix_cursor agree ==" << std::endl;
+	return true;
+}
+
+/*
+ * A prefix which is a key itself is walked through its terminator by
+ * basic_trie::go_forward, prefix_search has to step back from there to
+ * find the longer keys as well.
+ */
+static bool check_basic()
+{
+	basic_trie btrie;
+	const char *dict[] = {"ab", "abc", "abd", "b"};
+	const char *prefixes[] = {"", "a", "ab", "abc", "b", "c"};
+	size_t i, j;
+
+	for (i = 0; i < sizeof(dict) / sizeof(char *); i++)
+		btrie.insert(trie::key_type(dict[i], strlen(dict[i])), i + 1);
+	for (i = 0; i < sizeof(prefixes) / sizeof(char *); i++) {
+		std::vector<std::string> expected, searched;
+		for (j = 0; j < sizeof(dict) / sizeof(char *); j++)
+			if (!strncmp(dict[j], prefixes[i], strlen(prefixes[i])))
+				expected.push_back(dict[j]);
+		trie::result_type result;
+		btrie.prefix_search(trie::key_type(prefixes[i], strlen(prefixes[i])), &result);
+		for (j = 0; j < result.size(); j++)
+			searched.push_back(key_bytes(result[j].first));
+		std::sort(searched.begin(), searched.end());
+		if (searched != expected) {
+			std::cout << "TEST FAILED on basic_trie prefix \"" << prefixes[i]
+				  << "\": " << expected.size() << " keys, "
+				  << searched.size() << " searched" << std::endl;
+			return false;
+		}
+	}
+	std::cout << "== basic_trie finds keys below a key ==" << std::endl;
+	return true;
+}
+
 int main(int argc, char *argv[])
 {
 	if (argc < 2) {
@@ -44,4 +146,9 @@ int main(int argc, char *argv[])
 	std::cout << "== Done ==" << std::endl;
 	delete trie;
 
+	trie = trie::create_trie(argv[1][0] == '1'?trie::SINGLE_TRIE:trie::DOUBLE_TRIE);
+	bool ok = check_cursor(trie);
+	delete trie;
+	ok = check_basic() && ok;
+	return ok?0:1;
 }
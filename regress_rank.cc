@@ -0,0 +1,202 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com>
+//
+// rank, select and range_search against the keys sorted by bytes, with
+// and without key ids, for every archive type, empty or not, in memory,
+// reloaded and under a delta holding changes. Inputs part from long
+// keys inside their tails or rear tries, stop short of them or run past
+// them, and empty ranges or ranges the wrong way round find nothing.
+
+#include <unistd.h>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include "trie.h"
+#include "trie_impl.h"
+#include "regress.h"
+
+using namespace dutil;
+
+typedef std::map<std::string, trie::value_type> key_map;
+
+/**
+ * Keys of a few bytes, with '\0', a high byte and the empty key, and
+ * long ones apart only near their ends.
+ */
+static key_map make_keys(size_t count)
+{
+    unsigned int seed = 8191;
+    key_map keys;
+    keys[""] = 9;
+    for (size_t i = 0; i < count; i++) {
+        std::string key = random_key(kKeyBytes, 4, 7, &seed);
+        keys[key] = 1 + i % 555;
+    }
+    std::string stem(30, 'b');
+    for (size_t i = 0; i < 8; i++) {
+        keys[stem + std::string(1, "ab\0\xff"[i % 4]) + "ab"] = -1;
+        keys["a" + stem.substr(i)] = -2;
+    }
+    return keys;
+}
+
+static void collect(const char *key, size_t length, trie::value_type value,
+                    void *context)
+{
+    std::vector<std::pair<std::string, trie::value_type> > *found
+        = static_cast<std::vector<std::pair<std::string,
+                                            trie::value_type> > *>(context);
+    found->push_back(std::make_pair(std::string(key, length), value));
+}
+
+static bool check(const char *name, const trie *mtrie, const key_map &keys)
+{
+    // keys in byte order, shorter keys first, as key_map keeps them
+    std::vector<std::pair<std::string, trie::value_type> > sorted(
+        keys.begin(), keys.end());
+    bool ok = true;
+
+    // keys, inputs between keys and inputs past every key
+    std::vector<std::string> inputs(1, "");
+    for (size_t i = 0; i < sorted.size(); i += 5) {
+        const std::string &key = sorted[i].first;
+        inputs.push_back(key);
+        inputs.push_back(key + std::string(1, '\0'));
+        inputs.push_back(key + "q");
+        // short of the key, and apart from it at its last byte
+        inputs.push_back(key.substr(0, key.size() * 2 / 3));
+        if (!key.empty())
+            inputs.push_back(key.substr(0, key.size() - 1) + "\x80");
+    }
+    inputs.push_back(std::string(8, '\xff'));
+    for (size_t i = 0; i < inputs.size(); i++) {
+        size_t expected = std::lower_bound(
+            sorted.begin(), sorted.end(),
+            std::make_pair(inputs[i], INT32_MIN)) - sorted.begin();
+        if (mtrie->rank(inputs[i].data(), inputs[i].size())
+            != static_cast<trie::size_type>(expected))
+            ok = false;
+    }
+
+    std::string key;
+    trie::value_type value;
+    for (size_t i = 0; i < sorted.size(); i++)
+        if (!mtrie->select(i, &key, &value) || key != sorted[i].first
+            || value != sorted[i].second)
+            ok = false;
+    if (mtrie->select(-1, &key) || mtrie->select(sorted.size(), &key))
+        ok = false;
+
+    // pages of 17 keys, then ranges between any inputs
+    for (size_t i = 0; i < sorted.size(); i += 17) {
+        std::vector<std::pair<std::string, trie::value_type> > found;
+        size_t end = std::min(i + 17, sorted.size());
+        std::string hi = end < sorted.size()?sorted[end].first
+                                             :std::string(8, '\xff');
+        size_t count = mtrie->range_search(sorted[i].first.data(),
+                                           sorted[i].first.size(),
+                                           hi.data(), hi.size(), collect,
+                                           &found);
+        if (count != end - i
+            || !std::equal(found.begin(), found.end(), sorted.begin() + i))
+            ok = false;
+    }
+    for (size_t i = 0; i + 7 < inputs.size(); i += 7) {
+        const std::string &lo = inputs[i], &hi = inputs[i + 7];
+        std::vector<std::pair<std::string, trie::value_type> > found,
+                                                               expected;
+        for (size_t j = 0; j < sorted.size(); j++)
+            if (sorted[j].first >= lo && sorted[j].first < hi)
+                expected.push_back(sorted[j]);
+        mtrie->range_search(lo.data(), lo.size(), hi.data(), hi.size(),
+                            collect, &found);
+        if (found != expected)
+            ok = false;
+        // nothing when hi is not after lo
+        if ((lo < hi && mtrie->range_search(hi.data(), hi.size(), lo.data(),
+                                            lo.size(), collect, &found))
+            || mtrie->range_search(lo.data(), lo.size(), lo.data(),
+                                   lo.size(), collect, &found))
+            ok = false;
+    }
+    printf("%s: %s\n", name, ok?"ok":"TEST FAILED");
+    return ok;
+}
+
+int main()
+{
+    const char *filename = "regress_rank.trie";
+    const char *names[] = {"", "single", "double", "compact", "dawg", "ac"};
+    bool ok = true;
+
+    // no key at all, then many
+    key_map sets[2];
+    sets[1] = make_keys(1500);
+    for (size_t i = 0; i < 2; i++) {
+        const key_map &keys = sets[i];
+        std::vector<trie::entry_type> entries;
+        key_map::const_iterator it;
+        for (it = keys.begin(); it != keys.end(); it++) {
+            trie::entry_type entry = {it->first.data(), it->first.size(),
+                                      it->second};
+            entries.push_back(entry);
+        }
+        for (int type = trie::SINGLE_TRIE; type <= trie::AC_TRIE; type++) {
+            for (int ids = 0; ids < 2; ids++) {
+                char name[64];
+                std::vector<trie::entry_type> copy(entries);
+                trie *mtrie = trie::create_trie(
+                    static_cast<trie::trie_type>(type));
+                mtrie->record_key_ids(ids);
+                mtrie->set_build_threads(3);
+                mtrie->insert_bulk(&copy);
+                if (type <= trie::DOUBLE_TRIE && !ids) {
+                    snprintf(name, sizeof(name), "%s, %lu keys, in memory",
+                             names[type], keys.size());
+                    ok = check(name, mtrie, keys) && ok;
+                }
+                mtrie->build(filename);
+                delete mtrie;
+                mtrie = trie::create_trie(filename);
+                snprintf(name, sizeof(name), "%s, %lu keys, archive%s",
+                         names[type], keys.size(), ids?" with ids":"");
+                ok = check(name, mtrie, keys) && ok;
+                delete mtrie;
+            }
+
+            // a delta changing, removing and adding keys
+            std::string delta_filename = std::string(filename) + ".delta";
+            unlink(delta_filename.c_str());
+            delta_trie *delta = new delta_trie(filename);
+            key_map changed(keys);
+            size_t n = 0;
+            for (it = keys.begin(); it != keys.end(); it++, n++) {
+                trie::key_type key(it->first.data(), it->first.size());
+                if (n % 13 == 4) {
+                    delta->remove(key);
+                    changed.erase(it->first);
+                } else if (n % 13 == 9) {
+                    delta->insert(key, 2000);
+                    changed[it->first] = 2000;
+                }
+            }
+            const char *added[] = {"ab\x80", "\xff\xff\xff\xff\xff\xff", "c"};
+            for (n = 0; n < sizeof(added) / sizeof(added[0]); n++) {
+                delta->insert(trie::key_type(added[n], strlen(added[n])), 7);
+                changed[added[n]] = 7;
+            }
+            char name[64];
+            snprintf(name, sizeof(name), "%s, %lu keys, delta",
+                     names[type], keys.size());
+            ok = check(name, delta, changed) && ok;
+            delete delta;
+            unlink(delta_filename.c_str());
+        }
+    }
+    unlink(filename);
+    return ok?0:1;
+}
+
+// vim: ts=4 sw=4 ai et
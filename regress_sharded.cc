@@ -0,0 +1,372 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com>
+//
+// sharded_trie against a brute-force scan of the same keys, for both
+// routings, filled by insert from threads and by insert_bulk, in
+// memory and reloaded from its archive. prefix_search follows the order
+// of prefix_cursor, pages over a delta neither skip nor repeat keys,
+// cursors lock out inserts into their shards, a failed build leaves
+// no file behind, and each shard is bounded by its section.
+
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include "trie.h"
+#include "trie_impl.h"
+#include "regress.h"
+
+using namespace dutil;
+
+typedef std::map<std::string, trie::value_type> key_map;
+
+/// Keys of a few bytes, with '\0', a high byte and the empty key.
+static key_map make_keys(size_t count)
+{
+    const char alphabet[] = {'a', 'b', '\0', 'z', '\xff'};
+    unsigned int seed = 20091;
+    key_map keys;
+    keys[""] = 42;
+    for (size_t i = 0; i < count; i++) {
+        std::string key = random_key(alphabet, 5, 8, &seed);
+        keys[key] = static_cast<trie::value_type>(i * 37 % 1000) - 300;
+    }
+    return keys;
+}
+
+static std::vector<std::string> with_prefix(const key_map &keys,
+                                            const std::string &prefix)
+{
+    std::vector<std::string> found;
+    key_map::const_iterator it;
+    for (it = keys.begin(); it != keys.end(); it++)
+        if (!it->first.compare(0, prefix.size(), prefix))
+            found.push_back(it->first);
+    std::sort(found.begin(), found.end(), walk_less);
+    return found;
+}
+
+/// Bytes of a key found by prefix_search or top_k.
+static std::string key_bytes(const trie::key_type &key)
+{
+    std::string bytes;
+    for (const trie::char_type *p = key.data();
+         *p != trie::key_type::kTerminator; p++)
+        bytes.push_back(trie::key_type::char_out(*p));
+    return bytes;
+}
+
+/// Pages of 7 keys over prefix, each page continuing after the last key.
+static std::vector<std::string> walk_pages(
+    const trie *mtrie, const std::string &prefix,
+    std::vector<trie::value_type> *values)
+{
+    std::vector<std::string> walked;
+    std::string last;
+    bool more = true;
+    while (more) {
+        trie::cursor *cursor = mtrie->prefix_cursor(
+            prefix.data(), prefix.size(), 7,
+            walked.empty()?NULL:last.data(), last.size());
+        size_t n = 0;
+        while (cursor->next()) {
+            last.assign(cursor->key(), cursor->length());
+            walked.push_back(last);
+            values->push_back(cursor->value());
+            ++n;
+        }
+        delete cursor;
+        more = (n == 7);
+    }
+    return walked;
+}
+
+static bool check(const char *name, const trie *mtrie, const key_map &keys)
+{
+    const char *prefixes[] = {"", "a", "ab", "\xff", "z\0", "q"};
+    const size_t lengths[] = {0, 1, 2, 1, 2, 1};
+    bool ok = true;
+
+    key_map::const_iterator it;
+    trie::value_type value;
+    for (it = keys.begin(); it != keys.end(); it++)
+        if (!mtrie->search(it->first.data(), it->first.size(), &value)
+            || value != it->second)
+            ok = false;
+    if (mtrie->search("abq", 3, &value))
+        ok = false;
+
+    for (size_t i = 0; ok && i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+        std::string prefix(prefixes[i], lengths[i]);
+        std::vector<std::string> expected = with_prefix(keys, prefix);
+
+        trie::result_type result;
+        std::vector<std::string> searched;
+        mtrie->prefix_search(trie::key_type(prefix.data(), prefix.size()),
+                             &result);
+        for (size_t j = 0; j < result.size(); j++)
+            searched.push_back(key_bytes(result[j].first));
+        if (searched != expected)
+            ok = false;
+
+        std::vector<trie::value_type> values;
+        if (walk_pages(mtrie, prefix, &values) != expected)
+            ok = false;
+        for (size_t j = 0; ok && j < values.size(); j++)
+            if (values[j] != keys.find(expected[j])->second)
+                ok = false;
+
+        result.clear();
+        mtrie->top_k(prefix.data(), prefix.size(), 5, &result);
+        std::vector<trie::value_type> top, best;
+        for (size_t j = 0; j < result.size(); j++)
+            top.push_back(result[j].second);
+        for (size_t j = 0; j < expected.size(); j++)
+            best.push_back(keys.find(expected[j])->second);
+        std::sort(best.rbegin(), best.rend());
+        best.resize(std::min<size_t>(best.size(), 5));
+        if (top != best)
+            ok = false;
+
+        trie::aggregate_type aggregate;
+        bool found = mtrie->aggregate_prefix(prefix.data(), prefix.size(),
+                                             &aggregate);
+        int64_t sum = 0;
+        for (size_t j = 0; j < expected.size(); j++)
+            sum += keys.find(expected[j])->second;
+        if (found != !expected.empty()
+            || (found && (aggregate.count
+                          != static_cast<trie::size_type>(expected.size())
+                          || aggregate.sum != sum)))
+            ok = false;
+        if (!ok)
+            printf("TEST FAILED on %s, prefix of %lu bytes\n", name,
+                   prefix.size());
+    }
+    printf("%s: %s\n", name, ok?"ok":"TEST FAILED");
+    return ok;
+}
+
+typedef struct {
+    sharded_trie *mtrie;
+    const std::vector<key_map::value_type> *pairs;
+    size_t thread;
+} insert_job_type;
+
+static void *insert_keys(void *arg)
+{
+    insert_job_type *job = static_cast<insert_job_type *>(arg);
+    const std::vector<key_map::value_type> &pairs = *job->pairs;
+    for (size_t i = job->thread; i < pairs.size(); i += 4)
+        job->mtrie->insert(trie::key_type(pairs[i].first.data(),
+                                          pairs[i].first.size()),
+                           pairs[i].second);
+    return NULL;
+}
+
+/**
+ * Changes and adds keys in the delta of an archive: pages then continue
+ * from prefix_search of the merged keys, which hold every key once.
+ */
+static bool check_delta(const char *filename, key_map keys)
+{
+    const char *prefixes[] = {"", "a", "b\0", "\xff"};
+    const size_t lengths[] = {0, 1, 2, 1};
+    delta_trie *mtrie = new delta_trie(filename);
+    key_map::iterator it = keys.begin();
+    for (size_t i = 0; it != keys.end(); it++, i++) {
+        if (i % 9 == 0) {
+            it->second += 5000;
+            mtrie->insert(trie::key_type(it->first.data(),
+                                         it->first.size()), it->second);
+        }
+    }
+    for (size_t i = 0; i < 60; i++) {
+        char key[16];
+        snprintf(key, sizeof(key), "%s%lu", i % 2?"a":"\xff", i);
+        keys[key] = static_cast<trie::value_type>(i);
+        mtrie->insert(trie::key_type(key, strlen(key)), keys[key]);
+    }
+
+    bool ok = true;
+    for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+        std::string prefix(prefixes[i], lengths[i]);
+        trie::result_type result;
+        std::vector<std::string> searched;
+        mtrie->prefix_search(trie::key_type(prefix.data(), prefix.size()),
+                             &result);
+        for (size_t j = 0; j < result.size(); j++) {
+            searched.push_back(key_bytes(result[j].first));
+            if (result[j].second != keys.find(searched.back())->second)
+                ok = false;
+        }
+        std::vector<std::string> sorted(searched);
+        std::vector<trie::value_type> values;
+        std::sort(sorted.begin(), sorted.end(), walk_less);
+        if (walk_pages(mtrie, prefix, &values) != searched
+            || sorted != with_prefix(keys, prefix))
+            ok = false;
+    }
+    delete mtrie;
+    unlink((std::string(filename) + ".delta").c_str());
+    printf("  paged over a delta: %s\n", ok?"ok":"TEST FAILED");
+    return ok;
+}
+
+typedef struct {
+    sharded_trie *mtrie;
+    volatile bool done;
+} blocked_job_type;
+
+static void *insert_blocked(void *arg)
+{
+    blocked_job_type *job = static_cast<blocked_job_type *>(arg);
+    job->mtrie->insert(trie::key_type("ab", 2), 7);
+    job->done = true;
+    return NULL;
+}
+
+/// An insert waits while a cursor walks the shard of its key.
+static bool check_locked(sharded_trie *mtrie)
+{
+    blocked_job_type job = {mtrie, false};
+    pthread_t thread;
+    trie::cursor *cursor = mtrie->prefix_cursor("", 0);
+    cursor->next();
+    pthread_create(&thread, NULL, insert_blocked, &job);
+    usleep(100000);
+    bool ok = !job.done;
+    while (cursor->next())
+        ;
+    delete cursor;
+    pthread_join(thread, NULL);
+    trie::value_type value;
+    ok = ok && job.done && mtrie->search("ab", 2, &value) && value == 7;
+    printf("  insert waits for a cursor: %s\n", ok?"ok":"TEST FAILED");
+    return ok;
+}
+
+/// Building over a directory fails, and leaves no shard file behind.
+static bool check_failed_build(sharded_trie *mtrie, size_t shards)
+{
+    const char *dirname = "regress_sharded.dir";
+    mkdir(dirname, 0755);
+    bool thrown = false;
+    try {
+        mtrie->build(dirname);
+    } catch (const std::exception &) {
+        thrown = true;
+    }
+    bool ok = thrown;
+    for (size_t i = 0; i < shards; i++) {
+        char shard[64];
+        struct stat sb;
+        snprintf(shard, sizeof(shard), "%s.shard%lu", dirname, i);
+        if (stat(shard, &sb) == 0) {
+            unlink(shard);
+            ok = false;
+        }
+    }
+    rmdir(dirname);
+    printf("  failed build: %s\n", ok?"ok":"TEST FAILED");
+    return ok;
+}
+
+/**
+ * A shard reads only its own section: cut short, empty or running past
+ * the file, the archive is refused.
+ */
+static bool check_sections(const char *filename)
+{
+    bool ok = true;
+    sharded_trie::section_type first;
+    FILE *file = fopen(filename, "r+");
+    fseek(file, sizeof(sharded_trie::header_type), SEEK_SET);
+    if (fread(&first, sizeof(first), 1, file) != 1)
+        ok = false;
+    int64_t sizes[] = {first.size - 1, 0, first.size + (1 << 30)};
+    for (size_t i = 0; i < 3; i++) {
+        sharded_trie::section_type section = first;
+        section.size = sizes[i];
+        fseek(file, sizeof(sharded_trie::header_type), SEEK_SET);
+        fwrite(&section, sizeof(section), 1, file);
+        fflush(file);
+        bool thrown = false;
+        try {
+            delete trie::create_trie(filename);
+        } catch (const std::exception &) {
+            thrown = true;
+        }
+        ok = thrown && ok;
+    }
+    fclose(file);
+    printf("  sections: %s\n", ok?"ok":"TEST FAILED");
+    return ok;
+}
+
+int main()
+{
+    const char *filename = "regress_sharded.trie";
+    key_map keys = make_keys(1500);
+    std::vector<key_map::value_type> pairs(keys.begin(), keys.end());
+    bool ok = true;
+
+    for (int mode = 0; mode < 8; mode++) {
+        trie::trie_type type = (mode & 1)?trie::SINGLE_TRIE
+                                         :trie::DOUBLE_TRIE;
+        sharded_trie::routing_type routing = (mode & 2)
+                                             ?sharded_trie::BYTE_ROUTING
+                                             :sharded_trie::HASH_ROUTING;
+        char name[64];
+        snprintf(name, sizeof(name), "%s, %s routing, %s",
+                 type == trie::SINGLE_TRIE?"single":"double",
+                 routing == sharded_trie::BYTE_ROUTING?"byte":"hash",
+                 (mode & 4)?"insert_bulk -j 3":"insert from 4 threads");
+        sharded_trie *mtrie = new sharded_trie(type, 7, routing);
+        mtrie->record_max_values(true);
+        mtrie->record_aggregates(true);
+        if (mode & 4) {
+            std::vector<trie::entry_type> entries;
+            for (size_t i = 0; i < pairs.size(); i++) {
+                trie::entry_type entry = {pairs[i].first.data(),
+                                          pairs[i].first.size(),
+                                          pairs[i].second};
+                entries.push_back(entry);
+            }
+            mtrie->set_build_threads(3);
+            mtrie->insert_bulk(&entries);
+        } else {
+            pthread_t threads[4];
+            insert_job_type jobs[4];
+            for (size_t i = 0; i < 4; i++) {
+                insert_job_type job = {mtrie, &pairs, i};
+                jobs[i] = job;
+                pthread_create(&threads[i], NULL, insert_keys, &jobs[i]);
+            }
+            for (size_t i = 0; i < 4; i++)
+                pthread_join(threads[i], NULL);
+        }
+        ok = check(name, mtrie, keys) && ok;
+        if (mode == 0)
+            ok = check_failed_build(mtrie, 7) && ok;
+        mtrie->build(filename);
+        if (mode == 0)
+            ok = check_locked(mtrie) && ok;
+        delete mtrie;
+        trie *archive = trie::create_trie(filename);
+        ok = check("  reloaded", archive, keys) && ok;
+        delete archive;
+        unlink((std::string(filename) + ".delta").c_str());
+        ok = check_delta(filename, keys) && ok;
+        if (mode < 2)
+            ok = check_sections(filename) && ok;
+    }
+    unlink(filename);
+    return ok?0:1;
+}
+
+// vim: ts=4 sw=4 ai et
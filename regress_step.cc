@@ -0,0 +1,180 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com>
+//
+// step, value, is_terminal and enumerate against a brute-force scan of
+// the same keys, walking every prefix of every key byte by byte, for
+// every archive type and a delta over it. A failed step leaves the
+// traversal unchanged, restoring a copy goes back as a backspace does,
+// and walks reach positions in tails and rear tries.
+
+#include <unistd.h>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+#include "trie.h"
+#include "trie_impl.h"
+#include "regress.h"
+
+using namespace dutil;
+
+typedef std::map<std::string, trie::value_type> key_map;
+
+/// Bytes tried after every prefix, 'q' is in no key.
+static const char kProbes[] = {'a', 'b', '\0', '\xff', 'q'};
+
+/// Keys of a few bytes with '\0', a high byte and the empty key, and a
+/// few long ones whose rest is held by a tail or a rear trie.
+static key_map make_keys(size_t count)
+{
+    unsigned int seed = 7919;
+    key_map keys;
+    keys[""] = 11;
+    for (size_t i = 0; i < count; i++) {
+        std::string key = random_key(kProbes, 4, 7, &seed);
+        keys[key] = static_cast<trie::value_type>(i * 29 % 500) - 100;
+    }
+    keys[std::string("\xff\xff\xff\xff" "abab\0ab", 11)] = 1001;
+    keys["bbbbbbbbbbbbbbbbaaaa"] = 1002;
+    keys["bbbbbbbbbbbbbbbbaaab"] = 1003;
+    return keys;
+}
+
+typedef struct {
+    const trie *mtrie;
+    const key_map *keys;
+    size_t steps;       ///< Steps taken.
+    size_t tails;       ///< Steps which ended in a tail or rear trie.
+    bool ok;
+} walk_type;
+
+static bool same(const trie::traversal_type &lhs,
+                 const trie::traversal_type &rhs)
+{
+    return lhs.key == rhs.key && lhs.state == rhs.state
+           && lhs.tail == rhs.tail;
+}
+
+/// Checks where t stands against keys starting with the bytes stepped.
+static void check_here(walk_type *walk, const trie::traversal_type &t)
+{
+    const key_map &keys = *walk->keys;
+    key_map::const_iterator it = keys.find(t.key);
+    trie::value_type value;
+    bool found = walk->mtrie->value(t, &value);
+    if (found != (it != keys.end()) || (found && value != it->second)
+        || walk->mtrie->is_terminal(t) != found)
+        walk->ok = false;
+
+    // enumerate walks as prefix_cursor does, two keys at most
+    trie::cursor *from = walk->mtrie->enumerate(t, 2);
+    trie::cursor *root = walk->mtrie->prefix_cursor(t.key.data(),
+                                                    t.key.length(), 2);
+    bool more;
+    do {
+        more = from->next();
+        if (more != root->next()
+            || (more && (std::string(from->key(), from->length())
+                         != std::string(root->key(), root->length())
+                         || from->value() != root->value())))
+            walk->ok = false;
+    } while (more && walk->ok);
+    delete from;
+    delete root;
+}
+
+/**
+ * Steps every probe after the bytes stepped by t, going back by
+ * restoring a copy of t after each.
+ */
+static void walk_from(walk_type *walk, trie::traversal_type *t)
+{
+    const key_map &keys = *walk->keys;
+    check_here(walk, *t);
+    for (size_t i = 0; walk->ok && i < sizeof(kProbes); i++) {
+        trie::traversal_type saved = *t;
+        std::string next = t->key + kProbes[i];
+        key_map::const_iterator it = keys.lower_bound(next);
+        bool expected = it != keys.end()
+                        && !it->first.compare(0, next.size(), next);
+        if (walk->mtrie->step(t, kProbes[i]) != expected) {
+            walk->ok = false;
+        } else if (!expected) {
+            if (!same(*t, saved))
+                walk->ok = false;
+        } else {
+            walk->steps++;
+            if (t->tail)
+                walk->tails++;
+            walk_from(walk, t);
+            *t = saved;
+            check_here(walk, *t);
+        }
+    }
+}
+
+static bool check(const char *name, const trie *mtrie, const key_map &keys,
+                  bool tails)
+{
+    walk_type walk = {mtrie, &keys, 0, 0, true};
+    trie::traversal_type t;
+    walk_from(&walk, &t);
+    // tries with a tail or a rear trie must have walked into it
+    bool ok = walk.ok && walk.steps > keys.size() && (!tails || walk.tails);
+    printf("%s, %lu steps, %lu in tails: %s\n", name, walk.steps, walk.tails,
+           ok?"ok":"TEST FAILED");
+    return ok;
+}
+
+int main()
+{
+    const char *filename = "regress_step.trie";
+    const char *names[] = {"", "single", "double", "compact", "dawg", "ac"};
+    key_map keys = make_keys(400);
+    bool ok = true;
+
+    for (int type = trie::SINGLE_TRIE; type <= trie::AC_TRIE; type++) {
+        char name[64];
+        bool tails = type <= trie::DOUBLE_TRIE;
+        std::vector<trie::entry_type> entries;
+        key_map::const_iterator it;
+        for (it = keys.begin(); it != keys.end(); it++) {
+            trie::entry_type entry = {it->first.data(), it->first.size(),
+                                      it->second};
+            entries.push_back(entry);
+        }
+        trie *mtrie = trie::create_trie(static_cast<trie::trie_type>(type));
+        mtrie->insert_bulk(&entries);
+        if (tails) {
+            snprintf(name, sizeof(name), "%s, in memory", names[type]);
+            ok = check(name, mtrie, keys, true) && ok;
+        }
+        mtrie->build(filename);
+        delete mtrie;
+        mtrie = trie::create_trie(filename);
+        snprintf(name, sizeof(name), "%s, reloaded", names[type]);
+        ok = check(name, mtrie, keys, tails) && ok;
+        delete mtrie;
+
+        // a delta steps in its archive until it holds a change
+        unlink((std::string(filename) + ".delta").c_str());
+        delta_trie *delta = new delta_trie(filename);
+        snprintf(name, sizeof(name), "%s, empty delta", names[type]);
+        ok = check(name, delta, keys, tails) && ok;
+        key_map changed(keys);
+        delta->insert(trie::key_type("ba\xff" "a", 4), 2001);
+        changed["ba\xff" "a"] = 2001;
+        delta->insert(trie::key_type("bbbbbbbbbbbbbbbbaaaa", 20), 2002);
+        changed["bbbbbbbbbbbbbbbbaaaa"] = 2002;
+        delta->remove(trie::key_type("bbbbbbbbbbbbbbbbaaab", 20));
+        changed.erase("bbbbbbbbbbbbbbbbaaab");
+        snprintf(name, sizeof(name), "%s, delta", names[type]);
+        ok = check(name, delta, changed, false) && ok;
+        delete delta;
+        unlink((std::string(filename) + ".delta").c_str());
+    }
+    unlink(filename);
+    return ok?0:1;
+}
+
+// vim: ts=4 sw=4 ai et
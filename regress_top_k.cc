@@ -0,0 +1,124 @@
+// Copyright Jianing Yang <jianingy.yang@gmail.com>
+//
+// top_k against a brute-force scan of the same keys, best-first over
+// recorded max values and by the default walk, for every archive type.
+
+#include <unistd.h>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+#include "trie.h"
+#include "trie_impl.h"
+#include "regress.h"
+
+using namespace dutil;
+
+typedef std::map<std::string, trie::value_type> key_map;
+
+/// Keys of a few bytes, with '\0' and the empty key.
+static key_map make_keys(size_t count)
+{
+    const char alphabet[] = {'a', 'b', '\0', 'd'};
+    unsigned int seed = 31337;
+    key_map keys;
+    keys[""] = 5;
+    for (size_t i = 0; i < count; i++) {
+        std::string key = random_bytes(alphabet, 4, next_random(&seed) % 10,
+                                       &seed);
+        keys[key] = static_cast<trie::value_type>((seed >> 8) % 200) - 100;
+    }
+    return keys;
+}
+
+static bool check(const char *name, const trie *mtrie, const key_map &keys)
+{
+    const size_t ks[] = {0, 1, 3, 50};
+    bool ok = true;
+    // every prefix of up to 2 bytes of the alphabet
+    for (size_t i = 0; ok && i < 1 + 4 + 16; i++) {
+        const char alphabet[] = {'a', 'b', '\0', 'd'};
+        std::string prefix;
+        for (size_t j = i; j > 0; j = (j - 1) / 4)
+            prefix.insert(prefix.begin(), alphabet[(j - 1) % 4]);
+        std::vector<trie::value_type> all;
+        key_map::const_iterator it;
+        for (it = keys.begin(); it != keys.end(); it++)
+            if (!it->first.compare(0, prefix.size(), prefix))
+                all.push_back(it->second);
+        std::sort(all.begin(), all.end(), std::greater<trie::value_type>());
+        for (size_t j = 0; j < sizeof(ks) / sizeof(ks[0]); j++) {
+            trie::result_type result;
+            mtrie->top_k(prefix.data(), prefix.size(), ks[j], &result);
+            std::vector<trie::value_type> best(all.begin(), all.begin()
+                                               + std::min(ks[j], all.size()));
+            std::vector<trie::value_type> top;
+            for (size_t r = 0; r < result.size(); r++) {
+                std::string key;
+                const trie::char_type *p = result[r].first.data();
+                for (; *p != trie::key_type::kTerminator; p++)
+                    key.push_back(trie::key_type::char_out(*p));
+                it = keys.find(key);
+                if (it == keys.end() || it->second != result[r].second
+                    || key.compare(0, prefix.size(), prefix))
+                    ok = false;
+                top.push_back(result[r].second);
+            }
+            if (top != best) {
+                printf("TEST FAILED on %s, prefix of %lu bytes, k = %lu\n",
+                       name, prefix.size(), ks[j]);
+                ok = false;
+            }
+        }
+    }
+    printf("%s: %s\n", name, ok?"ok":"TEST FAILED");
+    return ok;
+}
+
+int main()
+{
+    const char *filename = "regress_top_k.trie";
+    const char *names[] = {"", "single", "double", "compact", "dawg", "ac"};
+    key_map keys = make_keys(600);
+    std::vector<trie::entry_type> entries;
+    key_map::const_iterator it;
+    for (it = keys.begin(); it != keys.end(); it++) {
+        trie::entry_type entry = {it->first.data(), it->first.size(),
+                                  it->second};
+        entries.push_back(entry);
+    }
+    bool ok = true;
+    for (int type = trie::SINGLE_TRIE; type <= trie::AC_TRIE; type++) {
+        for (int record = 0; record < 2; record++) {
+            char name[64];
+            trie *mtrie = trie::create_trie(
+                static_cast<trie::trie_type>(type));
+            mtrie->record_max_values(record);
+            if (type <= trie::DOUBLE_TRIE) {
+                // in memory, keys inserted one by one
+                for (it = keys.begin(); it != keys.end(); it++)
+                    mtrie->insert(it->first.data(), it->first.size(),
+                                  it->second);
+                snprintf(name, sizeof(name), "%s in memory", names[type]);
+                ok = check(name, mtrie, keys) && ok;
+            } else {
+                std::vector<trie::entry_type> copy(entries);
+                mtrie->insert_bulk(&copy);
+            }
+            mtrie->build(filename);
+            delete mtrie;
+            mtrie = trie::create_trie(filename);
+            snprintf(name, sizeof(name), "%s archive%s", names[type],
+                     record?", max values":"");
+            ok = check(name, mtrie, keys) && ok;
+            delete mtrie;
+        }
+    }
+    unlink(filename);
+    return ok?0:1;
+}
+
+// vim: ts=4 sw=4 ai et
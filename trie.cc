@@ -33,13 +33,18 @@
 #include <iostream>
 #include <cstdlib>
 #include <cstdio>
+#include <cstring>
+#include <algorithm>
 
 #include "trie.h"
 #include "trie_impl.h"
 
 BEGIN_TRIE_NAMESPACE
 
-static trie::trie_type find_archive_type(const char *archive)
+const trie::char_type trie::key_type::kCharsetSize;
+const trie::char_type trie::key_type::kTerminator;
+
+trie::trie_type trie::find_archive_type(const char *archive)
 {
     FILE *fp;
     char magic[16] = {0};
@@ -50,6 +55,14 @@ static trie::trie_type find_archive_type(const char *archive)
             return trie::DOUBLE_TRIE;
         else if (strncmp(magic, "TAIL_TRIE", length) == 0)
             return trie::SINGLE_TRIE;
+        else if (strncmp(magic, "COMPACT_TRIE", length) == 0)
+            return trie::COMPACT_TRIE;
+        else if (strncmp(magic, "DAWG_TRIE", length) == 0)
+            return trie::DAWG_TRIE;
+        else if (strncmp(magic, "AC_TRIE", length) == 0)
+            return trie::AC_TRIE;
+        else if (strncmp(magic, "SHARDED_TRIE", length) == 0)
+            return trie::SHARDED_TRIE;
         else
             return trie::UNKNOW;
     } else {
@@ -61,6 +74,14 @@ trie* trie::create_trie(trie_type type, size_t size)
 {
     if (type == SINGLE_TRIE)
         return new single_trie(size);
+    else if (type == COMPACT_TRIE)
+        return new compact_trie(size);
+    else if (type == DAWG_TRIE)
+        return new dawg_trie(size);
+    else if (type == AC_TRIE)
+        return new ac_trie(size);
+    else if (type == SHARDED_TRIE)
+        return new sharded_trie();
     else
         return new double_trie(size);
 }
@@ -72,10 +93,25 @@ trie* trie::create_trie(const char *archive)
         return new single_trie(archive);
     else if (type == DOUBLE_TRIE)
         return new double_trie(archive);
+    else if (type == COMPACT_TRIE)
+        return new compact_trie(archive);
+    else if (type == DAWG_TRIE)
+        return new dawg_trie(archive);
+    else if (type == AC_TRIE)
+        return new ac_trie(archive);
+    else if (type == SHARDED_TRIE)
+        return new sharded_trie(archive);
     else
         throw bad_trie_archive("file magic error");
 }
 
+bool trie::walk_less(const char *lhs, size_t lhs_length,
+                     const char *rhs, size_t rhs_length)
+{
+    int retval = memcmp(lhs, rhs, std::min(lhs_length, rhs_length));
+    return retval < 0 || (retval == 0 && lhs_length > rhs_length);
+}
+
 void trie::insert(const char *inputs, size_t length,
                             value_type value)
 {
@@ -90,6 +126,314 @@ bool trie::search(const char *inputs, size_t length,
     return search(key, value);
 }
 
+size_t trie::search_batch(const key_type *keys, size_t n,
+                          value_type *values, bool *found) const
+{
+    size_t i, count = 0;
+    for (i = 0; i < n; i++)
+        if ((found[i] = search(keys[i], &values[i])))
+            ++count;
+    return count;
+}
+
+size_t trie::search_batch(const char *const *inputs, const size_t *lengths,
+                          size_t n, value_type *values, bool *found) const
+{
+    size_t i, count = 0;
+    key_type key;
+    for (i = 0; i < n; i++) {
+        key.assign(inputs[i], lengths[i]);
+        if ((found[i] = search(key, &values[i])))
+            ++count;
+    }
+    return count;
+}
+
+/**
+ * Walks the result of prefix_search, for tries which can not walk
+ * their states one by one.
+ */
+class result_cursor: public trie::cursor {
+  public:
+    result_cursor(const trie &owner, const char *prefix, size_t length,
+                  size_t limit, const char *after, size_t after_length)
+        :pos_(0), limit_(limit), count_(0)
+    {
+        trie::key_type key(prefix, length);
+        owner.prefix_search(key, &result_);
+        if (!after)
+            return;
+        // keys are unique, so the continuation is found by its bytes
+        std::string last(after, after_length);
+        while (pos_ < result_.size()) {
+            assign(result_[pos_++].first);
+            if (key_ == last)
+                return;
+        }
+    }
+
+    bool next()
+    {
+        if (pos_ >= result_.size() || (limit_ && count_ >= limit_))
+            return false;
+        assign(result_[pos_].first);
+        value_ = result_[pos_++].second;
+        ++count_;
+        return true;
+    }
+
+  private:
+    /// Sets bytes of key to key_.
+    void assign(const trie::key_type &key)
+    {
+        const trie::char_type *p;
+        key_.clear();
+        for (p = key.data(); *p != trie::key_type::kTerminator; p++)
+            key_.push_back(trie::key_type::char_out(*p));
+    }
+
+    trie::result_type result_;  ///< Keys found by prefix_search.
+    size_t pos_;                ///< Next key in result_.
+    size_t limit_;              ///< Maximum number of keys, 0 for none.
+    size_t count_;              ///< Number of keys returned.
+};
+
+trie::cursor *trie::prefix_cursor(const char *prefix, size_t length,
+                                  size_t limit, const char *after,
+                                  size_t after_length) const
+{
+    if (after && (after_length < length || memcmp(after, prefix, length)))
+        throw std::runtime_error("prefix_cursor: after does not start "
+                                 "with prefix");
+    return new result_cursor(*this, prefix, length, limit,
+                             after, after_length);
+}
+
+/// Orders key-value pairs by value, the largest first.
+static bool larger_value(const std::pair<trie::key_type, trie::value_type> &a,
+                         const std::pair<trie::key_type, trie::value_type> &b)
+{
+    return a.second > b.second;
+}
+
+size_t trie::top_k(const char *prefix, size_t length, size_t k,
+                   result_type *result) const
+{
+    // a heap of the k largest values so far, the smallest on its top
+    result_type found;
+    cursor *keys = prefix_cursor(prefix, length);
+    while (k && keys->next()) {
+        if (found.size() == k) {
+            if (keys->value() <= found.front().second)
+                continue;
+            std::pop_heap(found.begin(), found.end(), larger_value);
+            found.pop_back();
+        }
+        found.push_back(std::make_pair(key_type(keys->key(), keys->length()),
+                                       keys->value()));
+        std::push_heap(found.begin(), found.end(), larger_value);
+    }
+    delete keys;
+    std::sort_heap(found.begin(), found.end(), larger_value);
+    result->insert(result->end(), found.begin(), found.end());
+    return result->size();
+}
+
+/**
+ * Computes the edit distance between a and b, or limit + 1 if it is
+ * larger than limit.
+ */
+static size_t edit_distance(const char *a, size_t alength,
+                            const char *b, size_t blength, size_t limit)
+{
+    if ((alength > blength?alength - blength:blength - alength) > limit)
+        return limit + 1;
+    std::vector<size_t> row(blength + 1);
+    for (size_t j = 0; j <= blength; j++)
+        row[j] = j;
+    for (size_t i = 0; i < alength; i++) {
+        size_t diagonal = row[0], least = ++row[0];
+        for (size_t j = 1; j <= blength; j++) {
+            size_t cell = std::min(std::min(row[j], row[j - 1]) + 1,
+                                   diagonal + (a[i] != b[j - 1]));
+            diagonal = row[j];
+            row[j] = cell;
+            least = std::min(least, cell);
+        }
+        if (least > limit)
+            return limit + 1;
+    }
+    return std::min(row[blength], limit + 1);
+}
+
+size_t trie::fuzzy_search(const char *inputs, size_t length,
+                          size_t distance, fuzzy_callback found,
+                          void *context) const
+{
+    size_t count = 0;
+    cursor *keys = prefix_cursor("", 0);
+    while (keys->next()) {
+        fuzzy_match_type match = {keys->key(), keys->length(),
+                                  keys->value(), 0};
+        match.distance = edit_distance(match.key, match.length,
+                                       inputs, length, distance);
+        if (match.distance <= distance) {
+            found(match, context);
+            ++count;
+        }
+    }
+    delete keys;
+    return count;
+}
+
+bool trie::step(traversal_type *t, char ch) const
+{
+    t->key.push_back(ch);
+    cursor *keys = prefix_cursor(t->key.data(), t->key.length(), 1);
+    bool found = keys->next();
+    delete keys;
+    if (!found)
+        t->key.erase(t->key.length() - 1);
+    return found;
+}
+
+bool trie::value(const traversal_type &t, value_type *result) const
+{
+    return search(t.key.data(), t.key.length(), result);
+}
+
+trie::cursor *trie::enumerate(const traversal_type &t, size_t limit) const
+{
+    return prefix_cursor(t.key.data(), t.key.length(), limit);
+}
+
+bool trie::aggregate_prefix(const char *prefix, size_t length,
+                            aggregate_type *result) const
+{
+    aggregate_type aggregate = {0, 0, INT32_MAX, INT32_MIN, 0};
+    cursor *keys = prefix_cursor(prefix, length);
+    while (keys->next()) {
+        aggregate.sum += keys->value();
+        aggregate.count++;
+        aggregate.min = std::min(aggregate.min, keys->value());
+        aggregate.max = std::max(aggregate.max, keys->value());
+    }
+    delete keys;
+    if (!aggregate.count)
+        return false;
+    *result = aggregate;
+    return true;
+}
+
+/// Returns true if bytes of a are less than bytes of b.
+static bool less_bytes(const char *a, size_t alength,
+                       const char *b, size_t blength)
+{
+    int retval = memcmp(a, b, std::min(alength, blength));
+    return retval < 0 || (retval == 0 && alength < blength);
+}
+
+/// Retrieves all keys of owner with their values, in the byte order.
+static void sort_keys(const trie &owner,
+                      std::vector<std::pair<std::string,
+                                            trie::value_type> > *keys)
+{
+    trie::cursor *all = owner.prefix_cursor("", 0);
+    while (all->next())
+        keys->push_back(std::make_pair(std::string(all->key(),
+                                                   all->length()),
+                                       all->value()));
+    delete all;
+    std::sort(keys->begin(), keys->end());
+}
+
+trie::size_type trie::rank(const char *inputs, size_t length) const
+{
+    size_type count = 0;
+    cursor *all = prefix_cursor("", 0);
+    while (all->next())
+        if (less_bytes(all->key(), all->length(), inputs, length))
+            ++count;
+    delete all;
+    return count;
+}
+
+bool trie::select(size_type rank, std::string *key, value_type *value) const
+{
+    if (key_id_size())
+        return key_of(rank, key, value);
+    std::vector<std::pair<std::string, value_type> > keys;
+    sort_keys(*this, &keys);
+    if (rank < 0 || static_cast<size_t>(rank) >= keys.size())
+        return false;
+    key->swap(keys[rank].first);
+    if (value)
+        *value = keys[rank].second;
+    return true;
+}
+
+size_t trie::range_search(const char *lo, size_t lo_length,
+                          const char *hi, size_t hi_length,
+                          key_callback found, void *context) const
+{
+    size_t count = 0;
+    if (key_id_size()) {
+        std::string key;
+        value_type value;
+        size_type last = rank(hi, hi_length);
+        for (size_type id = rank(lo, lo_length); id < last; id++) {
+            key_of(id, &key, &value);
+            found(key.data(), key.length(), value, context);
+            ++count;
+        }
+        return count;
+    }
+    std::vector<std::pair<std::string, value_type> > keys;
+    std::vector<std::pair<std::string, value_type> >::const_iterator it;
+    sort_keys(*this, &keys);
+    for (it = keys.begin(); it != keys.end(); it++) {
+        const std::string &key = it->first;
+        if (less_bytes(key.data(), key.length(), lo, lo_length))
+            continue;
+        if (!less_bytes(key.data(), key.length(), hi, hi_length))
+            break;
+        found(key.data(), key.length(), it->second, context);
+        ++count;
+    }
+    return count;
+}
+
+size_t trie::common_prefix_search(const char *inputs, size_t length,
+                                  prefix_result_type *result) const
+{
+    value_type value;
+    for (size_t i = 0; i <= length; i++)
+        if (search(inputs, i, &value))
+            result->push_back(std::make_pair(i, value));
+    return result->size();
+}
+
+bool trie::longest_prefix(const char *inputs, size_t length,
+                          size_t *matched, value_type *value) const
+{
+    size_t i = length + 1;
+    while (i-- > 0) {
+        if (search(inputs, i, value)) {
+            if (matched)
+                *matched = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+void trie::insert_bulk(std::vector<entry_type> *entries)
+{
+    std::vector<entry_type>::const_iterator it;
+    for (it = entries->begin(); it != entries->end(); it++)
+        insert(it->data, it->length, it->value);
+}
+
 void trie::read_from_text(const char *source, bool verbose)
 {
     FILE *file;
@@ -98,13 +442,15 @@ void trie::read_from_text(const char *source, bool verbose)
         char cstr[LINE_MAX];
         int val;
         size_t lineno = 0;
-        key_type key;
+        std::vector<char> keys;  // all keys stored back-to-back
+        std::vector<size_t> offsets;
+        std::vector<entry_type> entries;
         struct timezone tz;
         struct timeval total = {0, 0}, tv[2];
 
         if (verbose)
             std::cerr <<  "building";
-        snprintf(fmt, LINE_MAX, "%%d %%%d[^\n] ", LINE_MAX);
+        snprintf(fmt, LINE_MAX, "%%d %%%d[^\n] ", LINE_MAX - 1);
         while (!feof(file)) {
             if (verbose && lineno > 0) {
                 if (lineno % 500 == 0)
@@ -121,21 +467,26 @@ void trie::read_from_text(const char *source, bool verbose)
                 }
                 throw new bad_trie_source("format error");
             }
-            if (verbose)
-                gettimeofday(&tv[0], &tz);
-            key.assign(cstr, strlen(cstr));
-            insert(key, val);
-            if (verbose) {
-                gettimeofday(&tv[1], &tz);
-                total.tv_sec += tv[1].tv_sec - tv[0].tv_sec;
-                total.tv_usec += tv[1].tv_usec - tv[0].tv_usec;
-                while (total.tv_usec > 1000000) {
-                    total.tv_usec -= 1000000;
-                    total.tv_sec++;
-                }
-            }
+            entry_type entry = {NULL, strlen(cstr), val};
+            offsets.push_back(keys.size());
+            keys.insert(keys.end(), cstr, cstr + entry.length);
+            entries.push_back(entry);
         }
+        fclose(file);
+        // keys may have been moved while growing, so fix pointers up here
+        for (size_t i = 0; i < entries.size(); i++)
+            entries[i].data = &keys[0] + offsets[i];
+        if (verbose)
+            gettimeofday(&tv[0], &tz);
+        insert_bulk(&entries);
         if (verbose) {
+            gettimeofday(&tv[1], &tz);
+            total.tv_sec = tv[1].tv_sec - tv[0].tv_sec;
+            total.tv_usec = tv[1].tv_usec - tv[0].tv_usec;
+            if (total.tv_usec < 0) {
+                total.tv_usec += 1000000;
+                total.tv_sec--;
+            }
             std::cerr.precision(15);
             std::cerr << "..." << lineno << "." << std::endl
                       << "total insertion time = "
@@ -144,7 +495,6 @@ void trie::read_from_text(const char *source, bool verbose)
                       << (total.tv_sec * 1000000.0 + total.tv_usec) / lineno
                       << "us" << std::endl;
         }
-        fclose(file);
     } else {
         throw bad_trie_source("file error");
     }
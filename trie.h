@@ -31,6 +31,7 @@
 
 #include <map>
 #include <vector>
+#include <string>
 #include <cstdlib>
 #include <stdexcept>
 
@@ -96,15 +97,111 @@ class trie {
     /// Represents a key to access trie.
     class key_type;
 
+    /// Represents a key-value pair for insert_bulk.
+    typedef struct {
+        const char *data;  ///< Buffer of the key.
+        size_t length;     ///< Length of the key buffer.
+        value_type value;  ///< The value.
+    } entry_type;
+
     /// Represents a result set for prefix_search.
     //base["hell"]+o 可以简单认为hell为key,base[hell]为value
     typedef std::vector<std::pair<key_type, value_type> > result_type;
 
+    /// Represents keys found by common_prefix_search, as pairs of the
+    /// length of a key and its value.
+    typedef std::vector<std::pair<size_t, value_type> > prefix_result_type;
+
+    /// Represents a key found by fuzzy_search.
+    typedef struct {
+        const char *key;   ///< Bytes of the key, not null-terminated.
+        size_t length;     ///< Length of the key.
+        value_type value;  ///< Value of the key.
+        size_t distance;   ///< Edit distance between the key and input.
+    } fuzzy_match_type;
+
+    /// Called by fuzzy_search for every key found.
+    typedef void (*fuzzy_callback)(const fuzzy_match_type &match,
+                                   void *context);
+
+    /// Represents values of keys below a prefix, see aggregate_prefix.
+    typedef struct {
+        int64_t sum;       ///< Sum of values.
+        size_type count;   ///< Number of keys.
+        value_type min;    ///< Minimum value.
+        value_type max;    ///< Maximum value.
+        size_type unused;  ///< for 32/64 bits compatible.
+    } aggregate_type;
+
+    /// Called by range_search for every key found.
+    typedef void (*key_callback)(const char *key, size_t length,
+                                 value_type value, void *context);
+
+    /**
+     * Walks keys below a prefix one at a time, see prefix_cursor.
+     * Moving to the next key reuses the buffer of the current one, so
+     * key() is valid until next() is called again.
+     */
+    class cursor {
+      public:
+        cursor(): value_(0) {}
+
+        virtual ~cursor() {}
+
+        /**
+         * Moves to the next key.
+         *
+         * @return false if there is no more key.
+         */
+        virtual bool next() = 0;
+
+        /// Returns bytes of the current key, not null-terminated.
+        const char *key() const
+        {
+            return key_.data();
+        }
+
+        /// Returns the length of the current key.
+        size_t length() const
+        {
+            return key_.length();
+        }
+
+        /// Returns the value of the current key.
+        value_type value() const
+        {
+            return value_;
+        }
+
+      protected:
+        std::string key_;   ///< Bytes of the current key.
+        value_type value_;  ///< Value of the current key.
+    };
+
+    /**
+     * Keeps the progress of a walk along a key, one byte at a time, see
+     * step. It is a plain value, so a copy saves the walk and restoring
+     * the copy goes back, as a backspace does. A traversal is valid
+     * until the trie changes.
+     */
+    class traversal_type {
+      public:
+        traversal_type(): state(0), tail(0) {}
+
+        std::string key;  ///< Bytes stepped so far.
+        size_type state;  ///< State reached, 0 for the root.
+        size_type tail;   ///< Position in a tail or rear trie, 0 if none.
+    };
+
     /// Represents a trie type.
     enum trie_type {
         UNKNOW = 0,   /**< Unknow. */
         SINGLE_TRIE,  /**< Tail Trie. */
-        DOUBLE_TRIE   /**< Two Trie. */
+        DOUBLE_TRIE,  /**< Two Trie. */
+        COMPACT_TRIE, /**< Compact Trie, only built by insert_bulk. */
+        DAWG_TRIE,    /**< Minimal automaton, only built by insert_bulk. */
+        AC_TRIE,      /**< Aho-Corasick automaton, only built by insert_bulk. */
+        SHARDED_TRIE  /**< Shards of two tries, see sharded_trie. */
     };
 
 
@@ -155,6 +252,10 @@ class trie {
     /**
      * Retrieves a value_type from trie using a c-style string as key
      *
+     * The default implementation converts the key into a key_type.
+     * Tries built on double-arrays override it to walk the bytes
+     * directly, without any allocation.
+     *
      * @param inputs Buffer of the key.
      * @param length Length of the key buffer.
      * @param value The value_type.
@@ -163,15 +264,335 @@ class trie {
     virtual bool search(const char *inputs, size_t length,
                         value_type *value) const;
 
+    /**
+     * Retrieves values of many keys at once.
+     *
+     * The default implementation searches keys one by one. Tries built
+     * on double-arrays walk a group of keys in lockstep instead and
+     * prefetch the next state of each key, so the cache misses of
+     * different keys overlap.
+     *
+     * @param keys The keys.
+     * @param n Number of keys.
+     * @param[out] values values[i] is set if keys[i] is found.
+     * @param[out] found found[i] tells whether keys[i] is found.
+     * @return The number of keys found.
+     */
+    virtual size_t search_batch(const key_type *keys, size_t n,
+                                value_type *values, bool *found) const;
+
+    /**
+     * Retrieves values of many c-style keys at once.
+     *
+     * @param inputs Buffers of the keys.
+     * @param lengths Lengths of the key buffers.
+     * @param n Number of keys.
+     * @param[out] values values[i] is set if key i is found.
+     * @param[out] found found[i] tells whether key i is found.
+     * @return The number of keys found.
+     */
+    virtual size_t search_batch(const char *const *inputs,
+                                const size_t *lengths, size_t n,
+                                value_type *values, bool *found) const;
+
+    /**
+     * Stores many key-value pairs at once.
+     *
+     * The default implementation inserts entries one by one. Tries
+     * that are still empty override it to sort the entries and place
+     * every state exactly once, which avoids all relocations. When a
+     * key appears more than once, the last one wins.
+     *
+     * @param[in,out] entries The key-value pairs. They may be reordered.
+     */
+    virtual void insert_bulk(std::vector<entry_type> *entries);
+
+    /**
+     * Sets the number of threads used by insert_bulk of an empty trie.
+     * Keys are sorted by buckets of their first byte, and subtrees are
+     * built into separate double-arrays which are then stitched into
+     * one. Tries which do not support it ignore this.
+     *
+     * @param threads Number of threads, 1 builds in the calling thread.
+     */
+    virtual void set_build_threads(size_t threads) {}
+
+    /**
+     * Asks build to record the maximum value below every state in the
+     * archive, which lets top_k skip subtrees that can not make it into
+     * the result. It costs one value_type per state. Tries which do not
+     * support it ignore this.
+     *
+     * @param record Records maximum values if it sets to true.
+     */
+    virtual void record_max_values(bool record) {}
+
+    /**
+     * Asks build to record the number, sum, minimum and maximum of
+     * values of keys below every state in the archive, so that
+     * aggregate_prefix only walks along the prefix. It costs one
+     * aggregate_type per state. Tries which do not support it ignore
+     * this.
+     *
+     * @param record Records aggregates if it sets to true.
+     */
+    virtual void record_aggregates(bool record) {}
+
+    /**
+     * Asks build to number keys from 0 to n - 1 in the byte order of
+     * keys, shorter keys first, so that features of keys can be kept in
+     * external arrays. The archive records the id of the first key
+     * below every state, which is the number of keys before the state,
+     * and the leaf of every id. key_of restores a key by walking back
+     * from its leaf to the root, and rank adds nothing to a walk along
+     * the key but sibling lookups. It costs one size_type per state and
+     * one per key. Tries which do not support it ignore this.
+     *
+     * @param record Records key ids if it sets to true.
+     */
+    virtual void record_key_ids(bool record) {}
+
+    /// Returns the number of key ids recorded, 0 if there is none.
+    virtual size_t key_id_size() const
+    {
+        return 0;
+    }
+
+    /**
+     * Restores the key of an id recorded by record_key_ids.
+     *
+     * @param id The id.
+     * @param[out] key Bytes of the key.
+     * @param[out] value The value of the key, if not NULL.
+     * @return false if id is out of range or there is no id recorded.
+     */
+    virtual bool key_of(size_type id, std::string *key,
+                        value_type *value = NULL) const
+    {
+        return false;
+    }
+
+    /**
+     * Retrieves the id of a key recorded by record_key_ids.
+     *
+     * @param inputs Buffer of the key.
+     * @param length Length of the key buffer.
+     * @param[out] id The id if found.
+     * @return false if the key does not exist or there is no id
+     *         recorded.
+     */
+    virtual bool id_of(const char *inputs, size_t length,
+                       size_type *id) const
+    {
+        return false;
+    }
+
+    /**
+     * Retrieves the number, sum, minimum and maximum of values of keys
+     * which start with prefix. Archives built with record_aggregates
+     * read them at the state reached by prefix, the default
+     * implementation walks all keys below prefix.
+     *
+     * @param prefix Buffer of the prefix.
+     * @param length Length of the prefix buffer.
+     * @param[out] result The aggregates.
+     * @return false if no key starts with prefix.
+     */
+    virtual bool aggregate_prefix(const char *prefix, size_t length,
+                                  aggregate_type *result) const;
+
+    /// Returns the number of keys which start with prefix.
+    size_t count_prefix(const char *prefix, size_t length) const
+    {
+        aggregate_type aggregate;
+        return aggregate_prefix(prefix, length, &aggregate)
+               ?aggregate.count:0;
+    }
+
+    /**
+     * Counts keys before given input in the byte order of keys, shorter
+     * keys first. It is the id the input has or would have. Archives
+     * with key ids walk along the input once, the default
+     * implementation compares input with every key.
+     *
+     * @param inputs Buffer of the input.
+     * @param length Length of the input buffer.
+     * @return The number of keys less than input.
+     */
+    virtual size_type rank(const char *inputs, size_t length) const;
+
+    /**
+     * Retrieves the key of a given rank in the byte order of keys, the
+     * key with id rank when key ids are recorded. The default
+     * implementation sorts all keys.
+     *
+     * @param rank Number of keys before the key.
+     * @param[out] key Bytes of the key.
+     * @param[out] value The value of the key, if not NULL.
+     * @return false if rank is out of range.
+     */
+    virtual bool select(size_type rank, std::string *key,
+                        value_type *value = NULL) const;
+
+    /**
+     * Retrieves keys from lo up to but not including hi in the byte
+     * order of keys. Archives with key ids find the ranks of lo and hi
+     * and restore the keys between them, the default implementation
+     * sorts all keys.
+     *
+     * @param lo Buffer of the first key of the range.
+     * @param lo_length Length of lo.
+     * @param hi Buffer of the end of the range.
+     * @param hi_length Length of hi.
+     * @param found Called for every key in order.
+     * @param context Passed to found.
+     * @return The number of keys found.
+     */
+    virtual size_t range_search(const char *lo, size_t lo_length,
+                                const char *hi, size_t hi_length,
+                                key_callback found, void *context) const;
+
     /**
      * Retrieves all key-value pairs match given prefix.
      *
      * @param key The prefix.
-     * @param[out] result Result set contains the existing keys.
+     * @param[out] result The keys are appended, pairs already in it
+     *                    are kept.
      * @return The number of elements in the result set.
      */
     virtual size_t prefix_search(const key_type &key,
                                  result_type *result) const = 0;
+
+    /**
+     * Creates a cursor walking keys which start with prefix, in the
+     * order of prefix_search. Keys are found one by one as next() is
+     * called, so stopping early leaves the rest of the subtree alone.
+     *
+     * A walk can be continued later by passing the last key returned
+     * as after, then the new cursor starts right behind it. Tries built
+     * on double-arrays walk states with an explicit stack. The default
+     * implementation runs prefix_search and walks the result.
+     *
+     * @param prefix Buffer of the prefix.
+     * @param length Length of the prefix buffer.
+     * @param limit Maximum number of keys to return, 0 for no limit.
+     * @param after Continuation, a key returned by an earlier cursor
+     *              with the same prefix, or NULL to start from the
+     *              first key.
+     * @param after_length Length of after.
+     * @return The cursor, to be deleted by the caller before the trie.
+     */
+    virtual cursor *prefix_cursor(const char *prefix, size_t length,
+                                  size_t limit = 0, const char *after = NULL,
+                                  size_t after_length = 0) const;
+
+    /**
+     * Retrieves k keys with the largest values among keys which start
+     * with prefix, the largest first. Keys with the same value come in
+     * no particular order.
+     *
+     * Archives built with record_max_values search best-first, always
+     * expanding the subtree with the largest maximum value, so only
+     * the branches leading to the result are visited. The default
+     * implementation walks prefix_cursor and keeps the k largest.
+     *
+     * @param prefix Buffer of the prefix.
+     * @param length Length of the prefix buffer.
+     * @param k Maximum number of keys.
+     * @param[out] result The keys are appended.
+     * @return The number of elements in the result set.
+     */
+    virtual size_t top_k(const char *prefix, size_t length, size_t k,
+                         result_type *result) const;
+
+    /**
+     * Finds all keys within an edit distance of given input, counting
+     * insertions, deletions and substitutions of bytes. Tries built on
+     * double-arrays keep one row of the edit distance table per depth
+     * while walking states, so a subtree is left as soon as no cell of
+     * its row is within distance, and keys sharing a prefix share its
+     * rows. Rests of keys stored in tails are compared the same way.
+     * The default implementation compares input with every key.
+     *
+     * @param inputs Buffer of the input.
+     * @param length Length of the input buffer.
+     * @param distance Maximum edit distance.
+     * @param found Called for every key found, in no particular order.
+     * @param context Passed to found.
+     * @return The number of keys found.
+     */
+    virtual size_t fuzzy_search(const char *inputs, size_t length,
+                                size_t distance, fuzzy_callback found,
+                                void *context) const;
+
+    /**
+     * Moves a traversal one byte further, so a typeahead pays one
+     * transition per keystroke instead of walking again from the root.
+     * Tries built on double-arrays keep the state reached, and the
+     * position in a tail or rear trie once the key is the only one
+     * left. The default implementation looks for a key starting with
+     * the bytes stepped.
+     *
+     * @param t The traversal, default-constructed to start at the root.
+     * @param ch The next byte.
+     * @return false if no key continues with ch, t is then unchanged.
+     */
+    virtual bool step(traversal_type *t, char ch) const;
+
+    /**
+     * Retrieves the value of the key ending where a traversal stands.
+     *
+     * @param t The traversal.
+     * @param[out] result The value if found.
+     * @return true if a key ends there.
+     */
+    virtual bool value(const traversal_type &t, value_type *result) const;
+
+    /// Returns true if a key ends where a traversal stands.
+    bool is_terminal(const traversal_type &t) const
+    {
+        return value(t, NULL);
+    }
+
+    /**
+     * Creates a cursor walking keys which start with the bytes stepped
+     * by a traversal, as prefix_cursor does but without walking them
+     * again.
+     *
+     * @param t The traversal.
+     * @param limit Maximum number of keys to return, 0 for no limit.
+     * @return The cursor, to be deleted by the caller before the trie.
+     */
+    virtual cursor *enumerate(const traversal_type &t,
+                              size_t limit = 0) const;
+
+    /**
+     * Retrieves all keys which are prefixes of given input, shortest
+     * first. Tries built on double-arrays find them in one walk along
+     * the input, the default implementation searches every prefix.
+     *
+     * @param inputs Buffer of the input.
+     * @param length Length of the input buffer.
+     * @param[out] result Lengths and values of the keys are appended.
+     * @return The number of elements in the result set.
+     */
+    virtual size_t common_prefix_search(const char *inputs, size_t length,
+                                        prefix_result_type *result) const;
+
+    /**
+     * Retrieves the longest key which is a prefix of given input. Tries
+     * built on double-arrays find it in one walk along the input, the
+     * default implementation searches prefixes from the longest one.
+     *
+     * @param inputs Buffer of the input.
+     * @param length Length of the input buffer.
+     * @param[out] matched Length of the key.
+     * @param[out] value The value of the key.
+     * @return true if found.
+     */
+    virtual bool longest_prefix(const char *inputs, size_t length,
+                                size_t *matched, value_type *value) const;
+
     /**
      * Builds a trie archive.
      *
@@ -211,6 +632,20 @@ class trie {
      * @param archive The filename of the archive.
      */
     static trie *create_trie(const char *archive);
+
+    /**
+     * Returns the type of a trie archive by its magic.
+     *
+     * @param archive The filename of the archive.
+     */
+    static trie_type find_archive_type(const char *archive);
+
+    /**
+     * Orders keys the way tries walk them, by bytes, with a key after
+     * the keys it prefixes.
+     */
+    static bool walk_less(const char *lhs, size_t lhs_length,
+                          const char *rhs, size_t rhs_length);
 };
 
 /**
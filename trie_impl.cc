@@ -26,8 +26,18 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  *
  */
+#include <pthread.h>
+#include <sched.h>
+
 #include <iostream>
+#include <exception>
 #include <cstdio>
+#include <queue>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
 
 #include "trie_impl.h"
 
@@ -41,11 +51,31 @@ BEGIN_TRIE_NAMESPACE
 
 const char double_trie::magic_[16] = "TWO_TRIE";
 const char single_trie::magic_[16] = "TAIL_TRIE";
+const char compact_trie::magic_[16] = "COMPACT_TRIE";
+const char dawg_trie::magic_[16] = "DAWG_TRIE";
+const char ac_trie::magic_[16] = "AC_TRIE";
+const char delta_trie::magic_[16] = "DELTA_TRIE";
+const char sharded_trie::magic_[16] = "SHARDED_TRIE";
 
 // ************************************************************************
 // * Implementation of helper functions                                   *
 // ************************************************************************
 
+/**
+ * Returns the end of an array of count T at start, or throws if it runs
+ * past end, the end of a mapped archive.
+ */
+template<typename T>
+static T *archive_extent(T *start, trie::size_type count, const void *end)
+{
+    const char *first = reinterpret_cast<const char *>(start);
+    if (count < 0 || first > static_cast<const char *>(end)
+        || static_cast<size_t>(static_cast<const char *>(end) - first)
+           / sizeof(T) < static_cast<size_t>(count))
+        throw std::runtime_error("file corrupted");
+    return start + count;
+}
+
 static const char* pretty_size(size_t size, char *buf, size_t buflen)
 {
     assert(buf);
@@ -63,940 +93,6261 @@ static const char* pretty_size(size_t size, char *buf, size_t buflen)
     return buf;
 }
 
-trie::~trie()
+/// Shared state of run_parallel.
+typedef struct {
+    void (*run)(size_t, void *);  ///< The job.
+    void *context;                ///< Argument of run.
+    size_t next;                  ///< Next job to run.
+    size_t count;                 ///< Number of jobs.
+    std::exception_ptr error;     ///< First exception thrown by a job.
+    pthread_mutex_t mutex;        ///< Guards next and error.
+} pool_type;
+
+static void *pool_worker(void *arg)
 {
+    pool_type *pool = static_cast<pool_type *>(arg);
+    while (true) {
+        pthread_mutex_lock(&pool->mutex);
+        size_t job = pool->next++;
+        bool failed = static_cast<bool>(pool->error);
+        pthread_mutex_unlock(&pool->mutex);
+        if (job >= pool->count || failed)
+            break;
+        try {
+            pool->run(job, pool->context);
+        } catch (...) {
+            pthread_mutex_lock(&pool->mutex);
+            if (!pool->error)
+                pool->error = std::current_exception();
+            pthread_mutex_unlock(&pool->mutex);
+        }
+    }
+    return NULL;
 }
 
-// ************************************************************************
-// * Implementation of basic_trie                                         *
-// ************************************************************************
-
-basic_trie::basic_trie(size_type size,
-                       trie_relocator_interface<size_type> *relocator)
-    :header_(NULL), states_(NULL), last_base_(0), max_state_(0), owner_(true),
-     relocator_(relocator)
+/**
+ * Runs jobs 0, 1, ..., count - 1 on a pool of threads. Each thread
+ * takes the next job until all of them are done, so jobs should be
+ * ordered from the largest one. The calling thread works too.
+ *
+ * @param threads Number of threads.
+ * @param count Number of jobs.
+ * @param run The job, called with its index and context.
+ * @param context Argument of run.
+ * @throw The first exception thrown by a job, once all threads stop.
+ */
+static void run_parallel(size_t threads, size_t count,
+                         void (*run)(size_t, void *), void *context)
 {
-    if (size < key_type::kCharsetSize)
-        size = kDefaultStateSize;
-    header_ = new header_type();
-    memset(header_, 0, sizeof(header_type));
-    resize_state(size);
+    pool_type pool = {run, context, 0, count, std::exception_ptr(),
+                      PTHREAD_MUTEX_INITIALIZER};
+    std::vector<pthread_t> workers;
+    size_t i;
+
+    for (i = 1; i < threads && i < count; i++) {
+        pthread_t worker;
+        if (pthread_create(&worker, NULL, pool_worker, &pool) != 0)
+            break;
+        workers.push_back(worker);
+    }
+    pool_worker(&pool);
+    for (i = 0; i < workers.size(); i++)
+        pthread_join(workers[i], NULL);
+    pthread_mutex_destroy(&pool.mutex);
+    if (pool.error)
+        std::rethrow_exception(pool.error);
 }
 
-basic_trie::basic_trie(void *header, void *states)
-    :header_(NULL), states_(NULL), last_base_(0), max_state_(0), owner_(false),
-     relocator_(NULL)
+/// Orders entries of insert_bulk by their keys.
+static bool entry_less(const trie::entry_type &lhs, const trie::entry_type &rhs)
 {
-    header_ = static_cast<header_type *>(header);
-    states_ = static_cast<state_type *>(states);
+    int retval = memcmp(lhs.data, rhs.data, std::min(lhs.length, rhs.length));
+    return (retval < 0 || (retval == 0 && lhs.length < rhs.length));
 }
 
-basic_trie::basic_trie(const basic_trie &trie)
-    :header_(NULL), states_(NULL), last_base_(0), max_state_(0), owner_(false),
-     relocator_(NULL)
+/// Returns true if two entries of insert_bulk have the same key.
+static bool entry_equal(const trie::entry_type &lhs,
+                        const trie::entry_type &rhs)
 {
-    clone(trie);
+    return (lhs.length == rhs.length
+            && memcmp(lhs.data, rhs.data, lhs.length) == 0);
 }
 
-basic_trie &basic_trie::operator=(const basic_trie &trie)
+/// Buckets of entries sorted by sort_entries.
+typedef struct {
+    std::vector<trie::entry_type> *entries;  ///< All entries.
+    std::vector<size_t> first;               ///< First entry of buckets.
+    std::vector<size_t> order;               ///< Buckets, largest first.
+} bucket_type;
+
+static void sort_bucket(size_t job, void *context)
 {
-    clone(trie);
-    return *this;
+    bucket_type *buckets = static_cast<bucket_type *>(context);
+    size_t b = buckets->order[job];
+    std::stable_sort(buckets->entries->begin() + buckets->first[b],
+                     buckets->entries->begin() + buckets->first[b + 1],
+                     entry_less);
 }
 
-void basic_trie::clone(const basic_trie &trie)
+/// Orders buckets by size descending.
+class bucket_greater {
+  public:
+    explicit bucket_greater(const std::vector<size_t> &first)
+        :first_(first)
+    {
+    }
+
+    bool operator()(size_t lhs, size_t rhs) const
+    {
+        return first_[lhs + 1] - first_[lhs] > first_[rhs + 1] - first_[rhs];
+    }
+
+  private:
+    const std::vector<size_t> &first_;
+};
+
+/**
+ * Sorts entries of insert_bulk by key and removes duplicated keys. The
+ * last value of a duplicated key wins, like what insert does.
+ *
+ * With more than one thread, entries are distributed stably into 257
+ * buckets by their first byte (an empty key comes first), and buckets
+ * are sorted on a pool of threads.
+ *
+ * @param[in,out] entries The entries.
+ * @param threads Number of threads.
+ */
+static void sort_entries(std::vector<trie::entry_type> *entries,
+                         size_t threads = 1)
 {
-    if (owner_) {
-        if (header_) {
-            sanity_delete(header_);
+    if (std::is_sorted(entries->begin(), entries->end(), entry_less)) {
+        // nothing to do
+    } else if (threads > 1) {
+        bucket_type buckets;
+        std::vector<trie::entry_type> sorted(entries->size());
+        std::vector<size_t> next(258, 0);
+        size_t i, b;
+
+        for (i = 0; i < entries->size(); i++) {
+            const trie::entry_type &entry = (*entries)[i];
+            ++next[entry.length?static_cast<uint8_t>(entry.data[0]) + 2:1];
         }
-        if (states_) {
-            resize(states_, 0, 0);
-            states_ = NULL;  // set to NULL for next resize
+        for (b = 1; b < next.size(); b++)
+            next[b] += next[b - 1];
+        buckets.first = next;
+        for (i = 0; i < entries->size(); i++) {
+            const trie::entry_type &entry = (*entries)[i];
+            b = entry.length?static_cast<uint8_t>(entry.data[0]) + 1:0;
+            sorted[next[b]++] = entry;
         }
+        entries->swap(sorted);
+        buckets.entries = entries;
+        for (b = 0; b + 1 < buckets.first.size(); b++)
+            if (buckets.first[b + 1] - buckets.first[b] > 1)
+                buckets.order.push_back(b);
+        std::sort(buckets.order.begin(), buckets.order.end(),
+                  bucket_greater(buckets.first));
+        run_parallel(threads, buckets.order.size(), sort_bucket, &buckets);
+    } else {
+        std::stable_sort(entries->begin(), entries->end(), entry_less);
     }
-    owner_ = true;
-    max_state_ = trie.max_state();
-    header_ = new header_type();
-    states_ = resize(states_, 0, trie.header()->size);
-    memcpy(header_, trie.header(), sizeof(header_type));
-    memcpy(states_, trie.states(), trie.header()->size * sizeof(state_type));
-}
-
-basic_trie::~basic_trie()
-{
-    if (owner_) {
-        sanity_delete(header_);
-        resize(states_, 0, 0);  // free states_
+    size_t i, n = 0;
+    for (i = 0; i < entries->size(); i++) {
+        if (n > 0 && entry_equal((*entries)[n - 1], (*entries)[i]))
+            (*entries)[n - 1] = (*entries)[i];
+        else
+            (*entries)[n++] = (*entries)[i];
     }
+    entries->resize(n);
 }
 
-//返回可用的偏移基址，但并没有对base,check写入
-trie::size_type
-basic_trie::find_base(const char_type *inputs, const extremum_type &extremum)
-{
-    bool found;
-    size_type i;
-    const char_type *p;
+/// Accesses the char_types of sorted entries of insert_bulk.
+class entry_label {
+  public:
+    typedef trie::char_type char_type;
 
-    for (i = last_base_, found = false; !found; /* empty */) {
-        i++;
-        if (i + extremum.max >= header_->size)
-            resize_state(extremum.max);
-        if (check(i + extremum.min) <= 0 && check(i + extremum.max) <= 0) {
-            for (p = inputs, found = true; *p; p++) {
-                if (check(i + *p) > 0) {
-                    found = false;
-                    break;
-                }
-            }
-        } else {
-            //  i += extremum.min;
-        }
+    explicit entry_label(const std::vector<trie::entry_type> &entries)
+        :entries_(entries)
+    {
     }
 
-    last_base_ = (i > 256)?i - 255:i;
+    /// Returns the number of char_types of key i, including terminator.
+    size_t length(size_t i) const
+    {
+        return entries_[i].length + 1;
+    }
 
-    return i;
-}
+    /// Returns the d(th) char_type of key i.
+    char_type label(size_t i, size_t d) const
+    {
+        if (d < entries_[i].length)
+            return trie::key_type::char_in(entries_[i].data[d]);
+        return trie::key_type::kTerminator;
+    }
 
-trie::size_type
-basic_trie::relocate(size_type stand,
-                     size_type s,
-                     const char_type *inputs,
-                     const extremum_type &extremum)
-{
-    size_type obase, nbase, i;
-    char_type targets[key_type::kCharsetSize + 1];
+  private:
+    const std::vector<trie::entry_type> &entries_;
+};
 
-    obase = base(s);  // save old base value
-    nbase = find_base(inputs, extremum);  // find a new base
+/// Accesses keys of search_batch given as key_types.
+class key_label {
+  public:
+    typedef trie::char_type char_type;
 
-    for (i = 0; inputs[i]; i++) {
-        if (check(obase + inputs[i]) != s)  // find old links
-            continue;
-        set_base(nbase + inputs[i], base(obase + inputs[i]));//保证子状态偏移基址不变，不影响后--后面状态的状态编号,即存储位置不变，不用更新
-        set_check(nbase + inputs[i], check(obase + inputs[i]));//父状态号s没有改变，改变的是父状态的偏移基址
-        find_exist_target(obase + inputs[i], targets, NULL);//找到原来的孙子状态编号(因为子状态偏移基址不变，所以孙子状态编号也不变)
-        //因为子状态编号变了，所以孙子状态的父状态编号要更新
-        for (char_type *p = targets; *p; p++) {
-            set_check(base(obase + inputs[i]) + *p, nbase + inputs[i]);
-        }
-        // if where we are standing is moving, we move with it
-        if (stand == obase + inputs[i])
-            stand = nbase + inputs[i];
-        if (relocator_)
-            relocator_->relocate(obase + inputs[i], nbase + inputs[i]);
-        // free old places
-        set_base(obase + inputs[i], 0);
-        set_check(obase + inputs[i], 0);
-        // create new links according old ones
+    explicit key_label(const trie::key_type *keys)
+        :keys_(keys)
+    {
     }
-    // finally, set new base
-    set_base(s, nbase);
 
-    return stand;
-}
+    /// Returns the number of char_types of key i, including terminator.
+    size_t length(size_t i) const
+    {
+        return keys_[i].length() + 1;
+    }
 
-//包含了解决冲突的情况
-trie::size_type
-basic_trie::create_transition(size_type s, char_type ch)
-{
-    char_type targets[key_type::kCharsetSize + 1];
-    char_type parent_targets[key_type::kCharsetSize + 1];
-    extremum_type extremum = {0, 0}, parent_extremum = {0, 0};
+    /// Returns the d(th) char_type of key i.
+    char_type label(size_t i, size_t d) const
+    {
+        return keys_[i].data()[d];
+    }
 
-    size_type t = next(s, ch);
-    if (t >= header_->size)
-        resize_state(t - header_->size + 1);
+  private:
+    const trie::key_type *keys_;
+};
 
-    if (base(s) > 0 && check(t) <= 0) {//base[s]>0,意味着s还不是终点（构成了一个词）
-        // Do Nothing !!
-    } else {
-        //解决冲突，改变base[s],还是改变base[check[t]],取决于谁的下一个状态数少，就改变谁的base[]，这样操作更少
-        size_type num_targets =
-            find_exist_target(s, targets, &extremum);
-        size_type num_parent_targets = check(t)?
-            find_exist_target(check(t), parent_targets, &parent_extremum):0;
-        if (num_parent_targets > 0 && num_targets + 1 > num_parent_targets) {
-            //s比check[t]的目标状态多，改变base[check[t]]
-            s = relocate(s, check(t), parent_targets, parent_extremum);
-        } else {
-            targets[num_targets++] = ch;
-            targets[num_targets] = 0;
-            if (ch > extremum.max || !extremum.max)
-                extremum.max = ch;
-            if (ch < extremum.min || !extremum.min)
-                extremum.min = ch;
-            s = relocate(s, s, targets, extremum);
-        }
-        t = next(s, ch);
-        if (t >= header_->size)
-            resize_state(t - header_->size + 1);
+/// Accesses keys of search_batch given as c-style buffers.
+class byte_label {
+  public:
+    typedef trie::char_type char_type;
+
+    byte_label(const char *const *inputs, const size_t *lengths)
+        :inputs_(inputs), lengths_(lengths)
+    {
     }
-    set_check(t, s);
 
-    return t;
-}
-//value不是偏移基址?
-//关键词key(比如"hello")所设置的value就是base[hello]里的值，所以value代表key所对应的偏移基址。
-void basic_trie::insert(const key_type &key, const value_type &value)
-{
-    //value为偏移基址
-    if (value < 1)
-        throw std::runtime_error("basic_trie::insert: value must > 0");
+    /// Returns the number of char_types of key i, including terminator.
+    size_t length(size_t i) const
+    {
+        return lengths_[i] + 1;
+    }
 
-    const char_type *p = NULL;
-    size_type s = go_forward(1, key.data(), &p);
-    do {
-        s = create_transition(s, *p);
-    } while (*p++ != key_type::kTerminator);
-    //s对应abcdef(Terminator)，value设置为负值，代表单词结束标记？不可为负，必须大于0
-    set_base(s, value);
-}
+    /// Returns the d(th) char_type of key i.
+    char_type label(size_t i, size_t d) const
+    {
+        if (d < lengths_[i])
+            return trie::key_type::char_in(inputs_[i][d]);
+        return trie::key_type::kTerminator;
+    }
 
-//value对应key状态的偏移基址,并不是？并不是，value是与key对应的值，比如员工编号，解释含义的下标
-bool basic_trie::search(const key_type &key, value_type *value) const
-{
-    const char_type *p = NULL;
-    size_type s = go_forward(1, key.data(), &p);
-    if (p)
-        return false;
-    if (value)
-        *value = base(s);
-    return true;
-}
+  private:
+    const char *const *inputs_;
+    const size_t *lengths_;
+};
 
-size_t
-basic_trie::prefix_search(const key_type &prefix, result_type *result) const
-{
-    const char_type *p;
-    size_type s = go_forward(1, prefix.data(), &p);
-    key_type store(prefix);
-    prefix_search_aux(s, p, &store, result);
-    return result->size();
-}
-//保存前缀(对应状态s)后面的所有到终点的分支，和对应的base值,即查找所有前缀是s的key及base值
-size_t basic_trie::prefix_search_aux(size_type s,
-                                     const char_type *miss,
-                                     key_type *store,
-                                     result_type *result) const
-{
-    char_type targets[key_type::kCharsetSize + 1];
+/// Number of keys walked in lockstep by forward_batch.
+static const size_t kBatchWidth = 16;
 
-    if (find_exist_target(s, targets, NULL)) {
-        for (char_type *p = targets; *p; p++) {
-            if (miss && *miss != key_type::kTerminator && *miss != *p)
-                continue;
-            size_type t = next(s, *p);
-            store->push(*p);
-            if (!miss || *miss == key_type::kTerminator)
-                prefix_search_aux(t, miss, store, result);
-            else
-                prefix_search_aux(t, miss + 1, store, result);
-            store->pop();
-        }
-    } else {
-        result->push_back(std::pair<key_type, value_type>(*store, base(s)));
-    }
-    return 0;
-}
+/// Number of keys handled by one round of search_batch.
+static const size_t kBatchSize = 256;
 
-//打印从s开始所有字符串
-void basic_trie::trace(size_type s) const
+/**
+ * Walks keys first, first + 1, ..., last - 1 from the root of btrie as
+ * go_forward does, but kBatchWidth keys at a time in turn. Once a key
+ * moves, the state it needs next is prefetched, and it is not touched
+ * again before the other keys have moved.
+ *
+ * @param btrie The basic_trie.
+ * @param label Accessor of char_types of keys.
+ * @param first The first key.
+ * @param last One after the last key.
+ * @param[out] states states[i - first] is the last state arrived by key i.
+ * @param[out] depths depths[i - first] is the number of char_types key i
+ *                    consumed. It is label.length(i) if key i reached
+ *                    the state after its terminator.
+ */
+template<typename L>
+static void forward_batch(const basic_trie &btrie, const L &label,
+                          size_t first, size_t last,
+                          trie::size_type *states, size_t *depths)
 {
-    size_type num_target;
-    char_type targets[key_type::kCharsetSize + 1];
-    static std::vector<size_type> trace_stack;
+    typedef struct {
+        size_t key;             ///< Index of the key.
+        size_t depth;           ///< Number of char_types consumed.
+        size_t length;          ///< Length of the key with terminator.
+        trie::size_type state;  ///< The state arrived.
+    } lane_type;
 
-    trace_stack.push_back(s);
-    if ((num_target = find_exist_target(s, targets, NULL))) {
-        for (char_type *p = targets; *p; p++) {
-            size_type t = next(s, *p);
-            if (t < header_->size)
-                trace(next(s, *p));
+    const basic_trie::state_type *base = btrie.states();
+    lane_type lanes[kBatchWidth];
+    size_t k, active = 0, next = first;
+
+    while (active || next < last) {
+        while (active < kBatchWidth && next < last) {
+            lane_type lane = {next, 0, label.length(next), 1};
+            __builtin_prefetch(base + btrie.next(1, label.label(next, 0)));
+            lanes[active++] = lane;
+            next++;
         }
-    } else {
-        size_type cbase = 0, obase = 0;
-        std::cerr << "transition => ";
-        std::vector<size_type>::const_iterator it;
-        for (it = trace_stack.begin();it != trace_stack.end(); it++) {
-            cbase = base(*it);
-            if (obase) {
-                if (*it - obase == key_type::kTerminator) {
-                    std::cerr << "-#->";
-                } else {
-                    char ch = key_type::char_out(*it - obase);
-                    if (isgraph(ch))
-                        std::cerr << "-'" << ch << "'->";
-                    else
-                        std::cerr << "-<" << std::hex
-                                  << static_cast<uint8_t>(ch) << ">->";
+        for (k = 0; k < active; ) {
+            lane_type &lane = lanes[k];
+            trie::size_type t = btrie.next(lane.state,
+                                           label.label(lane.key, lane.depth));
+            bool moved = btrie.check_transition(lane.state, t);
+            if (moved) {
+                lane.state = t;
+                if (++lane.depth < lane.length) {
+                    if (btrie.base(t) > 0)
+                        __builtin_prefetch(base + btrie.next(t, label.label(
+                                           lane.key, lane.depth)));
+                    k++;
+                    continue;
                 }
             }
-            std::clog << *it << "[" << cbase << "]";
-            obase = cbase;
+            states[lane.key - first] = lane.state;
+            depths[lane.key - first] = lane.depth;
+            lane = lanes[--active];
         }
-        std::cerr << "->{" << std::dec << (cbase) << "}" << std::endl;
     }
-    trace_stack.pop_back();
 }
 
-// ************************************************************************
-// * Implementation of two trie                                           *
-// ************************************************************************
+/// Appends keys found by find_prefixes to a result set.
+struct prefix_collector {
+    trie::prefix_result_type *result;  ///< The result set.
 
-double_trie::double_trie(size_t size)
-    :header_(NULL), lhs_(NULL), rhs_(NULL), index_(NULL), accept_(NULL),
-     next_accept_(1), next_index_(1), front_relocator_(NULL),
-     rear_relocator_(NULL), mmap_(NULL), mmap_size_(0)
-{
-    header_ = new header_type();
-    memset(header_, 0, sizeof(header_type));
-    snprintf(header_->magic, sizeof(header_->magic), "%s", magic_);
-    front_relocator_ = new trie_relocator<double_trie>
-                           (this, &double_trie::relocate_front);
-    rear_relocator_ = new trie_relocator<double_trie>
-                          (this, &double_trie::relocate_rear);
-    lhs_ = new basic_trie(size);
-    rhs_ = new basic_trie(size);
-    lhs_->set_relocator(front_relocator_);
-    rhs_->set_relocator(rear_relocator_);
-    header_->index_size = size?size:basic_trie::kDefaultStateSize;
-    index_ = resize(index_, 0, header_->index_size);
-    header_->accept_size = size?size:basic_trie::kDefaultStateSize;
-    accept_ = resize(accept_, 0, header_->accept_size);
-    watcher_[0] = 0;
-    watcher_[1] = 0;
-}
-
-double_trie::double_trie(const char *filename)
-    :header_(NULL), lhs_(NULL), rhs_(NULL), index_(NULL), accept_(NULL),
-     next_accept_(1), next_index_(1), front_relocator_(NULL),
-     rear_relocator_(NULL), mmap_(NULL), mmap_size_(0)
-{
-    struct stat sb;
-    int fd, retval;
+    void operator()(size_t length, trie::value_type value)
+    {
+        result->push_back(std::make_pair(length, value));
+    }
+};
 
-    if (!filename)
-        throw std::runtime_error(std::string("can not load from file ")
-                                 + filename);
+/// Keeps the last, which is the longest, key found by find_prefixes.
+struct prefix_keeper {
+    bool found;              ///< Whether any key is found.
+    size_t length;           ///< Length of the key.
+    trie::value_type value;  ///< Value of the key.
 
-    fd = open(filename, O_RDONLY);
-    if (fd < 0)
-        throw std::runtime_error(strerror(errno));
-    if (fstat(fd, &sb) < 0)
-        throw std::runtime_error(strerror(errno));
+    void operator()(size_t length, trie::value_type value)
+    {
+        this->found = true;
+        this->length = length;
+        this->value = value;
+    }
 
-    mmap_ = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-    if (mmap_ == MAP_FAILED)
-        throw std::runtime_error(strerror(errno));
-    while (retval = close(fd), retval == -1 && errno == EINTR) {
-        // exmpty
+    /// Copies the key found to matched and value, returns whether found.
+    bool report(size_t *matched, trie::value_type *value) const
+    {
+        if (found) {
+            if (matched)
+                *matched = length;
+            if (value)
+                *value = this->value;
+        }
+        return found;
     }
-    mmap_size_ = sb.st_size;
+};
 
-    void *start;
-    start = header_ = reinterpret_cast<header_type *>(mmap_);
-    if (strcmp(header_->magic, magic_))
-        throw std::runtime_error("file corrupted");
-    // load index
-    start = index_ = reinterpret_cast<index_type *>(
-                     reinterpret_cast<header_type *>(start) + 1);
-    // load accept
-    start = accept_ = reinterpret_cast<accept_type *>(
-                      reinterpret_cast<index_type *>(start)
-                      + header_->index_size);
-    // load front trie
-    start = reinterpret_cast<accept_type *>(start) + header_->accept_size;
-    lhs_ = new basic_trie(start,
-                          reinterpret_cast<basic_trie::header_type *>(start)
-                          + 1);
-    // load rear trie
-    start = reinterpret_cast<basic_trie::state_type *>
-            ((basic_trie::header_type *)start + 1)
-            + lhs_->header()->size;
-    rhs_ = new basic_trie(start,
-                          reinterpret_cast<basic_trie::header_type *>(start)
-                          + 1);
+/**
+ * Throws if after, the continuation of prefix_cursor, does not start
+ * with prefix.
+ */
+static void check_after(const char *prefix, size_t length,
+                        const char *after, size_t after_length)
+{
+    if (after && (after_length < length || memcmp(after, prefix, length)))
+        throw std::runtime_error("prefix_cursor: after does not start "
+                                 "with prefix");
 }
 
+/// Represents a state visited by walk_cursor.
+typedef struct {
+    trie::size_type s;     ///< The state.
+    trie::size_type rank;  ///< Rank of the first key below s, for dawg_trie.
+} walk_node;
 
-double_trie::~double_trie()
-{
-    if (mmap_) {
-        if (munmap(mmap_, mmap_size_) < 0)
-            throw std::runtime_error(strerror(errno));
-    } else {
-        sanity_delete(header_);
-        resize(index_, 0, 0);  // free index_
-        resize(accept_, 0, 0);  // free accept_
-        sanity_delete(front_relocator_);
-        sanity_delete(rear_relocator_);
+/**
+ * Walks keys below a prefix with an explicit stack, in the order of
+ * prefix_search. A walker W adapts a trie:
+ *
+ *     root(&n)             gets the root, false if the trie is empty
+ *     go(n, ch, &t)        goes from n by ch, false if there is no way
+ *     children(n, labels)  stores labels of n in ascending order
+ *     leaf(t, ch)          whether t reached by ch holds a whole key
+ *     tail(t, ch, &key)    appends the rest of the key at leaf t to key
+ *                          and returns its value
+ *     final(n, &value)     whether a key ends at n, after keys below n
+ *     in(byte), out(ch)    converts between bytes and char_types
+ *
+ * Labels of all frames share one buffer, so a walk only allocates
+ * while the stack grows deeper than before.
+ */
+template<typename W>
+class walk_cursor: public trie::cursor {
+  public:
+    typedef trie::char_type char_type;
+
+    walk_cursor(const W &walker, const char *prefix, size_t length,
+                size_t limit, const char *after, size_t after_length)
+        :walker_(walker), limit_(limit), count_(0), single_(false)
+    {
+        walk_node n, t;
+        if (!walker_.root(&n))
+            return;
+        for (size_t i = 0; i < length; i++) {
+            char_type ch = walker_.in(prefix[i]);
+            if (!walker_.go(n, ch, &t))
+                return;
+            if (walker_.leaf(t, ch)) {
+                // the prefix ends inside the only key below t
+                key_.assign(prefix, i + 1);
+                value_ = walker_.tail(t, ch, &key_);
+                single_ = key_.length() >= length
+                          && !memcmp(key_.data(), prefix, length)
+                          && (!after || behind(after, after_length));
+                return;
+            }
+            n = t;
+        }
+        key_.assign(prefix, length);
+        push(n);
+        if (after)
+            seek(after, after_length, length);
     }
-    sanity_delete(lhs_);
-    sanity_delete(rhs_);
-}
 
-trie::size_type
-double_trie::rhs_append(const char_type *inputs)
-{
-    const char_type *p;
-    size_type s = 1, t;
+    /// Walks keys below n, which is reached by key.
+    walk_cursor(const W &walker, const walk_node &n, const std::string &key,
+                size_t limit)
+        :walker_(walker), limit_(limit), count_(0), single_(false)
+    {
+        walk_node root;
+        if (!walker_.root(&root))
+            return;
+        key_ = key;
+        push(n);
+    }
 
-    s = rhs_->go_forward_reverse(s, inputs, &p);
-    if (!p) {  // all characters match
-        if (outdegree(s) == 0) {
-            return s;
-        } else {
-            t = rhs_->next(s, key_type::kTerminator);
-            if (!rhs_->check_transition(s, t))
-                return rhs_->create_transition(s, key_type::kTerminator);
-            return t;
+    bool next()
+    {
+        if (limit_ && count_ >= limit_)
+            return false;
+        if (single_) {
+            single_ = false;
+            ++count_;
+            return true;
         }
-    }
-    if (outdegree(s) == 0) {
-        t = rhs_->create_transition(s, key_type::kTerminator);
-        std::set<size_type>::const_iterator it;
-        if (refer_.find(s) != refer_.end()) {
-            for (it = refer_[s].referer.begin();
-                    it != refer_[s].referer.end();
-                    it++) {
-                set_link(*it, t);
+        while (!stack_.empty()) {
+            frame_type &f = stack_.back();
+            key_.resize(f.length);
+            if (f.pos < f.last) {
+                char_type ch = labels_[f.pos++];
+                walk_node t;
+                walker_.go(f.node, ch, &t);
+                if (ch != trie::key_type::kTerminator)
+                    key_.push_back(walker_.out(ch));
+                if (walker_.leaf(t, ch)) {
+                    value_ = walker_.tail(t, ch, &key_);
+                    ++count_;
+                    return true;
+                }
+                push(t);
+            } else {
+                bool found = !f.done && walker_.final(f.node, &value_);
+                labels_.resize(f.first);
+                stack_.pop_back();
+                if (found) {
+                    ++count_;
+                    return true;
+                }
             }
-            free_accept_entry(s);
         }
+        return false;
     }
-    do {
-        s = rhs_->create_transition(s, *p);
-    } while (p-- > inputs);
-    return s;
-}
 
-void
-double_trie::lhs_insert(size_type s, const char_type *inputs, value_type value)
-{
-    size_t i;
-    s = lhs_->create_transition(s, inputs[0]);
-    if (*inputs == key_type::kTerminator) {
-        i = find_index_entry(s);
-        index_[i].index = 0;
-    } else {
-        i = set_link(s, rhs_append(inputs + 1));
+  private:
+    /// Represents a state on the stack.
+    typedef struct {
+        walk_node node;  ///< The state.
+        size_t length;   ///< Length of the key leading to node.
+        size_t first;    ///< First label of node in labels_.
+        size_t last;     ///< End of labels of node in labels_.
+        size_t pos;      ///< Next label to visit.
+        bool done;       ///< Whether the key ending at node is returned.
+    } frame_type;
+
+    /// Pushes node n with its labels.
+    void push(const walk_node &n)
+    {
+        char_type labels[trie::key_type::kCharsetSize + 1];
+        size_t count = walker_.children(n, labels);
+        frame_type f = {n, key_.length(), labels_.size(), 0, 0, false};
+        labels_.insert(labels_.end(), labels, labels + count);
+        f.pos = f.first;
+        f.last = labels_.size();
+        stack_.push_back(f);
     }
-    index_[i].data = value;
-}
 
-void double_trie::rhs_clean_more(size_type t)
-{
-    if (outdegree(t) == 0 && count_referer(t) == 0) {
-        assert(rhs_->check(t) > 0);
-        size_type s = rhs_->prev(t);
-        remove_accept_state(t);
-        assert(s > 0);
-        rhs_clean_more(s);
-    } else if (outdegree(t) == 1) {
-        size_type r = rhs_->next(t, key_type::kTerminator);
-        if (rhs_->check_transition(t, r)) {
-            // delete transition 't -#-> r'
-            if (refer_.find(r) != refer_.end()) {
-                std::set<size_type>::const_iterator it;
-                for (it = refer_[r].referer.begin();
-                        it != refer_[r].referer.end();
-                        it++)
-                    set_link(*it, t);
-                assert (refer_.find(t) != refer_.end());
-                accept_[refer_[t].accept_index].accept = t;
+    /**
+     * Skips all keys up to after. Keys are ordered by char_types with
+     * terminator the largest, so at every depth the labels up to the
+     * char_type of after are done. after needs not be a key of the
+     * trie, the only key of a leaf on its way is kept if it is behind.
+     */
+    void seek(const char *after, size_t length, size_t depth)
+    {
+        for (size_t d = depth; ; d++) {
+            frame_type &f = stack_.back();
+            char_type ch = (d < length)?walker_.in(after[d])
+                                       :trie::key_type::kTerminator;
+            while (f.pos < f.last && labels_[f.pos] <= ch)
+                f.pos++;
+            if (ch == trie::key_type::kTerminator) {
+                f.done = true;
+                return;
             }
-            if (rhs_->base(r) > 1)
-                rhs_->set_last_base(rhs_->base(r));
-            remove_accept_state(r);
+            walk_node t;
+            if (!walker_.go(f.node, ch, &t))
+                return;
+            key_.push_back(after[d]);
+            if (walker_.leaf(t, ch)) {
+                value_ = walker_.tail(t, ch, &key_);
+                single_ = behind(after, length);
+                return;
+            }
+            push(t);
         }
     }
-}
 
-void double_trie::rhs_insert(size_type s, size_type r,
-                             const std::vector<char_type> &match,
-                             const char_type *remain,
-                             char_type ch, size_type value)
-{
-    // R-1
-    size_type u = link_state(s);
-    assert(u > 0);
-    assert(rhs_->check(u) > 0);
-    value_type oval = index_[-lhs_->base(s)].data;
-    index_[-lhs_->base(s)].index = 0;
-    index_[-lhs_->base(s)].data = 0;
-    free_index_.push_back(-lhs_->base(s));
-    // s is separator which implies base(s) < 0, so we need to set base(s) = 0
-    lhs_->set_base(s, 0);
-    watcher_[0] = u; // u & r may be changed during rhs_->create_transition
-    watcher_[1] = r; // we use watcher_ to monitor there changing.
-    if (refer_.find(u) != refer_.end()) {
-        refer_[u].referer.erase(s);
+    /// Returns true if key_ comes after the given key in the walk.
+    bool behind(const char *after, size_t length) const
+    {
+        size_t n = std::min(key_.length(), length);
+        for (size_t i = 0; i < n; i++) {
+            char_type lhs = walker_.in(key_[i]), rhs = walker_.in(after[i]);
+            if (lhs != rhs)
+                return lhs > rhs;
+        }
+        // a key comes after the keys it prefixes
+        return key_.length() < length;
+    }
 
-        if (refer_[u].referer.size() == 0)
-            free_accept_entry(u);
+    W walker_;                        ///< Adaptor of the trie.
+    std::vector<frame_type> stack_;   ///< States being walked.
+    std::vector<char_type> labels_;   ///< Labels of states on stack_.
+    size_t limit_;                    ///< Maximum number of keys, or 0.
+    size_t count_;                    ///< Number of keys returned.
+    bool single_;                     ///< A key found by the prefix walk.
+};
+
+/// Walks a basic_trie for walk_cursor, values are kept in terminators.
+class basic_walker {
+  public:
+    typedef trie::char_type char_type;
+
+    explicit basic_walker(const basic_trie *trie)
+        :trie_(trie)
+    {
     }
 
-    // R-2
-    std::vector<char_type>::const_iterator it;
-    for (it = match.begin(); it != match.end(); it++) {
-        s = lhs_->create_transition(s, *it);
+    bool root(walk_node *n) const
+    {
+        n->s = 1;
+        n->rank = 0;
+        return trie_->header()->size > 1;
     }
 
-    size_type t = lhs_->create_transition(s, *remain);
-    size_type i;
-    if (*remain == key_type::kTerminator) {
-        i = find_index_entry(t);
-        index_[-lhs_->base(t)].data = value;
-        index_[-lhs_->base(t)].index = 0;
-    } else {
-        size_type a = rhs_append(remain + 1);
-        assert(rhs_->check(watcher_[0]) > 0);
-        i = set_link(t, a);
-        index_[i].data = value;
+    bool go(const walk_node &n, char_type ch, walk_node *t) const
+    {
+        t->s = trie_->next(n.s, ch);
+        t->rank = 0;
+        return trie_->check_transition(n.s, t->s);
     }
 
-    // R-3
-    t = lhs_->create_transition(s, ch);
-    size_type v = rhs_->prev(watcher_[1]);  // v -ch-> r
-    if (!rhs_->check_transition(v, rhs_->next(v, key_type::kTerminator)))
-        r = rhs_->create_transition(v, key_type::kTerminator);
-    else
-        r = rhs_->next(v, key_type::kTerminator);
-    i = set_link(t, r);
-    index_[i].data = oval;
+    size_t children(const walk_node &n, char_type *labels) const
+    {
+        return trie_->children(n.s, labels);
+    }
 
-    // R-4
-    u = watcher_[0];
-    if (!rhs_clean_one(u))
-        rhs_clean_more(u);
-}
+    bool leaf(const walk_node &t, char_type ch) const
+    {
+        return ch == trie::key_type::kTerminator;
+    }
 
-void double_trie::insert(const key_type &key, const value_type &value)
-{
-    const char_type *p;
-    size_type s = lhs_->go_forward(1, key.data(), &p);
+    trie::value_type tail(const walk_node &t, char_type ch,
+                          std::string *key) const
+    {
+        return trie_->base(t.s);
+    }
 
-    if (!p) {
-        // duplicated key found
-        index_[-lhs_->base(s)].data = value;
-        return;
+    bool final(const walk_node &n, trie::value_type *value) const
+    {
+        return false;
     }
 
-    if (!check_separator(s)) {
-        lhs_insert(s, p, value);
-        return;
+    char_type in(char ch) const
+    {
+        return trie::key_type::char_in(ch);
     }
-    assert(index_[-lhs_->base(s)].index > 0);
-    size_type r = link_state(s);
-    // skip dummy terminator
-    if (rhs_->check_reverse_transition(r, key_type::kTerminator)
-        && rhs_->prev(r) > 1)
-        r = rhs_->prev(r);
 
-    // travel reversely
-    exists_.clear();
-    do {
-        if (rhs_->check_reverse_transition(r, *p)) {
-            r = rhs_->prev(r);
-            exists_.push_back(*p);
+    char out(char_type ch) const
+    {
+        return trie::key_type::char_out(ch);
+    }
+
+  protected:
+    const basic_trie *trie_;
+};
+
+/**
+ * Records the maximum value of keys below every state into maxima, in
+ * post-order with an explicit stack. W is a walker of walk_cursor which
+ * also provides value(t, ch), the value of the key held by leaf t.
+ * States that can not be reached keep their values.
+ */
+template<typename W>
+static void find_max_values(const W &walker, trie::value_type *maxima)
+{
+    typedef struct {
+        walk_node node;          ///< The state.
+        size_t first;            ///< First label of node in labels.
+        size_t pos;              ///< Next label to visit.
+        trie::value_type max;    ///< Maximum value found below node.
+    } frame_type;
+
+    trie::char_type targets[trie::key_type::kCharsetSize + 1];
+    std::vector<frame_type> stack;
+    std::vector<trie::char_type> labels;
+    walk_node n, t;
+    if (!walker.root(&n))
+        return;
+    frame_type root = {n, 0, 0, INT32_MIN};
+    labels.insert(labels.end(), targets,
+                  targets + walker.children(n, targets));
+    stack.push_back(root);
+    while (!stack.empty()) {
+        frame_type &f = stack.back();
+        if (f.pos < labels.size()) {
+            trie::char_type ch = labels[f.pos++];
+            walker.go(f.node, ch, &t);
+            if (walker.leaf(t, ch)) {
+                maxima[t.s] = walker.value(t, ch);
+                f.max = std::max(f.max, maxima[t.s]);
+                continue;
+            }
+            frame_type next = {t, labels.size(), labels.size(), INT32_MIN};
+            labels.insert(labels.end(), targets,
+                          targets + walker.children(t, targets));
+            stack.push_back(next);
         } else {
-            break;
-        }
-        if (r == 1) {  // duplicated key
-            index_[-lhs_->base(s)].data = value;
-            return;
+            maxima[f.node.s] = f.max;
+            labels.resize(f.first);
+            stack.pop_back();
+            if (!stack.empty())
+                stack.back().max = std::max(stack.back().max,
+                                            maxima[f.node.s]);
         }
-    } while (*p++ != key_type::kTerminator);
-    char_type mismatch = r - rhs_->base(rhs_->prev(r));
-    rhs_insert(s, r, exists_, p, mismatch, value);
-    return;
+    }
 }
 
-bool double_trie::search(const key_type &key, value_type *value) const
+/// Adds aggregates of b to a.
+static void merge_aggregate(trie::aggregate_type *a,
+                            const trie::aggregate_type &b)
 {
-    const char_type *p, *mismatch;
-    size_type s = lhs_->go_forward(1, key.data(), &p);
-    if (!p) {
-        if (value)
-            *value = index_[-lhs_->base(s)].data;
-        return true;
+    a->sum += b.sum;
+    a->count += b.count;
+    a->min = std::min(a->min, b.min);
+    a->max = std::max(a->max, b.max);
+}
+
+/**
+ * Records the count, sum, minimum and maximum of values of keys below
+ * every state into aggregates, in post-order as find_max_values does.
+ * aggregates must start empty, which is what a state with no key below
+ * keeps.
+ */
+template<typename W>
+static void find_aggregates(const W &walker, trie::aggregate_type *aggregates)
+{
+    typedef struct {
+        walk_node node;  ///< The state.
+        size_t first;    ///< First label of node in labels.
+        size_t pos;      ///< Next label to visit.
+    } frame_type;
+
+    trie::char_type targets[trie::key_type::kCharsetSize + 1];
+    std::vector<frame_type> stack;
+    std::vector<trie::char_type> labels;
+    walk_node n, t;
+    if (!walker.root(&n))
+        return;
+    frame_type root = {n, 0, 0};
+    labels.insert(labels.end(), targets,
+                  targets + walker.children(n, targets));
+    stack.push_back(root);
+    while (!stack.empty()) {
+        frame_type &f = stack.back();
+        if (f.pos < labels.size()) {
+            trie::char_type ch = labels[f.pos++];
+            walker.go(f.node, ch, &t);
+            if (walker.leaf(t, ch)) {
+                trie::value_type value = walker.value(t, ch);
+                trie::aggregate_type leaf = {value, 1, value, value, 0};
+                aggregates[t.s] = leaf;
+                merge_aggregate(&aggregates[f.node.s], leaf);
+                continue;
+            }
+            frame_type next = {t, labels.size(), labels.size()};
+            labels.insert(labels.end(), targets,
+                          targets + walker.children(t, targets));
+            stack.push_back(next);
+        } else {
+            trie::size_type s = f.node.s;
+            labels.resize(f.first);
+            stack.pop_back();
+            if (!stack.empty())
+                merge_aggregate(&aggregates[stack.back().node.s],
+                                aggregates[s]);
+        }
+    }
+}
+
+/**
+ * Reads aggregates found by find_aggregates at the state reached by
+ * prefix. A leaf reached before the end of prefix holds a single key,
+ * which starts with prefix or not.
+ *
+ * @return false if no key starts with prefix.
+ */
+template<typename W>
+static bool find_aggregate(const W &walker,
+                           const trie::aggregate_type *aggregates,
+                           const char *prefix, size_t length,
+                           trie::aggregate_type *result)
+{
+    walk_node n, t;
+    if (!walker.root(&n))
+        return false;
+    for (size_t i = 0; i < length; i++) {
+        trie::char_type ch = walker.in(prefix[i]);
+        if (!walker.go(n, ch, &t))
+            return false;
+        if (walker.leaf(t, ch)) {
+            std::string key(prefix, i + 1);
+            trie::value_type value = walker.tail(t, ch, &key);
+            if (key.compare(0, length, prefix, length))
+                return false;
+            trie::aggregate_type leaf = {value, 1, value, value, 0};
+            *result = leaf;
+            return true;
+        }
+        n = t;
+    }
+    if (!aggregates[n.s].count)
+        return false;
+    *result = aggregates[n.s];
+    return true;
+}
+
+/// Appends labels of n in the byte order of keys, terminator first.
+template<typename W>
+static void ordered_children(const W &walker, const walk_node &n,
+                             std::vector<trie::char_type> *labels)
+{
+    trie::char_type targets[trie::key_type::kCharsetSize + 1];
+    std::pair<int, trie::char_type> order[trie::key_type::kCharsetSize + 1];
+    size_t count = walker.children(n, targets);
+    for (size_t i = 0; i < count; i++)
+        order[i] = std::make_pair((targets[i] == trie::key_type::kTerminator)
+                                  ?-1
+                                  :static_cast<unsigned char>(
+                                      walker.out(targets[i])),
+                                  targets[i]);
+    std::sort(order, order + count);
+    for (size_t i = 0; i < count; i++)
+        labels->push_back(order[i].second);
+}
+
+/**
+ * Numbers keys for record_key_ids in the byte order of keys, shorter
+ * keys before the keys they prefix. ids[s] is set to the id of the
+ * first key below s, that is the id of the key held by s if s is a
+ * leaf, and states[id] to the leaf holding key id.
+ */
+template<typename W>
+static void find_key_ids(const W &walker, trie::size_type *ids,
+                         std::vector<trie::size_type> *states)
+{
+    typedef struct {
+        walk_node node;  ///< The state.
+        size_t first;    ///< First label of node in labels.
+        size_t pos;      ///< Next label to visit.
+    } frame_type;
+
+    std::vector<frame_type> stack;
+    std::vector<trie::char_type> labels;
+    walk_node n, t;
+    if (!walker.root(&n))
+        return;
+    frame_type root = {n, 0, 0};
+    ids[n.s] = 0;
+    ordered_children(walker, n, &labels);
+    stack.push_back(root);
+    while (!stack.empty()) {
+        frame_type &f = stack.back();
+        if (f.pos < labels.size()) {
+            trie::char_type ch = labels[f.pos++];
+            walker.go(f.node, ch, &t);
+            if (walker.leaf(t, ch)) {
+                ids[t.s] = states->size();
+                states->push_back(t.s);
+                continue;
+            }
+            frame_type next = {t, labels.size(), labels.size()};
+            ids[t.s] = states->size();
+            ordered_children(walker, t, &labels);
+            stack.push_back(next);
+        } else {
+            labels.resize(f.first);
+            stack.pop_back();
+        }
+    }
+}
+
+/**
+ * Restores the key held by leaf s of front trie for key_of. Labels are
+ * found by walking back to the root, then the rest of the key is taken
+ * from the leaf.
+ *
+ * @return The value of the key.
+ */
+template<typename W>
+static trie::value_type restore_key(const W &walker, const basic_trie *front,
+                                    trie::size_type s, std::string *key)
+{
+    std::vector<trie::char_type> path;
+    for (trie::size_type t = s; t > 1; t = front->prev(t))
+        path.push_back(t - front->base(front->prev(t)));
+    key->clear();
+    for (size_t i = path.size(); i > 1; i--)
+        key->push_back(walker.out(path[i - 1]));
+    if (path[0] != trie::key_type::kTerminator)
+        key->push_back(walker.out(path[0]));
+    walk_node leaf = {s, 0};
+    return walker.tail(leaf, path[0], key);
+}
+
+/**
+ * Counts keys less than inputs for rank, with ids of the first keys
+ * below states found by find_key_ids. Walking along inputs, the keys
+ * before the first label larger than the next byte end the count if
+ * the walk stops below.
+ */
+template<typename W>
+static trie::size_type find_rank(const W &walker, const trie::size_type *ids,
+                                 trie::size_type size, const char *inputs,
+                                 size_t length)
+{
+    std::vector<trie::char_type> labels;
+    trie::size_type end = size;
+    walk_node n, t;
+    if (!walker.root(&n))
+        return 0;
+    for (size_t i = 0; i < length; i++) {
+        int b = static_cast<unsigned char>(inputs[i]);
+        trie::char_type match = 0;
+        labels.clear();
+        ordered_children(walker, n, &labels);
+        for (size_t j = 0; j < labels.size(); j++) {
+            if (labels[j] == trie::key_type::kTerminator)
+                continue;
+            int o = static_cast<unsigned char>(walker.out(labels[j]));
+            if (o == b) {
+                match = labels[j];
+            } else if (o > b) {
+                walker.go(n, labels[j], &t);
+                end = ids[t.s];
+                break;
+            }
+        }
+        if (!match)
+            return end;
+        walker.go(n, match, &t);
+        if (walker.leaf(t, match)) {
+            // the only key below t decides
+            std::string key(inputs, i + 1);
+            walker.tail(t, match, &key);
+            return (key.compare(0, key.npos, inputs, length) < 0)
+                   ?ids[t.s] + 1:ids[t.s];
+        }
+        n = t;
+    }
+    // keys below n start with inputs
+    return ids[n.s];
+}
+
+/// Orders key-value pairs by value, the largest first.
+static bool larger_value(const std::pair<trie::key_type, trie::value_type> &a,
+                         const std::pair<trie::key_type, trie::value_type> &b)
+{
+    return a.second > b.second;
+}
+
+/**
+ * Finds k keys with the largest values below prefix, best-first over
+ * maxima found by find_max_values. Every subtree reached is queued by
+ * its maximum value, so a subtree is only expanded when it holds the
+ * largest value left, and a leaf popped from the queue is the next key
+ * of the result.
+ */
+template<typename W>
+static size_t find_top_k(const W &walker, const trie::value_type *maxima,
+                         const char *prefix, size_t length, size_t k,
+                         trie::result_type *result)
+{
+    typedef struct {
+        walk_node node;          ///< The state.
+        size_t parent;           ///< Record of the previous state.
+        trie::char_type label;   ///< Label from the previous state.
+        bool leaf;               ///< Whether node holds a whole key.
+    } record_type;
+
+    walk_node n, t;
+    if (!k || !walker.root(&n))
+        return result->size();
+    for (size_t i = 0; i < length; i++) {
+        trie::char_type ch = walker.in(prefix[i]);
+        if (!walker.go(n, ch, &t))
+            return result->size();
+        if (walker.leaf(t, ch)) {
+            // the prefix ends inside the only key below t
+            std::string key(prefix, i + 1);
+            trie::value_type value = walker.tail(t, ch, &key);
+            if (key.length() >= length && !memcmp(key.data(), prefix, length))
+                result->push_back(std::pair<trie::key_type, trie::value_type>(
+                    trie::key_type(key.data(), key.length()), value));
+            return result->size();
+        }
+        n = t;
+    }
+
+    // records are queued by maximum value, earlier ones first on ties
+    std::vector<record_type> records;
+    std::priority_queue<std::pair<trie::value_type, ptrdiff_t> > queue;
+    trie::char_type targets[trie::key_type::kCharsetSize + 1];
+    std::string key;
+    size_t found = 0;
+    record_type root = {n, 0, 0, false};
+    records.push_back(root);
+    queue.push(std::make_pair(maxima[n.s], 0));
+    while (!queue.empty() && found < k) {
+        size_t i = -queue.top().second;
+        queue.pop();
+        record_type r = records[i];
+        if (r.leaf) {
+            key.assign(prefix, length);
+            for (size_t j = i; j; j = records[j].parent)
+                if (records[j].label != trie::key_type::kTerminator)
+                    key.push_back(walker.out(records[j].label));
+            std::reverse(key.begin() + length, key.end());
+            trie::value_type value = walker.tail(r.node, r.label, &key);
+            result->push_back(std::pair<trie::key_type, trie::value_type>(
+                trie::key_type(key.data(), key.length()), value));
+            ++found;
+            continue;
+        }
+        size_t count = walker.children(r.node, targets);
+        for (size_t j = 0; j < count; j++) {
+            walker.go(r.node, targets[j], &t);
+            record_type child = {t, i, targets[j],
+                                 walker.leaf(t, targets[j])};
+            records.push_back(child);
+            queue.push(std::make_pair(maxima[t.s], -static_cast<ptrdiff_t>(
+                records.size() - 1)));
+        }
+    }
+    return result->size();
+}
+
+/**
+ * Fills rows of the edit distance table between inputs and key, from
+ * the row of key[0..from) to the row of the whole key. Row d is kept at
+ * rows[d * (length + 1)], cells larger than distance are stored as
+ * distance + 1, and only cells within distance of the diagonal are
+ * computed since the others can not be any smaller.
+ *
+ * @return false if no cell of a row is within distance, then no key
+ *         starting with the part of key filled can be found.
+ */
+static bool fill_rows(std::vector<size_t> *rows, const char *inputs,
+                      size_t length, const std::string &key, size_t from,
+                      size_t distance)
+{
+    size_t width = length + 1, limit = distance + 1;
+    rows->resize((key.length() + 1) * width);
+    for (size_t d = from; d < key.length(); d++) {
+        const size_t *last = &(*rows)[d * width];
+        size_t *row = &(*rows)[(d + 1) * width];
+        size_t low = (d + 1 > distance)?d + 1 - distance:1;
+        size_t high = std::min(d + 1 + distance, length);
+        size_t least = row[0] = std::min(d + 1, limit);
+        for (size_t i = 1; i < std::min(low, width); i++)
+            row[i] = limit;
+        for (size_t i = low; i <= high; i++) {
+            row[i] = std::min(std::min(last[i], row[i - 1]) + 1,
+                              last[i - 1] + (inputs[i - 1] != key[d]));
+            row[i] = std::min(row[i], limit);
+            least = std::min(least, row[i]);
+        }
+        for (size_t i = std::max(high + 1, low); i <= length; i++)
+            row[i] = limit;
+        if (least > distance)
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Finds keys within an edit distance of inputs for fuzzy_search. States
+ * are walked with an explicit stack as walk_cursor does, computing one
+ * row of the edit distance table per char_type, and a subtree is left
+ * once its row has no cell within distance. A key ending at a leaf
+ * continues the rows over the rest of it found by tail.
+ */
+template<typename W>
+static size_t find_fuzzy(const W &walker, const char *inputs, size_t length,
+                         size_t distance, trie::fuzzy_callback found,
+                         void *context)
+{
+    typedef struct {
+        walk_node node;  ///< The state.
+        size_t depth;    ///< Length of the key leading to node.
+        size_t first;    ///< First label of node in labels.
+        size_t pos;      ///< Next label to visit.
+    } frame_type;
+
+    trie::char_type targets[trie::key_type::kCharsetSize + 1];
+    std::vector<frame_type> stack;
+    std::vector<trie::char_type> labels;
+    std::vector<size_t> rows(length + 1);
+    std::string key;
+    size_t count = 0;
+    trie::fuzzy_match_type match;
+    walk_node n, t;
+    if (!walker.root(&n))
+        return 0;
+    for (size_t i = 0; i <= length; i++)
+        rows[i] = std::min(i, distance + 1);
+    frame_type root = {n, 0, 0, 0};
+    labels.insert(labels.end(), targets,
+                  targets + walker.children(n, targets));
+    stack.push_back(root);
+    while (!stack.empty()) {
+        frame_type &f = stack.back();
+        size_t depth = f.depth;
+        key.resize(depth);
+        if (f.pos < labels.size()) {
+            trie::char_type ch = labels[f.pos++];
+            walker.go(f.node, ch, &t);
+            if (ch != trie::key_type::kTerminator)
+                key.push_back(walker.out(ch));
+            if (walker.leaf(t, ch)) {
+                match.value = walker.tail(t, ch, &key);
+                if (!fill_rows(&rows, inputs, length, key, depth, distance))
+                    continue;
+                match.distance = rows[key.length() * (length + 1) + length];
+                if (match.distance > distance)
+                    continue;
+                match.key = key.data();
+                match.length = key.length();
+                found(match, context);
+                ++count;
+                continue;
+            }
+            if (!fill_rows(&rows, inputs, length, key, depth, distance))
+                continue;
+            frame_type next = {t, depth + 1, labels.size(), labels.size()};
+            labels.insert(labels.end(), targets,
+                          targets + walker.children(t, targets));
+            stack.push_back(next);
+        } else {
+            match.distance = rows[depth * (length + 1) + length];
+            if (match.distance <= distance
+                && walker.final(f.node, &match.value)) {
+                match.key = key.data();
+                match.length = key.length();
+                found(match, context);
+                ++count;
+            }
+            labels.resize(f.first);
+            stack.pop_back();
+        }
+    }
+    return count;
+}
+
+/// Determines which states become leaves in build_sorted.
+enum leaf_policy {
+    kLeafOnTerminator,  ///< States reached by terminator.
+    kLeafOnUnique,      ///< States leading to only one key.
+    kLeafOnEnd          ///< States where a key runs out, used by rear trie.
+};
+
+/// Represents a leaf state created by build_sorted.
+typedef struct {
+    trie::size_type state;  ///< The leaf state.
+    size_t index;           ///< Index of the key leading to state.
+    size_t depth;           ///< Number of char_types consumed to reach state.
+} leaf_type;
+
+/// Represents a state and the keys passing it in build_sorted.
+typedef struct {
+    trie::size_type s;  ///< The state.
+    size_t first;       ///< First key passing s.
+    size_t last;        ///< One past the last key passing s.
+    size_t depth;       ///< Number of char_types consumed to reach s.
+} frame_type;
+
+/**
+ * Creates all outcome transitions of state f.s at once.
+ *
+ * @param btrie The basic_trie.
+ * @param label Accessor of char_types of keys.
+ * @param f The state and its keys.
+ * @param policy Which states become leaves.
+ * @param[out] leaves Leaf states are appended here.
+ * @param[out] frames Other states are appended here, largest label first.
+ */
+template<typename L>
+static void expand_frame(basic_trie *btrie, const L &label,
+                         const frame_type &f, leaf_policy policy,
+                         std::vector<leaf_type> *leaves,
+                         std::vector<frame_type> *frames)
+{
+    trie::char_type inputs[trie::key_type::kCharsetSize + 1];
+    frame_type children[trie::key_type::kCharsetSize];
+    basic_trie::extremum_type extremum = {0, 0};
+    size_t i, j, k;
+
+    for (i = f.first, k = 0; i < f.last; i = j, k++) {
+        trie::char_type ch = label.label(i, f.depth);
+        for (j = i + 1; j < f.last && label.label(j, f.depth) == ch; j++) {
+            // empty
+        }
+        inputs[k] = ch;
+        if (ch > extremum.max || !extremum.max)
+            extremum.max = ch;
+        if (ch < extremum.min || !extremum.min)
+            extremum.min = ch;
+        frame_type child = {0, i, j, f.depth + 1};
+        children[k] = child;
+    }
+    inputs[k] = 0;
+
+    trie::size_type base = btrie->create_transitions(f.s, inputs, extremum);
+    while (k-- > 0) {
+        frame_type &child = children[k];
+        bool leaf;
+        child.s = base + inputs[k];
+        if (policy == kLeafOnTerminator)
+            leaf = (inputs[k] == trie::key_type::kTerminator);
+        else if (policy == kLeafOnUnique)
+            leaf = (child.last - child.first == 1);
+        else
+            leaf = (child.last - child.first == 1
+                    && label.length(child.first) <= child.depth);
+        if (leaf) {
+            leaf_type l = {child.s, child.first, child.depth};
+            leaves->push_back(l);
+        } else {
+            frames->push_back(child);
+        }
+    }
+}
+
+/// Expands frames on stack and all their descendants.
+template<typename L>
+static void build_frames(basic_trie *btrie, const L &label,
+                         leaf_policy policy, std::vector<leaf_type> *leaves,
+                         std::vector<frame_type> *stack)
+{
+    while (!stack->empty()) {
+        frame_type f = stack->back();
+        stack->pop_back();
+        // children are pushed in reverse order so the smallest one is
+        // visited first
+        expand_frame(btrie, label, f, policy, leaves, stack);
+    }
+}
+
+/**
+ * Places sorted and unique keys into an empty basic_trie. Every state
+ * has all of its outcome transitions created at once, so it never calls
+ * relocate. The keys are walked in depth-first order using an explicit
+ * stack.
+ *
+ * @param btrie An empty basic_trie.
+ * @param label Accessor of char_types of keys.
+ * @param size Number of keys.
+ * @param policy Which states become leaves.
+ * @param[out] leaves All leaf states.
+ */
+template<typename L>
+static void build_sorted(basic_trie *btrie, const L &label, size_t size,
+                         leaf_policy policy, std::vector<leaf_type> *leaves)
+{
+    std::vector<frame_type> stack;
+
+    if (!size)
+        return;
+    frame_type root = {1, 0, size, 0};
+    stack.push_back(root);
+    build_frames(btrie, label, policy, leaves, &stack);
+}
+
+/// Accesses the keys below a frame, as if the frame were the root.
+template<typename L>
+class frame_label {
+  public:
+    typedef trie::char_type char_type;
+
+    frame_label(const L &label, const frame_type &frame)
+        :label_(label), first_(frame.first), depth_(frame.depth)
+    {
+    }
+
+    /// Returns the number of char_types of key i, including terminator.
+    size_t length(size_t i) const
+    {
+        return label_.length(first_ + i) - depth_;
+    }
+
+    /// Returns the d(th) char_type of key i.
+    char_type label(size_t i, size_t d) const
+    {
+        return label_.label(first_ + i, depth_ + d);
+    }
+
+  private:
+    const L &label_;
+    size_t first_, depth_;
+};
+
+/// Shared state of build_frame.
+template<typename L>
+struct frame_job {
+    const L *label;                             ///< Accessor of all keys.
+    leaf_policy policy;                         ///< Which states are leaves.
+    std::vector<frame_type> frames;             ///< Frames, largest first.
+    std::vector<basic_trie *> tries;            ///< Tries of frames.
+    std::vector<std::vector<leaf_type> > leaves;  ///< Leaves of frames.
+};
+
+/// Builds the keys below a frame into a new basic_trie.
+template<typename L>
+static void build_frame(size_t job, void *context)
+{
+    frame_job<L> *jobs = static_cast<frame_job<L> *>(context);
+    const frame_type &f = jobs->frames[job];
+    jobs->tries[job] = new basic_trie();
+    build_sorted(jobs->tries[job], frame_label<L>(*jobs->label, f),
+                 f.last - f.first, jobs->policy, &jobs->leaves[job]);
+}
+
+/// Orders frames by number of keys.
+static bool frame_less(const frame_type &lhs, const frame_type &rhs)
+{
+    return lhs.last - lhs.first < rhs.last - rhs.first;
+}
+
+/**
+ * Finds the smallest offset at which every state of a sub trie falls
+ * into a free state of btrie.
+ *
+ * @param btrie The trie to be stitched into.
+ * @param states States of the sub trie but the root, in ascending order.
+ * @param root_base BASE of the root of the sub trie.
+ * @param from The first free state of btrie.
+ */
+static trie::size_type find_offset(const basic_trie &btrie,
+                                   const std::vector<trie::size_type> &states,
+                                   trie::size_type root_base,
+                                   trie::size_type from)
+{
+    trie::size_type size = btrie.header()->size;
+    trie::size_type offset = from - (states.empty()?1:states.front());
+    if (root_base + offset <= 0)
+        offset = 1 - root_base;
+    for (;; offset++) {
+        size_t i;
+        for (i = 0; i < states.size(); i++) {
+            trie::size_type t = states[i] + offset;
+            if (t >= size)
+                return offset;
+            if (btrie.check(t) > 0)
+                break;
+        }
+        if (i == states.size())
+            return offset;
+    }
+}
+
+/**
+ * Same as build_sorted, but builds on a pool of threads.
+ *
+ * The largest subtree is expanded in btrie until every subtree holds a
+ * small share of keys. Each of the larger subtrees is then built into
+ * its own basic_trie in parallel, and those are stitched into the free
+ * states of btrie one after another. The smaller ones are built in place
+ * at last, filling the holes left by stitching. The states are laid out
+ * differently from build_sorted, but the trie holds the same keys.
+ *
+ * @param btrie An empty basic_trie.
+ * @param label Accessor of char_types of keys.
+ * @param size Number of keys.
+ * @param policy Which states become leaves.
+ * @param[out] leaves All leaf states.
+ * @param threads Number of threads.
+ */
+template<typename L>
+static void build_sorted(basic_trie *btrie, const L &label, size_t size,
+                         leaf_policy policy, std::vector<leaf_type> *leaves,
+                         size_t threads)
+{
+    if (threads <= 1 || size < 2) {
+        build_sorted(btrie, label, size, policy, leaves);
+        return;
+    }
+
+    frame_job<L> jobs;
+    size_t i, j;
+    size_t limit = std::max(size / (threads * 2), static_cast<size_t>(1));
+    frame_type root = {1, 0, size, 0};
+    jobs.label = &label;
+    jobs.policy = policy;
+    jobs.frames.push_back(root);
+    // a heap keeps the largest frame at front
+    while (!jobs.frames.empty()
+           && jobs.frames.front().last - jobs.frames.front().first > limit) {
+        std::pop_heap(jobs.frames.begin(), jobs.frames.end(), frame_less);
+        frame_type f = jobs.frames.back();
+        jobs.frames.pop_back();
+        size_t n = jobs.frames.size();
+        expand_frame(btrie, label, f, policy, leaves, &jobs.frames);
+        for (i = n; i < jobs.frames.size(); i++)
+            std::push_heap(jobs.frames.begin(), jobs.frames.begin() + i + 1,
+                           frame_less);
+    }
+    std::sort_heap(jobs.frames.begin(), jobs.frames.end(), frame_less);
+    std::reverse(jobs.frames.begin(), jobs.frames.end());
+    // small subtrees are left to fill the holes between stitched tries
+    std::vector<frame_type> rest;
+    while (!jobs.frames.empty()
+           && jobs.frames.back().last - jobs.frames.back().first <= limit / 16) {
+        rest.push_back(jobs.frames.back());
+        jobs.frames.pop_back();
+    }
+
+    jobs.tries.resize(jobs.frames.size(), NULL);
+    jobs.leaves.resize(jobs.frames.size());
+    try {
+        run_parallel(threads, jobs.frames.size(), build_frame<L>, &jobs);
+    } catch (...) {
+        for (i = 0; i < jobs.tries.size(); i++)
+            delete jobs.tries[i];
+        throw;
+    }
+
+    // fit each trie into the free states left so far
+    std::vector<trie::size_type> states;
+    trie::size_type from = 2;
+    for (i = 0; i < jobs.frames.size(); i++) {
+        const frame_type &f = jobs.frames[i];
+        const basic_trie *sub = jobs.tries[i];
+        trie::size_type t, last = sub->last_state();
+        states.clear();
+        for (t = 2; t <= last; t++)
+            if (sub->check(t) > 0)
+                states.push_back(t);
+        while (from < btrie->header()->size && btrie->check(from) > 0)
+            from++;
+        trie::size_type offset = find_offset(*btrie, states, sub->base(1),
+                                             from);
+        btrie->stitch(f.s, *sub, offset);
+        for (j = 0; j < jobs.leaves[i].size(); j++) {
+            const leaf_type &l = jobs.leaves[i][j];
+            leaf_type leaf = {l.state + offset, l.index + f.first,
+                              l.depth + f.depth};
+            leaves->push_back(leaf);
+        }
+        delete jobs.tries[i];
+    }
+    build_frames(btrie, label, policy, leaves, &rest);
+}
+
+/// Represents a reversed tail used to build rear trie in insert_bulk.
+typedef struct {
+    size_t offset;  ///< Offset of the first char_type.
+    size_t length;  ///< Number of char_types.
+    size_t leaf;    ///< Index of the separated state in front trie.
+} tail_type;
+
+/// Orders reversed tails of insert_bulk.
+class tail_less {
+  public:
+    explicit tail_less(const std::vector<trie::char_type> &chars)
+        :chars_(chars)
+    {
+    }
+
+    bool operator()(const tail_type &lhs, const tail_type &rhs) const
+    {
+        return std::lexicographical_compare(
+                   chars_.begin() + lhs.offset,
+                   chars_.begin() + lhs.offset + lhs.length,
+                   chars_.begin() + rhs.offset,
+                   chars_.begin() + rhs.offset + rhs.length);
+    }
+
+  private:
+    const std::vector<trie::char_type> &chars_;
+};
+
+/// Accesses the char_types of sorted reversed tails of insert_bulk.
+class tail_label {
+  public:
+    typedef trie::char_type char_type;
+
+    tail_label(const std::vector<trie::char_type> &chars,
+               const std::vector<tail_type> &tails)
+        :chars_(chars), tails_(tails)
+    {
+    }
+
+    /// Returns the number of char_types of tail i.
+    size_t length(size_t i) const
+    {
+        return tails_[i].length;
+    }
+
+    /// Returns the d(th) char_type of tail i.
+    char_type label(size_t i, size_t d) const
+    {
+        if (d < tails_[i].length)
+            return chars_[tails_[i].offset + d];
+        return trie::key_type::kTerminator;
+    }
+
+  private:
+    const std::vector<trie::char_type> &chars_;
+    const std::vector<tail_type> &tails_;
+};
+
+/**
+ * Stores input char_types of states in [first, last) whose CHECK is s
+ * into targets. These are the kernels of basic_trie::scan_exist_target.
+ *
+ * @param states The state buffer.
+ * @param base BASE of s.
+ * @param first First state to be compared.
+ * @param last Last state (excluded) to be compared.
+ * @param s Parent state.
+ * @param[out] targets The input char_types in ascending order.
+ * @return Number of targets stored.
+ */
+static trie::size_type scan_check(const basic_trie::state_type *states,
+                                  trie::size_type base,
+                                  trie::size_type first,
+                                  trie::size_type last,
+                                  trie::size_type s,
+                                  trie::char_type *targets)
+{
+    trie::char_type *p = targets;
+    for (trie::size_type t = first; t < last; t++)
+        if (states[t].check == s)
+            *(p++) = t - base;
+    return p - targets;
+}
+
+#ifdef HAVE_X86_SIMD
+/*
+ * Each state is a pair of (BASE, CHECK), so after comparing all int32
+ * lanes with s only the odd bits of the mask belong to CHECK.
+ */
+__attribute__((target("sse2")))
+static trie::size_type scan_check_sse2(const basic_trie::state_type *states,
+                                       trie::size_type base,
+                                       trie::size_type first,
+                                       trie::size_type last,
+                                       trie::size_type s,
+                                       trie::char_type *targets)
+{
+    trie::char_type *p = targets;
+    trie::size_type t;
+    const __m128i needle = _mm_set1_epi32(s);
+
+    for (t = first; t + 4 <= last; t += 4) {
+        const __m128i *v = reinterpret_cast<const __m128i *>(states + t);
+        __m128i lo = _mm_cmpeq_epi32(_mm_loadu_si128(v), needle);
+        __m128i hi = _mm_cmpeq_epi32(_mm_loadu_si128(v + 1), needle);
+        unsigned mask = (_mm_movemask_ps(_mm_castsi128_ps(lo))
+                         | (_mm_movemask_ps(_mm_castsi128_ps(hi)) << 4))
+                        & 0xaa;
+        while (mask) {
+            *(p++) = t + (__builtin_ctz(mask) >> 1) - base;
+            mask &= mask - 1;
+        }
+    }
+    return (p - targets) + scan_check(states, base, t, last, s, p);
+}
+
+__attribute__((target("avx2")))
+static trie::size_type scan_check_avx2(const basic_trie::state_type *states,
+                                       trie::size_type base,
+                                       trie::size_type first,
+                                       trie::size_type last,
+                                       trie::size_type s,
+                                       trie::char_type *targets)
+{
+    trie::char_type *p = targets;
+    trie::size_type t;
+    const __m256i needle = _mm256_set1_epi32(s);
+
+    for (t = first; t + 8 <= last; t += 8) {
+        const __m256i *v = reinterpret_cast<const __m256i *>(states + t);
+        __m256i lo = _mm256_cmpeq_epi32(_mm256_loadu_si256(v), needle);
+        __m256i hi = _mm256_cmpeq_epi32(_mm256_loadu_si256(v + 1), needle);
+        unsigned mask = (_mm256_movemask_ps(_mm256_castsi256_ps(lo))
+                         | (_mm256_movemask_ps(_mm256_castsi256_ps(hi)) << 8))
+                        & 0xaaaa;
+        while (mask) {
+            *(p++) = t + (__builtin_ctz(mask) >> 1) - base;
+            mask &= mask - 1;
+        }
+    }
+    return (p - targets) + scan_check(states, base, t, last, s, p);
+}
+#endif
+
+/// Returns the best instruction set supported by the running cpu.
+static basic_trie::simd_type detect_simd()
+{
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return basic_trie::SIMD_AVX2;
+    if (__builtin_cpu_supports("sse2"))
+        return basic_trie::SIMD_SSE2;
+#endif
+    return basic_trie::SIMD_NONE;
+}
+
+trie::~trie()
+{
+}
+
+// ************************************************************************
+// * Implementation of basic_trie                                         *
+// ************************************************************************
+
+basic_trie::simd_type basic_trie::simd_ = detect_simd();
+
+basic_trie::simd_type basic_trie::set_simd(simd_type simd)
+{
+    simd_type best = detect_simd();
+    simd_ = (simd > best)?best:simd;
+    return simd_;
+}
+
+trie::size_type
+basic_trie::scan_exist_target(size_type s, char_type *targets) const
+{
+    if (s <= 0)
+        return 0;
+    size_type first = std::max(base(s) + 1, 1);
+    size_type last = std::min(base(s) + key_type::kCharsetSize + 1,
+                              header_->size);
+    if (first >= last)
+        return 0;
+    switch (simd_) {
+#ifdef HAVE_X86_SIMD
+        case SIMD_AVX2:
+            return scan_check_avx2(states_, base(s), first, last, s, targets);
+        case SIMD_SSE2:
+            return scan_check_sse2(states_, base(s), first, last, s, targets);
+#endif
+        default:
+            return scan_check(states_, base(s), first, last, s, targets);
+    }
+}
+
+basic_trie::basic_trie(size_type size,
+                       trie_relocator_interface<size_type> *relocator)
+    :header_(NULL), states_(NULL), max_state_(0), owner_(true),
+     links_(NULL), labels_(NULL), blocks_(NULL),
+     open_(-1), closed_(-1), full_(-1),
+     relocator_(relocator), threads_(1)
+{
+    if (size < key_type::kCharsetSize)
+        size = kDefaultStateSize;
+    header_ = new header_type();
+    memset(header_, 0, sizeof(header_type));
+    resize_state(size);
+}
+
+basic_trie::basic_trie(void *header, void *states)
+    :header_(NULL), states_(NULL), max_state_(0), owner_(false),
+     links_(NULL), labels_(NULL), blocks_(NULL),
+     open_(-1), closed_(-1), full_(-1),
+     relocator_(NULL), threads_(1)
+{
+    header_ = static_cast<header_type *>(header);
+    states_ = static_cast<state_type *>(states);
+}
+
+basic_trie::basic_trie(const basic_trie &trie)
+    :header_(NULL), states_(NULL), max_state_(0), owner_(false),
+     links_(NULL), labels_(NULL), blocks_(NULL),
+     open_(-1), closed_(-1), full_(-1),
+     relocator_(NULL), threads_(1)
+{
+    clone(trie);
+}
+
+basic_trie &basic_trie::operator=(const basic_trie &trie)
+{
+    clone(trie);
+    return *this;
+}
+
+void basic_trie::clone(const basic_trie &trie)
+{
+    if (owner_) {
+        if (header_) {
+            sanity_delete(header_);
+        }
+        if (states_) {
+            resize(states_, 0, 0);
+            states_ = NULL;  // set to NULL for next resize
+        }
+    }
+    owner_ = true;
+    max_state_ = trie.max_state();
+    header_ = new header_type();
+    states_ = resize(states_, 0, trie.header()->size);
+    memcpy(header_, trie.header(), sizeof(header_type));
+    memcpy(states_, trie.states(), trie.header()->size * sizeof(state_type));
+    clear_blocks();
+    grow_blocks(0, header_->size);
+    labels_ = resize(labels_, 0, header_->size);
+    build_labels();
+}
+
+basic_trie::~basic_trie()
+{
+    if (owner_) {
+        sanity_delete(header_);
+        resize(states_, 0, 0);  // free states_
+        free(labels_);
+        clear_blocks();
+    }
+}
+
+void basic_trie::build_labels()
+{
+    // walk backward so that each list is built in ascending order
+    for (size_type t = header_->size - 1; t > 1; t--) {
+        size_type s = check(t);
+        if (s > 0 && s < header_->size && t - base(s) > 0
+            && t - base(s) <= key_type::kCharsetSize) {
+            labels_[t].sibling = labels_[s].child;
+            labels_[s].child = t - base(s);
+        }
+    }
+}
+
+void basic_trie::grow_blocks(size_type osize, size_type nsize)
+{
+    size_type b, s;
+    size_type ocount = (osize + kBlockSize - 1) / kBlockSize;
+    size_type ncount = (nsize + kBlockSize - 1) / kBlockSize;
+
+    links_ = resize(links_, osize, nsize);
+    blocks_ = resize(blocks_, ocount, ncount);
+    // new blocks start as full, push_empty moves them to open list
+    for (b = ocount; b < ncount; b++) {
+        blocks_[b].head = -1;
+        transfer_block(b, NULL, &full_);
+    }
+    // state 0 is never used and state 1 is the root
+    for (s = std::max(osize, 2); s < nsize; s++)
+        if (check(s) <= 0)
+            push_empty(s);
+}
+
+void basic_trie::push_empty(size_type s)
+{
+    size_type b = s / kBlockSize;
+    block_type &block = blocks_[b];
+
+    if (block.num == 0) {
+        links_[s].prev = links_[s].next = s;
+        block.head = s;
+        transfer_block(b, &full_, &open_);
+    } else {
+        size_type tail = links_[block.head].prev;
+        links_[s].prev = tail;
+        links_[s].next = block.head;
+        links_[tail].next = s;
+        links_[block.head].prev = s;
+        if (block.trial >= kMaxTrial)
+            transfer_block(b, &closed_, &open_);
+    }
+    block.num++;
+    block.trial = 0;
+}
+
+void basic_trie::pop_empty(size_type s)
+{
+    size_type b = s / kBlockSize;
+    block_type &block = blocks_[b];
+
+    if (--block.num == 0) {
+        block.head = -1;
+        transfer_block(b, (block.trial >= kMaxTrial)?&closed_:&open_, &full_);
+    } else {
+        links_[links_[s].prev].next = links_[s].next;
+        links_[links_[s].next].prev = links_[s].prev;
+        if (block.head == s)
+            block.head = links_[s].next;
+    }
+}
+
+void basic_trie::transfer_block(size_type b, size_type *from, size_type *to)
+{
+    block_type &block = blocks_[b];
+
+    if (from) {
+        if (block.next == b) {
+            *from = -1;
+        } else {
+            blocks_[block.prev].next = block.next;
+            blocks_[block.next].prev = block.prev;
+            if (*from == b)
+                *from = block.next;
+        }
+    }
+    if (*to < 0) {
+        block.prev = block.next = b;
+        *to = b;
+    } else {
+        size_type tail = blocks_[*to].prev;
+        block.prev = tail;
+        block.next = *to;
+        blocks_[tail].next = b;
+        blocks_[*to].prev = b;
+    }
+}
+
+//返回可用的偏移基址，但并没有对base,check写入
+trie::size_type
+basic_trie::find_base(const char_type *inputs, const extremum_type &extremum)
+{
+    size_type i, b, s, num = 0;
+    char_type min = key_type::kCharsetSize + 1, max = 0;
+    const char_type *p;
+
+    // extremum given by callers may be loose, so count them again
+    for (p = inputs; *p; p++, num++) {
+        if (*p < min)
+            min = *p;
+        if (*p > max)
+            max = *p;
+    }
+    assert(num > 0);
+
+    // a single input fits in any empty state, try closed blocks first
+    if (num == 1 && closed_ >= 0) {
+        b = closed_;
+        do {
+            s = blocks_[b].head;
+            do {
+                if (s - min > 0) {
+                    i = s - min;
+                    goto found;
+                }
+                s = links_[s].next;
+            } while (s != blocks_[b].head);
+            b = blocks_[b].next;
+        } while (b != closed_);
+    }
+
+    // try every empty state of open blocks which have enough room
+    if (open_ >= 0) {
+        size_type last = blocks_[open_].prev, next;
+        for (b = open_; ; b = next) {
+            block_type &block = blocks_[b];
+            next = block.next;
+            if (block.num >= num) {
+                s = block.head;
+                do {
+                    i = s - min;
+                    if (i > 0) {
+                        for (p = inputs; *p; p++)
+                            if (i + *p < header_->size && check(i + *p) > 0)
+                                break;
+                        if (!*p)
+                            goto found;
+                    }
+                    s = links_[s].next;
+                } while (s != block.head);
+            }
+            if (++block.trial == kMaxTrial)
+                transfer_block(b, &open_, &closed_);
+            if (b == last)
+                break;
+        }
+    }
+
+    // no room at all, use states behind the end of state buffer
+    i = header_->size - min;
+
+found:
+    if (i + max >= header_->size)
+        resize_state(i + max - header_->size + 1);
+    return i;
+}
+
+trie::size_type
+basic_trie::relocate(size_type stand,
+                     size_type s,
+                     const char_type *inputs,
+                     const extremum_type &extremum)
+{
+    size_type obase, nbase, i;
+    char_type targets[key_type::kCharsetSize + 1];
+
+    obase = base(s);  // save old base value
+    nbase = find_base(inputs, extremum);  // find a new base
+
+    for (i = 0; inputs[i]; i++) {
+        if (check(obase + inputs[i]) != s)  // find old links
+            continue;
+        set_base(nbase + inputs[i], base(obase + inputs[i]));//保证子状态偏移基址不变，不影响后--后面状态的状态编号,即存储位置不变，不用更新
+        set_check(nbase + inputs[i], check(obase + inputs[i]));//父状态号s没有改变，改变的是父状态的偏移基址
+        find_exist_target(obase + inputs[i], targets, NULL);//找到原来的孙子状态编号(因为子状态偏移基址不变，所以孙子状态编号也不变)
+        if (labels_) {
+            labels_[nbase + inputs[i]] = labels_[obase + inputs[i]];
+            labels_[obase + inputs[i]].child = 0;
+            labels_[obase + inputs[i]].sibling = 0;
+        }
+        //因为子状态编号变了，所以孙子状态的父状态编号要更新
+        for (char_type *p = targets; *p; p++) {
+            set_check(base(obase + inputs[i]) + *p, nbase + inputs[i]);
+        }
+        // if where we are standing is moving, we move with it
+        if (stand == obase + inputs[i])
+            stand = nbase + inputs[i];
+        if (relocator_)
+            relocator_->relocate(obase + inputs[i], nbase + inputs[i]);
+        // free old places
+        set_base(obase + inputs[i], 0);
+        set_check(obase + inputs[i], 0);
+        // create new links according old ones
+    }
+    // finally, set new base
+    set_base(s, nbase);
+
+    return stand;
+}
+
+//包含了解决冲突的情况
+trie::size_type
+basic_trie::create_transition(size_type s, char_type ch)
+{
+    char_type targets[key_type::kCharsetSize + 1];
+    char_type parent_targets[key_type::kCharsetSize + 1];
+    extremum_type extremum = {0, 0}, parent_extremum = {0, 0};
+
+    size_type t = next(s, ch);
+    if (t >= header_->size)
+        resize_state(t - header_->size + 1);
+
+    if (base(s) > 0 && check(t) <= 0) {//base[s]>0,意味着s还不是终点（构成了一个词）
+        // Do Nothing !!
+    } else {
+        //解决冲突，改变base[s],还是改变base[check[t]],取决于谁的下一个状态数少，就改变谁的base[]，这样操作更少
+        size_type num_targets =
+            find_exist_target(s, targets, &extremum);
+        size_type num_parent_targets = check(t)?
+            find_exist_target(check(t), parent_targets, &parent_extremum):0;
+        if (num_parent_targets > 0 && num_targets + 1 > num_parent_targets) {
+            //s比check[t]的目标状态多，改变base[check[t]]
+            s = relocate(s, check(t), parent_targets, parent_extremum);
+        } else {
+            targets[num_targets++] = ch;
+            targets[num_targets] = 0;
+            if (ch > extremum.max || !extremum.max)
+                extremum.max = ch;
+            if (ch < extremum.min || !extremum.min)
+                extremum.min = ch;
+            s = relocate(s, s, targets, extremum);
+        }
+        t = next(s, ch);
+        if (t >= header_->size)
+            resize_state(t - header_->size + 1);
+    }
+    set_check(t, s);
+    if (labels_)
+        add_label(s, ch);
+
+    return t;
+}
+
+trie::size_type
+basic_trie::create_transitions(size_type s,
+                               const char_type *inputs,
+                               const extremum_type &extremum)
+{
+    size_type nbase = find_base(inputs, extremum);
+    for (const char_type *p = inputs; *p; p++)
+        set_check(nbase + *p, s);
+    set_base(s, nbase);
+    if (labels_) {
+        char_type sorted[key_type::kCharsetSize + 1];
+        size_t i, n;
+        for (n = 0; inputs[n]; n++)
+            sorted[n] = inputs[n];
+        std::sort(sorted, sorted + n);
+        labels_[s].child = sorted[0];
+        for (i = 0; i < n; i++)
+            labels_[nbase + sorted[i]].sibling = (i + 1 < n)?sorted[i + 1]:0;
+    }
+    // leaves may never get a BASE value, count them in as well
+    if (nbase + extremum.max > max_state_)
+        max_state_ = nbase + extremum.max;
+    return nbase;
+}
+//value不是偏移基址?
+//关键词key(比如"hello")所设置的value就是base[hello]里的值，所以value代表key所对应的偏移基址。
+void basic_trie::insert(const key_type &key, const value_type &value)
+{
+    //value为偏移基址
+    if (value < 1)
+        throw std::runtime_error("basic_trie::insert: value must > 0");
+
+    const char_type *p = NULL;
+    size_type s = go_forward(1, key.data(), &p);
+    if (!p) {
+        // duplicated key found
+        set_base(s, value);
+        return;
+    }
+    do {
+        s = create_transition(s, *p);
+    } while (*p++ != key_type::kTerminator);
+    //s对应abcdef(Terminator)，value设置为负值，代表单词结束标记？不可为负，必须大于0
+    set_base(s, value);
+}
+
+//value对应key状态的偏移基址,并不是？并不是，value是与key对应的值，比如员工编号，解释含义的下标
+bool basic_trie::search(const key_type &key, value_type *value) const
+{
+    const char_type *p = NULL;
+    size_type s = go_forward(1, key.data(), &p);
+    if (p)
+        return false;
+    if (value)
+        *value = base(s);
+    return true;
+}
+
+bool basic_trie::search(const char *inputs, size_t length,
+                        value_type *value) const
+{
+    byte_label label(&inputs, &length);
+    size_t depth;
+    size_type s = go_forward(1, label, 0, &depth);
+    if (depth < label.length(0))
+        return false;
+    if (value)
+        *value = base(s);
+    return true;
+}
+
+size_t basic_trie::search_batch(const key_type *keys, size_t n,
+                                value_type *values, bool *found) const
+{
+    return search_labels(key_label(keys), n, values, found);
+}
+
+size_t basic_trie::search_batch(const char *const *inputs,
+                                const size_t *lengths, size_t n,
+                                value_type *values, bool *found) const
+{
+    return search_labels(byte_label(inputs, lengths), n, values, found);
+}
+
+template<typename L>
+size_t basic_trie::search_labels(const L &label, size_t n,
+                                 value_type *values, bool *found) const
+{
+    size_type states[kBatchSize];
+    size_t depths[kBatchSize];
+    size_t first, i, count = 0;
+
+    for (first = 0; first < n; first += kBatchSize) {
+        size_t last = std::min(first + kBatchSize, n);
+        forward_batch(*this, label, first, last, states, depths);
+        for (i = first; i < last; i++) {
+            found[i] = (depths[i - first] == label.length(i));
+            if (found[i]) {
+                values[i] = base(states[i - first]);
+                ++count;
+            }
+        }
+    }
+    return count;
+}
+
+void basic_trie::insert_bulk(std::vector<entry_type> *entries)
+{
+    if (max_state_ > 0) {
+        trie::insert_bulk(entries);
+        return;
+    }
+    sort_entries(entries, threads_);
+    std::vector<entry_type>::const_iterator it;
+    for (it = entries->begin(); it != entries->end(); it++)
+        if (it->value < 1)
+            throw std::runtime_error("basic_trie::insert_bulk: value must > 0");
+
+    std::vector<leaf_type> leaves;
+    build_sorted(this, entry_label(*entries), entries->size(),
+                 kLeafOnTerminator, &leaves, threads_);
+    std::vector<leaf_type>::const_iterator leaf;
+    for (leaf = leaves.begin(); leaf != leaves.end(); leaf++)
+        set_base(leaf->state, (*entries)[leaf->index].value);
+}
+
+size_t
+basic_trie::prefix_search(const key_type &prefix, result_type *result) const
+{
+    const char_type *p;
+    size_type s = go_forward(1, prefix.data(), &p);
+    // a prefix which is a key itself ends up beyond its terminator
+    if (!p)
+        s = prev(s);
+    key_type store(prefix);
+    prefix_search_aux(s, p, &store, result);
+    return result->size();
+}
+
+trie::cursor *basic_trie::prefix_cursor(const char *prefix, size_t length,
+                                        size_t limit, const char *after,
+                                        size_t after_length) const
+{
+    check_after(prefix, length, after, after_length);
+    return new walk_cursor<basic_walker>(basic_walker(this), prefix, length,
+                                         limit, after, after_length);
+}
+
+size_t basic_trie::fuzzy_search(const char *inputs, size_t length,
+                                size_t distance, fuzzy_callback found,
+                                void *context) const
+{
+    return find_fuzzy(basic_walker(this), inputs, length, distance, found,
+                      context);
+}
+
+bool basic_trie::step(traversal_type *t, char ch) const
+{
+    size_type s = t->state?t->state:1;
+    size_type n = next(s, key_type::char_in(ch));
+    if (!check_transition(s, n))
+        return false;
+    t->key.push_back(ch);
+    t->state = n;
+    return true;
+}
+
+bool basic_trie::value(const traversal_type &t, value_type *result) const
+{
+    size_type s = t.state?t.state:1;
+    size_type n = next(s, key_type::kTerminator);
+    if (!check_transition(s, n))
+        return false;
+    if (result)
+        *result = base(n);
+    return true;
+}
+
+trie::cursor *basic_trie::enumerate(const traversal_type &t,
+                                    size_t limit) const
+{
+    walk_node n = {t.state?t.state:1, 0};
+    return new walk_cursor<basic_walker>(basic_walker(this), n, t.key, limit);
+}
+
+template<typename F>
+void basic_trie::find_prefixes(const char *inputs, size_t length,
+                               F &found) const
+{
+    size_type s = 1;
+    for (size_t i = 0; ; i++) {
+        size_type t = next(s, key_type::kTerminator);
+        if (check_transition(s, t))
+            found(i, base(t));
+        if (i == length)
+            break;
+        t = next(s, key_type::char_in(inputs[i]));
+        if (!check_transition(s, t))
+            break;
+        s = t;
+    }
+}
+
+size_t basic_trie::common_prefix_search(const char *inputs, size_t length,
+                                        prefix_result_type *result) const
+{
+    prefix_collector found = {result};
+    find_prefixes(inputs, length, found);
+    return result->size();
+}
+
+bool basic_trie::longest_prefix(const char *inputs, size_t length,
+                                size_t *matched, value_type *value) const
+{
+    prefix_keeper found = {false, 0, 0};
+    find_prefixes(inputs, length, found);
+    return found.report(matched, value);
+}
+
+//保存前缀(对应状态s)后面的所有到终点的分支，和对应的base值,即查找所有前缀是s的key及base值
+size_t basic_trie::prefix_search_aux(size_type s,
+                                     const char_type *miss,
+                                     key_type *store,
+                                     result_type *result) const
+{
+    char_type targets[key_type::kCharsetSize + 1];
+
+    if (find_exist_target(s, targets, NULL)) {
+        for (char_type *p = targets; *p; p++) {
+            if (miss && *miss != key_type::kTerminator && *miss != *p)
+                continue;
+            size_type t = next(s, *p);
+            store->push(*p);
+            if (!miss || *miss == key_type::kTerminator)
+                prefix_search_aux(t, miss, store, result);
+            else
+                prefix_search_aux(t, miss + 1, store, result);
+            store->pop();
+        }
+    } else if (s > 1) {
+        // the root of an empty trie is not a leaf
+        result->push_back(std::pair<key_type, value_type>(*store, base(s)));
+    }
+    return 0;
+}
+
+void basic_trie::remove_state(size_type s)
+{
+    size_type t = prev(s);
+    if (labels_ && t > 0) {
+        uint16_t *p = &labels_[t].child;
+        while (*p && next(t, *p) != s)
+            p = &labels_[next(t, *p)].sibling;
+        if (*p)
+            *p = labels_[s].sibling;
+        labels_[s].child = 0;
+        labels_[s].sibling = 0;
+    }
+    set_base(s, 0);
+    set_check(s, 0);
+}
+
+trie::size_type
+basic_trie::stitch(size_type s, const basic_trie &sub, size_type offset)
+{
+    size_type t, last = sub.last_state();
+    // keep room for scanning targets after the last state
+    size_type need = last + offset + key_type::kCharsetSize + 1;
+    if (need >= header_->size)
+        resize_state(need - header_->size);
+    for (t = 2; t <= last; t++) {
+        if (sub.check(t) <= 0)
+            continue;
+        size_type b = sub.base(t);
+        set_check(t + offset, (sub.check(t) == 1)?s:sub.check(t) + offset);
+        set_base(t + offset, (b > 0)?b + offset:b);
+        if (labels_ && sub.labels_)
+            labels_[t + offset] = sub.labels_[t];
+    }
+    set_base(s, sub.base(1) + offset);
+    if (labels_ && sub.labels_)
+        labels_[s].child = sub.labels_[1].child;
+    return last + offset;
+}
+
+//打印从s开始所有字符串
+void basic_trie::trace(size_type s) const
+{
+    size_type num_target;
+    char_type targets[key_type::kCharsetSize + 1];
+    static std::vector<size_type> trace_stack;
+
+    trace_stack.push_back(s);
+    if ((num_target = find_exist_target(s, targets, NULL))) {
+        for (char_type *p = targets; *p; p++) {
+            size_type t = next(s, *p);
+            if (t < header_->size)
+                trace(next(s, *p));
+        }
+    } else {
+        size_type cbase = 0, obase = 0;
+        std::cerr << "transition => ";
+        std::vector<size_type>::const_iterator it;
+        for (it = trace_stack.begin();it != trace_stack.end(); it++) {
+            cbase = base(*it);
+            if (obase) {
+                if (*it - obase == key_type::kTerminator) {
+                    std::cerr << "-#->";
+                } else {
+                    char ch = key_type::char_out(*it - obase);
+                    if (isgraph(ch))
+                        std::cerr << "-'" << ch << "'->";
+                    else
+                        std::cerr << "-<" << std::hex
+                                  << static_cast<uint8_t>(ch) << ">->";
+                }
+            }
+            std::clog << *it << "[" << cbase << "]";
+            obase = cbase;
+        }
+        std::cerr << "->{" << std::dec << (cbase) << "}" << std::endl;
+    }
+    trace_stack.pop_back();
+}
+
+// ************************************************************************
+// * Implementation of two trie                                           *
+// ************************************************************************
+
+double_trie::double_trie(size_t size)
+    :header_(NULL), lhs_(NULL), rhs_(NULL), index_(NULL), accept_(NULL),
+     next_accept_(1), next_index_(1), front_relocator_(NULL),
+     rear_relocator_(NULL), threads_(1), record_(false),
+     max_values_(NULL), record_ids_(false), key_ids_(NULL),
+     id_states_(NULL), record_aggregates_(false), aggregates_(NULL),
+     mmap_(NULL), mmap_size_(0)
+{
+    header_ = new header_type();
+    memset(header_, 0, sizeof(header_type));
+    snprintf(header_->magic, sizeof(header_->magic), "%s", magic_);
+    front_relocator_ = new trie_relocator<double_trie>
+                           (this, &double_trie::relocate_front);
+    rear_relocator_ = new trie_relocator<double_trie>
+                          (this, &double_trie::relocate_rear);
+    lhs_ = new basic_trie(size);
+    rhs_ = new basic_trie(size);
+    lhs_->set_relocator(front_relocator_);
+    rhs_->set_relocator(rear_relocator_);
+    header_->index_size = size?size:basic_trie::kDefaultStateSize;
+    index_ = resize(index_, 0, header_->index_size);
+    header_->accept_size = size?size:basic_trie::kDefaultStateSize;
+    accept_ = resize(accept_, 0, header_->accept_size);
+    watcher_[0] = 0;
+    watcher_[1] = 0;
+}
+
+double_trie::double_trie(const char *filename, off_t offset, off_t length)
+    :header_(NULL), lhs_(NULL), rhs_(NULL), index_(NULL), accept_(NULL),
+     next_accept_(1), next_index_(1), front_relocator_(NULL),
+     rear_relocator_(NULL), threads_(1), record_(false),
+     max_values_(NULL), record_ids_(false), key_ids_(NULL),
+     id_states_(NULL), record_aggregates_(false), aggregates_(NULL),
+     mmap_(NULL), mmap_size_(0)
+{
+    struct stat sb;
+    int fd, retval;
+
+    if (!filename)
+        throw std::runtime_error(std::string("can not load from file ")
+                                 + filename);
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error(strerror(errno));
+    if (fstat(fd, &sb) < 0)
+        throw std::runtime_error(strerror(errno));
+    if (offset < 0 || offset >= sb.st_size || length < 0
+        || length > sb.st_size - offset)
+        throw std::runtime_error("file corrupted");
+    if (!length)
+        length = sb.st_size - offset;
+
+    // mmap starts at a page, the archive may start anywhere in it
+    off_t skip = offset % sysconf(_SC_PAGESIZE);
+    mmap_size_ = length + skip;
+    mmap_ = mmap(NULL, mmap_size_, PROT_READ, MAP_PRIVATE, fd,
+                 offset - skip);
+    if (mmap_ == MAP_FAILED)
+        throw std::runtime_error(strerror(errno));
+    while (retval = close(fd), retval == -1 && errno == EINTR) {
+        // exmpty
+    }
+
+    void *start;
+    const char *end = static_cast<char *>(mmap_) + mmap_size_;
+    start = header_ = reinterpret_cast<header_type *>(
+                      static_cast<char *>(mmap_) + skip);
+    archive_extent(header_, 1, end);
+    if (strcmp(header_->magic, magic_))
+        throw std::runtime_error("file corrupted");
+    // load index
+    start = index_ = reinterpret_cast<index_type *>(
+                     reinterpret_cast<header_type *>(start) + 1);
+    // load accept
+    accept_ = reinterpret_cast<accept_type *>(
+              archive_extent(index_, header_->index_size, end));
+    // load front trie
+    start = archive_extent(accept_, header_->accept_size, end);
+    start = archive_extent(
+            reinterpret_cast<basic_trie::header_type *>(start), 1, end);
+    lhs_ = new basic_trie(reinterpret_cast<basic_trie::header_type *>(start)
+                          - 1, start);
+    size_type size = lhs_->header()->size;
+    // load rear trie
+    start = archive_extent(reinterpret_cast<basic_trie::state_type *>(start),
+                           size, end);
+    start = archive_extent(
+            reinterpret_cast<basic_trie::header_type *>(start), 1, end);
+    rhs_ = new basic_trie(reinterpret_cast<basic_trie::header_type *>(start)
+                          - 1, start);
+    start = archive_extent(reinterpret_cast<basic_trie::state_type *>(start),
+                           rhs_->header()->size, end);
+    // load max values, one per state of front trie
+    if (header_->max_size) {
+        if (header_->max_size != size)
+            throw std::runtime_error("file corrupted");
+        max_values_ = reinterpret_cast<value_type *>(start);
+        start = archive_extent(reinterpret_cast<value_type *>(start), size,
+                               end);
+    }
+    // load key ids
+    if (header_->id_size) {
+        key_ids_ = reinterpret_cast<size_type *>(start);
+        id_states_ = archive_extent(reinterpret_cast<size_type *>(start),
+                                    size, end);
+        start = archive_extent(const_cast<size_type *>(id_states_),
+                               header_->id_size, end);
+    }
+    // load aggregates, which start at a multiple of 8 bytes
+    if (header_->aggregate_size) {
+        if (header_->aggregate_size != size)
+            throw std::runtime_error("file corrupted");
+        size_t position = static_cast<char *>(start)
+                          - reinterpret_cast<char *>(header_);
+        aggregates_ = reinterpret_cast<aggregate_type *>(
+                      static_cast<char *>(start) + (8 - position % 8) % 8);
+        archive_extent(aggregates_, size, end);
+    }
+}
+
+
+double_trie::~double_trie()
+{
+    if (mmap_) {
+        if (munmap(mmap_, mmap_size_) < 0)
+            throw std::runtime_error(strerror(errno));
+    } else {
+        sanity_delete(header_);
+        resize(index_, 0, 0);  // free index_
+        resize(accept_, 0, 0);  // free accept_
+        sanity_delete(front_relocator_);
+        sanity_delete(rear_relocator_);
+    }
+    sanity_delete(lhs_);
+    sanity_delete(rhs_);
+}
+
+trie::size_type
+double_trie::rhs_append(const char_type *inputs)
+{
+    const char_type *p;
+    size_type s = 1, t;
+
+    s = rhs_->go_forward_reverse(s, inputs, &p);
+    if (!p) {  // all characters match
+        if (outdegree(s) == 0) {
+            return s;
+        } else {
+            t = rhs_->next(s, key_type::kTerminator);
+            if (!rhs_->check_transition(s, t))
+                return rhs_->create_transition(s, key_type::kTerminator);
+            return t;
+        }
+    }
+    if (outdegree(s) == 0) {
+        t = rhs_->create_transition(s, key_type::kTerminator);
+        std::set<size_type>::const_iterator it;
+        if (refer_.find(s) != refer_.end()) {
+            for (it = refer_[s].referer.begin();
+                    it != refer_[s].referer.end();
+                    it++) {
+                set_link(*it, t);
+            }
+            free_accept_entry(s);
+        }
+    }
+    do {
+        s = rhs_->create_transition(s, *p);
+    } while (p-- > inputs);
+    return s;
+}
+
+void
+double_trie::lhs_insert(size_type s, const char_type *inputs, value_type value)
+{
+    size_t i;
+    s = lhs_->create_transition(s, inputs[0]);
+    if (*inputs == key_type::kTerminator) {
+        i = find_index_entry(s);
+        index_[i].index = 0;
+    } else {
+        i = set_link(s, rhs_append(inputs + 1));
+    }
+    index_[i].data = value;
+}
+
+void double_trie::rhs_clean_more(size_type t)
+{
+    if (outdegree(t) == 0 && count_referer(t) == 0) {
+        assert(rhs_->check(t) > 0);
+        size_type s = rhs_->prev(t);
+        remove_accept_state(t);
+        assert(s > 0);
+        rhs_clean_more(s);
+    } else if (outdegree(t) == 1) {
+        size_type r = rhs_->next(t, key_type::kTerminator);
+        if (rhs_->check_transition(t, r)) {
+            // delete transition 't -#-> r'
+            if (refer_.find(r) != refer_.end()) {
+                std::set<size_type>::const_iterator it;
+                for (it = refer_[r].referer.begin();
+                        it != refer_[r].referer.end();
+                        it++)
+                    set_link(*it, t);
+                assert (refer_.find(t) != refer_.end());
+                accept_[refer_[t].accept_index].accept = t;
+            }
+            remove_accept_state(r);
+        }
+    }
+}
+
+void double_trie::rhs_insert(size_type s, size_type r,
+                             const std::vector<char_type> &match,
+                             const char_type *remain,
+                             char_type ch, size_type value)
+{
+    // R-1
+    size_type u = link_state(s);
+    assert(u > 0);
+    assert(rhs_->check(u) > 0);
+    value_type oval = index_[-lhs_->base(s)].data;
+    index_[-lhs_->base(s)].index = 0;
+    index_[-lhs_->base(s)].data = 0;
+    free_index_.push_back(-lhs_->base(s));
+    // s is separator which implies base(s) < 0, so we need to set base(s) = 0
+    lhs_->set_base(s, 0);
+    watcher_[0] = u; // u & r may be changed during rhs_->create_transition
+    watcher_[1] = r; // we use watcher_ to monitor there changing.
+    if (refer_.find(u) != refer_.end()) {
+        refer_[u].referer.erase(s);
+
+        if (refer_[u].referer.size() == 0)
+            free_accept_entry(u);
+    }
+
+    // R-2
+    std::vector<char_type>::const_iterator it;
+    for (it = match.begin(); it != match.end(); it++) {
+        s = lhs_->create_transition(s, *it);
+    }
+
+    size_type t = lhs_->create_transition(s, *remain);
+    size_type i;
+    if (*remain == key_type::kTerminator) {
+        i = find_index_entry(t);
+        index_[-lhs_->base(t)].data = value;
+        index_[-lhs_->base(t)].index = 0;
+    } else {
+        size_type a = rhs_append(remain + 1);
+        assert(rhs_->check(watcher_[0]) > 0);
+        i = set_link(t, a);
+        index_[i].data = value;
+    }
+
+    // R-3
+    t = lhs_->create_transition(s, ch);
+    size_type v = rhs_->prev(watcher_[1]);  // v -ch-> r
+    if (!rhs_->check_transition(v, rhs_->next(v, key_type::kTerminator)))
+        r = rhs_->create_transition(v, key_type::kTerminator);
+    else
+        r = rhs_->next(v, key_type::kTerminator);
+    i = set_link(t, r);
+    index_[i].data = oval;
+
+    // R-4
+    u = watcher_[0];
+    if (!rhs_clean_one(u))
+        rhs_clean_more(u);
+}
+
+void double_trie::insert(const key_type &key, const value_type &value)
+{
+    const char_type *p;
+    size_type s = lhs_->go_forward(1, key.data(), &p);
+
+    if (!p) {
+        // duplicated key found
+        index_[-lhs_->base(s)].data = value;
+        return;
+    }
+
+    if (!check_separator(s)) {
+        lhs_insert(s, p, value);
+        return;
+    }
+    assert(index_[-lhs_->base(s)].index > 0);
+    size_type r = tail_start(link_state(s));
+
+    // travel reversely
+    exists_.clear();
+    do {
+        if (rhs_->check_reverse_transition(r, *p)) {
+            r = rhs_->prev(r);
+            exists_.push_back(*p);
+        } else {
+            break;
+        }
+        if (r == 1) {  // duplicated key
+            index_[-lhs_->base(s)].data = value;
+            return;
+        }
+    } while (*p++ != key_type::kTerminator);
+    char_type mismatch = r - rhs_->base(rhs_->prev(r));
+    rhs_insert(s, r, exists_, p, mismatch, value);
+    return;
+}
+
+void double_trie::insert_bulk(std::vector<entry_type> *entries)
+{
+    if (lhs_->max_state() > 0) {
+        trie::insert_bulk(entries);
+        return;
+    }
+    sort_entries(entries, threads_);
+
+    // front trie stops at the first state leading to only one key
+    std::vector<leaf_type> fronts;
+    build_sorted(lhs_, entry_label(*entries), entries->size(),
+                 kLeafOnUnique, &fronts, threads_);
+
+    // collect reversed tails the same way as rhs_append reads them
+    std::vector<char_type> chars;
+    std::vector<tail_type> tails;
+    size_t i, j;
+    for (i = 0; i < fronts.size(); i++) {
+        const entry_type &entry = (*entries)[fronts[i].index];
+        if (fronts[i].depth > entry.length) {
+            size_type k = find_index_entry(fronts[i].state);
+            index_[k].index = 0;
+            index_[k].data = entry.value;
+            continue;
+        }
+        tail_type tail = {chars.size(), entry.length - fronts[i].depth + 1, i};
+        chars.push_back(key_type::kTerminator);
+        for (j = entry.length; j-- > fronts[i].depth; /* empty */)
+            chars.push_back(key_type::char_in(entry.data[j]));
+        tails.push_back(tail);
+    }
+
+    // separated states share an accept state if their tails are equal
+    std::vector<tail_type> unique;
+    std::vector<size_t> owner(fronts.size());
+    std::sort(tails.begin(), tails.end(), tail_less(chars));
+    for (i = 0; i < tails.size(); i++) {
+        if (unique.empty()
+            || tail_less(chars)(unique.back(), tails[i]))
+            unique.push_back(tails[i]);
+        owner[tails[i].leaf] = unique.size() - 1;
+    }
+
+    std::vector<leaf_type> rears;
+    std::vector<size_type> accept(unique.size());
+    build_sorted(rhs_, tail_label(chars, unique), unique.size(),
+                 kLeafOnEnd, &rears, threads_);
+    for (i = 0; i < rears.size(); i++)
+        accept[rears[i].index] = rears[i].state;
+    for (i = 0; i < tails.size(); i++) {
+        const leaf_type &front = fronts[tails[i].leaf];
+        size_type k = set_link(front.state, accept[owner[tails[i].leaf]]);
+        index_[k].data = (*entries)[front.index].value;
+    }
+}
+
+bool double_trie::search(const key_type &key, value_type *value) const
+{
+    const char_type *p, *mismatch;
+    size_type s = lhs_->go_forward(1, key.data(), &p);
+    if (!p) {
+        if (value)
+            *value = index_[-lhs_->base(s)].data;
+        return true;
     }
     if (!check_separator(s))
         return false;
-    assert(index_[-lhs_->base(s)].index > 0);
-    size_type r = link_state(s);
-    // skip a terminator
-    if (rhs_->check_reverse_transition(r, key_type::kTerminator))
-        r = rhs_->prev(r);
-    r = rhs_->go_backward(r, p, &mismatch);
-    if (r == 1) {
+    assert(index_[-lhs_->base(s)].index > 0);
+    size_type r = tail_start(link_state(s));
+    r = rhs_->go_backward(r, p, &mismatch);
+    if (r == 1) {
+        if (value)
+            *value = index_[-lhs_->base(s)].data;
+        return true;
+    }
+    return false;
+}
+
+size_t double_trie::search_batch(const key_type *keys, size_t n,
+                                 value_type *values, bool *found) const
+{
+    return search_labels(key_label(keys), n, values, found);
+}
+
+size_t double_trie::search_batch(const char *const *inputs,
+                                 const size_t *lengths, size_t n,
+                                 value_type *values, bool *found) const
+{
+    return search_labels(byte_label(inputs, lengths), n, values,
+                         found);
+}
+
+bool double_trie::search(const char *inputs, size_t length,
+                         value_type *value) const
+{
+    byte_label label(&inputs, &length);
+    size_t depth;
+    size_type s = lhs_->go_forward(1, label, 0, &depth);
+    return search_tail(label, 0, s, depth, value);
+}
+
+template<typename L>
+bool double_trie::search_tail(const L &label, size_t i, size_type s,
+                              size_t depth, value_type *value) const
+{
+    if (depth < label.length(i)) {
+        if (!check_separator(s))
+            return false;
+        // go backward as go_backward does
+        size_type r = tail_start(link_state(s));
+        for (;; depth++) {
+            char_type ch = label.label(i, depth);
+            size_type t = rhs_->prev(r);
+            if (rhs_->next(t, ch) != r
+                || !rhs_->check_transition(t, rhs_->next(t, ch)))
+                break;
+            r = t;
+            if (ch == key_type::kTerminator)
+                break;
+        }
+        if (r != 1)
+            return false;
+    }
+    if (value)
+        *value = index_[-lhs_->base(s)].data;
+    return true;
+}
+
+template<typename L>
+size_t double_trie::search_labels(const L &label, size_t n,
+                                  value_type *values, bool *found) const
+{
+    size_type states[kBatchSize];
+    size_t depths[kBatchSize];
+    size_t first, i, count = 0;
+
+    for (first = 0; first < n; first += kBatchSize) {
+        size_t last = std::min(first + kBatchSize, n);
+        forward_batch(*lhs_, label, first, last, states, depths);
+        // index of separated states, then accept states, then rear trie
+        for (i = first; i < last; i++)
+            if (check_separator(states[i - first]))
+                __builtin_prefetch(index_ - lhs_->base(states[i - first]));
+        for (i = first; i < last; i++)
+            if (depths[i - first] < label.length(i)
+                && check_separator(states[i - first]))
+                __builtin_prefetch(accept_ + index_[-lhs_->base(
+                                   states[i - first])].index);
+        for (i = first; i < last; i++) {
+            found[i] = search_tail(label, i, states[i - first],
+                                   depths[i - first], &values[i]);
+            if (found[i])
+                ++count;
+        }
+    }
+    return count;
+}
+
+template<typename F>
+void double_trie::find_prefixes(const char *inputs, size_t length,
+                                F &found) const
+{
+    size_type s = 1;
+    size_t i;
+    for (i = 0; ; i++) {
+        if (check_separator(s))
+            break;
+        size_type t = lhs_->next(s, key_type::kTerminator);
+        if (lhs_->check_transition(s, t) && check_separator(t))
+            found(i, index_[-lhs_->base(t)].data);
+        if (i == length)
+            return;
+        t = lhs_->next(s, key_type::char_in(inputs[i]));
+        if (!lhs_->check_transition(s, t))
+            return;
+        s = t;
+    }
+    // the rest of the only key below s is in rear trie
+    size_type r = tail_start(link_state(s));
+    for (; ; i++) {
+        size_type t = rhs_->prev(r);
+        if (t == 1
+            && rhs_->check_reverse_transition(r, key_type::kTerminator)) {
+            found(i, index_[-lhs_->base(s)].data);
+            return;
+        }
+        if (i == length)
+            return;
+        char_type ch = key_type::char_in(inputs[i]);
+        if (rhs_->next(t, ch) != r
+            || !rhs_->check_transition(t, rhs_->next(t, ch)))
+            return;
+        r = t;
+    }
+}
+
+size_t double_trie::common_prefix_search(const char *inputs, size_t length,
+                                         prefix_result_type *result) const
+{
+    prefix_collector found = {result};
+    find_prefixes(inputs, length, found);
+    return result->size();
+}
+
+bool double_trie::longest_prefix(const char *inputs, size_t length,
+                                 size_t *matched, value_type *value) const
+{
+    prefix_keeper found = {false, 0, 0};
+    find_prefixes(inputs, length, found);
+    return found.report(matched, value);
+}
+
+size_t
+double_trie::prefix_search(const key_type &key, result_type *result) const
+{
+    const char_type *p;
+    size_type s = lhs_->go_forward(1, key.data(), &p);
+    key_type store;
+    if (lhs_->check_reverse_transition(s, key_type::kTerminator))
+        s = lhs_->prev(s);
+    if (p)
+        store.assign(key.data(), p - key.data());
+    else
+        store.assign(key.data(), key.length());
+    // keys already in result are not ours, only the appended ones are
+    size_t first = result->size();
+    lhs_->prefix_search_aux(s, p, &store, result);
+    // keys failing the rest of prefix are dropped by moving the others
+    // forward, erasing them one by one is quadratic
+    result_type::iterator it, last = result->begin() + first;
+    for (it = result->begin() + first; it != result->end(); it++) {
+        size_t i = -it->second;
+        if (index_[i].index) {
+            const char_type *miss = p;
+            bool fail = false;
+            size_type r = tail_start(accept_[index_[i].index].accept);
+            do {
+                char_type ch = r - rhs_->base(rhs_->prev(r));
+                r = rhs_->prev(r);
+                if (miss && *miss != key_type::kTerminator) {
+                    if (ch != *miss) {
+                        fail = true;
+                        break;
+                    }
+                    miss++;
+                }
+                it->first.push(ch);
+            } while (r > 1);
+            if (fail || (miss && *miss != key_type::kTerminator))
+                continue;
+        }
+        it->second = index_[i].data;
+        if (last != it)
+            *last = *it;
+        ++last;
+    }
+    result->erase(last, result->end());
+
+    return result->size();
+}
+
+/// Walks the front trie, rests of keys are found in the rear trie.
+class double_trie::walker: public basic_walker {
+  public:
+    explicit walker(const double_trie &owner)
+        :basic_walker(owner.lhs_), owner_(owner)
+    {
+    }
+
+    bool leaf(const walk_node &t, char_type ch) const
+    {
+        return owner_.check_separator(t.s);
+    }
+
+    value_type tail(const walk_node &t, char_type ch, std::string *key) const
+    {
+        const index_type &index = owner_.index_[-trie_->base(t.s)];
+        if (!index.index)
+            return index.data;
+        const basic_trie *rhs = owner_.rhs_;
+        size_type r = owner_.tail_start(owner_.accept_[index.index].accept);
+        // the walk ends with the terminator of the key
+        while (r > 1) {
+            char_type c = r - rhs->base(rhs->prev(r));
+            r = rhs->prev(r);
+            if (c != key_type::kTerminator)
+                key->push_back(out(c));
+        }
+        return index.data;
+    }
+
+    value_type value(const walk_node &t, char_type ch) const
+    {
+        return owner_.index_[-trie_->base(t.s)].data;
+    }
+
+    char_type in(char ch) const
+    {
+        return key_type::char_in(ch);
+    }
+
+    char out(char_type ch) const
+    {
+        return key_type::char_out(ch);
+    }
+
+  private:
+    const double_trie &owner_;
+};
+
+trie::cursor *double_trie::prefix_cursor(const char *prefix, size_t length,
+                                         size_t limit, const char *after,
+                                         size_t after_length) const
+{
+    check_after(prefix, length, after, after_length);
+    return new walk_cursor<walker>(walker(*this), prefix, length,
+                                   limit, after, after_length);
+}
+
+size_t double_trie::fuzzy_search(const char *inputs, size_t length,
+                                 size_t distance, fuzzy_callback found,
+                                 void *context) const
+{
+    return find_fuzzy(walker(*this), inputs, length, distance, found,
+                      context);
+}
+
+bool double_trie::step(traversal_type *t, char ch) const
+{
+    char_type c = key_type::char_in(ch);
+    if (t->tail) {
+        // the only key left, go backward in rear trie
+        if (!rhs_->check_reverse_transition(t->tail, c))
+            return false;
+        t->tail = rhs_->prev(t->tail);
+    } else {
+        size_type s = t->state?t->state:1;
+        size_type n = lhs_->next(s, c);
+        if (!lhs_->check_transition(s, n))
+            return false;
+        t->state = n;
+        if (check_separator(n))
+            t->tail = tail_start(link_state(n));
+    }
+    t->key.push_back(ch);
+    return true;
+}
+
+bool double_trie::value(const traversal_type &t, value_type *result) const
+{
+    size_type s = t.state;
+    if (t.tail) {
+        // the rest ends with the terminator leaving the root
+        if (rhs_->prev(t.tail) != 1
+            || !rhs_->check_reverse_transition(t.tail, key_type::kTerminator))
+            return false;
+    } else {
+        size_type n = lhs_->next(s?s:1, key_type::kTerminator);
+        if (!lhs_->check_transition(s?s:1, n) || !check_separator(n))
+            return false;
+        s = n;
+    }
+    if (result)
+        *result = index_[-lhs_->base(s)].data;
+    return true;
+}
+
+trie::cursor *double_trie::enumerate(const traversal_type &t,
+                                     size_t limit) const
+{
+    if (t.tail)
+        return trie::enumerate(t, limit);
+    walk_node n = {t.state?t.state:1, 0};
+    return new walk_cursor<walker>(walker(*this), n, t.key, limit);
+}
+
+size_t double_trie::top_k(const char *prefix, size_t length, size_t k,
+                          result_type *result) const
+{
+    if (!max_values_)
+        return trie::top_k(prefix, length, k, result);
+    return find_top_k(walker(*this), max_values_, prefix, length, k,
+                      result);
+}
+
+bool double_trie::key_of(size_type id, std::string *key,
+                         value_type *value) const
+{
+    if (!key_ids_ || id < 0 || id >= header_->id_size)
+        return false;
+    value_type found = restore_key(walker(*this), lhs_, id_states_[id],
+                                   key);
+    if (value)
+        *value = found;
+    return true;
+}
+
+trie::size_type double_trie::rank(const char *inputs, size_t length) const
+{
+    if (!key_ids_)
+        return trie::rank(inputs, length);
+    return find_rank(walker(*this), key_ids_, header_->id_size, inputs,
+                     length);
+}
+
+bool double_trie::aggregate_prefix(const char *prefix, size_t length,
+                                   aggregate_type *result) const
+{
+    if (!aggregates_)
+        return trie::aggregate_prefix(prefix, length, result);
+    return find_aggregate(walker(*this), aggregates_, prefix, length, result);
+}
+
+bool double_trie::id_of(const char *inputs, size_t length,
+                        size_type *id) const
+{
+    if (!key_ids_)
+        return false;
+    byte_label label(&inputs, &length);
+    size_t depth;
+    size_type s = lhs_->go_forward(1, label, 0, &depth);
+    if (!search_tail(label, 0, s, depth, NULL))
+        return false;
+    *id = key_ids_[s];
+    return true;
+}
+
+void double_trie::build(const char *filename, bool verbose)
+{
+    FILE *out;
+
+    if (!filename)
+        throw std::runtime_error(std::string("can not save to file ")
+                                 + filename);
+
+    std::vector<value_type> maxima;
+    if (record_) {
+        maxima.resize(lhs_->compact_header()->size, INT32_MIN);
+        find_max_values(walker(*this), &maxima[0]);
+    }
+    std::vector<size_type> ids, states;
+    if (record_ids_) {
+        ids.resize(lhs_->compact_header()->size, -1);
+        find_key_ids(walker(*this), &ids[0], &states);
+    }
+    std::vector<aggregate_type> aggregates;
+    if (record_aggregates_) {
+        aggregate_type none = {0, 0, INT32_MAX, INT32_MIN, 0};
+        aggregates.resize(lhs_->compact_header()->size, none);
+        find_aggregates(walker(*this), &aggregates[0]);
+    }
+
+    if ((out = fopen(filename, "w+"))) {
+        snprintf(header_->magic, sizeof(header_->magic), "%s", magic_);
+        header_->index_size = next_index_;
+        header_->accept_size = next_accept_;
+        header_->max_size = maxima.size();
+        header_->id_size = states.size();
+        header_->aggregate_size = aggregates.size();
+        fwrite(header_, sizeof(header_type), 1, out);
+        fwrite(index_, sizeof(index_type) * header_->index_size, 1, out);
+        fwrite(accept_, sizeof(accept_type) * header_->accept_size, 1, out);
+        fwrite(lhs_->compact_header(),
+               sizeof(basic_trie::header_type), 1, out);
+        fwrite(lhs_->states(), sizeof(basic_trie::state_type)
+                               * lhs_->compact_header()->size, 1, out);
+        fwrite(rhs_->compact_header(),
+               sizeof(basic_trie::header_type), 1, out);
+        fwrite(rhs_->states(), sizeof(basic_trie::state_type)
+                               * rhs_->compact_header()->size, 1, out);
+        if (!maxima.empty())
+            fwrite(&maxima[0], sizeof(value_type) * maxima.size(), 1, out);
+        if (!states.empty()) {
+            fwrite(&ids[0], sizeof(size_type) * ids.size(), 1, out);
+            fwrite(&states[0], sizeof(size_type) * states.size(), 1, out);
+        }
+        if (!aggregates.empty()) {
+            static const char padding[8] = {0};
+            fwrite(padding, (8 - ftell(out) % 8) % 8, 1, out);
+            fwrite(&aggregates[0],
+                   sizeof(aggregate_type) * aggregates.size(), 1, out);
+        }
+        fclose(out);
+        if (verbose) {
+            char buf[256];
+            size_t size[4];
+            size[0] = sizeof(index_type) * header_->index_size;
+            size[1] = sizeof(accept_type) * header_->accept_size;
+            size[2] = sizeof(basic_trie::state_type)
+                      * lhs_->compact_header()->size;
+            size[3] = sizeof(basic_trie::state_type)
+                      * rhs_->compact_header()->size;
+
+            std::cerr << "index = "
+                      << pretty_size(size[0], buf, sizeof(buf));
+            std::cerr << ", accept = "
+                      << pretty_size(size[1], buf, sizeof(buf));
+            std::cerr << ", front = "
+                      << pretty_size(size[2], buf, sizeof(buf));
+            std::cerr << ", rear = "
+                      << pretty_size(size[3], buf, sizeof(buf));
+            std::cerr << ", total = "
+                      << pretty_size(size[0] + size[1] + size[2] + size[3],
+                                     buf, sizeof(buf))
+                      << std::endl;
+        }
+    }
+}
+
+// ************************************************************************
+// * Implementation of suffix trie                                        *
+// ************************************************************************
+
+single_trie::single_trie(size_t size)
+    :trie_(NULL), suffix_(NULL), header_(NULL), next_suffix_(1),
+     threads_(1), record_(false), max_values_(NULL),
+     record_ids_(false), key_ids_(NULL), id_states_(NULL),
+     record_aggregates_(false), aggregates_(NULL),
+     mmap_(NULL), mmap_size_(0)
+{
+    trie_ = new basic_trie(size);
+    header_ = new header_type();
+    memset(&common_, 0, sizeof(common_));
+    resize_suffix(size?size:basic_trie::kDefaultStateSize);
+    resize_common(kDefaultCommonSize);
+}
+
+single_trie::single_trie(const char *filename, off_t offset, off_t length)
+    :trie_(NULL), suffix_(NULL), header_(NULL), next_suffix_(1),
+     threads_(1), record_(false), max_values_(NULL),
+     record_ids_(false), key_ids_(NULL), id_states_(NULL),
+     record_aggregates_(false), aggregates_(NULL),
+     mmap_(NULL), mmap_size_(0)
+{
+    struct stat sb;
+    int fd, retval;
+
+    if (!filename)
+        throw std::runtime_error(std::string("can not load from file ")
+                                 + filename);
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error(strerror(errno));
+    if (fstat(fd, &sb) < 0)
+        throw std::runtime_error(strerror(errno));
+    if (offset < 0 || offset >= sb.st_size || length < 0
+        || length > sb.st_size - offset)
+        throw std::runtime_error("file corrupted");
+    if (!length)
+        length = sb.st_size - offset;
+
+    // mmap starts at a page, the archive may start anywhere in it
+    off_t skip = offset % sysconf(_SC_PAGESIZE);
+    mmap_size_ = length + skip;
+    mmap_ = mmap(NULL, mmap_size_, PROT_READ, MAP_PRIVATE, fd,
+                 offset - skip);
+    if (mmap_ == MAP_FAILED)
+        throw std::runtime_error(strerror(errno));
+    while (retval = close(fd), retval == -1 && errno == EINTR) {
+        // exmpty
+    }
+
+    void *start;
+    const char *end = static_cast<char *>(mmap_) + mmap_size_;
+    start = header_ = reinterpret_cast<header_type *>(
+                      static_cast<char *>(mmap_) + skip);
+    archive_extent(header_, 1, end);
+    if (strcmp(header_->magic, magic_))
+        throw std::runtime_error("file corrupted");
+    // load suffix
+    suffix_ = reinterpret_cast<suffix_type *>(
+              reinterpret_cast<header_type *>(start) + 1);
+    // load trie
+    start = archive_extent(suffix_, header_->suffix_size, end);
+    start = archive_extent(
+            reinterpret_cast<basic_trie::header_type *>(start), 1, end);
+    trie_ = new basic_trie(reinterpret_cast<basic_trie::header_type *>(start)
+                           - 1, start);
+    size_type size = trie_->header()->size;
+    start = archive_extent(reinterpret_cast<basic_trie::state_type *>(start),
+                           size, end);
+    // load max values, one per state
+    if (header_->max_size) {
+        if (header_->max_size != size)
+            throw std::runtime_error("file corrupted");
+        max_values_ = reinterpret_cast<value_type *>(start);
+        start = archive_extent(reinterpret_cast<value_type *>(start), size,
+                               end);
+    }
+    // load key ids
+    if (header_->id_size) {
+        key_ids_ = reinterpret_cast<size_type *>(start);
+        id_states_ = archive_extent(reinterpret_cast<size_type *>(start),
+                                    size, end);
+        start = archive_extent(const_cast<size_type *>(id_states_),
+                               header_->id_size, end);
+    }
+    // load aggregates, which start at a multiple of 8 bytes
+    if (header_->aggregate_size) {
+        if (header_->aggregate_size != size)
+            throw std::runtime_error("file corrupted");
+        size_t position = static_cast<char *>(start)
+                          - reinterpret_cast<char *>(header_);
+        aggregates_ = reinterpret_cast<aggregate_type *>(
+                      static_cast<char *>(start) + (8 - position % 8) % 8);
+        archive_extent(aggregates_, size, end);
+    }
+}
+
+
+single_trie::~single_trie()
+{
+    if (mmap_) {
+        if (munmap(mmap_, mmap_size_) < 0)
+            throw std::runtime_error(strerror(errno));
+    } else {
+        sanity_delete(header_);
+        resize(suffix_, 0, 0);   // free suffix_
+        resize(common_.data, 0, 0);  // free common_.data
+    }
+    sanity_delete(trie_);
+}
+
+//value可以作为每个单词的编号?
+void single_trie::insert_suffix(size_type s,
+                                const char_type *inputs,
+                                value_type value)
+{
+    trie_->set_base(s, -next_suffix_);
+    const char_type *p = inputs;
+    do {
+        // +1 for value
+        if (next_suffix_ + 1 >= header_->suffix_size)
+            resize_suffix(next_suffix_ + 1);
+        suffix_[next_suffix_++] = *p;
+    } while (*p++ != key_type::kTerminator);
+    suffix_[next_suffix_++] = value;
+}
+
+void single_trie::create_branch(size_type s,
+                                const char_type *inputs,
+                                value_type value)
+{
+    basic_trie::extremum_type extremum = {0, 0};
+    size_type start = -trie_->base(s);
+
+    // find common string
+    const char_type *p = inputs;
+    size_t i = 0;
+    do {
+        if (suffix_[start] != *p)
+            break;
+        if (i + 1 >= common_.size)
+            resize_common(i + 1);
+        common_.data[i++] = *p;
+        if (*p > extremum.max || !extremum.max)
+            extremum.max = *p;
+        if (*p < extremum.min || !extremum.min)
+            extremum.min = *p;
+        ++start;
+    } while (*p++ != key_type::kTerminator);
+    common_.data[i] = 0;  // end common string
+
+    // check if already exists by checking if the last common char is
+    // terminator
+    if (i > 0 && common_.data[i - 1] == key_type::kTerminator) {
+        // duplicated key
+        suffix_[start] = value;
+        return;
+    }
+
+    // if there is a common part, insert common string into trie
+    if (common_.data[0]) {
+        trie_->set_base(s, trie_->find_base(common_.data, extremum));
+        for (i = 0; common_.data[i]; i++)
+            s = trie_->create_transition(s, common_.data[i]);
+    } else {
+       trie_->set_base(s, 0);
+    }
+
+    // create twig for old suffix
+    size_type t = trie_->create_transition(s, suffix_[start]);
+    trie_->set_base(t, -(start + 1));
+
+    // create twig for new suffix
+    t = trie_->create_transition(s, *p);
+    if (*p == key_type::kTerminator) {
+        trie_->set_base(t, -next_suffix_);
+        suffix_[next_suffix_++] = value;
+    } else {
+        insert_suffix(t, p + 1, value);
+    }
+}
+
+
+void single_trie::insert(const key_type &key, const value_type &value)
+{
+    const char_type *p;
+    size_type s = trie_->go_forward(1, key.data(), &p);
+    if (trie_->base(s) < 0) {
+        if (p) {
+            create_branch(s, p, value);
+        } else {
+            // duplicated key
+            suffix_[-trie_->base(s)] = value;
+        }
+    } else {
+        s = trie_->create_transition(s, *p);
+        if (*p == key_type::kTerminator) {
+            trie_->set_base(s, -next_suffix_);
+            suffix_[next_suffix_++] = value;
+        } else {
+            insert_suffix(s, p + 1, value);
+        }
+    }
+}
+
+void single_trie::insert_bulk(std::vector<entry_type> *entries)
+{
+    if (trie_->max_state() > 0) {
+        trie::insert_bulk(entries);
+        return;
+    }
+    sort_entries(entries, threads_);
+
+    std::vector<leaf_type> leaves;
+    build_sorted(trie_, entry_label(*entries), entries->size(),
+                 kLeafOnUnique, &leaves, threads_);
+    std::vector<leaf_type>::const_iterator it;
+    for (it = leaves.begin(); it != leaves.end(); it++) {
+        const entry_type &entry = (*entries)[it->index];
+        // remaining char_types, terminator and value
+        size_type need = (it->depth > entry.length)?1:
+                         entry.length - it->depth + 2;
+        if (next_suffix_ + need >= header_->suffix_size)
+            resize_suffix(need);
+        trie_->set_base(it->state, -next_suffix_);
+        if (it->depth <= entry.length) {
+            for (size_t i = it->depth; i < entry.length; i++)
+                suffix_[next_suffix_++] =
+                    key_type::char_in(entry.data[i]);
+            suffix_[next_suffix_++] = key_type::kTerminator;
+        }
+        suffix_[next_suffix_++] = entry.value;
+    }
+}
+
+bool single_trie::search(const key_type &key, value_type *value) const
+{
+    const char_type *p;
+    size_type s = trie_->go_forward(1, key.data(), &p);
+    if (trie_->base(s) < 0) {
+        size_type start = -trie_->base(s);
+        if (p) {
+            do {
+                if (*p != suffix_[start++])
+                    return false;
+            } while (*p++ != key_type::kTerminator);
+        }
+        if (value)
+            *value = suffix_[start];
+        return true;
+    }
+    return false;
+}
+
+size_t single_trie::search_batch(const key_type *keys, size_t n,
+                                 value_type *values, bool *found) const
+{
+    return search_labels(key_label(keys), n, values, found);
+}
+
+size_t single_trie::search_batch(const char *const *inputs,
+                                 const size_t *lengths, size_t n,
+                                 value_type *values, bool *found) const
+{
+    return search_labels(byte_label(inputs, lengths), n, values,
+                         found);
+}
+
+bool single_trie::search(const char *inputs, size_t length,
+                         value_type *value) const
+{
+    byte_label label(&inputs, &length);
+    size_t depth;
+    size_type s = trie_->go_forward(1, label, 0, &depth);
+    return search_tail(label, 0, s, depth, value);
+}
+
+template<typename L>
+bool single_trie::search_tail(const L &label, size_t i, size_type s,
+                              size_t depth, value_type *value) const
+{
+    size_type start = -trie_->base(s);
+    size_t length = label.length(i);
+    if (start <= 0)
+        return false;
+    // compare the rest of key with suffix, including terminator
+    for (; depth < length && label.label(i, depth) == suffix_[start];
+         depth++, start++) {
+        // empty
+    }
+    if (depth < length)
+        return false;
+    if (value)
+        *value = suffix_[start];
+    return true;
+}
+
+template<typename L>
+size_t single_trie::search_labels(const L &label, size_t n,
+                                  value_type *values, bool *found) const
+{
+    size_type states[kBatchSize];
+    size_t depths[kBatchSize];
+    size_t first, i, count = 0;
+
+    for (first = 0; first < n; first += kBatchSize) {
+        size_t last = std::min(first + kBatchSize, n);
+        forward_batch(*trie_, label, first, last, states, depths);
+        for (i = first; i < last; i++)
+            if (trie_->base(states[i - first]) < 0)
+                __builtin_prefetch(suffix_ - trie_->base(states[i - first]));
+        for (i = first; i < last; i++) {
+            found[i] = search_tail(label, i, states[i - first],
+                                   depths[i - first], &values[i]);
+            if (found[i])
+                ++count;
+        }
+    }
+    return count;
+}
+
+template<typename F>
+void single_trie::find_prefixes(const char *inputs, size_t length,
+                                F &found) const
+{
+    size_type s = 1;
+    size_t i;
+    for (i = 0; ; i++) {
+        if (trie_->base(s) < 0)
+            break;
+        size_type t = trie_->next(s, key_type::kTerminator);
+        if (trie_->check_transition(s, t) && trie_->base(t) < 0)
+            found(i, suffix_[-trie_->base(t)]);
+        if (i == length)
+            return;
+        t = trie_->next(s, key_type::char_in(inputs[i]));
+        if (!trie_->check_transition(s, t))
+            return;
+        s = t;
+    }
+    // the rest of the only key below s is in suffix
+    size_type start = -trie_->base(s);
+    for (; suffix_[start] != key_type::kTerminator; start++, i++)
+        if (i == length
+            || suffix_[start] != key_type::char_in(inputs[i]))
+            return;
+    found(i, suffix_[start + 1]);
+}
+
+size_t single_trie::common_prefix_search(const char *inputs, size_t length,
+                                         prefix_result_type *result) const
+{
+    prefix_collector found = {result};
+    find_prefixes(inputs, length, found);
+    return result->size();
+}
+
+bool single_trie::longest_prefix(const char *inputs, size_t length,
+                                 size_t *matched, value_type *value) const
+{
+    prefix_keeper found = {false, 0, 0};
+    find_prefixes(inputs, length, found);
+    return found.report(matched, value);
+}
+
+size_t
+single_trie::prefix_search(const key_type &key, result_type *result) const
+{
+    const char_type *p;
+    size_type s = trie_->go_forward(1, key.data(), &p);
+    key_type store;
+    if (trie_->check_reverse_transition(s, key_type::kTerminator))
+        s = trie_->prev(s);
+    if (p)
+        store.assign(key.data(), p - key.data());//存放key中能到达的部分
+    else
+        store.assign(key.data(), key.length());
+    // keys already in result are not ours, only the appended ones are
+    size_t first = result->size();
+    trie_->prefix_search_aux(s, p, &store, result);
+    // keys failing the rest of prefix are dropped by moving the others
+    // forward, erasing them one by one is quadratic
+    result_type::iterator it, last = result->begin() + first;
+    for (it = result->begin() + first; it != result->end(); it++) {
+        size_t start = -it->second;
+        const char_type *miss = p;
+        bool fail = false;
+        if (it->first.data()[it->first.length() - 1]
+            == key_type::kTerminator) {
+            it->second = suffix_[start];
+        } else {
+            for (; suffix_[start] != key_type::kTerminator; start++) {
+                if (miss && *miss != key_type::kTerminator) {
+                    if (*miss != suffix_[start]) {
+                        fail = true;
+                        break;
+                    }
+                    miss++;
+                }
+                it->first.push(suffix_[start]);
+            }
+            if (fail || (miss && *miss != key_type::kTerminator))
+                continue;
+            it->second = suffix_[start + 1];
+        }
+        if (last != it)
+            *last = *it;
+        ++last;
+    }
+    result->erase(last, result->end());
+    return result->size();
+}
+
+/// Walks the trie, rests of keys are found in suffix.
+class single_trie::walker: public basic_walker {
+  public:
+    explicit walker(const single_trie &owner)
+        :basic_walker(owner.trie_), owner_(owner)
+    {
+    }
+
+    bool leaf(const walk_node &t, char_type ch) const
+    {
+        return trie_->base(t.s) < 0;
+    }
+
+    value_type tail(const walk_node &t, char_type ch, std::string *key) const
+    {
+        const suffix_type *p = owner_.suffix_ - trie_->base(t.s);
+        if (ch == key_type::kTerminator)
+            return *p;
+        for (; *p != key_type::kTerminator; p++)
+            key->push_back(out(*p));
+        return p[1];
+    }
+
+    value_type value(const walk_node &t, char_type ch) const
+    {
+        const suffix_type *p = owner_.suffix_ - trie_->base(t.s);
+        if (ch == key_type::kTerminator)
+            return *p;
+        while (*p != key_type::kTerminator)
+            p++;
+        return p[1];
+    }
+
+    char_type in(char ch) const
+    {
+        return key_type::char_in(ch);
+    }
+
+    char out(char_type ch) const
+    {
+        return key_type::char_out(ch);
+    }
+
+  private:
+    const single_trie &owner_;
+};
+
+trie::cursor *single_trie::prefix_cursor(const char *prefix, size_t length,
+                                         size_t limit, const char *after,
+                                         size_t after_length) const
+{
+    check_after(prefix, length, after, after_length);
+    return new walk_cursor<walker>(walker(*this), prefix, length,
+                                   limit, after, after_length);
+}
+
+size_t single_trie::fuzzy_search(const char *inputs, size_t length,
+                                 size_t distance, fuzzy_callback found,
+                                 void *context) const
+{
+    return find_fuzzy(walker(*this), inputs, length, distance, found,
+                      context);
+}
+
+bool single_trie::step(traversal_type *t, char ch) const
+{
+    char_type c = key_type::char_in(ch);
+    if (t->tail) {
+        // the only key left, compare with its suffix
+        if (suffix_[t->tail] != c)
+            return false;
+        ++t->tail;
+    } else {
+        size_type s = t->state?t->state:1;
+        size_type n = trie_->next(s, c);
+        if (!trie_->check_transition(s, n))
+            return false;
+        t->state = n;
+        if (trie_->base(n) < 0)
+            t->tail = -trie_->base(n);
+    }
+    t->key.push_back(ch);
+    return true;
+}
+
+bool single_trie::value(const traversal_type &t, value_type *result) const
+{
+    size_type start = t.tail;
+    if (start) {
+        // the value follows the terminator of suffix
+        if (suffix_[start++] != key_type::kTerminator)
+            return false;
+    } else {
+        size_type s = t.state?t.state:1;
+        size_type n = trie_->next(s, key_type::kTerminator);
+        if (!trie_->check_transition(s, n) || trie_->base(n) >= 0)
+            return false;
+        start = -trie_->base(n);
+    }
+    if (result)
+        *result = suffix_[start];
+    return true;
+}
+
+trie::cursor *single_trie::enumerate(const traversal_type &t,
+                                     size_t limit) const
+{
+    if (t.tail)
+        return trie::enumerate(t, limit);
+    walk_node n = {t.state?t.state:1, 0};
+    return new walk_cursor<walker>(walker(*this), n, t.key, limit);
+}
+
+size_t single_trie::top_k(const char *prefix, size_t length, size_t k,
+                          result_type *result) const
+{
+    if (!max_values_)
+        return trie::top_k(prefix, length, k, result);
+    return find_top_k(walker(*this), max_values_, prefix, length, k,
+                      result);
+}
+
+bool single_trie::key_of(size_type id, std::string *key,
+                         value_type *value) const
+{
+    if (!key_ids_ || id < 0 || id >= header_->id_size)
+        return false;
+    value_type found = restore_key(walker(*this), trie_, id_states_[id],
+                                   key);
+    if (value)
+        *value = found;
+    return true;
+}
+
+trie::size_type single_trie::rank(const char *inputs, size_t length) const
+{
+    if (!key_ids_)
+        return trie::rank(inputs, length);
+    return find_rank(walker(*this), key_ids_, header_->id_size, inputs,
+                     length);
+}
+
+bool single_trie::aggregate_prefix(const char *prefix, size_t length,
+                                   aggregate_type *result) const
+{
+    if (!aggregates_)
+        return trie::aggregate_prefix(prefix, length, result);
+    return find_aggregate(walker(*this), aggregates_, prefix, length, result);
+}
+
+bool single_trie::id_of(const char *inputs, size_t length,
+                        size_type *id) const
+{
+    if (!key_ids_)
+        return false;
+    byte_label label(&inputs, &length);
+    size_t depth;
+    size_type s = trie_->go_forward(1, label, 0, &depth);
+    if (!search_tail(label, 0, s, depth, NULL))
+        return false;
+    *id = key_ids_[s];
+    return true;
+}
+
+void single_trie::build(const char *filename, bool verbose)
+{
+    FILE *out;
+
+    if (!filename)
+        throw std::runtime_error(std::string("can not save to file ")
+                                 + filename);
+
+    std::vector<value_type> maxima;
+    if (record_) {
+        maxima.resize(trie_->compact_header()->size, INT32_MIN);
+        find_max_values(walker(*this), &maxima[0]);
+    }
+    std::vector<size_type> ids, states;
+    if (record_ids_) {
+        ids.resize(trie_->compact_header()->size, -1);
+        find_key_ids(walker(*this), &ids[0], &states);
+    }
+    std::vector<aggregate_type> aggregates;
+    if (record_aggregates_) {
+        aggregate_type none = {0, 0, INT32_MAX, INT32_MIN, 0};
+        aggregates.resize(trie_->compact_header()->size, none);
+        find_aggregates(walker(*this), &aggregates[0]);
+    }
+
+    if ((out = fopen(filename, "w+"))) {
+        snprintf(header_->magic, sizeof(header_->magic), "%s", magic_);
+        header_->suffix_size = next_suffix_;
+        header_->max_size = maxima.size();
+        header_->id_size = states.size();
+        header_->aggregate_size = aggregates.size();
+        fwrite(header_, sizeof(header_type), 1, out);
+        fwrite(suffix_, sizeof(suffix_type) * header_->suffix_size, 1, out);
+        fwrite(trie_->compact_header(),
+               sizeof(basic_trie::header_type), 1, out);
+        fwrite(trie_->states(), sizeof(basic_trie::state_type)
+                               * trie_->compact_header()->size, 1, out);
+        if (!maxima.empty())
+            fwrite(&maxima[0], sizeof(value_type) * maxima.size(), 1, out);
+        if (!states.empty()) {
+            fwrite(&ids[0], sizeof(size_type) * ids.size(), 1, out);
+            fwrite(&states[0], sizeof(size_type) * states.size(), 1, out);
+        }
+        if (!aggregates.empty()) {
+            static const char padding[8] = {0};
+            fwrite(padding, (8 - ftell(out) % 8) % 8, 1, out);
+            fwrite(&aggregates[0],
+                   sizeof(aggregate_type) * aggregates.size(), 1, out);
+        }
+
+        fclose(out);
+        if (verbose) {
+            char buf[256];
+            size_t size[2];
+            size[0] = sizeof(suffix_type) * header_->suffix_size;
+            size[1] = sizeof(basic_trie::state_type)
+                      * trie_->compact_header()->size;
+
+            std::cerr << "suffix = " << pretty_size(size[0], buf, sizeof(buf));
+            std::cerr << ", trie = " << pretty_size(size[1], buf, sizeof(buf));
+            std::cerr << ", total = "
+                      << pretty_size(size[0] + size[1], buf, sizeof(buf))
+                      << std::endl;
+        }
+    }
+}
+
+// ************************************************************************
+// * Implementation of compact trie                                       *
+// ************************************************************************
+
+/**
+ * Places sorted and unique entries into units of a compact_trie, see
+ * darts-clone. Free units are kept in a circular list, but only those
+ * in the last kExtraBlocks blocks. Free units of older blocks are left
+ * as holes so that finding a base never walks the whole array.
+ */
+class compact_builder {
+  public:
+    typedef compact_trie::unit_type unit_type;
+    typedef trie::size_type size_type;
+    typedef trie::char_type char_type;
+
+    /// Number of blocks searched for free units.
+    static const size_type kExtraBlocks = 16;
+
+    /// Constructs a builder with the root at unit 0.
+    compact_builder():head_(-1), fixed_(0)
+    {
+        add_block();
+        used_[0] = true;
+        unlink(0);
+    }
+
+    /**
+     * Builds units and values.
+     *
+     * @param entries Sorted and unique entries.
+     */
+    void build(const std::vector<trie::entry_type> &entries);
+
+    /**
+     * Places the children of s. Their units are reserved but left empty.
+     *
+     * @param s The parent.
+     * @param labels Labels of children, may be empty.
+     * @param n Number of children.
+     * @return The base, children are placed at base ^ label.
+     */
+    size_type place(size_type s, const char_type *labels, size_t n);
+
+    /**
+     * Makes s share children placed at base by another unit.
+     *
+     * @param s The unit.
+     * @param base The base.
+     * @return false if the offset of s can not be encoded.
+     */
+    bool link(size_type s, size_type base);
+
+    /// Returns unit t.
+    unit_type &unit(size_type t)
+    {
+        return units_[t];
+    }
+
+    /// Returns all units.
+    const std::vector<unit_type> &units() const
+    {
+        return units_;
+    }
+
+    /// Returns all values, ordered by index in leaves.
+    const std::vector<trie::value_type> &values() const
+    {
+        return values_;
+    }
+
+  private:
+    /// Appends a block of free units.
+    void add_block();
+
+    /// Removes free units in block b from the free list.
+    void fix_block(size_type b);
+
+    /// Removes unit u from the free list.
+    void unlink(size_type u);
+
+    /**
+     * Finds a base for the children of s.
+     *
+     * @param s The parent.
+     * @param labels Labels of children, ascending.
+     * @param n Number of children.
+     * @return The base, children are placed at base ^ label.
+     */
+    size_type find_base(size_type s, const char_type *labels, size_t n);
+
+    /// Returns true if all children of s fit in base.
+    bool valid_base(size_type s, size_type base, const char_type *labels,
+                    size_t n) const;
+
+    /// Returns true if offset can be stored in a unit.
+    static bool valid_offset(unit_type offset)
+    {
+        // large offsets are stored shifted, so their lower bits must be zero
+        return !(offset >> 20) || !(offset & (compact_trie::kBlockSize - 1));
+    }
+
+    std::vector<unit_type> units_;
+    std::vector<trie::value_type> values_;
+    std::vector<size_type> prev_;  ///< Previous free unit.
+    std::vector<size_type> next_;  ///< Next free unit.
+    std::vector<bool> used_;       ///< Unit is occupied.
+    std::vector<bool> used_base_;  ///< Base is taken by a node.
+    size_type head_;               ///< First free unit, -1 if none.
+    size_type fixed_;              ///< Number of fixed blocks.
+};
+
+void compact_builder::add_block()
+{
+    size_type start = units_.size(), u;
+    if (start >= (1 << 29))
+        throw std::runtime_error("compact_trie: too many units");
+    units_.resize(start + compact_trie::kBlockSize, 0);
+    prev_.resize(units_.size());
+    next_.resize(units_.size());
+    used_.resize(units_.size(), false);
+    used_base_.resize(units_.size(), false);
+    for (u = start; u < static_cast<size_type>(units_.size()); u++) {
+        if (head_ < 0) {
+            head_ = prev_[u] = next_[u] = u;
+        } else {
+            prev_[u] = prev_[head_];
+            next_[u] = head_;
+            next_[prev_[head_]] = u;
+            prev_[head_] = u;
+        }
+    }
+    if (units_.size() / compact_trie::kBlockSize - fixed_ > kExtraBlocks)
+        fix_block(fixed_++);
+}
+
+void compact_builder::fix_block(size_type b)
+{
+    size_type u;
+    for (u = b * compact_trie::kBlockSize;
+         u < (b + 1) * compact_trie::kBlockSize; u++) {
+        if (!used_[u])
+            unlink(u);
+    }
+}
+
+void compact_builder::unlink(size_type u)
+{
+    if (next_[u] == u) {
+        head_ = -1;
+    } else {
+        next_[prev_[u]] = next_[u];
+        prev_[next_[u]] = prev_[u];
+        if (head_ == u)
+            head_ = next_[u];
+    }
+}
+
+bool compact_builder::valid_base(size_type s, size_type base,
+                                 const char_type *labels, size_t n) const
+{
+    if (used_base_[base] || !valid_offset(s ^ base))
+        return false;
+    for (size_t i = 0; i < n; i++)
+        if (used_[base ^ labels[i]])
+            return false;
+    return true;
+}
+
+compact_builder::size_type
+compact_builder::find_base(size_type s, const char_type *labels, size_t n)
+{
+    char_type first = n?labels[0]:0;
+    if (head_ >= 0) {
+        size_type u = head_;
+        do {
+            if (valid_base(s, u ^ first, labels, n))
+                return u ^ first;
+            u = next_[u];
+        } while (u != head_);
+    }
+    // a new block always fits, keep the lower bits of offset zero
+    add_block();
+    return (units_.size() - compact_trie::kBlockSize)
+           | (s & (compact_trie::kBlockSize - 1));
+}
+
+compact_builder::size_type
+compact_builder::place(size_type s, const char_type *labels, size_t n)
+{
+    size_type base = find_base(s, labels, n);
+    link(s, base);
+    used_base_[base] = true;
+    for (size_t i = 0; i < n; i++) {
+        size_type t = base ^ labels[i];
+        used_[t] = true;
+        unlink(t);
+    }
+    return base;
+}
+
+bool compact_builder::link(size_type s, size_type base)
+{
+    unit_type offset = s ^ base;
+    if (!valid_offset(offset))
+        return false;
+    units_[s] &= (1U << 10) - 1;
+    if (offset >> 20)
+        units_[s] |= ((offset >> 9) << 11) | (1U << 10);
+    else
+        units_[s] |= offset << 11;
+    return true;
+}
+
+void compact_builder::build(const std::vector<trie::entry_type> &entries)
+{
+    typedef struct {
+        size_type s;
+        size_t first, last, depth;
+    } frame_type;
+
+    char_type labels[trie::key_type::kCharsetSize + 1];
+    std::vector<frame_type> stack, children;
+
+    if (entries.empty())
+        return;
+    frame_type root = {0, 0, entries.size(), 0};
+    stack.push_back(root);
+    while (!stack.empty()) {
+        frame_type f = stack.back();
+        size_t i = f.first, j, n = 0;
+        bool leaf = false;
+
+        stack.pop_back();
+        children.clear();
+        // the shortest key comes first and ends here
+        if (entries[i].length == f.depth) {
+            labels[n++] = 0;
+            leaf = true;
+            ++i;
+        }
+        for (; i < f.last; i = j) {
+            char ch = entries[i].data[f.depth];
+            for (j = i + 1; j < f.last && entries[j].data[f.depth] == ch; j++) {
+                // empty
+            }
+            labels[n++] = trie::key_type::char_in(ch);
+            frame_type child = {0, i, j, f.depth + 1};
+            children.push_back(child);
+        }
+
+        size_type base = place(f.s, labels, n);
+        if (leaf) {
+            units_[f.s] |= 1U << 9;
+            units_[base] = (1U << 31) | values_.size();
+            values_.push_back(entries[f.first].value);
+        }
+        // push in reverse order so the smallest child is visited first
+        for (i = children.size(); i-- > 0; ) {
+            children[i].s = base ^ labels[i + leaf];
+            units_[children[i].s] = labels[i + leaf];
+            stack.push_back(children[i]);
+        }
+    }
+}
+
+compact_trie::compact_trie(size_t size)
+    :header_(NULL), units_(NULL), values_(NULL), mmap_(NULL), mmap_size_(0)
+{
+    header_ = new header_type();
+}
+
+compact_trie::compact_trie(const char *filename)
+    :header_(NULL), units_(NULL), values_(NULL), mmap_(NULL), mmap_size_(0)
+{
+    struct stat sb;
+    int fd, retval;
+
+    if (!filename)
+        throw std::runtime_error(std::string("can not load from file ")
+                                 + filename);
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error(strerror(errno));
+    if (fstat(fd, &sb) < 0)
+        throw std::runtime_error(strerror(errno));
+
+    mmap_ = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mmap_ == MAP_FAILED)
+        throw std::runtime_error(strerror(errno));
+    while (retval = close(fd), retval == -1 && errno == EINTR) {
+        // exmpty
+    }
+    mmap_size_ = sb.st_size;
+
+    const char *end = static_cast<char *>(mmap_) + mmap_size_;
+    header_ = reinterpret_cast<header_type *>(mmap_);
+    archive_extent(header_, 1, end);
+    if (strcmp(header_->magic, magic_))
+        throw std::runtime_error("file corrupted");
+    units_ = reinterpret_cast<unit_type *>(header_ + 1);
+    values_ = reinterpret_cast<value_type *>(
+              archive_extent(units_, header_->unit_size, end));
+    archive_extent(values_, header_->value_size, end);
+}
+
+compact_trie::~compact_trie()
+{
+    if (mmap_) {
+        // a destructor can not throw, so only report the failure
+        if (munmap(mmap_, mmap_size_) < 0)
+            perror("munmap");
+    } else {
+        sanity_delete(header_);
+        // realloc(3) allocates if ptr is NULL
+        if (units_)
+            resize(units_, 0, 0);   // free units_
+        if (values_)
+            resize(values_, 0, 0);  // free values_
+    }
+}
+
+void compact_trie::insert_bulk(std::vector<entry_type> *entries)
+{
+    if (header_->unit_size > 0)
+        throw std::runtime_error("compact_trie::insert_bulk: "
+                                 "trie is not empty");
+    sort_entries(entries);
+    compact_builder builder;
+    builder.build(*entries);
+
+    const std::vector<unit_type> &units = builder.units();
+    const std::vector<value_type> &values = builder.values();
+    units_ = resize(units_, 0, units.size());
+    std::copy(units.begin(), units.end(), units_);
+    header_->unit_size = units.size();
+    if (!values.empty()) {
+        values_ = resize(values_, 0, values.size());
+        std::copy(values.begin(), values.end(), values_);
+    }
+    header_->value_size = values.size();
+}
+
+bool compact_trie::search(const key_type &key, value_type *value) const
+{
+    if (!header_->unit_size)
+        return false;
+
+    size_type s = 0;
+    const char_type *p;
+    for (p = key.data(); *p != key_type::kTerminator; p++)
+        if (!(s = go_forward(s, *p)))
+            return false;
+    unit_type u = units_[s];
+    if (!has_leaf(u))
+        return false;
+    if (value)
+        *value = values_[leaf_index(units_[s ^ offset(u)])];
+    return true;
+}
+
+bool compact_trie::search(const char *inputs, size_t length,
+                          value_type *value) const
+{
+    if (!header_->unit_size)
+        return false;
+
+    size_type s = 0;
+    for (size_t i = 0; i < length; i++)
+        if (!(s = go_forward(s, key_type::char_in(inputs[i]))))
+            return false;
+    unit_type u = units_[s];
+    if (!has_leaf(u))
+        return false;
+    if (value)
+        *value = values_[leaf_index(units_[s ^ offset(u)])];
+    return true;
+}
+
+template<typename F>
+void compact_trie::find_prefixes(const char *inputs, size_t length,
+                                 F &found) const
+{
+    if (!header_->unit_size)
+        return;
+
+    size_type s = 0;
+    for (size_t i = 0; ; i++) {
+        unit_type u = units_[s];
+        if (has_leaf(u))
+            found(i, values_[leaf_index(units_[s ^ offset(u)])]);
+        if (i == length
+            || !(s = go_forward(s, key_type::char_in(inputs[i]))))
+            break;
+    }
+}
+
+size_t compact_trie::common_prefix_search(const char *inputs, size_t length,
+                                          prefix_result_type *result) const
+{
+    prefix_collector found = {result};
+    find_prefixes(inputs, length, found);
+    return result->size();
+}
+
+bool compact_trie::longest_prefix(const char *inputs, size_t length,
+                                  size_t *matched, value_type *value) const
+{
+    prefix_keeper found = {false, 0, 0};
+    find_prefixes(inputs, length, found);
+    return found.report(matched, value);
+}
+
+size_t
+compact_trie::prefix_search(const key_type &prefix, result_type *result) const
+{
+    if (!header_->unit_size)
+        return result->size();
+
+    size_type s = 0;
+    const char_type *p;
+    for (p = prefix.data(); *p != key_type::kTerminator; p++)
+        if (!(s = go_forward(s, *p)))
+            return result->size();
+    key_type store(prefix);
+    prefix_search_aux(s, &store, result);
+    return result->size();
+}
+
+/// Walks nodes, a key ends at a node with has_leaf.
+class compact_trie::walker {
+  public:
+    explicit walker(const compact_trie &owner)
+        :owner_(owner)
+    {
+    }
+
+    bool root(walk_node *n) const
+    {
+        n->s = 0;
+        n->rank = 0;
+        return owner_.header_->unit_size > 0;
+    }
+
+    bool go(const walk_node &n, char_type ch, walk_node *t) const
+    {
+        t->s = owner_.go_forward(n.s, ch);
+        t->rank = 0;
+        return t->s != 0;
+    }
+
+    size_t children(const walk_node &n, char_type *labels) const
+    {
+        char_type *p = labels;
+        for (char_type ch = 1; ch < key_type::kTerminator; ch++)
+            if (owner_.go_forward(n.s, ch))
+                *(p++) = ch;
+        *p = 0;
+        return p - labels;
+    }
+
+    bool final(const walk_node &n, value_type *value) const
+    {
+        unit_type u = owner_.units_[n.s];
+        if (!has_leaf(u))
+            return false;
+        *value = owner_.values_[leaf_index(owner_.units_[n.s ^ offset(u)])];
+        return true;
+    }
+
+    bool leaf(const walk_node &t, char_type ch) const
+    {
+        return false;
+    }
+
+    value_type tail(const walk_node &t, char_type ch, std::string *key) const
+    {
+        return 0;
+    }
+
+    char_type in(char ch) const
+    {
+        return key_type::char_in(ch);
+    }
+
+    char out(char_type ch) const
+    {
+        return key_type::char_out(ch);
+    }
+
+  private:
+    const compact_trie &owner_;
+};
+
+trie::cursor *compact_trie::prefix_cursor(const char *prefix, size_t length,
+                                          size_t limit, const char *after,
+                                          size_t after_length) const
+{
+    check_after(prefix, length, after, after_length);
+    return new walk_cursor<walker>(walker(*this), prefix, length,
+                                   limit, after, after_length);
+}
+
+size_t compact_trie::fuzzy_search(const char *inputs, size_t length,
+                                  size_t distance, fuzzy_callback found,
+                                  void *context) const
+{
+    return find_fuzzy(walker(*this), inputs, length, distance, found,
+                      context);
+}
+
+void compact_trie::prefix_search_aux(size_type s, key_type *store,
+                                     result_type *result) const
+{
+    unit_type u = units_[s];
+    size_type base = s ^ offset(u);
+    char_type ch;
+
+    // children of s never leave the block of base
+    for (ch = 1; ch < key_type::kTerminator; ch++) {
+        size_type t = base ^ ch;
+        if (label(units_[t]) == static_cast<unit_type>(ch)) {
+            store->push(ch);
+            prefix_search_aux(t, store, result);
+            store->pop();
+        }
+    }
+    // keep the order of other tries, where terminator is the largest
+    if (has_leaf(u))
+        result->push_back(std::pair<key_type, value_type>(
+            *store, values_[leaf_index(units_[base])]));
+}
+
+void compact_trie::build(const char *filename, bool verbose)
+{
+    FILE *out;
+
+    if (!filename)
+        throw std::runtime_error(std::string("can not save to file ")
+                                 + filename);
+
+    if ((out = fopen(filename, "w+"))) {
+        snprintf(header_->magic, sizeof(header_->magic), "%s", magic_);
+        fwrite(header_, sizeof(header_type), 1, out);
+        fwrite(units_, sizeof(unit_type) * header_->unit_size, 1, out);
+        fwrite(values_, sizeof(value_type) * header_->value_size, 1, out);
+
+        fclose(out);
+        if (verbose) {
+            char buf[256];
+            size_t size[2];
+            size[0] = sizeof(unit_type) * header_->unit_size;
+            size[1] = sizeof(value_type) * header_->value_size;
+
+            std::cerr << "unit = " << pretty_size(size[0], buf, sizeof(buf));
+            std::cerr << ", value = " << pretty_size(size[1], buf, sizeof(buf));
+            std::cerr << ", total = "
+                      << pretty_size(size[0] + size[1], buf, sizeof(buf))
+                      << std::endl;
+        }
+    }
+}
+
+// ************************************************************************
+// * Implementation of dawg trie                                          *
+// ************************************************************************
+
+/**
+ * Builds a minimal acyclic automaton from sorted and unique keys, see
+ * Daciuk et al., "Incremental Construction of Minimal Acyclic Finite
+ * State Automata". States are minimized as soon as no more key can pass
+ * them. Equivalent states are found in a register keyed by finality and
+ * outcome transitions.
+ */
+class dawg_builder {
+  public:
+    typedef trie::size_type size_type;
+    typedef trie::char_type char_type;
+
+    /// Represents an outcome transition.
+    typedef std::pair<char_type, size_type> edge_type;
+
+    /// Represents a state.
+    typedef struct {
+        bool final;                     ///< A key ends here.
+        std::vector<edge_type> edges;   ///< Transitions, ascending.
+    } node_type;
+
+    /// Constructs a builder with the root at state 0.
+    dawg_builder()
+    {
+        new_node();
+        path_.push_back(0);
+    }
+
+    /**
+     * Adds a key, keys must be added in ascending order.
+     *
+     * @param data Buffer of the key.
+     * @param length Length of the key buffer.
+     */
+    void insert(const char *data, size_t length);
+
+    /// Minimizes the remaining states and counts keys below states.
+    void finish();
+
+    /// Returns state n.
+    const node_type &node(size_type n) const
+    {
+        return nodes_[n];
+    }
+
+    /// Returns number of keys below state n, including n itself.
+    size_type count(size_type n) const
+    {
+        return counts_[n];
+    }
+
+    /// Returns number of states.
+    size_t size() const
+    {
+        return nodes_.size() - free_.size();
+    }
+
+    /// Returns number of slots for states, some of them may be freed.
+    size_t capacity() const
+    {
+        return nodes_.size();
+    }
+
+  private:
+    /// Allocates an empty state.
+    size_type new_node();
+
+    /// Replaces or registers states of path_ deeper than depth.
+    void minimize(size_t depth);
+
+    std::vector<node_type> nodes_;
+    std::vector<size_type> free_;      ///< Freed states.
+    std::vector<size_type> path_;      ///< States of the last key.
+    std::vector<size_type> order_;     ///< States, children first.
+    std::vector<size_type> counts_;    ///< Keys below states.
+    std::map<std::vector<size_type>, size_type> register_;
+};
+
+dawg_builder::size_type dawg_builder::new_node()
+{
+    size_type n;
+    if (free_.empty()) {
+        n = nodes_.size();
+        nodes_.resize(n + 1);
+    } else {
+        n = free_.back();
+        free_.pop_back();
+    }
+    nodes_[n].final = false;
+    nodes_[n].edges.clear();
+    return n;
+}
+
+void dawg_builder::minimize(size_t depth)
+{
+    std::vector<size_type> signature;
+    size_t i, j;
+
+    for (i = path_.size() - 1; i > depth; i--) {
+        size_type n = path_[i];
+        signature.clear();
+        signature.push_back(nodes_[n].final);
+        for (j = 0; j < nodes_[n].edges.size(); j++) {
+            signature.push_back(nodes_[n].edges[j].first);
+            signature.push_back(nodes_[n].edges[j].second);
+        }
+        std::map<std::vector<size_type>, size_type>::const_iterator it;
+        it = register_.find(signature);
+        if (it != register_.end()) {
+            nodes_[path_[i - 1]].edges.back().second = it->second;
+            nodes_[n].edges.clear();
+            free_.push_back(n);
+        } else {
+            register_.insert(std::make_pair(signature, n));
+            order_.push_back(n);
+        }
+    }
+    path_.resize(depth + 1);
+}
+
+void dawg_builder::insert(const char *data, size_t length)
+{
+    size_t i;
+    // common prefix with the last key
+    for (i = 0; i < length && i + 1 < path_.size(); i++) {
+        const std::vector<edge_type> &edges = nodes_[path_[i]].edges;
+        if (edges.back().first != trie::key_type::char_in(data[i]))
+            break;
+    }
+    minimize(i);
+    for (; i < length; i++) {
+        size_type n = new_node();
+        edge_type edge(trie::key_type::char_in(data[i]), n);
+        nodes_[path_.back()].edges.push_back(edge);
+        path_.push_back(n);
+    }
+    nodes_[path_.back()].final = true;
+}
+
+void dawg_builder::finish()
+{
+    minimize(0);
+    order_.push_back(0);
+    register_.clear();
+
+    // children are always registered before their parents
+    counts_.assign(nodes_.size(), 0);
+    std::vector<size_type>::const_iterator it;
+    for (it = order_.begin(); it != order_.end(); it++) {
+        const node_type &n = nodes_[*it];
+        size_type count = n.final;
+        for (size_t i = 0; i < n.edges.size(); i++)
+            count += counts_[n.edges[i].second];
+        counts_[*it] = count;
+    }
+}
+
+dawg_trie::dawg_trie(size_t size)
+    :header_(NULL), units_(NULL), ranks_(NULL), values_(NULL),
+     mmap_(NULL), mmap_size_(0)
+{
+    header_ = new header_type();
+}
+
+dawg_trie::dawg_trie(const char *filename)
+    :header_(NULL), units_(NULL), ranks_(NULL), values_(NULL),
+     mmap_(NULL), mmap_size_(0)
+{
+    struct stat sb;
+    int fd, retval;
+
+    if (!filename)
+        throw std::runtime_error(std::string("can not load from file ")
+                                 + filename);
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error(strerror(errno));
+    if (fstat(fd, &sb) < 0)
+        throw std::runtime_error(strerror(errno));
+
+    mmap_ = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mmap_ == MAP_FAILED)
+        throw std::runtime_error(strerror(errno));
+    while (retval = close(fd), retval == -1 && errno == EINTR) {
+        // exmpty
+    }
+    mmap_size_ = sb.st_size;
+
+    const char *end = static_cast<char *>(mmap_) + mmap_size_;
+    header_ = reinterpret_cast<header_type *>(mmap_);
+    archive_extent(header_, 1, end);
+    if (strcmp(header_->magic, magic_))
+        throw std::runtime_error("file corrupted");
+    units_ = reinterpret_cast<unit_type *>(header_ + 1);
+    ranks_ = archive_extent(units_, header_->unit_size, end);
+    values_ = reinterpret_cast<value_type *>(
+              archive_extent(ranks_, header_->unit_size, end));
+    archive_extent(values_, header_->value_size, end);
+}
+
+dawg_trie::~dawg_trie()
+{
+    if (mmap_) {
+        // a destructor can not throw, so only report the failure
+        if (munmap(mmap_, mmap_size_) < 0)
+            perror("munmap");
+    } else {
+        sanity_delete(header_);
+        // realloc(3) allocates if ptr is NULL
+        if (units_)
+            resize(units_, 0, 0);   // free units_
+        if (ranks_)
+            resize(ranks_, 0, 0);   // free ranks_
+        if (values_)
+            resize(values_, 0, 0);  // free values_
+    }
+}
+
+void dawg_trie::insert_bulk(std::vector<entry_type> *entries)
+{
+    typedef struct {
+        size_type s;  ///< The unit.
+        size_type n;  ///< The state of automaton.
+    } frame_type;
+
+    if (header_->unit_size > 0)
+        throw std::runtime_error("dawg_trie::insert_bulk: trie is not empty");
+    sort_entries(entries);
+
+    dawg_builder dawg;
+    std::vector<entry_type>::const_iterator it;
+    for (it = entries->begin(); it != entries->end(); it++)
+        dawg.insert(it->data, it->length);
+    dawg.finish();
+
+    // place units of the automaton, equivalent states share their base
+    compact_builder builder;
+    std::vector<size_type> bases(dawg.capacity(), -1);
+    std::vector<unit_type> ranks;
+    std::vector<frame_type> stack;
+    char_type labels[key_type::kCharsetSize + 1];
+
+    frame_type root = {0, 0};
+    stack.push_back(root);
+    while (!stack.empty()) {
+        frame_type f = stack.back();
+        const dawg_builder::node_type &node = dawg.node(f.n);
+        size_t i;
+
+        stack.pop_back();
+        if (node.final)
+            builder.unit(f.s) |= 1U << 9;
+        if (bases[f.n] >= 0 && builder.link(f.s, bases[f.n]))
+            continue;
+        for (i = 0; i < node.edges.size(); i++)
+            labels[i] = node.edges[i].first;
+        size_type base = builder.place(f.s, labels, node.edges.size());
+        if (bases[f.n] < 0)
+            bases[f.n] = base;
+        if (ranks.size() < builder.units().size())
+            ranks.resize(builder.units().size(), 0);
+
+        unit_type rank = node.final;
+        for (i = 0; i < node.edges.size(); i++) {
+            frame_type child = {base ^ labels[i], node.edges[i].second};
+            builder.unit(child.s) = labels[i];
+            ranks[child.s] = rank;
+            rank += dawg.count(child.n);
+            stack.push_back(child);
+        }
+    }
+
+    const std::vector<unit_type> &units = builder.units();
+    ranks.resize(units.size(), 0);
+    units_ = resize(units_, 0, units.size());
+    std::copy(units.begin(), units.end(), units_);
+    ranks_ = resize(ranks_, 0, ranks.size());
+    std::copy(ranks.begin(), ranks.end(), ranks_);
+    header_->unit_size = units.size();
+    if (!entries->empty()) {
+        values_ = resize(values_, 0, entries->size());
+        for (size_t i = 0; i < entries->size(); i++)
+            values_[i] = (*entries)[i].value;
+    }
+    header_->value_size = entries->size();
+    header_->state_size = dawg.size();
+}
+
+bool dawg_trie::search(const key_type &key, value_type *value) const
+{
+    if (!header_->unit_size)
+        return false;
+
+    size_type s = 0;
+    unit_type rank = 0;
+    const char_type *p;
+    for (p = key.data(); *p != key_type::kTerminator; p++) {
+        if (!(s = go_forward(s, *p)))
+            return false;
+        rank += ranks_[s];
+    }
+    if (!compact_trie::has_leaf(units_[s]))
+        return false;
+    if (value)
+        *value = values_[rank];
+    return true;
+}
+
+bool dawg_trie::search(const char *inputs, size_t length,
+                       value_type *value) const
+{
+    if (!header_->unit_size)
+        return false;
+
+    size_type s = 0;
+    unit_type rank = 0;
+    for (size_t i = 0; i < length; i++) {
+        if (!(s = go_forward(s, key_type::char_in(inputs[i]))))
+            return false;
+        rank += ranks_[s];
+    }
+    if (!compact_trie::has_leaf(units_[s]))
+        return false;
+    if (value)
+        *value = values_[rank];
+    return true;
+}
+
+template<typename F>
+void dawg_trie::find_prefixes(const char *inputs, size_t length,
+                              F &found) const
+{
+    if (!header_->unit_size)
+        return;
+
+    size_type s = 0;
+    unit_type rank = 0;
+    for (size_t i = 0; ; i++) {
+        if (compact_trie::has_leaf(units_[s]))
+            found(i, values_[rank]);
+        if (i == length
+            || !(s = go_forward(s, key_type::char_in(inputs[i]))))
+            break;
+        rank += ranks_[s];
+    }
+}
+
+size_t dawg_trie::common_prefix_search(const char *inputs, size_t length,
+                                       prefix_result_type *result) const
+{
+    prefix_collector found = {result};
+    find_prefixes(inputs, length, found);
+    return result->size();
+}
+
+bool dawg_trie::longest_prefix(const char *inputs, size_t length,
+                               size_t *matched, value_type *value) const
+{
+    prefix_keeper found = {false, 0, 0};
+    find_prefixes(inputs, length, found);
+    return found.report(matched, value);
+}
+
+size_t
+dawg_trie::prefix_search(const key_type &prefix, result_type *result) const
+{
+    if (!header_->unit_size)
+        return result->size();
+
+    size_type s = 0;
+    unit_type rank = 0;
+    const char_type *p;
+    for (p = prefix.data(); *p != key_type::kTerminator; p++) {
+        if (!(s = go_forward(s, *p)))
+            return result->size();
+        rank += ranks_[s];
+    }
+    key_type store(prefix);
+    prefix_search_aux(s, rank, &store, result);
+    return result->size();
+}
+
+/// Walks states, summing up ranks along the way to find values.
+class dawg_trie::walker {
+  public:
+    explicit walker(const dawg_trie &owner)
+        :owner_(owner)
+    {
+    }
+
+    bool root(walk_node *n) const
+    {
+        n->s = 0;
+        n->rank = 0;
+        return owner_.header_->unit_size > 0;
+    }
+
+    bool go(const walk_node &n, char_type ch, walk_node *t) const
+    {
+        if (!(t->s = owner_.go_forward(n.s, ch)))
+            return false;
+        t->rank = n.rank + owner_.ranks_[t->s];
+        return true;
+    }
+
+    size_t children(const walk_node &n, char_type *labels) const
+    {
+        char_type *p = labels;
+        for (char_type ch = 1; ch < key_type::kTerminator; ch++)
+            if (owner_.go_forward(n.s, ch))
+                *(p++) = ch;
+        *p = 0;
+        return p - labels;
+    }
+
+    bool final(const walk_node &n, value_type *value) const
+    {
+        if (!compact_trie::has_leaf(owner_.units_[n.s]))
+            return false;
+        *value = owner_.values_[n.rank];
+        return true;
+    }
+
+    bool leaf(const walk_node &t, char_type ch) const
+    {
+        return false;
+    }
+
+    value_type tail(const walk_node &t, char_type ch, std::string *key) const
+    {
+        return 0;
+    }
+
+    char_type in(char ch) const
+    {
+        return key_type::char_in(ch);
+    }
+
+    char out(char_type ch) const
+    {
+        return key_type::char_out(ch);
+    }
+
+  private:
+    const dawg_trie &owner_;
+};
+
+trie::cursor *dawg_trie::prefix_cursor(const char *prefix, size_t length,
+                                       size_t limit, const char *after,
+                                       size_t after_length) const
+{
+    check_after(prefix, length, after, after_length);
+    return new walk_cursor<walker>(walker(*this), prefix, length,
+                                   limit, after, after_length);
+}
+
+size_t dawg_trie::fuzzy_search(const char *inputs, size_t length,
+                               size_t distance, fuzzy_callback found,
+                               void *context) const
+{
+    return find_fuzzy(walker(*this), inputs, length, distance, found,
+                      context);
+}
+
+void dawg_trie::prefix_search_aux(size_type s, unit_type rank,
+                                  key_type *store, result_type *result) const
+{
+    unit_type u = units_[s];
+    size_type base = s ^ compact_trie::offset(u);
+    char_type ch;
+
+    for (ch = 1; ch < key_type::kTerminator; ch++) {
+        size_type t = base ^ ch;
+        if (compact_trie::label(units_[t]) == static_cast<unit_type>(ch)) {
+            store->push(ch);
+            prefix_search_aux(t, rank + ranks_[t], store, result);
+            store->pop();
+        }
+    }
+    // keep the order of other tries, where terminator is the largest
+    if (compact_trie::has_leaf(u))
+        result->push_back(std::pair<key_type, value_type>(*store,
+                                                          values_[rank]));
+}
+
+void dawg_trie::build(const char *filename, bool verbose)
+{
+    FILE *out;
+
+    if (!filename)
+        throw std::runtime_error(std::string("can not save to file ")
+                                 + filename);
+
+    if ((out = fopen(filename, "w+"))) {
+        snprintf(header_->magic, sizeof(header_->magic), "%s", magic_);
+        fwrite(header_, sizeof(header_type), 1, out);
+        fwrite(units_, sizeof(unit_type) * header_->unit_size, 1, out);
+        fwrite(ranks_, sizeof(unit_type) * header_->unit_size, 1, out);
+        fwrite(values_, sizeof(value_type) * header_->value_size, 1, out);
+
+        fclose(out);
+        if (verbose) {
+            char buf[256];
+            size_t size[3];
+            size[0] = sizeof(unit_type) * header_->unit_size;
+            size[1] = sizeof(unit_type) * header_->unit_size;
+            size[2] = sizeof(value_type) * header_->value_size;
+
+            std::cerr << "states = " << header_->state_size;
+            std::cerr << ", unit = " << pretty_size(size[0], buf, sizeof(buf));
+            std::cerr << ", rank = " << pretty_size(size[1], buf, sizeof(buf));
+            std::cerr << ", value = " << pretty_size(size[2], buf, sizeof(buf));
+            std::cerr << ", total = "
+                      << pretty_size(size[0] + size[1] + size[2],
+                                     buf, sizeof(buf))
+                      << std::endl;
+        }
+    }
+}
+
+// ************************************************************************
+// * Implementation of aho-corasick trie                                  *
+// ************************************************************************
+
+ac_trie::ac_trie(size_t size)
+    :header_(NULL), trie_(NULL), fail_(NULL), output_(NULL), keys_(NULL),
+     threads_(1), mmap_(NULL), mmap_size_(0)
+{
+    header_ = new header_type();
+    trie_ = new basic_trie(size);
+}
+
+ac_trie::ac_trie(const char *filename)
+    :header_(NULL), trie_(NULL), fail_(NULL), output_(NULL), keys_(NULL),
+     threads_(1), mmap_(NULL), mmap_size_(0)
+{
+    struct stat sb;
+    int fd, retval;
+
+    if (!filename)
+        throw std::runtime_error(std::string("can not load from file ")
+                                 + filename);
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error(strerror(errno));
+    if (fstat(fd, &sb) < 0)
+        throw std::runtime_error(strerror(errno));
+
+    mmap_ = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mmap_ == MAP_FAILED)
+        throw std::runtime_error(strerror(errno));
+    while (retval = close(fd), retval == -1 && errno == EINTR) {
+        // exmpty
+    }
+    mmap_size_ = sb.st_size;
+
+    const char *end = static_cast<char *>(mmap_) + mmap_size_;
+    header_ = reinterpret_cast<header_type *>(mmap_);
+    archive_extent(header_, 1, end);
+    if (strcmp(header_->magic, magic_))
+        throw std::runtime_error("file corrupted");
+    // load trie
+    basic_trie::header_type *theader =
+        reinterpret_cast<basic_trie::header_type *>(header_ + 1);
+    basic_trie::state_type *states =
+        reinterpret_cast<basic_trie::state_type *>(
+        archive_extent(theader, 1, end));
+    fail_ = reinterpret_cast<size_type *>(
+            archive_extent(states, header_->state_size, end));
+    if (theader->size > header_->state_size)
+        throw std::runtime_error("file corrupted");
+    // load links and keys
+    output_ = archive_extent(fail_, header_->state_size, end);
+    keys_ = reinterpret_cast<key_info_type *>(
+            archive_extent(output_, header_->state_size, end));
+    archive_extent(keys_, header_->key_size, end);
+    trie_ = new basic_trie(theader, states);
+}
+
+ac_trie::~ac_trie()
+{
+    if (mmap_) {
+        // a destructor can not throw, so only report the failure
+        if (munmap(mmap_, mmap_size_) < 0)
+            perror("munmap");
+    } else {
+        sanity_delete(header_);
+        // realloc(3) allocates if ptr is NULL
+        if (fail_)
+            resize(fail_, 0, 0);    // free fail_
+        if (output_)
+            resize(output_, 0, 0);  // free output_
+        if (keys_)
+            resize(keys_, 0, 0);    // free keys_
+    }
+    sanity_delete(trie_);
+}
+
+void ac_trie::insert_bulk(std::vector<entry_type> *entries)
+{
+    if (header_->state_size > 0)
+        throw std::runtime_error("ac_trie::insert_bulk: trie is not empty");
+    sort_entries(entries, threads_);
+
+    size_t n = entries->size();
+    keys_ = resize(keys_, 0, n);
+    for (size_t i = 0; i < n; i++) {
+        keys_[i].value = (*entries)[i].value;
+        keys_[i].length = (*entries)[i].length;
+    }
+    header_->key_size = n;
+
+    // values go to keys_, so terminator states only keep slots
+    std::vector<leaf_type> leaves;
+    build_sorted(trie_, entry_label(*entries), n, kLeafOnTerminator,
+                 &leaves, threads_);
+    std::vector<leaf_type>::const_iterator leaf;
+    for (leaf = leaves.begin(); leaf != leaves.end(); leaf++)
+        trie_->set_base(leaf->state, leaf->index + 1);
+    build_links();
+}
+
+void ac_trie::build_links()
+{
+    size_type size = trie_->header()->size;
+    fail_ = resize(fail_, 0, size);
+    output_ = resize(output_, 0, size);
+    // as many states as the archive of trie_ holds, the root included
+    header_->state_size = trie_->compact_header()->size;
+
+    // a failure link always points to a shallower state, so states are
+    // visited by depth
+    char_type targets[key_type::kCharsetSize + 1];
+    std::deque<size_type> queue;
+    fail_[1] = 1;
+    queue.push_back(1);
+    while (!queue.empty()) {
+        size_type s = queue.front();
+        queue.pop_front();
+        trie_->children(s, targets);
+        for (const char_type *p = targets; *p; p++) {
+            if (*p == key_type::kTerminator)
+                continue;
+            size_type t = trie_->next(s, *p);
+            size_type f = s;
+            do {
+                f = fail_[f];
+                size_type u = trie_->next(f, *p);
+                if (s != 1 && trie_->check_transition(f, u)) {
+                    f = u;
+                    break;
+                }
+            } while (f != 1);
+            fail_[t] = f;
+            // the root never outputs, an empty key never occurs
+            output_[t] = (f != 1 && slot(f))?f:output_[f];
+            queue.push_back(t);
+        }
+    }
+}
+
+bool ac_trie::search(const key_type &key, value_type *value) const
+{
+    value_type index;
+    if (header_->state_size <= 1 || !trie_->search(key, &index))
+        return false;
+    if (value)
+        *value = keys_[index - 1].value;
+    return true;
+}
+
+bool ac_trie::search(const char *inputs, size_t length,
+                     value_type *value) const
+{
+    value_type index;
+    if (header_->state_size <= 1 || !trie_->search(inputs, length, &index))
+        return false;
+    if (value)
+        *value = keys_[index - 1].value;
+    return true;
+}
+
+size_t
+ac_trie::prefix_search(const key_type &prefix, result_type *result) const
+{
+    if (header_->state_size <= 1)
+        return result->size();
+
+    size_t first = result->size();
+    trie_->prefix_search(prefix, result);
+    for (size_t i = first; i < result->size(); i++)
+        (*result)[i].second = keys_[(*result)[i].second - 1].value;
+    return result->size();
+}
+
+/// Walks the trie, terminators keep slots of keys.
+class ac_trie::walker: public basic_walker {
+  public:
+    explicit walker(const ac_trie &owner)
+        :basic_walker(owner.trie_), owner_(owner)
+    {
+    }
+
+    bool root(walk_node *n) const
+    {
+        basic_walker::root(n);
+        return owner_.header_->state_size > 1;
+    }
+
+    value_type tail(const walk_node &t, char_type ch, std::string *key) const
+    {
+        return owner_.keys_[trie_->base(t.s) - 1].value;
+    }
+
+  private:
+    const ac_trie &owner_;
+};
+
+trie::cursor *ac_trie::prefix_cursor(const char *prefix, size_t length,
+                                     size_t limit, const char *after,
+                                     size_t after_length) const
+{
+    check_after(prefix, length, after, after_length);
+    return new walk_cursor<walker>(walker(*this), prefix, length,
+                                   limit, after, after_length);
+}
+
+size_t ac_trie::fuzzy_search(const char *inputs, size_t length,
+                             size_t distance, fuzzy_callback found,
+                             void *context) const
+{
+    return find_fuzzy(walker(*this), inputs, length, distance, found,
+                      context);
+}
+
+size_t ac_trie::scan(const char *text, size_t length, match_callback found,
+                     void *context, scan_state_type *state) const
+{
+    scan_state_type whole = {0, 0};
+    if (!state)
+        state = &whole;
+    if (header_->state_size <= 1) {
+        state->offset += length;
+        return 0;
+    }
+
+    size_type s = state->state?state->state:1;
+    size_t count = 0;
+    for (size_t i = 0; i < length; i++) {
+        char_type ch = key_type::char_in(text[i]);
+        for (;;) {
+            size_type t = trie_->next(s, ch);
+            if (trie_->check_transition(s, t)) {
+                s = t;
+                break;
+            }
+            if (s == 1)
+                break;
+            s = fail_[s];
+        }
+        size_type o = (s != 1 && slot(s))?s:output_[s];
+        for (; o; o = output_[o]) {
+            const key_info_type &key = keys_[slot(o) - 1];
+            match_type match = {state->offset + i + 1 - key.length,
+                                static_cast<size_t>(key.length), key.value};
+            found(match, context);
+            ++count;
+        }
+    }
+    state->state = s;
+    state->offset += length;
+    return count;
+}
+
+void ac_trie::build(const char *filename, bool verbose)
+{
+    FILE *out;
+
+    if (!filename)
+        throw std::runtime_error(std::string("can not save to file ")
+                                 + filename);
+
+    // links are computed by insert_bulk, but an empty one has none yet
+    if (!header_->state_size)
+        build_links();
+
+    if ((out = fopen(filename, "w+"))) {
+        snprintf(header_->magic, sizeof(header_->magic), "%s", magic_);
+        fwrite(header_, sizeof(header_type), 1, out);
+        fwrite(trie_->compact_header(),
+               sizeof(basic_trie::header_type), 1, out);
+        fwrite(trie_->states(), sizeof(basic_trie::state_type)
+                                * header_->state_size, 1, out);
+        fwrite(fail_, sizeof(size_type) * header_->state_size, 1, out);
+        fwrite(output_, sizeof(size_type) * header_->state_size, 1, out);
+        fwrite(keys_, sizeof(key_info_type) * header_->key_size, 1, out);
+
+        fclose(out);
+        if (verbose) {
+            char buf[256];
+            size_t size[3];
+            size[0] = sizeof(basic_trie::state_type) * header_->state_size;
+            size[1] = sizeof(size_type) * header_->state_size * 2;
+            size[2] = sizeof(key_info_type) * header_->key_size;
+
+            std::cerr << "trie = " << pretty_size(size[0], buf, sizeof(buf));
+            std::cerr << ", link = " << pretty_size(size[1], buf, sizeof(buf));
+            std::cerr << ", key = " << pretty_size(size[2], buf, sizeof(buf));
+            std::cerr << ", total = "
+                      << pretty_size(size[0] + size[1] + size[2],
+                                     buf, sizeof(buf))
+                      << std::endl;
+        }
+    }
+}
+
+// ************************************************************************
+// * Implementation of delta trie                                         *
+// ************************************************************************
+
+delta_trie::delta_trie(const char *filename)
+    :type_(UNKNOW), archive_(NULL), delta_(NULL), delta_length_(0),
+     out_(NULL), threads_(1), record_(false),
+     record_ids_(false), record_aggregates_(false), owner_(true)
+{
+    if (!filename)
+        throw std::runtime_error(std::string("can not load from file ")
+                                 + filename);
+    filename_ = filename;
+    delta_filename_ = filename_ + ".delta";
+    try {
+        load();
+    } catch (...) {
+        sanity_delete(archive_);
+        sanity_delete(delta_);
+        throw;
+    }
+}
+
+delta_trie::delta_trie(const delta_trie &writer, trie *archive)
+    :filename_(writer.filename_), delta_filename_(writer.delta_filename_),
+     type_(writer.type_), archive_(archive),
+     delta_(new basic_trie(*writer.delta_)), values_(writer.values_),
+     removed_(writer.removed_), delta_length_(writer.delta_length_),
+     out_(NULL), threads_(writer.threads_), record_(writer.record_),
+     record_ids_(writer.record_ids_),
+     record_aggregates_(writer.record_aggregates_), owner_(false)
+{
+}
+
+delta_trie::~delta_trie()
+{
+    if (out_)
+        fclose(out_);
+    if (owner_)
+        sanity_delete(archive_);
+    sanity_delete(delta_);
+}
+
+void delta_trie::load()
+{
+    FILE *in;
+    struct stat sb;
+
+    type_ = find_archive_type(filename_.c_str());
+    archive_ = create_trie(filename_.c_str());
+    delta_ = new basic_trie();
+    values_.clear();
+    removed_.clear();
+    delta_length_ = 0;
+    if (!(in = fopen(delta_filename_.c_str(), "r")))
+        return;
+
+    header_type header;
+    if (fread(&header, sizeof(header), 1, in) != 1
+        || strcmp(header.magic, magic_)) {
+        fclose(in);
+        throw bad_trie_archive("delta corrupted");
+    }
+    if (stat(filename_.c_str(), &sb) < 0) {
+        fclose(in);
+        throw std::runtime_error(strerror(errno));
+    }
+    // a crash in compact between its renames leaves the delta of the
+    // old archive, whose changes the new one holds, so it is dropped
+    if (header.size != sb.st_size || header.mtime != sb.st_mtime
+        || header.inode != static_cast<int64_t>(sb.st_ino)) {
+        fclose(in);
+        return;
+    }
+
+    // a record cut by a crash, or being written, is skipped here and
+    // cut off by the first append
+    if (fstat(fileno(in), &sb) < 0) {
+        fclose(in);
+        throw std::runtime_error(strerror(errno));
+    }
+    long good = ftell(in);
+    record_type record;
+    std::vector<char> buf;
+    key_type key;
+    while (fread(&record, sizeof(record), 1, in) == 1) {
+        // a length torn by the crash may run past the end of file
+        if (record.length > sb.st_size - ftell(in))
+            break;
+        buf.resize(static_cast<size_t>(record.length) + 1);
+        if (fread(&buf[0], 1, record.length, in) != record.length)
+            break;
+        key.assign(&buf[0], record.length);
+        apply(key, record.value, record.removed);
+        good = ftell(in);
+    }
+    fclose(in);
+    delta_length_ = good;
+}
+
+void delta_trie::apply(const key_type &key, value_type value, bool removed)
+{
+    value_type slot;
+    if (!delta_->search(key, &slot)) {
+        values_.push_back(0);
+        removed_.push_back(false);
+        slot = values_.size();
+        delta_->insert(key, slot);
+    }
+    values_[slot - 1] = value;
+    removed_[slot - 1] = removed;
+}
+
+void delta_trie::append(const key_type &key, value_type value, bool removed)
+{
+    if (!out_) {
+        if (!delta_length_)
+            reset(delta_filename_.c_str(), filename_.c_str());
+        else if (truncate(delta_filename_.c_str(), delta_length_) < 0)
+            throw std::runtime_error(strerror(errno));
+        if (!(out_ = fopen(delta_filename_.c_str(), "a")))
+            throw std::runtime_error(strerror(errno));
+    }
+    record_type record = {static_cast<uint32_t>(key.length()),
+                          removed?1:0, value};
+    fwrite(&record, sizeof(record), 1, out_);
+    fwrite(key.c_str(), 1, key.length(), out_);
+}
+
+void delta_trie::reset(const char *filename, const char *archive) const
+{
+    FILE *out;
+    struct stat sb;
+    header_type header;
+
+    if (stat(archive, &sb) < 0)
+        throw std::runtime_error(strerror(errno));
+    memset(&header, 0, sizeof(header));
+    snprintf(header.magic, sizeof(header.magic), "%s", magic_);
+    header.size = sb.st_size;
+    header.mtime = sb.st_mtime;
+    header.inode = sb.st_ino;
+    if (!(out = fopen(filename, "w")))
+        throw std::runtime_error(strerror(errno));
+    fwrite(&header, sizeof(header), 1, out);
+    if (fclose(out) < 0)
+        throw std::runtime_error(strerror(errno));
+}
+
+void delta_trie::insert(const key_type &key, const value_type &value)
+{
+    append(key, value, false);
+    if (fflush(out_) < 0)
+        throw std::runtime_error(strerror(errno));
+    apply(key, value, false);
+}
+
+void delta_trie::insert_bulk(std::vector<entry_type> *entries)
+{
+    key_type key;
+    std::vector<entry_type>::const_iterator it;
+    for (it = entries->begin(); it != entries->end(); it++) {
+        key.assign(it->data, it->length);
+        append(key, it->value, false);
+        apply(key, it->value, false);
+    }
+    if (out_ && fflush(out_) < 0)
+        throw std::runtime_error(strerror(errno));
+}
+
+bool delta_trie::remove(const key_type &key)
+{
+    if (!search(key, NULL))
+        return false;
+    append(key, 0, true);
+    if (fflush(out_) < 0)
+        throw std::runtime_error(strerror(errno));
+    apply(key, 0, true);
+    return true;
+}
+
+bool delta_trie::search(const key_type &key, value_type *value) const
+{
+    value_type slot;
+    if (delta_->search(key, &slot)) {
+        if (removed_[slot - 1])
+            return false;
         if (value)
-            *value = index_[-lhs_->base(s)].data;
+            *value = values_[slot - 1];
         return true;
     }
-    return false;
+    return archive_->search(key, value);
 }
 
-size_t
-double_trie::prefix_search(const key_type &key, result_type *result) const
+size_t delta_trie::prefix_search(const key_type &key,
+                                 result_type *result) const
 {
-    const char_type *p;
-    size_type s = lhs_->go_forward(1, key.data(), &p);
-    key_type store;
-    if (lhs_->check_reverse_transition(s, key_type::kTerminator))
-        s = lhs_->prev(s);
-    if (p)
-        store.assign(key.data(), p - key.data());
-    else
-        store.assign(key.data(), key.length());
-    lhs_->prefix_search_aux(s, p, &store, result);
-    result_type::iterator it;
-    for (it = result->begin(); it != result->end(); it++) {
-        size_t i = -it->second;
-        if (index_[i].index == 0) {
-            it->second = index_[i].data;
-            continue;
+    if (values_.empty())
+        return archive_->prefix_search(key, result);
+    // the merged walk, with key as bytes
+    std::string prefix;
+    for (const char_type *p = key.data(); *p != key_type::kTerminator; p++)
+        prefix.push_back(key_type::char_out(*p));
+    cursor *keys = prefix_cursor(prefix.data(), prefix.size());
+    while (keys->next())
+        result->push_back(std::make_pair(key_type(keys->key(),
+                                                  keys->length()),
+                                         keys->value()));
+    delete keys;
+    return result->size();
+}
+
+/**
+ * Merges keys of archive which are not changed in delta with keys
+ * inserted in delta, in walk order.
+ */
+class delta_trie::merge_cursor: public trie::cursor {
+  public:
+    /// Takes over both cursors.
+    merge_cursor(const delta_trie &owner, cursor *archive, cursor *delta,
+                 size_t limit)
+        :owner_(owner), archive_(archive), delta_(delta), limit_(limit),
+         count_(0)
+    {
+        more_archive_ = next_archive();
+        more_delta_ = next_delta();
+    }
+
+    ~merge_cursor()
+    {
+        delete archive_;
+        delete delta_;
+    }
+
+    bool next()
+    {
+        if ((limit_ && count_ >= limit_) || (!more_archive_ && !more_delta_))
+            return false;
+        // a key is in one of them only, as archive skips keys of delta
+        if (more_archive_
+            && (!more_delta_
+                || walk_less(archive_->key(), archive_->length(),
+                             delta_->key(), delta_->length()))) {
+            key_.assign(archive_->key(), archive_->length());
+            value_ = archive_->value();
+            more_archive_ = next_archive();
+        } else {
+            key_.assign(delta_->key(), delta_->length());
+            value_ = owner_.values_[delta_->value() - 1];
+            more_delta_ = next_delta();
         }
-        const char_type *miss = p;
-        bool fail = false;
-        size_type r = accept_[index_[i].index].accept;
-        // skip a terminator
-        if (rhs_->check_reverse_transition(r, key_type::kTerminator))
-            r = rhs_->prev(r);
-        do {
-            char_type ch = r - rhs_->base(rhs_->prev(r));
-            r = rhs_->prev(r);
-            if (miss && *miss != key_type::kTerminator) {
-                if (!rhs_->check_transition(r, rhs_->next(r, *miss))) {
-                    fail = true;
-                    break;
-                }
-                miss++;
-            }
-            it->first.push(ch);
-        } while (r > 1);
-        if (fail || (miss && *miss != key_type::kTerminator)) {
-            --it;
-            result->erase(it + 1);
+        ++count_;
+        return true;
+    }
+
+  private:
+    /// Moves archive_ to its next key not changed in delta.
+    bool next_archive()
+    {
+        value_type slot;
+        while (archive_->next())
+            if (!owner_.delta_->search(archive_->key(), archive_->length(),
+                                       &slot))
+                return true;
+        return false;
+    }
+
+    /// Moves delta_ to its next key not removed.
+    bool next_delta()
+    {
+        while (delta_->next())
+            if (!owner_.removed_[delta_->value() - 1])
+                return true;
+        return false;
+    }
+
+    const delta_trie &owner_;  ///< The trie walked.
+    cursor *archive_;          ///< Keys of archive.
+    cursor *delta_;            ///< Slots of keys in delta.
+    bool more_archive_;        ///< Whether archive_ is at a key.
+    bool more_delta_;          ///< Whether delta_ is at a key.
+    size_t limit_;             ///< Maximum number of keys, or 0.
+    size_t count_;             ///< Number of keys returned.
+};
+
+trie::cursor *delta_trie::prefix_cursor(const char *prefix, size_t length,
+                                        size_t limit, const char *after,
+                                        size_t after_length) const
+{
+    if (values_.empty())
+        return archive_->prefix_cursor(prefix, length, limit, after,
+                                       after_length);
+    // both continue after the key, which needs not be one of theirs
+    cursor *archive = archive_->prefix_cursor(prefix, length, 0, after,
+                                              after_length);
+    cursor *delta;
+    try {
+        delta = delta_->prefix_cursor(prefix, length, 0, after,
+                                      after_length);
+    } catch (...) {
+        delete archive;
+        throw;
+    }
+    return new merge_cursor(*this, archive, delta, limit);
+}
+
+size_t delta_trie::top_k(const char *prefix, size_t length, size_t k,
+                         result_type *result) const
+{
+    if (values_.empty())
+        return archive_->top_k(prefix, length, k, result);
+
+    // every key in delta hides at most one key of the archive
+    result_type found, changes;
+    result_type::iterator it;
+    value_type slot;
+    archive_->top_k(prefix, length, k + values_.size(), &found);
+    result_type::iterator last = found.begin();
+    for (it = found.begin(); it != found.end(); it++) {
+        if (delta_->search(it->first, &slot))
             continue;
+        if (last != it) {
+            last->first = it->first;
+            last->second = it->second;
         }
-        it->second = index_[i].data;
+        ++last;
     }
-
+    found.erase(last, found.end());
+    delta_->prefix_search(key_type(prefix, length), &changes);
+    for (it = changes.begin(); it != changes.end(); it++) {
+        slot = it->second;
+        if (!removed_[slot - 1])
+            found.push_back(std::make_pair(it->first, values_[slot - 1]));
+    }
+    k = std::min(k, found.size());
+    std::partial_sort(found.begin(), found.begin() + k, found.end(),
+                      larger_value);
+    result->insert(result->end(), found.begin(), found.begin() + k);
     return result->size();
 }
 
-void double_trie::build(const char *filename, bool verbose)
+bool delta_trie::key_of(size_type id, std::string *key,
+                        value_type *value) const
 {
-    FILE *out;
+    return values_.empty() && archive_->key_of(id, key, value);
+}
+
+trie::size_type delta_trie::rank(const char *inputs, size_t length) const
+{
+    if (values_.empty())
+        return archive_->rank(inputs, length);
+    return trie::rank(inputs, length);
+}
+
+bool delta_trie::aggregate_prefix(const char *prefix, size_t length,
+                                  aggregate_type *result) const
+{
+    if (values_.empty())
+        return archive_->aggregate_prefix(prefix, length, result);
+    return trie::aggregate_prefix(prefix, length, result);
+}
+
+bool delta_trie::step(traversal_type *t, char ch) const
+{
+    if (values_.empty())
+        return archive_->step(t, ch);
+    return trie::step(t, ch);
+}
+
+bool delta_trie::value(const traversal_type &t, value_type *result) const
+{
+    if (values_.empty())
+        return archive_->value(t, result);
+    return trie::value(t, result);
+}
+
+trie::cursor *delta_trie::enumerate(const traversal_type &t,
+                                    size_t limit) const
+{
+    if (values_.empty())
+        return archive_->enumerate(t, limit);
+    return trie::enumerate(t, limit);
+}
+
+size_t delta_trie::search_batch(const key_type *keys, size_t n,
+                                value_type *values, bool *found) const
+{
+    if (values_.empty())
+        return archive_->search_batch(keys, n, values, found);
+    return trie::search_batch(keys, n, values, found);
+}
+
+size_t delta_trie::search_batch(const char *const *inputs,
+                                const size_t *lengths, size_t n,
+                                value_type *values, bool *found) const
+{
+    if (values_.empty())
+        return archive_->search_batch(inputs, lengths, n, values, found);
+    return trie::search_batch(inputs, lengths, n, values, found);
+}
+
+bool delta_trie::id_of(const char *inputs, size_t length,
+                       size_type *id) const
+{
+    return values_.empty() && archive_->id_of(inputs, length, id);
+}
+
+size_t delta_trie::fuzzy_search(const char *inputs, size_t length,
+                                size_t distance, fuzzy_callback found,
+                                void *context) const
+{
+    if (values_.empty())
+        return archive_->fuzzy_search(inputs, length, distance, found,
+                                      context);
+    return trie::fuzzy_search(inputs, length, distance, found, context);
+}
+
+void delta_trie::build(const char *filename, bool verbose)
+{
+    result_type result;
+    key_type prefix("", 0);
+    prefix_search(prefix, &result);
+
+    std::vector<char> keys;
+    std::vector<size_t> offsets;
+    std::vector<entry_type> entries;
+    result_type::const_iterator it;
+    for (it = result.begin(); it != result.end(); it++) {
+        const char_type *p = it->first.data();
+        entry_type entry = {NULL, 0, it->second};
+        offsets.push_back(keys.size());
+        for (; *p != key_type::kTerminator; p++, entry.length++)
+            keys.push_back(key_type::char_out(*p));
+        entries.push_back(entry);
+    }
+    for (size_t i = 0; i < entries.size(); i++)
+        entries[i].data = &keys[0] + offsets[i];
+    if (verbose)
+        std::cerr << entries.size() << " keys merged, "
+                  << values_.size() << " from delta" << std::endl;
+
+    trie *merged = create_trie(type_);
+    try {
+        merged->record_max_values(record_);
+        merged->record_key_ids(record_ids_);
+        merged->record_aggregates(record_aggregates_);
+        merged->set_build_threads(threads_);
+        merged->insert_bulk(&entries);
+        merged->build(filename, verbose);
+    } catch (...) {
+        delete merged;
+        throw;
+    }
+    delete merged;
+}
+
+void delta_trie::compact(bool verbose)
+{
+    std::string archive = filename_ + ".tmp";
+    std::string delta = delta_filename_ + ".tmp";
+
+    build(archive.c_str(), verbose);
+    // rename keeps modify time and inode, so delta can be written ahead
+    reset(delta.c_str(), archive.c_str());
+    if (out_) {
+        fclose(out_);
+        out_ = NULL;
+    }
+    if (rename(archive.c_str(), filename_.c_str()) < 0
+        || rename(delta.c_str(), delta_filename_.c_str()) < 0)
+        throw std::runtime_error(strerror(errno));
+    sanity_delete(archive_);
+    sanity_delete(delta_);
+    load();
+}
+
+// ************************************************************************
+// * Implementation of concurrent trie                                    *
+// ************************************************************************
+
+/// Holds a mutex while alive, if not NULL.
+class mutex_lock {
+  public:
+    explicit mutex_lock(pthread_mutex_t *mutex)
+        :mutex_(mutex)
+    {
+        if (mutex_)
+            pthread_mutex_lock(mutex_);
+    }
+
+    ~mutex_lock()
+    {
+        if (mutex_)
+            pthread_mutex_unlock(mutex_);
+    }
+
+  private:
+    pthread_mutex_t *mutex_;
+};
+
+/**
+ * Pins the current snapshot of a concurrent_trie. The epoch is stored
+ * into a free slot before the snapshot is loaded, so a snapshot
+ * replaced after the load is retired at an epoch not older than the
+ * slot holds.
+ */
+class concurrent_trie::reader {
+  public:
+    explicit reader(const concurrent_trie &owner)
+        :owner_(owner)
+    {
+        // threads start from different slots, by the address of stack
+        uintptr_t hint = reinterpret_cast<uintptr_t>(&hint);
+        uint64_t hash = static_cast<uint64_t>(hint >> 12)
+                        * 0x9e3779b97f4a7c15ULL;
+        slot_ = (hash >> 32) % kReaderSlots;
+        for (size_t i = 0; ; i++) {
+            uint64_t idle = 0;
+            if (owner_.slots_[slot_].epoch.compare_exchange_strong(
+                    idle, owner_.epoch_.load()))
+                break;
+            slot_ = (slot_ + 1) % kReaderSlots;
+            if ((i + 1) % kReaderSlots)
+                continue;
+            // every slot is held, by other threads or by live cursors
+            if ((i + 1) / kReaderSlots == kReaderRetries)
+                throw std::runtime_error("concurrent_trie: more readers "
+                                         "than kReaderSlots");
+            sched_yield();
+        }
+        snapshot_ = owner_.current_.load();
+    }
+
+    ~reader()
+    {
+        owner_.slots_[slot_].epoch.store(0);
+    }
+
+    delta_trie *operator->() const
+    {
+        return snapshot_;
+    }
+
+  private:
+    const concurrent_trie &owner_;  ///< The trie read.
+    size_t slot_;                   ///< Slot holding the epoch.
+    delta_trie *snapshot_;          ///< The pinned snapshot.
+};
+
+class concurrent_trie::snapshot_cursor: public trie::cursor {
+  public:
+    snapshot_cursor(const concurrent_trie &owner, const char *prefix,
+                    size_t length, size_t limit, const char *after,
+                    size_t after_length)
+        :reader_(owner),
+         keys_(reader_->prefix_cursor(prefix, length, limit, after,
+                                      after_length))
+    {
+    }
+
+    ~snapshot_cursor()
+    {
+        delete keys_;
+    }
+
+    bool next()
+    {
+        if (!keys_->next())
+            return false;
+        key_.assign(keys_->key(), keys_->length());
+        value_ = keys_->value();
+        return true;
+    }
+
+  private:
+    reader reader_;  ///< Pins the snapshot walked by keys_.
+    cursor *keys_;   ///< Keys of the snapshot.
+};
 
+concurrent_trie::concurrent_trie(const char *filename)
+    :writer_(NULL), archive_(NULL), current_(NULL), epoch_(1)
+{
     if (!filename)
-        throw std::runtime_error(std::string("can not save to file ")
+        throw std::runtime_error(std::string("can not load from file ")
                                  + filename);
+    filename_ = filename;
+    for (size_t i = 0; i < kReaderSlots; i++)
+        slots_[i].epoch.store(0);
+    try {
+        writer_ = new delta_trie(filename);
+        archive_ = create_trie(filename);
+        current_.store(new delta_trie(*writer_, archive_));
+    } catch (...) {
+        sanity_delete(archive_);
+        sanity_delete(writer_);
+        throw;
+    }
+    pthread_mutex_init(&mutex_, NULL);
+}
 
-    if ((out = fopen(filename, "w+"))) {
-        header_->index_size = next_index_;
-        header_->accept_size = next_accept_;
-        fwrite(header_, sizeof(header_type), 1, out);
-        fwrite(index_, sizeof(index_type) * header_->index_size, 1, out);
-        fwrite(accept_, sizeof(accept_type) * header_->accept_size, 1, out);
-        fwrite(lhs_->compact_header(),
-               sizeof(basic_trie::header_type), 1, out);
-        fwrite(lhs_->states(), sizeof(basic_trie::state_type)
-                               * lhs_->compact_header()->size, 1, out);
-        fwrite(rhs_->compact_header(),
-               sizeof(basic_trie::header_type), 1, out);
-        fwrite(rhs_->states(), sizeof(basic_trie::state_type)
-                               * rhs_->compact_header()->size, 1, out);
-        fclose(out);
-        if (verbose) {
-            char buf[256];
-            size_t size[4];
-            size[0] = sizeof(index_type) * header_->index_size;
-            size[1] = sizeof(accept_type) * header_->accept_size;
-            size[2] = sizeof(basic_trie::state_type)
-                      * lhs_->compact_header()->size;
-            size[3] = sizeof(basic_trie::state_type)
-                      * rhs_->compact_header()->size;
+concurrent_trie::~concurrent_trie()
+{
+    for (size_t i = 0; i < retired_.size(); i++) {
+        delete retired_[i].snapshot;
+        delete retired_[i].archive;
+    }
+    delete current_.load();
+    sanity_delete(archive_);
+    sanity_delete(writer_);
+    pthread_mutex_destroy(&mutex_);
+}
 
-            std::cerr << "index = "
-                      << pretty_size(size[0], buf, sizeof(buf));
-            std::cerr << ", accept = "
-                      << pretty_size(size[1], buf, sizeof(buf));
-            std::cerr << ", front = "
-                      << pretty_size(size[2], buf, sizeof(buf));
-            std::cerr << ", rear = "
-                      << pretty_size(size[3], buf, sizeof(buf));
-            std::cerr << ", total = "
-                      << pretty_size(size[0] + size[1] + size[2] + size[3],
-                                     buf, sizeof(buf))
-                      << std::endl;
-        }
+void concurrent_trie::publish(trie *archive)
+{
+    delta_trie *snapshot = new delta_trie(*writer_,
+                                          archive?archive:archive_);
+    retired_type retired = {0, current_.exchange(snapshot),
+                            archive?archive_:NULL};
+    // readers which loaded the old snapshot hold this epoch or older
+    retired.epoch = epoch_.fetch_add(1);
+    retired_.push_back(retired);
+    if (archive)
+        archive_ = archive;
+    reclaim();
+}
+
+void concurrent_trie::reclaim()
+{
+    uint64_t oldest = UINT64_MAX;
+    for (size_t i = 0; i < kReaderSlots; i++) {
+        uint64_t epoch = slots_[i].epoch.load();
+        if (epoch)
+            oldest = std::min(oldest, epoch);
+    }
+    // snapshots are retired in order of epoch
+    size_t freed = 0;
+    while (freed < retired_.size() && retired_[freed].epoch < oldest) {
+        delete retired_[freed].snapshot;
+        delete retired_[freed].archive;
+        ++freed;
     }
+    retired_.erase(retired_.begin(), retired_.begin() + freed);
+}
+
+void concurrent_trie::insert(const key_type &key, const value_type &value)
+{
+    mutex_lock lock(&mutex_);
+    writer_->insert(key, value);
+    publish(NULL);
+}
+
+bool concurrent_trie::remove(const key_type &key)
+{
+    mutex_lock lock(&mutex_);
+    if (!writer_->remove(key))
+        return false;
+    publish(NULL);
+    return true;
+}
+
+void concurrent_trie::insert_bulk(std::vector<entry_type> *entries)
+{
+    mutex_lock lock(&mutex_);
+    writer_->insert_bulk(entries);
+    publish(NULL);
+}
+
+void concurrent_trie::compact(bool verbose)
+{
+    mutex_lock lock(&mutex_);
+    writer_->compact(verbose);
+    publish(create_trie(filename_.c_str()));
+}
+
+void concurrent_trie::build(const char *filename, bool verbose)
+{
+    reader snapshot(*this);
+    snapshot->build(filename, verbose);
+}
+
+bool concurrent_trie::search(const key_type &key, value_type *value) const
+{
+    reader snapshot(*this);
+    return snapshot->search(key, value);
+}
+
+bool concurrent_trie::search(const char *inputs, size_t length,
+                             value_type *value) const
+{
+    reader snapshot(*this);
+    return snapshot->search(inputs, length, value);
+}
+
+size_t concurrent_trie::prefix_search(const key_type &key,
+                                      result_type *result) const
+{
+    reader snapshot(*this);
+    return snapshot->prefix_search(key, result);
+}
+
+trie::cursor *concurrent_trie::prefix_cursor(const char *prefix,
+                                             size_t length, size_t limit,
+                                             const char *after,
+                                             size_t after_length) const
+{
+    return new snapshot_cursor(*this, prefix, length, limit, after,
+                               after_length);
+}
+
+size_t concurrent_trie::top_k(const char *prefix, size_t length, size_t k,
+                              result_type *result) const
+{
+    reader snapshot(*this);
+    return snapshot->top_k(prefix, length, k, result);
+}
+
+bool concurrent_trie::aggregate_prefix(const char *prefix, size_t length,
+                                       aggregate_type *result) const
+{
+    reader snapshot(*this);
+    return snapshot->aggregate_prefix(prefix, length, result);
+}
+
+trie::size_type concurrent_trie::rank(const char *inputs,
+                                      size_t length) const
+{
+    reader snapshot(*this);
+    return snapshot->rank(inputs, length);
+}
+
+size_t concurrent_trie::fuzzy_search(const char *inputs, size_t length,
+                                     size_t distance, fuzzy_callback found,
+                                     void *context) const
+{
+    reader snapshot(*this);
+    return snapshot->fuzzy_search(inputs, length, distance, found,
+                                  context);
+}
+
+void concurrent_trie::set_build_threads(size_t threads)
+{
+    mutex_lock lock(&mutex_);
+    writer_->set_build_threads(threads);
+}
+
+void concurrent_trie::record_max_values(bool record)
+{
+    mutex_lock lock(&mutex_);
+    writer_->record_max_values(record);
+}
+
+void concurrent_trie::record_key_ids(bool record)
+{
+    mutex_lock lock(&mutex_);
+    writer_->record_key_ids(record);
+}
+
+void concurrent_trie::record_aggregates(bool record)
+{
+    mutex_lock lock(&mutex_);
+    writer_->record_aggregates(record);
 }
 
 // ************************************************************************
-// * Implementation of suffix trie                                        *
+// * Implementation of sharded trie                                       *
 // ************************************************************************
 
-single_trie::single_trie(size_t size)
-    :trie_(NULL), suffix_(NULL), header_(NULL), next_suffix_(1),
-     mmap_(NULL), mmap_size_(0)
+/// Holds a read or a write lock of a shard while alive, if not NULL.
+class shard_lock {
+  public:
+    shard_lock(pthread_rwlock_t *lock, bool write)
+        :lock_(lock)
+    {
+        if (lock_ && write)
+            pthread_rwlock_wrlock(lock_);
+        else if (lock_)
+            pthread_rwlock_rdlock(lock_);
+    }
+
+    ~shard_lock()
+    {
+        if (lock_)
+            pthread_rwlock_unlock(lock_);
+    }
+
+  private:
+    pthread_rwlock_t *lock_;
+};
+
+class sharded_trie::shard_cursor: public trie::cursor {
+  public:
+    /**
+     * Merges cursors of shards in range, each continuing after. The
+     * shards are read locked until the cursor is deleted.
+     */
+    shard_cursor(const sharded_trie &owner, const char *prefix,
+                 size_t length, size_t limit, const char *after,
+                 size_t after_length, std::pair<size_t, size_t> range)
+        :locks_(owner.locks_), range_(range), limit_(limit), count_(0)
+    {
+        // in the order of shards, so cursors never wait for each other
+        for (size_t i = range_.first; locks_ && i < range_.second; i++)
+            pthread_rwlock_rdlock(&locks_[i]);
+        try {
+            for (size_t i = range.first; i < range.second; i++) {
+                cursors_.push_back(owner.shards_[i]->prefix_cursor(
+                                       prefix, length, 0, after,
+                                       after_length));
+                if (cursors_.back()->next())
+                    heap_.push_back(cursors_.size() - 1);
+            }
+        } catch (...) {
+            release();
+            throw;
+        }
+        std::make_heap(heap_.begin(), heap_.end(), later(cursors_));
+    }
+
+    ~shard_cursor()
+    {
+        release();
+    }
+
+    bool next()
+    {
+        if ((limit_ && count_ >= limit_) || heap_.empty())
+            return false;
+        std::pop_heap(heap_.begin(), heap_.end(), later(cursors_));
+        cursor *keys = cursors_[heap_.back()];
+        key_.assign(keys->key(), keys->length());
+        value_ = keys->value();
+        ++count_;
+        if (keys->next())
+            std::push_heap(heap_.begin(), heap_.end(), later(cursors_));
+        else
+            heap_.pop_back();
+        return true;
+    }
+
+  private:
+    /// Puts the cursor whose key comes first at the top of the heap.
+    class later {
+      public:
+        explicit later(const std::vector<cursor *> &cursors)
+            :cursors_(cursors)
+        {
+        }
+
+        bool operator()(size_t lhs, size_t rhs) const
+        {
+            return walk_less(cursors_[rhs]->key(), cursors_[rhs]->length(),
+                             cursors_[lhs]->key(), cursors_[lhs]->length());
+        }
+
+      private:
+        const std::vector<cursor *> &cursors_;
+    };
+
+    /// Deletes cursors of the shards, then unlocks the shards.
+    void release()
+    {
+        for (size_t i = 0; i < cursors_.size(); i++)
+            delete cursors_[i];
+        for (size_t i = range_.first; locks_ && i < range_.second; i++)
+            pthread_rwlock_unlock(&locks_[i]);
+    }
+
+    pthread_rwlock_t *locks_;        ///< Locks of shards, NULL if mapped.
+    std::pair<size_t, size_t> range_;  ///< Shards walked.
+    std::vector<cursor *> cursors_;  ///< Cursors of the shards.
+    std::vector<size_t> heap_;       ///< Cursors having a key.
+    size_t limit_;                   ///< Maximum number of keys, or 0.
+    size_t count_;                   ///< Number of keys returned.
+};
+
+sharded_trie::sharded_trie(trie_type type, size_t shards,
+                           routing_type routing)
+    :locks_(NULL), threads_(1)
 {
-    trie_ = new basic_trie(size);
-    header_ = new header_type();
-    memset(&common_, 0, sizeof(common_));
-    resize_suffix(size?size:basic_trie::kDefaultStateSize);
-    resize_common(kDefaultCommonSize);
+    if (type != SINGLE_TRIE && type != DOUBLE_TRIE)
+        throw std::runtime_error("sharded_trie: shards must be single or "
+                                 "double tries");
+    if (shards < 1 || shards > 256)
+        throw std::runtime_error("sharded_trie: 1 to 256 shards");
+    memset(&header_, 0, sizeof(header_));
+    snprintf(header_.magic, sizeof(header_.magic), "%s", magic_);
+    header_.shards = shards;
+    header_.routing = routing;
+    header_.type = type;
+    locks_ = new pthread_rwlock_t[shards];
+    for (size_t i = 0; i < shards; i++) {
+        pthread_rwlock_init(&locks_[i], NULL);
+        shards_.push_back(create_trie(type));
+    }
 }
 
-single_trie::single_trie(const char *filename)
-    :trie_(NULL), suffix_(NULL), header_(NULL), next_suffix_(1),
-     mmap_(NULL), mmap_size_(0)
+sharded_trie::sharded_trie(const char *filename)
+    :locks_(NULL), threads_(1)
 {
-    struct stat sb;
-    int fd, retval;
+    FILE *in;
 
     if (!filename)
         throw std::runtime_error(std::string("can not load from file ")
                                  + filename);
-
-    fd = open(filename, O_RDONLY);
-    if (fd < 0)
+    if (!(in = fopen(filename, "r")))
         throw std::runtime_error(strerror(errno));
-    if (fstat(fd, &sb) < 0)
-        throw std::runtime_error(strerror(errno));
-
-    mmap_ = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-    if (mmap_ == MAP_FAILED)
-        throw std::runtime_error(strerror(errno));
-    while (retval = close(fd), retval == -1 && errno == EINTR) {
-        // exmpty
+    std::vector<section_type> sections;
+    if (fread(&header_, sizeof(header_), 1, in) == 1
+        && !strcmp(header_.magic, magic_)
+        && header_.shards >= 1 && header_.shards <= 256) {
+        sections.resize(header_.shards);
+        if (fread(&sections[0], sizeof(section_type), sections.size(), in)
+            != sections.size())
+            sections.clear();
     }
-    mmap_size_ = sb.st_size;
-
-    void *start;
-    start = header_ = reinterpret_cast<header_type *>(mmap_);
-    if (strcmp(header_->magic, magic_))
+    fclose(in);
+    if (sections.empty())
         throw std::runtime_error("file corrupted");
-    // load suffix
-    suffix_ = reinterpret_cast<suffix_type *>(
-              reinterpret_cast<header_type *>(start) + 1);
-    // load trie
-    start = suffix_ + header_->suffix_size;
-    trie_ = new basic_trie(start,
-                          reinterpret_cast<basic_trie::header_type *>(start)
-                          + 1);
+    try {
+        for (size_t i = 0; i < sections.size(); i++) {
+            // each shard is bounded by its section, not by the file
+            if (sections[i].size <= 0)
+                throw std::runtime_error("file corrupted");
+            if (header_.type == SINGLE_TRIE)
+                shards_.push_back(new single_trie(filename,
+                                                  sections[i].offset,
+                                                  sections[i].size));
+            else
+                shards_.push_back(new double_trie(filename,
+                                                  sections[i].offset,
+                                                  sections[i].size));
+        }
+    } catch (...) {
+        for (size_t i = 0; i < shards_.size(); i++)
+            delete shards_[i];
+        throw;
+    }
 }
 
+sharded_trie::~sharded_trie()
+{
+    for (size_t i = 0; i < shards_.size(); i++) {
+        delete shards_[i];
+        if (locks_)
+            pthread_rwlock_destroy(&locks_[i]);
+    }
+    delete []locks_;
+}
 
-single_trie::~single_trie()
+size_t sharded_trie::route(const char *inputs, size_t length) const
 {
-    if (mmap_) {
-        if (munmap(mmap_, mmap_size_) < 0)
-            throw std::runtime_error(strerror(errno));
-    } else {
-        sanity_delete(header_);
-        resize(suffix_, 0, 0);   // free suffix_
-        resize(common_.data, 0, 0);  // free common_.data
+    if (header_.routing == BYTE_ROUTING)
+        return length?static_cast<unsigned char>(inputs[0])
+                      * shards_.size() / 256:0;
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= static_cast<unsigned char>(inputs[i]);
+        hash *= 16777619u;
     }
-    sanity_delete(trie_);
+    return hash % shards_.size();
 }
 
-//value可以作为每个单词的编号?
-void single_trie::insert_suffix(size_type s,
-                                const char_type *inputs,
-                                value_type value)
+std::pair<size_t, size_t> sharded_trie::shards_of(const char *prefix,
+                                                  size_t length) const
 {
-    trie_->set_base(s, -next_suffix_);
-    const char_type *p = inputs;
-    do {
-        // +1 for value
-        if (next_suffix_ + 1 >= header_->suffix_size)
-            resize_suffix(next_suffix_ + 1);
-        suffix_[next_suffix_++] = *p;
-    } while (*p++ != key_type::kTerminator);
-    suffix_[next_suffix_++] = value;
+    if (header_.routing == BYTE_ROUTING && length) {
+        size_t shard = route(prefix, length);
+        return std::make_pair(shard, shard + 1);
+    }
+    return std::make_pair(static_cast<size_t>(0), shards_.size());
 }
 
-void single_trie::create_branch(size_type s,
-                                const char_type *inputs,
-                                value_type value)
+void sharded_trie::insert(const key_type &key, const value_type &value)
 {
-    basic_trie::extremum_type extremum = {0, 0};
-    size_type start = -trie_->base(s);
+    size_t shard = route(key.c_str(), key.length());
+    shard_lock lock(locks_?&locks_[shard]:NULL, true);
+    shards_[shard]->insert(key, value);
+}
 
-    // find common string
-    const char_type *p = inputs;
-    size_t i = 0;
-    do {
-        if (suffix_[start] != *p)
-            break;
-        if (i + 1 >= common_.size)
-            resize_common(i + 1);
-        common_.data[i++] = *p;
-        if (*p > extremum.max || !extremum.max)
-            extremum.max = *p;
-        if (*p < extremum.min || !extremum.min)
-            extremum.min = *p;
-        ++start;
-    } while (*p++ != key_type::kTerminator);
-    common_.data[i] = 0;  // end common string
+bool sharded_trie::search(const key_type &key, value_type *value) const
+{
+    size_t shard = route(key.c_str(), key.length());
+    shard_lock lock(locks_?&locks_[shard]:NULL, false);
+    return shards_[shard]->search(key, value);
+}
 
-    // check if already exists by checking if the last common char is
-    // terminator
-    if (i > 0 && common_.data[i - 1] == key_type::kTerminator) {
-        // duplicated key
-        suffix_[start] = value;
-        return;
-    }
+bool sharded_trie::search(const char *inputs, size_t length,
+                          value_type *value) const
+{
+    size_t shard = route(inputs, length);
+    shard_lock lock(locks_?&locks_[shard]:NULL, false);
+    return shards_[shard]->search(inputs, length, value);
+}
 
-    // if there is a common part, insert common string into trie
-    if (common_.data[0]) {
-        trie_->set_base(s, trie_->find_base(common_.data, extremum));
-        for (i = 0; common_.data[i]; i++)
-            s = trie_->create_transition(s, common_.data[i]);
-    } else {
-       trie_->set_base(s, 0);
-    }
+/// Shared state of jobs of sharded_trie.
+typedef struct {
+    std::vector<trie *> *shards;  ///< The shards.
+    pthread_rwlock_t *locks;      ///< Locks of shards.
+    std::vector<std::vector<trie::entry_type> > *parts;  ///< Entries.
+    const char *filename;         ///< Prefix of filenames of shards.
+} shard_job_type;
 
-    // create twig for old suffix
-    size_type t = trie_->create_transition(s, suffix_[start]);
-    trie_->set_base(t, -(start + 1));
+/// Returns the filename a shard is built to before it is copied.
+static std::string shard_filename(const char *filename, size_t shard)
+{
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".shard%zu", shard);
+    return std::string(filename) + suffix;
+}
 
-    // create twig for new suffix
-    t = trie_->create_transition(s, *p);
-    if (*p == key_type::kTerminator) {
-        trie_->set_base(t, -next_suffix_);
-        suffix_[next_suffix_++] = value;
-    } else {
-        insert_suffix(t, p + 1, value);
-    }
+static void insert_shard(size_t shard, void *context)
+{
+    shard_job_type *job = static_cast<shard_job_type *>(context);
+    shard_lock lock(&job->locks[shard], true);
+    (*job->shards)[shard]->insert_bulk(&(*job->parts)[shard]);
 }
 
+static void build_shard(size_t shard, void *context)
+{
+    shard_job_type *job = static_cast<shard_job_type *>(context);
+    // build settles the header of a shard, as insert changes it
+    shard_lock lock(job->locks?&job->locks[shard]:NULL, true);
+    (*job->shards)[shard]->build(
+        shard_filename(job->filename, shard).c_str());
+}
 
-void single_trie::insert(const key_type &key, const value_type &value)
+void sharded_trie::insert_bulk(std::vector<entry_type> *entries)
 {
-    const char_type *p;
-    size_type s = trie_->go_forward(1, key.data(), &p);
-    if (trie_->base(s) < 0) {
-        if (p) {
-            create_branch(s, p, value);
-        } else {
-            // duplicated key
-            suffix_[-trie_->base(s)] = value;
-        }
-    } else {
-        s = trie_->create_transition(s, *p);
-        if (*p == key_type::kTerminator) {
-            trie_->set_base(s, -next_suffix_);
-            suffix_[next_suffix_++] = value;
-        } else {
-            insert_suffix(s, p + 1, value);
-        }
-    }
+    if (!locks_)
+        throw std::runtime_error("sharded_trie: archive is read only");
+    std::vector<std::vector<entry_type> > parts(shards_.size());
+    std::vector<entry_type>::const_iterator it;
+    for (it = entries->begin(); it != entries->end(); it++)
+        parts[route(it->data, it->length)].push_back(*it);
+    shard_job_type job = {&shards_, locks_, &parts, NULL};
+    run_parallel(threads_, shards_.size(), insert_shard, &job);
 }
 
-bool single_trie::search(const key_type &key, value_type *value) const
+size_t sharded_trie::prefix_search(const key_type &key,
+                                   result_type *result) const
 {
-    const char_type *p;
-    size_type s = trie_->go_forward(1, key.data(), &p);
-    if (trie_->base(s) < 0) {
-        size_type start = -trie_->base(s);
-        if (p) {
-            do {
-                if (*p != suffix_[start++])
-                    return false;
-            } while (*p++ != key_type::kTerminator);
-        }
-        if (value)
-            *value = suffix_[start];
-        return true;
+    // keys of all shards are merged as prefix_cursor walks them
+    cursor *keys = prefix_cursor(key.c_str(), key.length());
+    key_type found;
+    while (keys->next()) {
+        found.assign(keys->key(), keys->length());
+        result->push_back(std::make_pair(found, keys->value()));
     }
-    return false;
+    delete keys;
+    return result->size();
 }
 
-size_t
-single_trie::prefix_search(const key_type &key, result_type *result) const
+trie::cursor *sharded_trie::prefix_cursor(const char *prefix, size_t length,
+                                          size_t limit, const char *after,
+                                          size_t after_length) const
 {
-    const char_type *p;
-    size_type s = trie_->go_forward(1, key.data(), &p);
-    key_type store;
-    if (trie_->check_reverse_transition(s, key_type::kTerminator))
-        s = trie_->prev(s);
-    if (p)
-        store.assign(key.data(), p - key.data());//存放key中能到达的部分
-    else
-        store.assign(key.data(), key.length());
-    trie_->prefix_search_aux(s, p, &store, result);
-    result_type::iterator it;
-    for (it = result->begin(); it != result->end(); it++) {
-        size_t start = -it->second;
-        const char_type *miss = p;
-        bool fail = false;
-        if (it->first.data()[it->first.length() - 1]
-            == key_type::kTerminator) {
-            it->second = suffix_[start];
-            continue;
-        }
-        for (; suffix_[start] != key_type::kTerminator; start++) {
-            if (miss && *miss != key_type::kTerminator) {
-                if (*miss != suffix_[start]) {
-                    fail = true;
-                    break;
-                }
-                miss++;
-            }
-            it->first.push(suffix_[start]);
-        }
-        if (fail || (miss && *miss != key_type::kTerminator)) {
-            --it;
-            result->erase(it + 1);
-            continue;
-        }
-        it->second = suffix_[start + 1];
+    check_after(prefix, length, after, after_length);
+    return new shard_cursor(*this, prefix, length, limit, after,
+                            after_length, shards_of(prefix, length));
+}
+
+size_t sharded_trie::top_k(const char *prefix, size_t length, size_t k,
+                           result_type *result) const
+{
+    result_type found;
+    std::pair<size_t, size_t> range = shards_of(prefix, length);
+    for (size_t i = range.first; i < range.second; i++) {
+        shard_lock lock(locks_?&locks_[i]:NULL, false);
+        shards_[i]->top_k(prefix, length, k, &found);
     }
+    k = std::min(k, found.size());
+    std::partial_sort(found.begin(), found.begin() + k, found.end(),
+                      larger_value);
+    result->insert(result->end(), found.begin(), found.begin() + k);
     return result->size();
 }
 
-void single_trie::build(const char *filename, bool verbose)
+bool sharded_trie::aggregate_prefix(const char *prefix, size_t length,
+                                    aggregate_type *result) const
 {
-    FILE *out;
+    aggregate_type total = {0, 0, INT32_MAX, INT32_MIN, 0}, aggregate;
+    std::pair<size_t, size_t> range = shards_of(prefix, length);
+    for (size_t i = range.first; i < range.second; i++) {
+        shard_lock lock(locks_?&locks_[i]:NULL, false);
+        if (shards_[i]->aggregate_prefix(prefix, length, &aggregate))
+            merge_aggregate(&total, aggregate);
+    }
+    if (!total.count)
+        return false;
+    *result = total;
+    return true;
+}
+
+void sharded_trie::build(const char *filename, bool verbose)
+{
+    // sections start at pages, each shard maps and reads only its own
+    static const long kSectionAlign = 4096;
+    FILE *out, *in;
 
     if (!filename)
         throw std::runtime_error(std::string("can not save to file ")
                                  + filename);
-
-    if ((out = fopen(filename, "w+"))) {
-        snprintf(header_->magic, sizeof(header_->magic), "%s", magic_);
-        header_->suffix_size = next_suffix_;
-        fwrite(header_, sizeof(header_type), 1, out);
-        fwrite(suffix_, sizeof(suffix_type) * header_->suffix_size, 1, out);
-        fwrite(trie_->compact_header(),
-               sizeof(basic_trie::header_type), 1, out);
-        fwrite(trie_->states(), sizeof(basic_trie::state_type)
-                               * trie_->compact_header()->size, 1, out);
-
-        fclose(out);
-        if (verbose) {
-            char buf[256];
-            size_t size[2];
-            size[0] = sizeof(suffix_type) * header_->suffix_size;
-            size[1] = sizeof(basic_trie::state_type)
-                      * trie_->compact_header()->size;
-
-            std::cerr << "suffix = " << pretty_size(size[0], buf, sizeof(buf));
-            std::cerr << ", trie = " << pretty_size(size[1], buf, sizeof(buf));
-            std::cerr << ", total = "
-                      << pretty_size(size[0] + size[1], buf, sizeof(buf))
-                      << std::endl;
+    shard_job_type job = {&shards_, locks_, NULL, filename};
+    std::vector<section_type> sections(shards_.size());
+    out = in = NULL;
+    try {
+        run_parallel(threads_, shards_.size(), build_shard, &job);
+        if (!(out = fopen(filename, "w+")))
+            throw std::runtime_error(strerror(errno));
+        fwrite(&header_, sizeof(header_), 1, out);
+        fwrite(&sections[0], sizeof(section_type), sections.size(), out);
+        std::vector<char> block(65536);
+        for (size_t i = 0; i < shards_.size(); i++) {
+            std::string shard = shard_filename(filename, i);
+            while (ftell(out) % kSectionAlign)
+                fputc(0, out);
+            sections[i].offset = ftell(out);
+            if (!(in = fopen(shard.c_str(), "r")))
+                throw std::runtime_error(strerror(errno));
+            size_t length;
+            while ((length = fread(&block[0], 1, block.size(), in)) > 0)
+                fwrite(&block[0], 1, length, out);
+            fclose(in);
+            in = NULL;
+            unlink(shard.c_str());
+            sections[i].size = ftell(out) - sections[i].offset;
         }
+        fseek(out, sizeof(header_), SEEK_SET);
+        fwrite(&sections[0], sizeof(section_type), sections.size(), out);
+        FILE *closing = out;
+        out = NULL;
+        if (fclose(closing) < 0)
+            throw std::runtime_error(strerror(errno));
+    } catch (...) {
+        // neither a partial archive nor a shard is left behind
+        if (in)
+            fclose(in);
+        if (out)
+            fclose(out);
+        unlink(filename);
+        for (size_t i = 0; i < shards_.size(); i++)
+            unlink(shard_filename(filename, i).c_str());
+        throw;
+    }
+    if (verbose) {
+        char buf[256];
+        std::cerr << shards_.size() << " shards, total = "
+                  << pretty_size(sections.back().offset
+                                 + sections.back().size, buf, sizeof(buf))
+                  << std::endl;
     }
 }
 
+void sharded_trie::record_max_values(bool record)
+{
+    for (size_t i = 0; i < shards_.size(); i++)
+        shards_[i]->record_max_values(record);
+}
+
+void sharded_trie::record_aggregates(bool record)
+{
+    for (size_t i = 0; i < shards_.size(); i++)
+        shards_[i]->record_aggregates(record);
+}
+
 END_TRIE_NAMESPACE
 
 // vim: ts=4 sw=4 ai et
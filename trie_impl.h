@@ -44,6 +44,7 @@
 #include <errno.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <pthread.h>
 
 #include <cstring>
 #include <cstdio>
@@ -56,6 +57,7 @@
 #include <map>
 #include <set>
 #include <deque>
+#include <atomic>
 
 #ifdef HAVE_CONFIG_H
 #include "config.h"
@@ -154,6 +156,16 @@ class basic_trie: public trie
         char unused[60]; ///< Unused, for 32/64 bits compatible.
     } header_type;
 
+    /**
+     * Represents the first outcome transition of a state and the next
+     * outcome transition of its parent. Both are input char_types in
+     * ascending order and zero indicates the end.
+     */
+    typedef struct {
+        uint16_t child;    ///< Input of the first outcome transition.
+        uint16_t sibling;  ///< Input of the next transition from parent.
+    } label_type;
+
     /**
      * Represents a pair of extremum. It is used to improve
      * performance of find_base method.
@@ -207,7 +219,30 @@ class basic_trie: public trie
 
     void insert(const key_type &key, const value_type &value);
     bool search(const key_type &key, value_type *value) const;
+    bool search(const char *inputs, size_t length, value_type *value) const;
+    size_t search_batch(const key_type *keys, size_t n,
+                        value_type *values, bool *found) const;
+    size_t search_batch(const char *const *inputs, const size_t *lengths,
+                        size_t n, value_type *values, bool *found) const;
     size_t prefix_search(const key_type &prefix, result_type *result) const;
+    cursor *prefix_cursor(const char *prefix, size_t length,
+                          size_t limit = 0, const char *after = NULL,
+                          size_t after_length = 0) const;
+    size_t fuzzy_search(const char *inputs, size_t length, size_t distance,
+                        fuzzy_callback found, void *context) const;
+    bool step(traversal_type *t, char ch) const;
+    bool value(const traversal_type &t, value_type *result) const;
+    cursor *enumerate(const traversal_type &t, size_t limit = 0) const;
+    size_t common_prefix_search(const char *inputs, size_t length,
+                                prefix_result_type *result) const;
+    bool longest_prefix(const char *inputs, size_t length,
+                        size_t *matched, value_type *value) const;
+    void insert_bulk(std::vector<entry_type> *entries);
+
+    void set_build_threads(size_t threads)
+    {
+        threads_ = threads;
+    }
 
     void build(const char *filename, bool verbose)
     {
@@ -243,6 +278,19 @@ class basic_trie: public trie
      */
     size_type create_transition(size_type s, char_type ch);
 
+    /**
+     * Creates all transitions from state s at once. State s must not
+     * have any outcome transition yet, so nothing will be relocated.
+     *
+     * @param s Start state.
+     * @param inputs The input char_types, ends with zero.
+     * @param extremum The max and min value in inputs.
+     * @return The new BASE value of s.
+     */
+    size_type create_transitions(size_type s,
+                                 const char_type *inputs,
+                                 const extremum_type &extremum);
+
     /**
      * Finds a free BASE value for storing all inputs.
      *
@@ -254,6 +302,53 @@ class basic_trie: public trie
     size_type find_base(const char_type *inputs,
                         const extremum_type &extremum);
 
+    /**
+     * Removes state s and the transition leading to it. State s must
+     * not have any outcome transition.
+     *
+     * @param s The state to be removed.
+     */
+    void remove_state(size_type s);
+
+    /**
+     * Copies all states of sub into this trie. The root of sub becomes
+     * state s, which must not have any outcome transition yet, and any
+     * other state t becomes t + offset, which must be free.
+     *
+     * @param s The state standing for the root of sub.
+     * @param sub The basic_trie to be copied from.
+     * @param offset The offset added to states of sub.
+     * @return The last state being used.
+     */
+    size_type stitch(size_type s, const basic_trie &sub, size_type offset);
+
+    /// Returns the last state whose CHECK is set.
+    size_type last_state() const
+    {
+        size_type s = header_->size - 1;
+        while (s > 1 && check(s) <= 0)
+            s--;
+        return s;
+    }
+
+    /// Returns the number of outcome transitions of state s.
+    size_t outdegree(size_type s) const
+    {
+        char_type targets[key_type::kCharsetSize + 1];
+        return find_exist_target(s, targets, NULL);
+    }
+
+    /**
+     * Stores char_types of outcome transitions of state s into targets
+     * in ascending order, followed by zero.
+     *
+     * @return The number of targets stored.
+     */
+    size_type children(size_type s, char_type *targets) const
+    {
+        return find_exist_target(s, targets, NULL);
+    }
+
     /**
      * Prints all outcome transition from state s.
      *
@@ -274,17 +369,6 @@ class basic_trie: public trie
         return new basic_trie(header, states);
     }
 
-    /**
-     * Sets the last available BASE value. It uses to improve the
-     * performance of find_base.
-     *
-     * @param base The BASE value.
-     */
-    void set_last_base(size_type base)
-    {
-        last_base_ = base;
-    }
-
     /**
      * Sets a new state relocator.
      *
@@ -318,7 +402,16 @@ class basic_trie: public trie
     /// Set a new CHECK value of state s.
     void set_check(size_type s, size_type val)
     {
+        if (blocks_) {
+            if (states_[s].check <= 0 && val > 0)
+                pop_empty(s);
+            else if (states_[s].check > 0 && val <= 0)
+                push_empty(s);
+        }
         states_[s].check = val;
+        // a leaf may never get a base, it still has to be saved
+        if (val > 0 && s > max_state_)
+            max_state_ = s;
     }
 
     /// Gets next state from s with input ch.
@@ -355,6 +448,27 @@ class basic_trie: public trie
         return s;
     }
 
+    /**
+     * Goes forward from state s with key i of label, including its
+     * terminator. Returns the last arrived state and sets depth to the
+     * number of char_types consumed, which is label.length(i) if all of
+     * them are.
+     */
+    template<typename L>
+    size_type go_forward(size_type s, const L &label, size_t i,
+                         size_t *depth) const
+    {
+        size_t d, length = label.length(i);
+        for (d = 0; d < length; d++) {
+            size_type t = next(s, label.label(i, d));
+            if (!check_transition(s, t))
+                break;
+            s = t;
+        }
+        *depth = d;
+        return s;
+    }
+
     /**
      * Goes forward from state s with reverse inputs. Returns the last
      * arrived state and sets mismatch to mismatch position.
@@ -408,7 +522,8 @@ class basic_trie: public trie
     const header_type *compact_header() const
     {
         memcpy(&compact_header_, header_, sizeof(header_type));
-        compact_header_.size = max_state_ + 1;
+        // the root is kept even if nothing was ever stored
+        compact_header_.size = std::max<size_type>(max_state_, 1) + 1;
         return &compact_header_;
     }
 
@@ -430,6 +545,30 @@ class basic_trie: public trie
         return max_state_;
     }
 
+    /// Instruction sets used by scan_exist_target.
+    enum simd_type {
+        SIMD_NONE = 0,  /**< Plain C++. */
+        SIMD_SSE2,      /**< 4 states per round. */
+        SIMD_AVX2       /**< 8 states per round. */
+    };
+
+    /// Returns the instruction set used by scan_exist_target.
+    static simd_type simd()
+    {
+        return simd_;
+    }
+
+    /**
+     * Changes the instruction set used by scan_exist_target. The best
+     * one supported by the running cpu is used by default. It is
+     * mostly for benchmarking.
+     *
+     * @param simd The instruction set. It falls back to the best
+     *             supported one if the cpu does not support it.
+     * @return The instruction set actually used.
+     */
+    static simd_type set_simd(simd_type simd);
+
     /// Returns true if a basic_trie owns the memory of its data.
     bool owner() const
     {
@@ -452,6 +591,26 @@ class basic_trie: public trie
     }
 
   protected:
+    /**
+     * Implements search_batch for keys accessed by label.
+     *
+     * @param label Accessor of char_types of keys.
+     * @param n Number of keys.
+     * @param[out] values values[i] is set if key i is found.
+     * @param[out] found found[i] tells whether key i is found.
+     * @return The number of keys found.
+     */
+    template<typename L>
+    size_t search_labels(const L &label, size_t n, value_type *values,
+                         bool *found) const;
+
+    /**
+     * Walks along inputs from the root and calls found(length, value)
+     * for every key which is a prefix of inputs, shortest first.
+     */
+    template<typename F>
+    void find_prefixes(const char *inputs, size_t length, F &found) const;
+
     /**
      * Relocates all target states linked from state s by changing the BASE
      * of s.
@@ -472,9 +631,55 @@ class basic_trie: public trie
     void resize_state(size_type size)
     {
         // align with 4k
+        size_type osize = header_->size;
         size_type nsize = (((header_->size * 2 + size) >> 12) + 1) << 12;
         states_ = resize(states_, header_->size, nsize);
+        labels_ = resize(labels_, header_->size, nsize);
         header_->size = nsize;
+        grow_blocks(osize, nsize);
+    }
+
+    /// Adds input ch to the outcome transitions of state s in labels_.
+    void add_label(size_type s, char_type ch)
+    {
+        uint16_t *p = &labels_[s].child;
+        while (*p && *p < ch)
+            p = &labels_[base(s) + *p].sibling;
+        if (*p == ch)
+            return;
+        labels_[base(s) + ch].sibling = *p;
+        *p = ch;
+    }
+
+    /// Rebuilds labels_ from states_.
+    void build_labels();
+
+    /// Adds states in [osize, nsize) into blocks of empty states.
+    void grow_blocks(size_type osize, size_type nsize);
+
+    /// Removes state s from its block when it is being used.
+    void pop_empty(size_type s);
+
+    /// Adds state s to its block when it is being freed.
+    void push_empty(size_type s);
+
+    /**
+     * Moves block b from list *from to list *to.
+     *
+     * @param b The block.
+     * @param from Pointer to head of the source list.
+     * @param to Pointer to head of the target list.
+     */
+    void transfer_block(size_type b, size_type *from, size_type *to);
+
+    /// Frees all blocks of empty states.
+    void clear_blocks()
+    {
+        free(links_);
+        free(blocks_);
+        links_ = NULL;
+        blocks_ = NULL;
+        open_ = closed_ = full_ = -1;
     }
 
     /**
@@ -486,38 +691,84 @@ class basic_trie: public trie
                                 char_type *targets,
                                 extremum_type *extremum) const
     {
-        char_type ch;
-        char_type *p;
+        char_type *p = targets;
 
-        for (ch = 1, p = targets; ch < key_type::kCharsetSize + 1; ch++) {
-            size_type t = next(s, ch);
-            if (t >= header_->size)
-                break;
-            if (check_transition(s, t)) {
+        if (labels_) {
+            for (char_type ch = labels_[s].child; ch;
+                 ch = labels_[next(s, ch)].sibling)
                 *(p++) = ch;
-                if (extremum) {
-                    if (ch > extremum->max)
-                        extremum->max = ch;
-                    if (ch < extremum->min)
-                        extremum->min = ch;
-                }
-            }
+        } else {
+            p += scan_exist_target(s, targets);
         }
 
         *p = 0;  // zero indicates the end of targets.此0不是\0,\0对应1
 
+        // targets are in ascending order
+        if (extremum && p > targets) {
+            if (p[-1] > extremum->max)
+                extremum->max = p[-1];
+            if (targets[0] < extremum->min || !extremum->min)
+                extremum->min = targets[0];
+        }
+
         return p - targets;
     }
+
+    /**
+     * Finds out all exists targets from s by comparing CHECK of all
+     * possible target states with s. It is used when there is no
+     * labels_, e.g. the basic_trie is loaded from an archive.
+     *
+     * @return The number of targets stored.
+     */
+    size_type scan_exist_target(size_type s, char_type *targets) const;
   private:
+    /// Number of states in a block of empty states.
+    static const size_type kBlockSize = 256;
+
+    /// Times a block may fail find_base before it is closed.
+    static const size_type kMaxTrial = 1;
+
+    /// Represents a link between empty states in the same block.
+    typedef struct {
+        size_type prev;  ///< Previous empty state.
+        size_type next;  ///< Next empty state.
+    } link_type;
+
+    /**
+     * Represents kBlockSize consecutive states. Blocks without empty
+     * states are kept in the full list, blocks which have failed
+     * find_base kMaxTrial times are kept in the closed list and are
+     * only tried for single input, others are kept in the open list.
+     */
+    typedef struct {
+        size_type prev;   ///< Previous block in the same list.
+        size_type next;   ///< Next block in the same list.
+        size_type num;    ///< Number of empty states.
+        size_type trial;  ///< Times of failing find_base.
+        size_type head;   ///< First empty state.
+    } block_type;
+
     header_type *header_;  ///< Pointer to header.
     state_type *states_;   ///< Pointer to state buffer.
-    size_type last_base_;  ///< Last avaiable BASE value.
     size_type max_state_;  ///< Number of state being used.
     bool owner_;           ///< Ownership of data.
+    link_type *links_;     ///< Links between empty states, NULL if unused.
+    label_type *labels_;   ///< Outcome transitions, NULL if unused.
+    block_type *blocks_;   ///< Blocks of empty states, NULL if unused.
+    size_type open_;       ///< Head of open blocks, -1 if none.
+    size_type closed_;     ///< Head of closed blocks, -1 if none.
+    size_type full_;       ///< Head of full blocks, -1 if none.
 
     /// Relocator for notifying state changing.
     trie_relocator_interface<size_type> *relocator_;
 
+    /// Number of threads used by insert_bulk.
+    size_t threads_;
+
+    /// Instruction set used by scan_exist_target.
+    static simd_type simd_;
+
     /// @see compact_header().
     mutable header_type compact_header_;
 };
@@ -579,7 +830,10 @@ class double_trie: public trie {
         char magic[16];  ///< Archive magic.
         size_type index_size;  ///< Index array size.
         size_type accept_size; ///< Accept array size.
-        char unused[40]; ///< for 32/64bits compatible.
+        size_type max_size; ///< Size of max value array, 0 if not recorded.
+        size_type id_size; ///< Number of key ids, 0 if not recorded.
+        size_type aggregate_size; ///< Size of aggregate array, 0 if none.
+        char unused[28]; ///< for 32/64bits compatible.
     } header_type;
 
     /**
@@ -593,17 +847,71 @@ class double_trie: public trie {
      * Constructs a double_trie using a trie archive.
      *
      * @param filename Filename of the archive.
+     * @param offset Offset of the archive in the file, see sharded_trie.
+     * @param length Length of the archive, 0 for the rest of the file.
      */
-    explicit double_trie(const char *filename);
+    explicit double_trie(const char *filename, off_t offset = 0,
+                         off_t length = 0);
 
     /// Destructs a double_trie.
     ~double_trie();
 
     void insert(const key_type &key, const value_type &value);
     bool search(const key_type &key, value_type *value) const;
+    bool search(const char *inputs, size_t length, value_type *value) const;
+    size_t search_batch(const key_type *keys, size_t n,
+                        value_type *values, bool *found) const;
+    size_t search_batch(const char *const *inputs, const size_t *lengths,
+                        size_t n, value_type *values, bool *found) const;
     size_t prefix_search(const key_type &key, result_type *result) const;
+    cursor *prefix_cursor(const char *prefix, size_t length,
+                          size_t limit = 0, const char *after = NULL,
+                          size_t after_length = 0) const;
+    size_t fuzzy_search(const char *inputs, size_t length, size_t distance,
+                        fuzzy_callback found, void *context) const;
+    bool step(traversal_type *t, char ch) const;
+    bool value(const traversal_type &t, value_type *result) const;
+    cursor *enumerate(const traversal_type &t, size_t limit = 0) const;
+    size_t top_k(const char *prefix, size_t length, size_t k,
+                 result_type *result) const;
+    bool key_of(size_type id, std::string *key,
+                value_type *value = NULL) const;
+    bool id_of(const char *inputs, size_t length, size_type *id) const;
+    size_type rank(const char *inputs, size_t length) const;
+    bool aggregate_prefix(const char *prefix, size_t length,
+                          aggregate_type *result) const;
+    size_t common_prefix_search(const char *inputs, size_t length,
+                                prefix_result_type *result) const;
+    bool longest_prefix(const char *inputs, size_t length,
+                        size_t *matched, value_type *value) const;
+    void insert_bulk(std::vector<entry_type> *entries);
     void build(const char *filename, bool verbose = false);
 
+    void set_build_threads(size_t threads)
+    {
+        threads_ = threads;
+    }
+
+    void record_max_values(bool record)
+    {
+        record_ = record;
+    }
+
+    void record_key_ids(bool record)
+    {
+        record_ids_ = record;
+    }
+
+    void record_aggregates(bool record)
+    {
+        record_aggregates_ = record;
+    }
+
+    size_t key_id_size() const
+    {
+        return key_ids_?header_->id_size:0;
+    }
+
     /// Returns a pointer to front trie.
     const basic_trie *front_trie() const
     {
@@ -653,6 +961,41 @@ class double_trie: public trie {
     }
 
   protected:
+    /**
+     * Implements search_batch for keys accessed by label.
+     *
+     * @param label Accessor of char_types of keys.
+     * @param n Number of keys.
+     * @param[out] values values[i] is set if key i is found.
+     * @param[out] found found[i] tells whether key i is found.
+     * @return The number of keys found.
+     */
+    template<typename L>
+    size_t search_labels(const L &label, size_t n, value_type *values,
+                         bool *found) const;
+
+    /**
+     * Walks along inputs from the root and calls found(length, value)
+     * for every key which is a prefix of inputs, shortest first.
+     */
+    template<typename F>
+    void find_prefixes(const char *inputs, size_t length, F &found) const;
+
+    /**
+     * Finishes searching key i of label which arrived at state s after
+     * consuming depth char_types.
+     *
+     * @param label Accessor of char_types of keys.
+     * @param i The key.
+     * @param s The last state arrived by go_forward.
+     * @param depth Number of char_types consumed.
+     * @param[out] value The value if found.
+     * @return true if found.
+     */
+    template<typename L>
+    bool search_tail(const L &label, size_t i, size_type s, size_t depth,
+                     value_type *value) const;
+
     /// Appends inputs to rear trie.
     size_type rhs_append(const char_type *inputs);
 
@@ -687,8 +1030,7 @@ class double_trie: public trie {
     void remove_accept_state(size_type s)
     {
         assert(s > 0);
-        rhs_->set_base(s, 0);
-        rhs_->set_check(s, 0);
+        rhs_->remove_state(s);
         free_accept_entry(s);
     }
 
@@ -704,6 +1046,19 @@ class double_trie: public trie {
         return accept_[index_[-lhs_->base(s)].index].accept;
     }
 
+    /**
+     * Returns where the rest of a key starts in rear trie, from accept
+     * state r. A dummy terminator is skipped, but not the terminator of
+     * a key ending right at the separator, whose parent is the root.
+     */
+    size_type tail_start(size_type r) const
+    {
+        if (rhs_->check_reverse_transition(r, key_type::kTerminator)
+            && rhs_->prev(r) > 1)
+            return rhs_->prev(r);
+        return r;
+    }
+
     /**
       * Sets a accept state for a separated state.
       *
@@ -794,17 +1149,7 @@ class double_trie: public trie {
     /// Returns the out degree of state s in rear trie.
     size_t outdegree(size_type s) const
     {
-        char_type ch;
-        size_t degree = 0;
-        for (ch = 1; ch < key_type::kCharsetSize + 1; ch++) {
-            size_type t = rhs_->next(s, ch);
-            if (t >= rhs_->header()->size)
-                break;
-            if (rhs_->check_transition(s, t))
-                degree++;
-        }
-
-        return degree;
+        return rhs_->outdegree(s);
     }
 
     /**
@@ -889,6 +1234,9 @@ class double_trie: public trie {
     }
 
   private:
+    /// Adapts double_trie to walk_cursor, see prefix_cursor.
+    class walker;
+
     /// Represents a separated state index.
     typedef struct {
         size_type accept;
@@ -940,6 +1288,30 @@ class double_trie: public trie {
     /// List of freed index entry.
     std::deque<size_type> free_index_;
 
+    /// Number of threads used by insert_bulk.
+    size_t threads_;
+
+    /// Records maximum values of states in build.
+    bool record_;
+
+    /// Maximum value below each front state, if in archive.
+    const value_type *max_values_;
+
+    /// Records key ids in build.
+    bool record_ids_;
+
+    /// Id of the first key below each front state, if in archive.
+    const size_type *key_ids_;
+
+    /// Front state holding each key id, if in archive.
+    const size_type *id_states_;
+
+    /// Records aggregates of states in build.
+    bool record_aggregates_;
+
+    /// Aggregates of values below each front state, if in archive.
+    const aggregate_type *aggregates_;
+
     /// Pointer to mmapped buffer
     void *mmap_;
 
@@ -948,6 +1320,7 @@ class double_trie: public trie {
 
     /// Archive magic.
     static const char magic_[16];
+
 };
 
 /**
@@ -965,7 +1338,10 @@ class single_trie: public trie
     typedef struct {
         char magic[16];  ///< Archive magic.
         size_type suffix_size;  ///< Size of suffix buffer.
-        char unused[44];  ///< for 32/64 bits compatible.
+        size_type max_size;  ///< Size of max value array, 0 if not recorded.
+        size_type id_size;  ///< Number of key ids, 0 if not recorded.
+        size_type aggregate_size;  ///< Size of aggregate array, 0 if none.
+        char unused[32];  ///< for 32/64 bits compatible.
     } header_type;
 
     /**
@@ -992,17 +1368,71 @@ class single_trie: public trie
      * Constructs an single_trie from archive.
      *
      * @param filename Filename of the archive.
+     * @param offset Offset of the archive in the file, see sharded_trie.
+     * @param length Length of the archive, 0 for the rest of the file.
      */
-    explicit single_trie(const char *filename);
+    explicit single_trie(const char *filename, off_t offset = 0,
+                         off_t length = 0);
 
     /// Destructs a single_trie.
     ~single_trie();
 
     void insert(const key_type &key, const value_type &value);
     bool search(const key_type &key, value_type *value) const;
+    bool search(const char *inputs, size_t length, value_type *value) const;
+    size_t search_batch(const key_type *keys, size_t n,
+                        value_type *values, bool *found) const;
+    size_t search_batch(const char *const *inputs, const size_t *lengths,
+                        size_t n, value_type *values, bool *found) const;
     size_t prefix_search(const key_type &key, result_type *result) const;
+    cursor *prefix_cursor(const char *prefix, size_t length,
+                          size_t limit = 0, const char *after = NULL,
+                          size_t after_length = 0) const;
+    size_t fuzzy_search(const char *inputs, size_t length, size_t distance,
+                        fuzzy_callback found, void *context) const;
+    bool step(traversal_type *t, char ch) const;
+    bool value(const traversal_type &t, value_type *result) const;
+    cursor *enumerate(const traversal_type &t, size_t limit = 0) const;
+    size_t top_k(const char *prefix, size_t length, size_t k,
+                 result_type *result) const;
+    bool key_of(size_type id, std::string *key,
+                value_type *value = NULL) const;
+    bool id_of(const char *inputs, size_t length, size_type *id) const;
+    size_type rank(const char *inputs, size_t length) const;
+    bool aggregate_prefix(const char *prefix, size_t length,
+                          aggregate_type *result) const;
+    size_t common_prefix_search(const char *inputs, size_t length,
+                                prefix_result_type *result) const;
+    bool longest_prefix(const char *inputs, size_t length,
+                        size_t *matched, value_type *value) const;
+    void insert_bulk(std::vector<entry_type> *entries);
     void build(const char *filename, bool verbose);
 
+    void set_build_threads(size_t threads)
+    {
+        threads_ = threads;
+    }
+
+    void record_max_values(bool record)
+    {
+        record_ = record;
+    }
+
+    void record_key_ids(bool record)
+    {
+        record_ids_ = record;
+    }
+
+    void record_aggregates(bool record)
+    {
+        record_aggregates_ = record;
+    }
+
+    size_t key_id_size() const
+    {
+        return key_ids_?header_->id_size:0;
+    }
+
     /// Returns a pointer to the trie of single_trie.
     const basic_trie *trie()
     {
@@ -1032,6 +1462,41 @@ class single_trie: public trie
     }
 
   protected:
+    /**
+     * Implements search_batch for keys accessed by label.
+     *
+     * @param label Accessor of char_types of keys.
+     * @param n Number of keys.
+     * @param[out] values values[i] is set if key i is found.
+     * @param[out] found found[i] tells whether key i is found.
+     * @return The number of keys found.
+     */
+    template<typename L>
+    size_t search_labels(const L &label, size_t n, value_type *values,
+                         bool *found) const;
+
+    /**
+     * Walks along inputs from the root and calls found(length, value)
+     * for every key which is a prefix of inputs, shortest first.
+     */
+    template<typename F>
+    void find_prefixes(const char *inputs, size_t length, F &found) const;
+
+    /**
+     * Finishes searching key i of label which arrived at state s after
+     * consuming depth char_types.
+     *
+     * @param label Accessor of char_types of keys.
+     * @param i The key.
+     * @param s The last state arrived by go_forward.
+     * @param depth Number of char_types consumed.
+     * @param[out] value The value if found.
+     * @return true if found.
+     */
+    template<typename L>
+    bool search_tail(const L &label, size_t i, size_type s, size_t depth,
+                     value_type *value) const;
+
     /**
      * Resizes suffix to expected size
      *
@@ -1079,6 +1544,9 @@ class single_trie: public trie
     void create_branch(size_type s, const char_type *inputs, value_type value);
 
   private:
+    /// Adapts single_trie to walk_cursor, see prefix_cursor.
+    class walker;
+
     basic_trie *trie_;      ///< Pointer to trie.
     suffix_type *suffix_;   ///< Pointer to suffix.
     header_type *header_;   ///< Pointer to header
@@ -1090,12 +1558,945 @@ class single_trie: public trie
      */
     common_type common_;
 
+    size_t threads_;         ///< Number of threads used by insert_bulk.
+    bool record_;            ///< Records maximum values of states in build.
+    const value_type *max_values_;  ///< Maximum value below each state.
+    bool record_ids_;        ///< Records key ids in build.
+    const size_type *key_ids_;    ///< Id of the first key below states.
+    const size_type *id_states_;  ///< State holding each key id.
+    bool record_aggregates_;      ///< Records aggregates in build.
+    const aggregate_type *aggregates_;  ///< Aggregates below each state.
+
+    void *mmap_;
+    size_t mmap_size_;
+
+    /// Archive magic
+    static const char magic_[16];
+};
+
+/**
+ * A read-only double-array trie using 4-byte units.
+ *
+ * Every unit is either a node or a leaf. A node stores the label of
+ * its incoming transition, so there is no check array. The children of
+ * node s are placed at s ^ offset(s) ^ ch and no two nodes share the
+ * same s ^ offset(s), so a child is verified by comparing its label. A
+ * node with has_leaf set is the end of a key, and the leaf at
+ * s ^ offset(s) holds the index of its value in the value buffer.
+ *
+ * Layout of a node:
+ *     bit 0-8:   label (char_type of the incoming transition)
+ *     bit 9:     has_leaf
+ *     bit 10:    offset is shifted left by 9 bits
+ *     bit 11-30: offset
+ *     bit 31:    0
+ *
+ * Layout of a leaf:
+ *     bit 0-30:  index in value buffer
+ *     bit 31:    1
+ *
+ * A compact_trie can only be created by insert_bulk on an empty one,
+ * so convert an existing trie by dumping it with prefix_search.
+ */
+class compact_trie: public trie {
+  public:
+    /// Represents a unit of double-array.
+    typedef uint32_t unit_type;
+
+    /**
+     * Represents some information about compact_trie.
+     */
+    typedef struct {
+        char magic[16];  ///< Archive magic.
+        size_type unit_size;  ///< Size of unit buffer.
+        size_type value_size;  ///< Size of value buffer.
+        char unused[40];  ///< for 32/64 bits compatible.
+    } header_type;
+
+    /// Number of units in a block, children of a node never cross it.
+    static const size_type kBlockSize = 512;
+
+    /**
+     * Constructs an empty compact_trie.
+     *
+     * @param size Ignored, units are allocated while building.
+     */
+    explicit compact_trie(size_t size = 0);
+
+    /**
+     * Constructs a compact_trie from archive.
+     *
+     * @param filename Filename of the archive.
+     */
+    explicit compact_trie(const char *filename);
+
+    /// Destructs a compact_trie.
+    ~compact_trie();
+
+    /// A compact_trie can not be modified key by key.
+    void insert(const key_type &key, const value_type &value)
+    {
+        throw std::runtime_error("not implement");
+    }
+
+    bool search(const key_type &key, value_type *value) const;
+    bool search(const char *inputs, size_t length, value_type *value) const;
+    size_t prefix_search(const key_type &key, result_type *result) const;
+    cursor *prefix_cursor(const char *prefix, size_t length,
+                          size_t limit = 0, const char *after = NULL,
+                          size_t after_length = 0) const;
+    size_t fuzzy_search(const char *inputs, size_t length, size_t distance,
+                        fuzzy_callback found, void *context) const;
+    size_t common_prefix_search(const char *inputs, size_t length,
+                                prefix_result_type *result) const;
+    bool longest_prefix(const char *inputs, size_t length,
+                        size_t *matched, value_type *value) const;
+    void insert_bulk(std::vector<entry_type> *entries);
+    void build(const char *filename, bool verbose = false);
+
+    /// Returns true if unit u is a leaf.
+    static bool is_leaf(unit_type u)
+    {
+        return u >> 31;
+    }
+
+    /// Returns true if a key ends at node u.
+    static bool has_leaf(unit_type u)
+    {
+        return (u >> 9) & 1;
+    }
+
+    /// Returns the label of node u, a leaf never matches any char_type.
+    static unit_type label(unit_type u)
+    {
+        return u & ((1U << 31) | 0x1ff);
+    }
+
+    /// Returns the offset of node u.
+    static unit_type offset(unit_type u)
+    {
+        return (u >> 11) << (((u >> 10) & 1) * 9);
+    }
+
+    /// Returns the value index of leaf u.
+    static unit_type leaf_index(unit_type u)
+    {
+        return u & ~(1U << 31);
+    }
+
+    /// Returns the unit at state s.
+    unit_type unit(size_type s) const
+    {
+        return units_[s];
+    }
+
+    /// Returns the state reached from s by ch.
+    size_type next(size_type s, char_type ch) const
+    {
+        return s ^ offset(units_[s]) ^ ch;
+    }
+
+    /// Returns the state reached from s by ch if exists, or 0.
+    size_type go_forward(size_type s, char_type ch) const
+    {
+        size_type t = next(s, ch);
+        return label(units_[t]) == static_cast<unit_type>(ch)?t:0;
+    }
+
+    /// Returns a pointer to the header of compact_trie.
+    const header_type *header() const
+    {
+        return header_;
+    }
+
+  protected:
+    /**
+     * Walks along inputs from the root and calls found(length, value)
+     * for every key which is a prefix of inputs, shortest first.
+     */
+    template<typename F>
+    void find_prefixes(const char *inputs, size_t length, F &found) const;
+
+    /**
+     * Retrieves all keys below state s.
+     *
+     * @param s The state.
+     * @param store Char_types leading to s.
+     * @param[out] result Result set contains the existing keys.
+     */
+    void prefix_search_aux(size_type s, key_type *store,
+                           result_type *result) const;
+
+  private:
+    /// Adapts compact_trie to walk_cursor, see prefix_cursor.
+    class walker;
+
+    header_type *header_;  ///< Pointer to header.
+    unit_type *units_;     ///< Pointer to units.
+    value_type *values_;   ///< Pointer to values.
+
     void *mmap_;
     size_t mmap_size_;
 
     /// Archive magic
     static const char magic_[16];
 };
+
+/**
+ * A read-only minimal acyclic automaton (DAWG) in compact_trie units.
+ *
+ * Keys sharing a suffix share states, so a state no longer determines
+ * a key and values can not be kept in leaves. Instead, every key has a
+ * rank, its position in sorted order, and values are kept in rank
+ * order. Each unit t reached from s by ch stores in ranks the number of
+ * keys which are ordered before the keys through t but after the keys
+ * of s, i.e. whether s is final plus the number of keys below the
+ * smaller siblings of t. The rank of a key is the sum along its path.
+ *
+ * Units of equivalent states share the same base, like darts-clone
+ * does for its dawg, so the children of a state are placed only once.
+ * Leaves are not stored, has_leaf alone marks a final state.
+ */
+class dawg_trie: public trie {
+  public:
+    /// Represents a unit of double-array.
+    typedef compact_trie::unit_type unit_type;
+
+    /**
+     * Represents some information about dawg_trie.
+     */
+    typedef struct {
+        char magic[16];  ///< Archive magic.
+        size_type unit_size;  ///< Size of unit and rank buffer.
+        size_type value_size;  ///< Size of value buffer.
+        size_type state_size;  ///< Number of states of the automaton.
+        char unused[36];  ///< for 32/64 bits compatible.
+    } header_type;
+
+    /**
+     * Constructs an empty dawg_trie.
+     *
+     * @param size Ignored, units are allocated while building.
+     */
+    explicit dawg_trie(size_t size = 0);
+
+    /**
+     * Constructs a dawg_trie from archive.
+     *
+     * @param filename Filename of the archive.
+     */
+    explicit dawg_trie(const char *filename);
+
+    /// Destructs a dawg_trie.
+    ~dawg_trie();
+
+    /// A dawg_trie can not be modified key by key.
+    void insert(const key_type &key, const value_type &value)
+    {
+        throw std::runtime_error("not implement");
+    }
+
+    bool search(const key_type &key, value_type *value) const;
+    bool search(const char *inputs, size_t length, value_type *value) const;
+    size_t prefix_search(const key_type &key, result_type *result) const;
+    cursor *prefix_cursor(const char *prefix, size_t length,
+                          size_t limit = 0, const char *after = NULL,
+                          size_t after_length = 0) const;
+    size_t fuzzy_search(const char *inputs, size_t length, size_t distance,
+                        fuzzy_callback found, void *context) const;
+    size_t common_prefix_search(const char *inputs, size_t length,
+                                prefix_result_type *result) const;
+    bool longest_prefix(const char *inputs, size_t length,
+                        size_t *matched, value_type *value) const;
+    void insert_bulk(std::vector<entry_type> *entries);
+    void build(const char *filename, bool verbose = false);
+
+    /// Returns the state reached from s by ch if exists, or 0.
+    size_type go_forward(size_type s, char_type ch) const
+    {
+        size_type t = s ^ compact_trie::offset(units_[s]) ^ ch;
+        return compact_trie::label(units_[t])
+               == static_cast<unit_type>(ch)?t:0;
+    }
+
+    /// Returns a pointer to the header of dawg_trie.
+    const header_type *header() const
+    {
+        return header_;
+    }
+
+  protected:
+    /**
+     * Walks along inputs from the root and calls found(length, value)
+     * for every key which is a prefix of inputs, shortest first.
+     */
+    template<typename F>
+    void find_prefixes(const char *inputs, size_t length, F &found) const;
+
+    /**
+     * Retrieves all keys below state s.
+     *
+     * @param s The state.
+     * @param rank Rank of the first key below s.
+     * @param store Char_types leading to s.
+     * @param[out] result Result set contains the existing keys.
+     */
+    void prefix_search_aux(size_type s, unit_type rank, key_type *store,
+                           result_type *result) const;
+
+  private:
+    /// Adapts dawg_trie to walk_cursor, see prefix_cursor.
+    class walker;
+
+    header_type *header_;  ///< Pointer to header.
+    unit_type *units_;     ///< Pointer to units.
+    unit_type *ranks_;     ///< Pointer to ranks of units.
+    value_type *values_;   ///< Pointer to values in rank order.
+
+    void *mmap_;
+    size_t mmap_size_;
+
+    /// Archive magic
+    static const char magic_[16];
+};
+
+/**
+ * A read-only Aho-Corasick automaton on a basic_trie.
+ *
+ * Keys are stored in full in a basic_trie, so every prefix of a key is a
+ * state. Two arrays parallel to the states hold the failure link of a
+ * state, i.e. the state of its longest proper suffix in the trie, and
+ * the output link, i.e. the nearest state along failure links where a
+ * key ends. The state reached by terminator keeps the slot of the key in
+ * its BASE, and the value and length of the key are kept in slot order.
+ *
+ * scan reports all occurrences of keys in a text in one pass. A text can
+ * be given chunk by chunk with a scan_state_type, and occurrences across
+ * chunks are reported at the chunk where they end.
+ *
+ * An ac_trie can only be created by insert_bulk on an empty one.
+ */
+class ac_trie: public trie {
+  public:
+    /**
+     * Represents some information about ac_trie.
+     */
+    typedef struct {
+        char magic[16];  ///< Archive magic.
+        size_type state_size;  ///< Size of state, fail and output buffer.
+        size_type key_size;  ///< Size of key buffer.
+        char unused[40];  ///< for 32/64 bits compatible.
+    } header_type;
+
+    /**
+     * Represents a key in slot order.
+     */
+    typedef struct {
+        value_type value;  ///< Value of the key.
+        size_type length;  ///< Number of bytes of the key.
+    } key_info_type;
+
+    /**
+     * Represents an occurrence reported by scan.
+     */
+    typedef struct {
+        size_t offset;     ///< Offset of the first byte in the whole text.
+        size_t length;     ///< Length of the key.
+        value_type value;  ///< Value of the key.
+    } match_type;
+
+    /// Called by scan for every occurrence.
+    typedef void (*match_callback)(const match_type &match, void *context);
+
+    /**
+     * Keeps the progress of scan between chunks. Zero-initialize it
+     * before the first chunk.
+     */
+    typedef struct {
+        size_type state;  ///< State arrived at, zero for the root.
+        size_t offset;    ///< Number of bytes scanned.
+    } scan_state_type;
+
+    /**
+     * Constructs an empty ac_trie.
+     *
+     * @param size Initial size of the basic_trie.
+     */
+    explicit ac_trie(size_t size = 0);
+
+    /**
+     * Constructs an ac_trie from archive.
+     *
+     * @param filename Filename of the archive.
+     */
+    explicit ac_trie(const char *filename);
+
+    /// Destructs an ac_trie.
+    ~ac_trie();
+
+    /// An ac_trie can not be modified key by key.
+    void insert(const key_type &key, const value_type &value)
+    {
+        throw std::runtime_error("not implement");
+    }
+
+    bool search(const key_type &key, value_type *value) const;
+    bool search(const char *inputs, size_t length, value_type *value) const;
+    size_t prefix_search(const key_type &key, result_type *result) const;
+    cursor *prefix_cursor(const char *prefix, size_t length,
+                          size_t limit = 0, const char *after = NULL,
+                          size_t after_length = 0) const;
+    size_t fuzzy_search(const char *inputs, size_t length, size_t distance,
+                        fuzzy_callback found, void *context) const;
+    void insert_bulk(std::vector<entry_type> *entries);
+    void build(const char *filename, bool verbose = false);
+
+    void set_build_threads(size_t threads)
+    {
+        threads_ = threads;
+    }
+
+    /**
+     * Reports all occurrences of keys in text, including overlapped
+     * ones. Occurrences ending at the same byte are reported longest
+     * first. An empty key never occurs.
+     *
+     * @param text The text or a chunk of it.
+     * @param length Length of text.
+     * @param found Called for every occurrence.
+     * @param context Passed to found.
+     * @param[in,out] state Progress of previous chunks, NULL if text is
+     *                      the whole text.
+     * @return The number of occurrences reported.
+     */
+    size_t scan(const char *text, size_t length, match_callback found,
+                void *context, scan_state_type *state = NULL) const;
+
+    /// Returns the failure link of state s.
+    size_type fail(size_type s) const
+    {
+        return fail_[s];
+    }
+
+    /// Returns the output link of state s, or 0 if none.
+    size_type output(size_type s) const
+    {
+        return output_[s];
+    }
+
+    /// Returns a pointer to the header of ac_trie.
+    const header_type *header() const
+    {
+        return header_;
+    }
+
+  protected:
+    /// Returns one plus the slot of the key ending at state s, or 0.
+    size_type slot(size_type s) const
+    {
+        size_type t = trie_->next(s, key_type::kTerminator);
+        return trie_->check_transition(s, t)?trie_->base(t):0;
+    }
+
+    /// Computes failure and output links in breadth-first order.
+    void build_links();
+
+  private:
+    /// Adapts ac_trie to walk_cursor, see prefix_cursor.
+    class walker;
+
+    header_type *header_;    ///< Pointer to header.
+    basic_trie *trie_;       ///< Keys in full.
+    size_type *fail_;        ///< Failure links of states.
+    size_type *output_;      ///< Output links of states.
+    key_info_type *keys_;    ///< Keys in slot order.
+    size_t threads_;         ///< Number of threads used by insert_bulk.
+
+    void *mmap_;
+    size_t mmap_size_;
+
+    /// Archive magic
+    static const char magic_[16];
+};
+
+/**
+ * An archive plus an appendable delta.
+ *
+ * The archive of any type is kept as it is. Changes go into a delta
+ * file named after the archive with a ".delta" suffix. It holds a
+ * header followed by one record per insert or remove, so a change only
+ * appends a few bytes. On loading, the records are replayed into a
+ * small basic_trie which search consults before the archive. A removed
+ * key stays in the delta as a tombstone until compact merges the delta
+ * into a new archive.
+ */
+class delta_trie: public trie {
+  public:
+    /**
+     * Represents some information about delta file.
+     */
+    typedef struct {
+        char magic[16];     ///< Delta magic.
+        int64_t size;       ///< Size of the archive the delta belongs to.
+        int64_t mtime;      ///< Modify time of the archive.
+        int64_t inode;      ///< Inode of the archive.
+        char unused[24];    ///< for 32/64 bits compatible.
+    } header_type;
+
+    /**
+     * Represents a change in delta file, followed by length bytes of key.
+     */
+    typedef struct {
+        uint32_t length;    ///< Length of the key.
+        int32_t removed;    ///< Whether the key is removed.
+        value_type value;   ///< The value of an inserted key.
+    } record_type;
+
+    /**
+     * Constructs a delta_trie from archive and its delta if exists.
+     *
+     * @param filename Filename of the archive.
+     */
+    explicit delta_trie(const char *filename);
+
+    /**
+     * Constructs a copy of writer over archive for reading, see
+     * concurrent_trie. Delta is copied, archive is not owned by the copy
+     * and should hold the same keys as the archive of writer.
+     *
+     * @param writer The delta_trie to be copied from.
+     * @param archive The archive of the copy.
+     */
+    delta_trie(const delta_trie &writer, trie *archive);
+
+    /// Destructs a delta_trie.
+    ~delta_trie();
+
+    /**
+     * Stores a key into delta, overriding the one in archive.
+     *
+     * @param key The key.
+     * @param value The value_type.
+     */
+    void insert(const key_type &key, const value_type &value);
+
+    /**
+     * Removes a key by leaving a tombstone in delta.
+     *
+     * @param key The key.
+     * @return true if the key was found.
+     */
+    bool remove(const key_type &key);
+
+    bool search(const key_type &key, value_type *value) const;
+    using trie::search;  ///< Keeps search by bytes visible.
+
+    /// Appends all entries to delta and flushes once.
+    void insert_bulk(std::vector<entry_type> *entries);
+
+    /**
+     * Retrieves keys of archive which are not changed in delta and keys
+     * inserted in delta, merged in walk order.
+     */
+    size_t prefix_search(const key_type &key, result_type *result) const;
+
+    /**
+     * Walks keys in the order of prefix_search without collecting them,
+     * merging a cursor of archive and one of delta, both continuing
+     * after the given key.
+     */
+    cursor *prefix_cursor(const char *prefix, size_t length,
+                          size_t limit = 0, const char *after = NULL,
+                          size_t after_length = 0) const;
+
+    /**
+     * Retrieves top k keys of archive, asking for more to make up for
+     * the keys changed in delta, and merges keys inserted in delta.
+     */
+    size_t top_k(const char *prefix, size_t length, size_t k,
+                 result_type *result) const;
+
+    /// Restores a key of the archive while delta is empty.
+    bool key_of(size_type id, std::string *key,
+                value_type *value = NULL) const;
+
+    /// Retrieves an id of the archive while delta is empty.
+    bool id_of(const char *inputs, size_t length, size_type *id) const;
+
+    /// Ranks in the archive, or among every key if delta is not empty.
+    size_type rank(const char *inputs, size_t length) const;
+
+    /// Reads the archive while delta is empty.
+    bool aggregate_prefix(const char *prefix, size_t length,
+                          aggregate_type *result) const;
+
+    /**
+     * Steps in the archive while delta is empty. Otherwise every byte
+     * opens a cursor over the bytes stepped from the root, which walks
+     * keys of archive until one is not changed in delta, so a typeahead
+     * over a large delta should compact first.
+     */
+    bool step(traversal_type *t, char ch) const;
+
+    /// Reads the archive while delta is empty.
+    bool value(const traversal_type &t, value_type *result) const;
+
+    /// Walks from the state of archive while delta is empty.
+    cursor *enumerate(const traversal_type &t, size_t limit = 0) const;
+
+    /// Searches the archive in lockstep while delta is empty.
+    size_t search_batch(const key_type *keys, size_t n,
+                        value_type *values, bool *found) const;
+    size_t search_batch(const char *const *inputs, const size_t *lengths,
+                        size_t n, value_type *values, bool *found) const;
+
+    /// Searches the archive, or every key if delta is not empty.
+    size_t fuzzy_search(const char *inputs, size_t length, size_t distance,
+                        fuzzy_callback found, void *context) const;
+
+    /// Builds an archive of the same type holding archive and delta.
+    void build(const char *filename, bool verbose = false);
+
+    /**
+     * Merges delta into archive. A new archive is built next to the old
+     * one and renamed over it, then delta is emptied.
+     *
+     * @param verbose Display detail information if sets to true.
+     */
+    void compact(bool verbose = false);
+
+    void set_build_threads(size_t threads)
+    {
+        threads_ = threads;
+    }
+
+    void record_max_values(bool record)
+    {
+        record_ = record;
+    }
+
+    void record_key_ids(bool record)
+    {
+        record_ids_ = record;
+    }
+
+    void record_aggregates(bool record)
+    {
+        record_aggregates_ = record;
+    }
+
+    /// Returns ids of the archive, none while delta holds changes.
+    size_t key_id_size() const
+    {
+        return values_.empty()?archive_->key_id_size():0;
+    }
+
+    /// Returns the number of keys changed in delta.
+    size_t delta_size() const
+    {
+        return values_.size();
+    }
+
+  protected:
+    /**
+     * Loads archive and replays delta. A delta which belongs to another
+     * archive is ignored. Nothing is written, a record cut at the end
+     * is left for append to cut off.
+     */
+    void load();
+
+    /// Applies a change to delta in memory.
+    void apply(const key_type &key, value_type value, bool removed);
+
+    /// Appends a change to delta file.
+    void append(const key_type &key, value_type value, bool removed);
+
+    /// Writes an empty delta file belonging to archive.
+    void reset(const char *filename, const char *archive) const;
+
+  private:
+    class merge_cursor;
+
+    std::string filename_;         ///< Filename of archive.
+    std::string delta_filename_;   ///< Filename of delta.
+    trie_type type_;               ///< Type of archive.
+    trie *archive_;                ///< The archive.
+    basic_trie *delta_;            ///< Maps keys of delta to slots.
+    std::vector<value_type> values_;  ///< Values of slots.
+    std::vector<bool> removed_;    ///< Tombstones of slots.
+    long delta_length_;            ///< Bytes of whole records, 0 if stale.
+    FILE *out_;                    ///< Delta file opened for appending.
+    size_t threads_;               ///< Number of threads used by compact.
+    bool record_;                  ///< Records maximum values in compact.
+    bool record_ids_;              ///< Records key ids in compact.
+    bool record_aggregates_;       ///< Records aggregates in compact.
+    bool owner_;                   ///< Ownership of archive_.
+
+    /// Delta magic
+    static const char magic_[16];
+};
+
+/**
+ * Serves readers while a single writer changes keys, without locking
+ * readers. The writer changes a private delta_trie, then publishes an
+ * immutable copy of it as the current snapshot by swapping a pointer.
+ * A reader pins the snapshot with an epoch kept in a reader slot, so
+ * replaced snapshots are freed once no slot holds an epoch as old as
+ * theirs.
+ *
+ * Every change copies delta, so changes are best applied in bulk, and
+ * delta kept small by compact.
+ */
+class concurrent_trie: public trie {
+  public:
+    /**
+     * Number of readers pinning snapshots at the same time. Every call
+     * holds a slot while it runs and every cursor until it is deleted;
+     * a reader finding no free slot after kReaderRetries rounds throws
+     * std::runtime_error.
+     */
+    static const size_t kReaderSlots = 64;
+
+    /// Rounds over all slots before a reader gives up.
+    static const size_t kReaderRetries = 16;
+
+    /**
+     * Constructs a concurrent_trie from archive and its delta if exists.
+     *
+     * @param filename Filename of the archive.
+     */
+    explicit concurrent_trie(const char *filename);
+
+    /// Destructs a concurrent_trie, while no reader is left.
+    ~concurrent_trie();
+
+    /**
+     * Stores a key and publishes a snapshot holding it.
+     *
+     * The snapshot is a copy of the whole delta, so each call costs
+     * O(size of delta) and N calls O(N^2). Loaders of many keys should
+     * call insert_bulk, which publishes once, and compact to keep the
+     * delta small.
+     *
+     * @param key The key.
+     * @param value The value_type.
+     */
+    void insert(const key_type &key, const value_type &value);
+
+    /**
+     * Removes a key and publishes a snapshot without it. Costs a copy of
+     * the whole delta like insert.
+     *
+     * @param key The key.
+     * @return true if the key was found.
+     */
+    bool remove(const key_type &key);
+
+    /// Stores all entries and publishes one snapshot, one copy of delta
+    /// for the whole batch.
+    void insert_bulk(std::vector<entry_type> *entries);
+
+    bool search(const key_type &key, value_type *value) const;
+    bool search(const char *inputs, size_t length, value_type *value) const;
+    size_t prefix_search(const key_type &key, result_type *result) const;
+
+    /// Walks keys of the snapshot current when called, pinned until the
+    /// cursor is deleted.
+    cursor *prefix_cursor(const char *prefix, size_t length,
+                          size_t limit = 0, const char *after = NULL,
+                          size_t after_length = 0) const;
+    size_t top_k(const char *prefix, size_t length, size_t k,
+                 result_type *result) const;
+    bool aggregate_prefix(const char *prefix, size_t length,
+                          aggregate_type *result) const;
+    size_type rank(const char *inputs, size_t length) const;
+    size_t fuzzy_search(const char *inputs, size_t length, size_t distance,
+                        fuzzy_callback found, void *context) const;
+
+    /// Builds an archive of the current snapshot.
+    void build(const char *filename, bool verbose = false);
+
+    /**
+     * Merges delta into archive, see delta_trie::compact, and publishes
+     * a snapshot over the new archive. Readers of older snapshots keep
+     * the old archive until they leave.
+     *
+     * @param verbose Display detail information if sets to true.
+     */
+    void compact(bool verbose = false);
+
+    void set_build_threads(size_t threads);
+    void record_max_values(bool record);
+    void record_key_ids(bool record);
+    void record_aggregates(bool record);
+
+  private:
+    /// Pins the current snapshot while alive.
+    class reader;
+
+    /// Keeps a reader along with a cursor of its snapshot.
+    class snapshot_cursor;
+
+    /// Represents a reader slot, 0 while no reader holds it.
+    typedef struct {
+        std::atomic<uint64_t> epoch;  ///< Epoch read by the reader.
+        char unused[56];              ///< Keeps slots in own cache lines.
+    } slot_type;
+
+    /// Represents a snapshot replaced at epoch.
+    typedef struct {
+        uint64_t epoch;        ///< Epoch when the snapshot was replaced.
+        delta_trie *snapshot;  ///< The snapshot.
+        trie *archive;         ///< Archive replaced with it, or NULL.
+    } retired_type;
+
+    /**
+     * Publishes a copy of writer_ as the current snapshot. The caller
+     * holds mutex_.
+     *
+     * @param archive The new archive of readers, or NULL to keep it.
+     */
+    void publish(trie *archive);
+
+    /// Frees retired snapshots which no reader holds.
+    void reclaim();
+
+    std::string filename_;                ///< Filename of archive.
+    delta_trie *writer_;                  ///< Changed by the writer only.
+    trie *archive_;                       ///< Archive of current_.
+    std::atomic<delta_trie *> current_;   ///< The current snapshot.
+    std::atomic<uint64_t> epoch_;         ///< Increased on publish.
+    mutable slot_type slots_[kReaderSlots];  ///< Epochs pinned by readers.
+    std::vector<retired_type> retired_;   ///< Replaced snapshots.
+    pthread_mutex_t mutex_;               ///< Serializes writers.
+};
+
+/**
+ * Splits keys over independent single_trie or double_trie shards, each
+ * guarded by its own lock, so that threads insert into different
+ * shards at the same time. Keys are routed by a hash of the whole key,
+ * or by ranges of the leading byte so that shards keep keys in order.
+ *
+ * build writes all shards into one archive, a table of sections
+ * followed by an archive of each shard, and the routing is kept in the
+ * header. Queries of a loaded archive take no lock.
+ */
+class sharded_trie: public trie {
+  public:
+    /// Default number of shards.
+    static const size_t kDefaultShards = 16;
+
+    /// Represents how keys are routed to shards.
+    enum routing_type {
+        HASH_ROUTING = 0,  /**< By hash of the key. */
+        BYTE_ROUTING       /**< By ranges of the leading byte. */
+    };
+
+    /**
+     * Represents some information about sharded_trie.
+     */
+    typedef struct {
+        char magic[16];      ///< Archive magic.
+        size_type shards;    ///< Number of shards.
+        size_type routing;   ///< routing_type of keys.
+        size_type type;      ///< trie_type of shards.
+        char unused[36];     ///< for 32/64 bits compatible.
+    } header_type;
+
+    /// Represents where a shard is in the archive.
+    typedef struct {
+        int64_t offset;  ///< Offset of the shard archive.
+        int64_t size;    ///< Size of the shard archive.
+    } section_type;
+
+    /**
+     * Constructs an empty sharded_trie.
+     *
+     * @param type Type of shards, SINGLE_TRIE or DOUBLE_TRIE.
+     * @param shards Number of shards, from 1 to 256.
+     * @param routing How keys are routed to shards.
+     */
+    explicit sharded_trie(trie_type type = DOUBLE_TRIE,
+                          size_t shards = kDefaultShards,
+                          routing_type routing = HASH_ROUTING);
+
+    /**
+     * Constructs a sharded_trie from archive.
+     *
+     * @param filename Filename of the archive.
+     */
+    explicit sharded_trie(const char *filename);
+
+    /// Destructs a sharded_trie.
+    ~sharded_trie();
+
+    /// Inserts a key holding the lock of its shard only.
+    void insert(const key_type &key, const value_type &value);
+    bool search(const key_type &key, value_type *value) const;
+    bool search(const char *inputs, size_t length, value_type *value) const;
+
+    /// Splits entries by shard and inserts shards on build threads.
+    void insert_bulk(std::vector<entry_type> *entries);
+
+    /// Retrieves keys of all shards in the order of prefix_cursor.
+    size_t prefix_search(const key_type &key, result_type *result) const;
+
+    /**
+     * Merges cursors of the shards holding prefix, so keys come in the
+     * order of a single trie whatever the routing, and a walk continues
+     * after a key in every shard. The shards holding prefix stay read
+     * locked until the cursor is deleted, so inserts into them wait, and
+     * must not come from the thread holding the cursor.
+     */
+    cursor *prefix_cursor(const char *prefix, size_t length,
+                          size_t limit = 0, const char *after = NULL,
+                          size_t after_length = 0) const;
+
+    /// Merges top k keys of every shard.
+    size_t top_k(const char *prefix, size_t length, size_t k,
+                 result_type *result) const;
+
+    /// Merges aggregates of every shard.
+    bool aggregate_prefix(const char *prefix, size_t length,
+                          aggregate_type *result) const;
+
+    /// Builds shards on build threads and writes them as one archive.
+    void build(const char *filename, bool verbose = false);
+
+    void record_max_values(bool record);
+    void record_aggregates(bool record);
+
+    void set_build_threads(size_t threads)
+    {
+        threads_ = threads;
+    }
+
+    /// Returns the number of shards.
+    size_t shard_size() const
+    {
+        return shards_.size();
+    }
+
+  private:
+    /// Merges cursors of shards by key.
+    class shard_cursor;
+
+    /// Returns the shard of a key.
+    size_t route(const char *inputs, size_t length) const;
+
+    /// Returns the first and the end of shards holding keys of prefix.
+    std::pair<size_t, size_t> shards_of(const char *prefix,
+                                        size_t length) const;
+
+    header_type header_;          ///< Routing and type of shards.
+    std::vector<trie *> shards_;  ///< The shards.
+    pthread_rwlock_t *locks_;     ///< Lock of each shard, NULL if mapped.
+    size_t threads_;              ///< Number of threads used by build.
+
+    /// Archive magic.
+    static const char magic_[16];
+};
+
 #endif  // TRIE_IMPL_H_
 
 END_TRIE_NAMESPACE
@@ -2,26 +2,60 @@
 #include <limits.h>
 #include <errno.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <sys/time.h>
 #include <iostream>
 #include <stdexcept>
+#include <algorithm>
+#include <string>
+#include <vector>
 #include <cstring>
 #include <cstdio>
 #include <cstdlib>
 
 #include "trie.h"
+#include "trie_impl.h"
 
 using namespace dutil;
 
+static void
+print_fuzzy(const trie::fuzzy_match_type &match, void *)
+{
+    std::cout << match.distance << " " << match.value << " ";
+    std::cout.write(match.key, match.length);
+    std::cout << "\n";
+}
+
 static void *
-query_trie(const char *query, const char *index, bool prefix, bool verbose)
+query_trie(const char *query, const char *index, bool prefix, size_t top,
+           int fuzzy, bool count, bool verbose)
 {
     int retval = 0;
     trie::value_type value;
-    trie *mtrie = trie::create_trie(index);
+    trie *mtrie = new delta_trie(index);
     trie::key_type key(query, strlen(query));
-    if (prefix) {
+    if (fuzzy >= 0) {
+        size_t found = mtrie->fuzzy_search(query, strlen(query), fuzzy,
+                                           print_fuzzy, NULL);
+        std::cout.flush();
+        if (verbose)
+            std::cerr << found << " keys within " << fuzzy << std::endl;
+        retval = found?0:1;
+    } else if (count) {
+        trie::aggregate_type aggregate;
+        if (mtrie->aggregate_prefix(query, strlen(query), &aggregate)) {
+            std::cout << aggregate.count << " " << aggregate.sum << " "
+                      << aggregate.min << " " << aggregate.max << std::endl;
+        } else {
+            std::cerr << query << " not found." << std::endl;
+            retval = 1;
+        }
+    } else if (prefix || top) {
         trie::result_type result;
-        mtrie->prefix_search(key, &result);
+        if (top)
+            mtrie->top_k(query, strlen(query), top, &result);
+        else
+            mtrie->prefix_search(key, &result);
         trie::result_type::const_iterator it;
         for (it = result.begin(); it != result.end(); it++)
             std::cout << it->second << " " << it->first.c_str() << std::endl;
@@ -37,36 +71,542 @@ query_trie(const char *query, const char *index, bool prefix, bool verbose)
     exit(retval);
 }
 
+/// Queries read by batch_trie at a time and their answers.
+typedef struct {
+    std::vector<char> text;        ///< Queries, each followed by '\0'.
+    std::vector<size_t> offsets;   ///< Offsets of queries, plus the end.
+    std::vector<std::string> outputs;  ///< Answers of each block.
+} batch_chunk_type;
+
+/**
+ * Queries of batch_trie, handed to its workers a chunk at a time. The
+ * workers live as long as the batch, the next chunk is read while they
+ * answer the current one.
+ */
+typedef struct {
+    const trie *mtrie;             ///< The archive shared by all threads.
+    bool prefix;                   ///< Prefix mode query.
+    size_t top;                    ///< N largest values if not zero.
+    int fuzzy;                     ///< Distance of fuzzy mode if not -1.
+    bool count;                    ///< Count mode query.
+    batch_chunk_type *chunk;       ///< Chunk being answered, or NULL.
+    size_t next;                   ///< Next block of chunk to answer.
+    size_t done;                   ///< Blocks of chunk answered.
+    bool closed;                   ///< No more chunks are coming.
+    pthread_mutex_t mutex;         ///< Guards chunk, next, done, closed.
+    pthread_cond_t ready;          ///< Signaled when a chunk is handed.
+    pthread_cond_t answered;       ///< Signaled when a chunk is done.
+} batch_type;
+
+/// A thread of batch_trie and its statistics.
+typedef struct {
+    batch_type *batch;  ///< The batch being answered.
+    size_t queries;     ///< Number of queries answered.
+    size_t found;       ///< Number of queries having an answer.
+    double busy;        ///< Seconds spent on answering.
+    std::string error;  ///< What a failed query threw.
+} batch_worker_type;
+
+/// Queries answered by a thread at a time, kept in input order.
+static const size_t kBatchBlock = 256;
+
+static double
+now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/// Context of print_batch_fuzzy.
+typedef struct {
+    const char *query;  ///< The query.
+    size_t length;      ///< Length of the query.
+    std::string *out;   ///< Answers of the block.
+} batch_fuzzy_type;
+
+static void
+print_batch_fuzzy(const trie::fuzzy_match_type &match, void *context)
+{
+    batch_fuzzy_type *fuzzy = static_cast<batch_fuzzy_type *>(context);
+    char buf[64];
+    snprintf(buf, sizeof(buf), "\t%d %d ", static_cast<int>(match.distance),
+             match.value);
+    fuzzy->out->append(fuzzy->query, fuzzy->length);
+    fuzzy->out->append(buf);
+    fuzzy->out->append(match.key, match.length);
+    fuzzy->out->push_back('\n');
+}
+
+/**
+ * Appends the answers of query i of a chunk to out, one line per
+ * answer starting with the query and a tab. Exact queries are searched
+ * with the rest of their block by search_batch instead.
+ *
+ * @return Whether the query has an answer.
+ */
+static bool
+answer_query(const batch_type &batch, const batch_chunk_type &chunk,
+             size_t i, std::string *out)
+{
+    const char *query = &chunk.text[chunk.offsets[i]];
+    size_t length = chunk.offsets[i + 1] - chunk.offsets[i] - 1;
+    char buf[128];
+    if (batch.fuzzy >= 0) {
+        batch_fuzzy_type fuzzy = {query, length, out};
+        return batch.mtrie->fuzzy_search(query, length, batch.fuzzy,
+                                         print_batch_fuzzy, &fuzzy) > 0;
+    } else if (batch.count) {
+        trie::aggregate_type aggregate;
+        if (!batch.mtrie->aggregate_prefix(query, length, &aggregate))
+            return false;
+        snprintf(buf, sizeof(buf), "\t%d %lld %d %d\n", aggregate.count,
+                 static_cast<long long>(aggregate.sum), aggregate.min,
+                 aggregate.max);
+        out->append(query, length);
+        out->append(buf);
+        return true;
+    }
+    trie::result_type result;
+    if (batch.top)
+        batch.mtrie->top_k(query, length, batch.top, &result);
+    else
+        batch.mtrie->prefix_search(trie::key_type(query, length), &result);
+    trie::result_type::const_iterator it;
+    for (it = result.begin(); it != result.end(); it++) {
+        snprintf(buf, sizeof(buf), "\t%d ", it->second);
+        out->append(query, length);
+        out->append(buf);
+        out->append(it->first.c_str());
+        out->push_back('\n');
+    }
+    return !result.empty();
+}
+
+/// Answers the block [first, last) of a chunk of exact queries.
+static size_t
+search_block(const batch_type &batch, const batch_chunk_type &chunk,
+             size_t first, size_t last, std::string *out)
+{
+    const char *inputs[kBatchBlock] = {};
+    size_t lengths[kBatchBlock] = {};
+    trie::value_type values[kBatchBlock] = {};
+    bool found[kBatchBlock] = {};
+    size_t n = last - first;
+    for (size_t i = 0; i < n; i++) {
+        inputs[i] = &chunk.text[chunk.offsets[first + i]];
+        lengths[i] = chunk.offsets[first + i + 1]
+                     - chunk.offsets[first + i] - 1;
+    }
+    size_t hits = batch.mtrie->search_batch(inputs, lengths, n, values,
+                                            found);
+    char buf[32];
+    for (size_t i = 0; i < n; i++) {
+        if (!found[i])
+            continue;
+        snprintf(buf, sizeof(buf), "\t%d\n", values[i]);
+        out->append(inputs[i], lengths[i]);
+        out->append(buf);
+    }
+    return hits;
+}
+
+/// Answers blocks of each chunk handed out until the batch is closed.
+static void *
+batch_worker(void *arg)
+{
+    batch_worker_type *worker = static_cast<batch_worker_type *>(arg);
+    batch_type *batch = worker->batch;
+    bool exact = batch->fuzzy < 0 && !batch->count && !batch->prefix
+                 && !batch->top;
+    pthread_mutex_lock(&batch->mutex);
+    while (true) {
+        while (!batch->closed
+               && (!batch->chunk
+                   || batch->next >= batch->chunk->outputs.size()))
+            pthread_cond_wait(&batch->ready, &batch->mutex);
+        if (!batch->chunk || batch->next >= batch->chunk->outputs.size())
+            break;
+        batch_chunk_type *chunk = batch->chunk;
+        size_t block = batch->next++;
+        pthread_mutex_unlock(&batch->mutex);
+
+        size_t first = block * kBatchBlock;
+        size_t last = std::min(first + kBatchBlock,
+                               chunk->offsets.size() - 1);
+        std::string *out = &chunk->outputs[block];
+        double start = now();
+        try {
+            if (exact) {
+                worker->found += search_block(*batch, *chunk, first, last,
+                                              out);
+            } else {
+                for (size_t i = first; i < last; i++)
+                    worker->found += answer_query(*batch, *chunk, i, out);
+            }
+            worker->queries += last - first;
+        } catch (const std::exception &e) {
+            worker->error = e.what();
+        }
+        worker->busy += now() - start;
+
+        // a failed block still counts, batch_trie reports the error
+        pthread_mutex_lock(&batch->mutex);
+        if (++batch->done == chunk->outputs.size())
+            pthread_cond_signal(&batch->answered);
+    }
+    pthread_mutex_unlock(&batch->mutex);
+    return NULL;
+}
+
+/**
+ * Reads up to count queries of in into chunk, one per line, through the
+ * getline buffer line of capacity bytes.
+ *
+ * @return Whether any query is read.
+ */
+static bool
+read_chunk(FILE *in, size_t count, char **line, size_t *capacity,
+           batch_chunk_type *chunk)
+{
+    ssize_t length;
+    chunk->text.clear();
+    chunk->offsets.clear();
+    while (chunk->offsets.size() < count
+           && (length = getline(line, capacity, in)) >= 0) {
+        if (length > 0 && (*line)[length - 1] == '\n')
+            length--;
+        chunk->offsets.push_back(chunk->text.size());
+        chunk->text.insert(chunk->text.end(), *line, *line + length);
+        chunk->text.push_back('\0');
+    }
+    if (chunk->offsets.empty())
+        return false;
+    chunk->offsets.push_back(chunk->text.size());
+    chunk->outputs.assign((chunk->offsets.size() + kBatchBlock - 2)
+                          / kBatchBlock, std::string());
+    return true;
+}
+
+static void *
+batch_trie(const char *input, const char *index, bool prefix, size_t top,
+           int fuzzy, bool count, size_t threads, bool verbose)
+{
+    // queries are read and answered this many at a time
+    static const size_t kBatchSize = 1 << 16;
+    static char buffer[1 << 20];
+    FILE *in = strcmp(input, "-")?fopen(input, "r"):stdin;
+    if (!in) {
+        std::cerr << input << ": " << strerror(errno) << std::endl;
+        exit(1);
+    }
+    setvbuf(stdout, buffer, _IOFBF, sizeof(buffer));
+    trie *mtrie = new delta_trie(index);
+    batch_type batch;
+    batch.mtrie = mtrie;
+    batch.prefix = prefix;
+    batch.top = top;
+    batch.fuzzy = fuzzy;
+    batch.count = count;
+    batch.chunk = NULL;
+    batch.next = batch.done = 0;
+    batch.closed = false;
+    pthread_mutex_init(&batch.mutex, NULL);
+    pthread_cond_init(&batch.ready, NULL);
+    pthread_cond_init(&batch.answered, NULL);
+    std::vector<batch_worker_type> workers(threads);
+    std::vector<pthread_t> ids(threads);
+    for (size_t i = 0; i < threads; i++) {
+        workers[i].batch = &batch;
+        workers[i].queries = 0;
+        workers[i].found = 0;
+        workers[i].busy = 0;
+        int error = pthread_create(&ids[i], NULL, batch_worker, &workers[i]);
+        if (error) {
+            std::cerr << "batch: " << strerror(error) << std::endl;
+            exit(1);
+        }
+    }
+
+    // workers answer one chunk while the next one is read
+    batch_chunk_type chunks[2];
+    char *line = NULL;
+    size_t capacity = 0, total = 0;
+    double start = now();
+    bool more = read_chunk(in, kBatchSize, &line, &capacity, &chunks[0]);
+    for (size_t c = 0; more; c ^= 1) {
+        batch_chunk_type *chunk = &chunks[c];
+        total += chunk->offsets.size() - 1;
+        pthread_mutex_lock(&batch.mutex);
+        batch.chunk = chunk;
+        batch.next = batch.done = 0;
+        pthread_cond_broadcast(&batch.ready);
+        pthread_mutex_unlock(&batch.mutex);
+
+        more = read_chunk(in, kBatchSize, &line, &capacity, &chunks[c ^ 1]);
+
+        pthread_mutex_lock(&batch.mutex);
+        while (batch.done < chunk->outputs.size())
+            pthread_cond_wait(&batch.answered, &batch.mutex);
+        batch.chunk = NULL;
+        pthread_mutex_unlock(&batch.mutex);
+        for (size_t i = 0; i < threads; i++) {
+            if (!workers[i].error.empty()) {
+                std::cerr << "batch: " << workers[i].error << std::endl;
+                exit(1);
+            }
+        }
+        for (size_t i = 0; i < chunk->outputs.size(); i++)
+            fwrite(chunk->outputs[i].data(), 1, chunk->outputs[i].size(),
+                   stdout);
+    }
+    pthread_mutex_lock(&batch.mutex);
+    batch.closed = true;
+    pthread_cond_broadcast(&batch.ready);
+    pthread_mutex_unlock(&batch.mutex);
+    for (size_t i = 0; i < threads; i++)
+        pthread_join(ids[i], NULL);
+    double elapsed = now() - start;
+    free(line);
+    if (in != stdin)
+        fclose(in);
+    delete mtrie;
+    pthread_cond_destroy(&batch.answered);
+    pthread_cond_destroy(&batch.ready);
+    pthread_mutex_destroy(&batch.mutex);
+    if (fflush(stdout) == EOF) {
+        std::cerr << "batch: " << strerror(errno) << std::endl;
+        exit(1);
+    }
+
+    if (!verbose)
+        exit(0);
+    size_t found = 0;
+    for (size_t i = 0; i < threads; i++)
+        found += workers[i].found;
+    std::cerr << total << " queries, " << found << " found in " << elapsed
+              << "s, " << static_cast<size_t>(total / std::max(elapsed, 1e-6))
+              << " queries/s" << std::endl;
+    for (size_t i = 0; i < threads; i++) {
+        const batch_worker_type &worker = workers[i];
+        std::cerr << "thread " << i << ": " << worker.queries
+                  << " queries, " << worker.found << " found, busy "
+                  << worker.busy << "s, "
+                  << static_cast<size_t>(worker.queries
+                                         / std::max(worker.busy, 1e-6))
+                  << " queries/s" << std::endl;
+    }
+    exit(0);
+}
+
 static void *
-build_trie(const char *source, const char *index, trie::trie_type type, bool verbose)
+dump_trie(const char *index, bool verbose)
+{
+    // keys are streamed by a cursor, stdout is flushed once per buffer
+    static char buffer[1 << 20];
+    setvbuf(stdout, buffer, _IOFBF, sizeof(buffer));
+    trie *mtrie = new delta_trie(index);
+    trie::cursor *keys = mtrie->prefix_cursor("", 0);
+    size_t count = 0;
+    while (keys->next()) {
+        printf("%d ", keys->value());
+        fwrite(keys->key(), 1, keys->length(), stdout);
+        putchar('\n');
+        ++count;
+    }
+    delete keys;
+    delete mtrie;
+    if (fflush(stdout) == EOF) {
+        std::cerr << "dump: " << strerror(errno) << std::endl;
+        exit(1);
+    }
+    if (verbose)
+        std::cerr << count << " keys dumped" << std::endl;
+    exit(0);
+}
+
+static void *
+key_of_trie(const char *id, const char *index, bool verbose)
+{
+    std::string key;
+    trie *mtrie = new delta_trie(index);
+    if (verbose)
+        std::cerr << mtrie->key_id_size() << " key ids" << std::endl;
+    if (!mtrie->key_of(atoi(id), &key)) {
+        std::cerr << "id " << id << " not found." << std::endl;
+        delete mtrie;
+        exit(1);
+    }
+    std::cout << key << std::endl;
+    delete mtrie;
+    exit(0);
+}
+
+static void *
+build_trie(const char *source, const char *index, trie::trie_type type,
+           bool record, bool ids, bool aggregates, size_t threads,
+           bool verbose)
 {
     trie *mtrie = trie::create_trie(type);
+    mtrie->record_max_values(record);
+    mtrie->record_key_ids(ids);
+    mtrie->record_aggregates(aggregates);
+    mtrie->set_build_threads(threads);
     mtrie->read_from_text(source, verbose);
     if (verbose)
         std::cerr << "writing to disk..." << std::endl;
     mtrie->build(index, verbose);
+    // changes appended to the old archive do not apply any more
+    unlink((std::string(index) + ".delta").c_str());
+    if (verbose)
+        std::cerr << "done" << std::endl;
+    delete mtrie;
+    exit(0);
+}
+
+static void *
+convert_trie(const char *source, const char *index, trie::trie_type type,
+             bool record, bool ids, bool aggregates, size_t threads,
+             bool verbose)
+{
+    trie *strie = trie::create_trie(source);
+    trie::result_type result;
+    trie::key_type prefix("", 0);
+    strie->prefix_search(prefix, &result);
+    delete strie;
+
+    std::vector<char> keys;
+    std::vector<size_t> offsets;
+    std::vector<trie::entry_type> entries;
+    trie::result_type::const_iterator it;
+    for (it = result.begin(); it != result.end(); it++) {
+        const trie::char_type *p = it->first.data();
+        trie::entry_type entry = {NULL, 0, it->second};
+        offsets.push_back(keys.size());
+        for (; *p != trie::key_type::kTerminator; p++, entry.length++)
+            keys.push_back(trie::key_type::char_out(*p));
+        entries.push_back(entry);
+    }
+    for (size_t i = 0; i < entries.size(); i++)
+        entries[i].data = &keys[0] + offsets[i];
+    if (verbose)
+        std::cerr << entries.size() << " keys loaded from " << source
+                  << std::endl;
+
+    trie *mtrie = trie::create_trie(type);
+    mtrie->record_max_values(record);
+    mtrie->record_key_ids(ids);
+    mtrie->record_aggregates(aggregates);
+    mtrie->set_build_threads(threads);
+    mtrie->insert_bulk(&entries);
+    if (verbose)
+        std::cerr << "writing to disk..." << std::endl;
+    mtrie->build(index, verbose);
+    // changes appended to the old archive do not apply any more
+    unlink((std::string(index) + ".delta").c_str());
     if (verbose)
         std::cerr << "done" << std::endl;
     delete mtrie;
     exit(0);
 }
 
+static void *
+update_trie(const char *source, const char *remove, const char *index,
+            bool compact, bool record, bool ids, bool aggregates,
+            size_t threads, bool verbose)
+{
+    delta_trie mtrie(index);
+    mtrie.record_max_values(record);
+    mtrie.record_key_ids(ids);
+    mtrie.record_aggregates(aggregates);
+    mtrie.set_build_threads(threads);
+    if (source)
+        mtrie.read_from_text(source, verbose);
+    if (remove) {
+        trie::key_type key(remove, strlen(remove));
+        if (!mtrie.remove(key))
+            std::cerr << remove << " not found." << std::endl;
+    }
+    if (verbose)
+        std::cerr << mtrie.delta_size() << " keys in delta" << std::endl;
+    if (compact) {
+        if (verbose)
+            std::cerr << "merging delta..." << std::endl;
+        mtrie.compact(verbose);
+        if (verbose)
+            std::cerr << "done" << std::endl;
+    }
+    exit(0);
+}
+
+static void
+print_match(const ac_trie::match_type &match, void *)
+{
+    std::cout << match.offset << " " << match.length << " "
+              << match.value << "\n";
+}
+
+static void *
+scan_trie(const char *text, const char *index, bool verbose)
+{
+    ac_trie mtrie(index);
+    FILE *in = strcmp(text, "-")?fopen(text, "r"):stdin;
+    if (!in) {
+        std::cerr << text << ": " << strerror(errno) << std::endl;
+        exit(1);
+    }
+    // occurrences across chunks are found by carrying state over
+    char buf[65536];
+    ac_trie::scan_state_type state = {0, 0};
+    size_t length, count = 0;
+    while ((length = fread(buf, 1, sizeof(buf), in)) > 0)
+        count += mtrie.scan(buf, length, print_match, NULL, &state);
+    if (in != stdin)
+        fclose(in);
+    std::cout.flush();
+    if (verbose)
+        std::cerr << count << " occurrences in " << state.offset
+                  << " bytes" << std::endl;
+    exit(0);
+}
+
 static void help_message()
 {
     std::cout << "Usage: trie_tool [OPTIONS] archive\n"
                  "Utility to manage archive of libxtree \n"
                  "OPTIONS:\n"
                  "        -b|--build SOURCE     build from SOURCE\n"
+                 "        -c|--convert ARCHIVE  convert ARCHIVE to TYPE\n"
+                 "        -e|--batch QUERIES    answer QUERIES by JOBS "
+                 "threads, - is stdin\n"
+                 "        -f|--fuzzy DISTANCE   keys within DISTANCE of QUERY\n"
+                 "        -g|--key-of ID        lookup key of ID in archive\n"
                  "        -h|--help             help message\n"
+                 "        -i|--ids              record key ids for key-of\n"
+                 "        -j|--jobs JOBS        build or query with JOBS "
+                 "threads\n"
+                 "        -k|--max-values       record max values for top\n"
+                 "        -m|--merge            merge delta into archive\n"
+                 "        -n|--top N            N largest values of prefix\n"
+                 "        -o|--count            count, sum, min and max of "
+                 "prefix\n"
                  "        -q|--query QUERY      lookup QUERY in archive\n"
                  "        -p|--prefix           prefix mode query\n"
+                 "        -r|--remove KEY       remove KEY by delta\n"
+                 "        -s|--scan TEXT        find keys in TEXT, - is stdin\n"
                  "        -t|--type TYPE        archive type\n"
-                 "        -v|--verbose          verbose\n\n"
+                 "        -u|--update SOURCE    append SOURCE to delta\n"
+                 "        -v|--verbose          verbose\n"
+                 "        -x|--aggregates       record aggregates for count\n\n"
                  "SOURCE FORMAT:\n"
                  "        value word\n\n"
                  "ARCHIVE TYPE:\n"
                  "        1: tail-trie\n"
                  "        2: two-trie (default value)\n"
+                 "        3: compact-trie\n"
+                 "        4: dawg-trie\n"
+                 "        5: ac-trie, required by scan\n"
+                 "        6: sharded two-trie, built by JOBS threads\n"
                  "\n"
                  "Report bugs to jianing.yang@alibaba-inc.com\n"
               << std::endl;
@@ -76,26 +616,51 @@ int main(int argc, char *argv[])
 {
     int c;
     const char *index = NULL, *source = NULL, *query = NULL;
+    const char *archive = NULL;
+    const char *update = NULL, *remove = NULL, *text = NULL;
+    const char *id = NULL, *batch = NULL;
     trie::trie_type type = trie::DOUBLE_TRIE;
     bool verbose = false;
+    bool record = false;
+    bool ids = false;
+    bool aggregates = false;
+    bool count = false;
+    size_t threads = 1;
+    size_t top = 0;
+    int fuzzy = -1;
     bool prefix = false;
     bool dump = false;
+    bool merge = false;
 
     while (true) {
         static struct option long_options[] =
         {
             {"build", required_argument, 0, 'b'},
+            {"convert", required_argument, 0, 'c'},
             {"dump", no_argument, 0, 'd'},
+            {"batch", required_argument, 0, 'e'},
+            {"fuzzy", required_argument, 0, 'f'},
+            {"key-of", required_argument, 0, 'g'},
             {"help", no_argument, 0, 'h'},
+            {"ids", no_argument, 0, 'i'},
+            {"jobs", required_argument, 0, 'j'},
+            {"max-values", no_argument, 0, 'k'},
+            {"merge", no_argument, 0, 'm'},
+            {"top", required_argument, 0, 'n'},
+            {"count", no_argument, 0, 'o'},
             {"prefix", no_argument, 0, 'p'},
             {"query", required_argument, 0, 'q'},
+            {"remove", required_argument, 0, 'r'},
+            {"scan", required_argument, 0, 's'},
             {"type", required_argument, 0, 't'},
+            {"update", required_argument, 0, 'u'},
             {"verbose", no_argument, 0, 'v'},
+            {"aggregates", no_argument, 0, 'x'},
             {0, 0, 0, 0}
         };
         int option_index;
 
-        c = getopt_long(argc, argv, "b:dhpq:t:v", long_options, &option_index);
+        c = getopt_long(argc, argv, "b:c:de:f:g:hij:kmn:opq:r:s:t:u:vx", long_options, &option_index);
         if (c == -1) break;
 
         switch (c) {
@@ -105,15 +670,54 @@ int main(int argc, char *argv[])
             case 'b':
                 source = optarg;
                 break;
+            case 'c':
+                archive = optarg;
+                break;
             case 'd':
                 dump = true;
                 break;
+            case 'e':
+                batch = optarg;
+                break;
+            case 'f':
+                fuzzy = std::max(atoi(optarg), 0);
+                break;
+            case 'g':
+                id = optarg;
+                break;
+            case 'i':
+                ids = true;
+                break;
+            case 'j':
+                threads = std::max(atoi(optarg), 1);
+                break;
+            case 'k':
+                record = true;
+                break;
+            case 'm':
+                merge = true;
+                break;
+            case 'n':
+                top = std::max(atoi(optarg), 1);
+                break;
+            case 'o':
+                count = true;
+                break;
             case 'p':
                 prefix = true;
                 break;
             case 'q':
                 query = optarg;
                 break;
+            case 'r':
+                remove = optarg;
+                break;
+            case 's':
+                text = optarg;
+                break;
+            case 'u':
+                update = optarg;
+                break;
             case 't':
                 switch (atoi(optarg)) {
                     case 1:
@@ -122,6 +726,18 @@ int main(int argc, char *argv[])
                     case 2:
                         type = trie::DOUBLE_TRIE;
                         break;
+                    case 3:
+                        type = trie::COMPACT_TRIE;
+                        break;
+                    case 4:
+                        type = trie::DAWG_TRIE;
+                        break;
+                    case 5:
+                        type = trie::AC_TRIE;
+                        break;
+                    case 6:
+                        type = trie::SHARDED_TRIE;
+                        break;
                     default:
                         help_message();
                         exit(0);
@@ -130,17 +746,34 @@ int main(int argc, char *argv[])
             case 'v':
                 verbose = true;
                 break;
+            case 'x':
+                aggregates = true;
+                break;
         }
     }
 
     if (optind < argc) {
         index = argv[optind];
         if (source)
-            build_trie(source, index, type, verbose);
+            build_trie(source, index, type, record, ids, aggregates,
+                       threads, verbose);
+        else if (archive)
+            convert_trie(archive, index, type, record, ids, aggregates,
+                         threads, verbose);
+        else if (update || remove || merge)
+            update_trie(update, remove, index, merge, record, ids,
+                        aggregates, threads, verbose);
+        else if (batch)
+            batch_trie(batch, index, prefix, top, fuzzy, count, threads,
+                       verbose);
         else if (query)
-            query_trie(query, index, prefix, verbose);
+            query_trie(query, index, prefix, top, fuzzy, count, verbose);
+        else if (id)
+            key_of_trie(id, index, verbose);
+        else if (text)
+            scan_trie(text, index, verbose);
         else if (dump)
-            query_trie("", index, true, verbose);
+            dump_trie(index, verbose);
     }
     help_message();
 